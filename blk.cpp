@@ -0,0 +1,345 @@
+// file: "blk.cpp"
+
+//-----------------------------------------------------------------------------
+
+#include "blk.h"
+#include "rtlib.h"
+#include "thread.h"
+
+//-----------------------------------------------------------------------------
+
+void blk_queue_init(blk_queue *q, blk_start_fn start, void *driver_data,
+                    uint32 max_count) {
+  q->head = NULL;
+  q->tail = NULL;
+  q->position = 0;
+  q->max_count = max_count;
+  q->active = 0;
+  q->barrier = FALSE;
+  q->plugged = 0;
+  q->start = start;
+  q->driver_data = driver_data;
+}
+
+void blk_request_init(blk_request *req, uint8 op, uint32 lba, blk_done_fn done,
+                      void *data) {
+  req->next = NULL;
+  req->merged = NULL;
+  req->q = NULL;
+  req->op = op;
+  req->nb_segments = 0;
+  req->lba = lba;
+  req->count = 0;
+  req->err = NO_ERROR;
+  req->done = done;
+  req->data = data;
+}
+
+bool blk_request_add(blk_request *req, void *buf, uint32 count) {
+  if (req->nb_segments == BLK_MAX_SEGMENTS)
+    return FALSE;
+
+  req->segments[req->nb_segments].buf = buf;
+  req->segments[req->nb_segments].count = count;
+  req->nb_segments++;
+  req->count += count;
+
+  return TRUE;
+}
+
+static bool blk_overlap(blk_request *a, uint32 lba, uint32 count) {
+  return a->op != BLK_FLUSH && a->lba < lba + count && lba < a->lba + a->count;
+}
+
+// Does a request from r to the end of the queue overlap the sectors?
+static bool blk_overlap_from(blk_request *r, uint32 lba, uint32 count) {
+  for (; r != NULL; r = r->next)
+    if (blk_overlap(r, lba, count))
+      return TRUE;
+
+  return FALSE;
+}
+
+static bool blk_can_merge(blk_queue *q, blk_request *r, blk_request *x) {
+  return r->op == x->op && r->count + x->count <= q->max_count &&
+         r->nb_segments + x->nb_segments <= BLK_MAX_SEGMENTS;
+}
+
+// Add the sectors of x, just before or after those of r, to r. The
+// requests merged with x are done with r.
+static void blk_absorb(blk_request *r, blk_request *x) {
+  if (x->lba < r->lba) {
+    for (uint8 i = r->nb_segments; i > 0; i--)
+      r->segments[i - 1 + x->nb_segments] = r->segments[i - 1];
+
+    for (uint8 i = 0; i < x->nb_segments; i++)
+      r->segments[i] = x->segments[i];
+
+    r->lba = x->lba;
+  } else {
+    for (uint8 i = 0; i < x->nb_segments; i++)
+      r->segments[r->nb_segments + i] = x->segments[i];
+  }
+
+  r->nb_segments += x->nb_segments;
+  r->count += x->count;
+
+  if (x->merged != NULL) {
+    blk_request *m = x->merged;
+    while (m->next != NULL)
+      m = m->next;
+    m->next = r->merged;
+    r->merged = x->merged;
+    x->merged = NULL;
+  }
+
+  x->next = r->merged;
+  r->merged = x;
+}
+
+// Try to merge req with a pending request. Merging moves req ahead of
+// the requests submitted after the one it joins, which is only done
+// when they don't touch the same sectors. The grown request may then
+// fill the gap to a request submitted after it.
+static bool blk_merge(blk_queue *q, blk_request *req) {
+  blk_request *r;
+  blk_request *x;
+  blk_request *prev;
+  blk_request *first = q->head;
+
+  if (req->op == BLK_FLUSH)
+    return FALSE;
+
+  // Requests can't be merged across a flush
+
+  for (r = q->head; r != NULL; r = r->next)
+    if (r->op == BLK_FLUSH)
+      first = r->next;
+
+  for (r = first; r != NULL; r = r->next) {
+    if (blk_can_merge(q, r, req) &&
+        (r->lba + r->count == req->lba || req->lba + req->count == r->lba) &&
+        !blk_overlap_from(r->next, req->lba, req->count))
+      break;
+  }
+
+  if (r == NULL)
+    return FALSE;
+
+  blk_absorb(r, req);
+
+  for (prev = r, x = r->next; x != NULL; prev = x, x = x->next) {
+    if (blk_can_merge(q, r, x) &&
+        (r->lba + r->count == x->lba || x->lba + x->count == r->lba)) {
+      blk_request *e;
+
+      for (e = r->next; e != x; e = e->next)
+        if (blk_overlap(e, x->lba, x->count))
+          break;
+
+      if (e == x) {
+        prev->next = x->next;
+        if (q->tail == x)
+          q->tail = prev;
+        blk_absorb(r, x);
+        break;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+void blk_submit(blk_queue *q, blk_request *req) {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+
+  CLI();
+
+  req->q = q;
+  req->next = NULL;
+  req->merged = NULL;
+  req->err = IN_PROGRESS;
+
+  if (!blk_merge(q, req)) {
+    if (q->tail == NULL)
+      q->head = req;
+    else
+      q->tail->next = req;
+    q->tail = req;
+  }
+
+  if (q->plugged == 0)
+    q->start(q);
+
+  if (enabled)
+    STI();
+}
+
+static void blk_wake(blk_request *req) {
+  condvar_mutexless_signal(CAST(condvar *, req->data));
+}
+
+error_code blk_submit_wait(blk_queue *q, blk_request *req) {
+  condvar cv;
+
+  ASSERT_INTERRUPTS_ENABLED(); // Interrupts should be enabled at this point
+
+  // Not registered with the scheduler since it lives on the stack
+  wait_queue_init(&cv.super);
+
+  req->done = blk_wake;
+  req->data = &cv;
+
+  disable_interrupts();
+
+  blk_submit(q, req);
+
+  while (req->err == IN_PROGRESS)
+    condvar_mutexless_wait(&cv);
+
+  enable_interrupts();
+
+  return req->err;
+}
+
+void blk_plug(blk_queue *q) {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+
+  CLI();
+  q->plugged++;
+  if (enabled)
+    STI();
+}
+
+void blk_unplug(blk_queue *q) {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+
+  CLI();
+  if (--q->plugged == 0)
+    q->start(q);
+  if (enabled)
+    STI();
+}
+
+blk_request *blk_queue_next(blk_queue *q) {
+  blk_request *r;
+  blk_request *prev;
+  blk_request *best = NULL;
+  blk_request *best_prev = NULL;
+  blk_request *lowest = NULL;
+  blk_request *lowest_prev = NULL;
+
+  ASSERT_INTERRUPTS_DISABLED();
+
+  if (q->head == NULL || q->barrier)
+    return NULL;
+
+  if (q->head->op == BLK_FLUSH) {
+    if (q->active > 0)
+      return NULL; // wait for the requests before the flush
+
+    r = q->head;
+    q->head = r->next;
+    if (q->head == NULL)
+      q->tail = NULL;
+
+    q->barrier = TRUE;
+    q->active++;
+
+    return r;
+  }
+
+  // Serve the requests in increasing sector order from the position of
+  // the disk head, then come back to the lowest one. A request that
+  // touches the sectors of an earlier one keeps its turn.
+
+  for (prev = NULL, r = q->head; r != NULL && r->op != BLK_FLUSH;
+       prev = r, r = r->next) {
+    blk_request *e;
+
+    for (e = q->head; e != r; e = e->next)
+      if (blk_overlap(e, r->lba, r->count))
+        break;
+
+    if (e != r)
+      continue;
+
+    if (r->lba >= q->position && (best == NULL || r->lba < best->lba)) {
+      best = r;
+      best_prev = prev;
+    }
+
+    if (lowest == NULL || r->lba < lowest->lba) {
+      lowest = r;
+      lowest_prev = prev;
+    }
+  }
+
+  if (best == NULL) {
+    best = lowest;
+    best_prev = lowest_prev;
+  }
+
+  // The first request is always eligible, so best isn't NULL
+
+  if (best_prev == NULL)
+    q->head = best->next;
+  else
+    best_prev->next = best->next;
+
+  if (q->tail == best)
+    q->tail = best_prev;
+
+  best->next = NULL;
+
+  q->position = best->lba + best->count;
+  q->active++;
+
+  return best;
+}
+
+void blk_complete(blk_request *req, error_code err) {
+  blk_queue *q = req->q;
+  blk_request *m = req->merged;
+
+  ASSERT_INTERRUPTS_DISABLED();
+
+  q->active--;
+
+  if (req->op == BLK_FLUSH)
+    q->barrier = FALSE;
+
+  // The done functions may reuse the requests
+
+  req->err = err;
+  req->done(req);
+
+  while (m != NULL) {
+    blk_request *next = m->next;
+    m->err = err;
+    m->done(m);
+    m = next;
+  }
+}
+
+void blk_requeue(blk_request *req) {
+  blk_queue *q = req->q;
+
+  ASSERT_INTERRUPTS_DISABLED();
+
+  q->active--;
+
+  if (req->op == BLK_FLUSH)
+    q->barrier = FALSE;
+
+  req->next = q->head;
+  q->head = req;
+  if (q->tail == NULL)
+    q->tail = req;
+}
+
+//-----------------------------------------------------------------------------
+
+// Local Variables: //
+// mode: C++ //
+// End: //
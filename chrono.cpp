@@ -131,6 +131,12 @@ extern "C" void irq8() {
   inb(RTC_PORT_DATA);            // acknowledge RTC interrupt
 }
 
+#ifdef USE_APIC_FOR_TIMER
+
+uint32 _tsc_counts_per_sec = 0; // only measured for TSC-deadline mode
+
+#endif
+
 #endif
 
 #ifdef USE_TSC_FOR_TIME
@@ -148,6 +154,12 @@ rational _cpu_bus_multiplier;
 
 #endif
 
+#ifdef USE_APIC_FOR_TIMER
+
+uint32 _apic_timer_counts_per_sec = 0;
+
+#endif
+
 static int32 secs_since_epoch_at_refpoint = 0;
 
 uint8 bcd_to_int(uint8 bcd) {
@@ -214,20 +226,37 @@ void setup_time() {
 
   int samples_left = 2;
 
+#ifdef USE_APIC_FOR_TIMER
+
+  // Wait one more RTC second to calibrate the local APIC timer
+
+  if (timer_source != TIMER_SOURCE_PIT)
+    samples_left = 3;
+
+#endif
 #endif
 
 #ifdef USE_TSC_FOR_TIME
 
   int samples_left = 3;
+
+#endif
+
+#if defined(USE_TSC_FOR_TIME) || defined(USE_APIC_FOR_TIMER)
+
   uint64 old_tsc = 0;
 
+#endif
+
 #ifdef USE_APIC_FOR_TIMER
 
   uint32 old_apic_timer_count = 0;
 
-  APIC_INITIAL_TIMER_COUNT = 0xffffffff;
+  // The timer interrupt is masked, the count down is only sampled
+
+  if (timer_source != TIMER_SOURCE_PIT)
+    APIC_INITIAL_TIMER_COUNT = 0xffffffff;
 
-#endif
 #endif
 
   uint8 old_sec = 255;
@@ -241,24 +270,40 @@ void setup_time() {
       if (old_sec != new_sec) {
 #ifdef USE_TSC_FOR_TIME
         uint64 new_tsc = rdtsc();
+#else
 #ifdef USE_APIC_FOR_TIMER
-        uint32 new_apic_timer_count = APIC_CURRENT_TIMER_COUNT;
+        uint64 new_tsc =
+            (timer_source == TIMER_SOURCE_TSC_DEADLINE) ? rdtsc() : 0;
 #endif
+#endif
+#ifdef USE_APIC_FOR_TIMER
+        uint32 new_apic_timer_count =
+            (timer_source != TIMER_SOURCE_PIT) ? APIC_CURRENT_TIMER_COUNT : 0;
 #endif
 
         if (--samples_left == 0) {
 #ifdef USE_TSC_FOR_TIME
 
           tsc_at_refpoint = new_tsc;
+
+#endif
+#if defined(USE_TSC_FOR_TIME) || defined(USE_APIC_FOR_TIMER)
+
           _tsc_counts_per_sec = new_tsc - old_tsc;
 
+#endif
 #ifdef USE_APIC_FOR_TIMER
 
+          _apic_timer_counts_per_sec =
+              old_apic_timer_count - new_apic_timer_count;
+
+#ifdef USE_TSC_FOR_TIME
+
           _cpu_bus_multiplier = rational_rationalize(
               make_rational(_tsc_counts_per_sec >> 10,
-                            (old_apic_timer_count - new_apic_timer_count) >>
-                                10),
+                            _apic_timer_counts_per_sec >> 10),
               make_rational(1, 16));
+
 #endif
 #endif
           break;
@@ -266,15 +311,15 @@ void setup_time() {
 
         old_sec = new_sec;
 
-#ifdef USE_TSC_FOR_TIME
+#if defined(USE_TSC_FOR_TIME) || defined(USE_APIC_FOR_TIMER)
 
         old_tsc = new_tsc;
 
+#endif
 #ifdef USE_APIC_FOR_TIMER
 
         old_apic_timer_count = new_apic_timer_count;
 
-#endif
 #endif
       }
     }
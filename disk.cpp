@@ -8,6 +8,7 @@
 
 //-----------------------------------------------------------------------------
 
+#include "blk.h"
 #include "disk.h"
 #include "ide.h"
 #include "rtlib.h"
@@ -15,16 +16,119 @@
 
 //-----------------------------------------------------------------------------
 
-#define DISK_CACHE_SIZE 100
-#define CACHE_BLOCK_HASH_TABLE_SIZE 5059
+// The cache gets a share of the usable memory, within bounds since it
+// is allocated in the kernel heap. DISK_CACHE_BLOCKS, when defined in
+// general.h, sets its size instead.
+
+#define DISK_CACHE_MEMORY_SHARE 64
+#define DISK_CACHE_MIN_BLOCKS 128
+#define DISK_CACHE_MAX_BLOCKS 8192
+#define DISK_FLUSH_BATCH 64
+
+// Dirty blocks are written back by the flusher thread once they have
+// been dirty for DISK_DIRTY_AGE seconds, or all at once when more than
+// DISK_DIRTY_RATIO percent of the cache is dirty. The writes are sorted
+// by LBA and adjacent blocks are written by a single request.
+
+#define DISK_FLUSH_INTERVAL 1 // seconds between two looks at the cache
+#define DISK_DIRTY_AGE 5
+#define DISK_DIRTY_RATIO 10
+
+// Sequential reads are detected per stream, a stream being a run of
+// consecutive sectors of a disk. When a stream gets close to the end of
+// what was read ahead for it, its next window of blocks is read
+// asynchronously. The window doubles when the blocks read ahead get
+// used and halves when they are evicted unused.
+
+#define DISK_RA_STREAMS 8
+#define DISK_RA_MIN_WINDOW 4
+#define DISK_RA_INIT_WINDOW 8
+#define DISK_RA_MAX_WINDOW 128
+#define DISK_RA_REQUESTS 128 // blocks being read ahead at once
+
+typedef struct disk_ra_stream_struct {
+  disk *d;      // NULL when unused
+  uint32 next;  // sector that continues the stream
+  uint32 ahead; // sector following the ones read ahead
+  uint32 window;
+} disk_ra_stream;
+
+// The blocks are spread over segments that each have a lock, a hash
+// table and replacement queues, so that threads using different blocks
+// rarely wait for each other. A sector always goes to the same segment.
+
+#define DISK_CACHE_SEGMENTS 16
+
+// With USE_DISK_CACHE_2Q, the replacement policy is 2Q: a block is
+// first put in a FIFO (A1in) and only gets to the LRU list (Am) when its
+// sector is used again after leaving the FIFO, which the segment
+// remembers for a while (A1out). A scan of a large file then only goes
+// through the FIFO and leaves the blocks used often in the LRU list.
+// Otherwise, every block is in the LRU list.
+
+#define DISK_CACHE_MAIN 0 // Am
+#define DISK_CACHE_IN 1   // A1in
+#define DISK_CACHE_QUEUES 2
+#define DISK_CACHE_IN_SHARE 4  // A1in is kept to a quarter of the blocks
+#define DISK_CACHE_OUT_SHARE 2 // A1out has half as many sectors as blocks
+
+typedef struct disk_cache_ghost_struct {
+  cache_block_deq hash_deq; // in its ghost bucket, alone when unused
+  disk *d;                  // NULL when unused
+  uint32 sector_pos;
+} disk_cache_ghost;
+
+typedef struct disk_cache_segment_struct {
+  mutex *mut;
+  condvar *cv; // signaled when a block of the segment becomes free
+  cache_block_deq queue[DISK_CACHE_QUEUES]; // most recent first
+  uint32 queue_len[DISK_CACHE_QUEUES];
+  cache_block_deq *hash_table;
+  uint32 hash_table_size;
+  uint32 nb_blocks;
+  disk_cache_ghost *ghosts; // A1out, a ring
+  uint32 nb_ghosts;
+  uint32 next_ghost;
+  cache_block_deq *ghost_table; // the ghosts hashed by sector
+  uint32 ghost_table_size;
+
+  uint32 hits;
+  uint32 misses;
+  uint32 main_hits;  // hits of blocks in Am
+  uint32 ghost_hits; // misses of sectors in A1out
+  uint32 lock_waits;
+  time lock_wait_time;
+} disk_cache_segment;
 
 typedef struct disk_module_struct {
   disk disk_table[MAX_NB_DISKS];
   uint32 nb_disks;
-  mutex *cache_mut;
-  condvar *cache_cv;
-  cache_block_deq LRU_deq;
-  cache_block_deq cache_block_hash_table[CACHE_BLOCK_HASH_TABLE_SIZE];
+  uint32 cache_nb_blocks;
+  disk_cache_segment cache_seg[DISK_CACHE_SEGMENTS];
+
+  mutex *ra_mut;
+  disk_ra_stream ra_stream[DISK_RA_STREAMS];
+  uint32 ra_replace; // stream to reuse for the next new stream
+  blk_request ra_req[DISK_RA_REQUESTS];
+  blk_request *ra_free; // protected by disabling interrupts
+  uint32 ra_blocks;
+  uint32 ra_hits;
+  uint32 ra_wasted;
+
+  uint32 nb_dirty; // protected by disabling interrupts
+  uint32 wb_blocks;
+  uint32 wb_writes;
+  mutex *flusher_mut;
+  condvar *flusher_cv;
+  bool flusher_wakeup; // write back every dirty block
+
+  uint32 direct_reads;
+  uint32 direct_sectors;
+
+#ifdef DISK_CACHE_TRACE
+  disk_cache_trace_entry trace[DISK_CACHE_TRACE_LEN]; // a ring
+  uint32 trace_count; // entries recorded since the start
+#endif
 } disk_module;
 
 static disk_module disk_mod;
@@ -80,110 +184,647 @@ uint32 disk_max_BIOS_CHS_to_LBA(disk *d) {
   return lba;
 }
 
+static blk_queue *disk_queue(disk *d) {
+  switch (d->kind) {
+  case DISK_IDE:
+    return &d->_.ide.dev->queue;
+  case DISK_VIRTIO:
+    return &d->_.virtio.dev->queue;
+  case DISK_AHCI:
+    return &d->_.ahci.port->queue;
+  default:
+    return NULL;
+  }
+}
+
+// Check that the request stays in the partition and make its LBA
+// relative to the device
+static error_code disk_map_request(disk *d, blk_request *req) {
+  if (disk_queue(d) == NULL)
+    return UNIMPL_ERROR;
+
+  if (req->op != BLK_FLUSH) {
+    if (req->lba >= d->partition_length ||
+        req->count > d->partition_length - req->lba)
+      return ARG_ERROR;
+
+    req->lba += d->partition_start;
+  }
+
+  return NO_ERROR;
+}
+
+error_code disk_submit(disk *d, blk_request *req) {
+  error_code err;
+
+  if (HAS_NO_ERROR(err = disk_map_request(d, req)))
+    blk_submit(disk_queue(d), req);
+
+  return err;
+}
+
+error_code disk_submit_wait(disk *d, blk_request *req) {
+  error_code err;
+
+  if (HAS_NO_ERROR(err = disk_map_request(d, req)))
+    err = blk_submit_wait(disk_queue(d), req);
+
+  return err;
+}
+
+static error_code disk_transfer(disk *d, uint8 op, uint32 lba, void *buf,
+                                uint32 count) {
+  blk_request req;
+
+  blk_request_init(&req, op, lba, NULL, NULL);
+  blk_request_add(&req, buf, count);
+
+  return disk_submit_wait(d, &req);
+}
+
 error_code disk_read_sectors(disk *d, uint32 lba, void *buf, uint32 count) {
-  error_code err = NO_ERROR;
-  if (lba < d->partition_length && lba + count <= d->partition_length) {
-    switch (d->kind) {
-    case DISK_IDE:
-      err =
-          ide_read_sectors(d->_.ide.dev, d->partition_start + lba, buf, count);
-      break;
-    default:
-      err = UNIMPL_ERROR;
-      break;
+  return disk_transfer(d, BLK_READ, lba, buf, count);
+}
+
+error_code disk_write_sectors(disk *d, uint32 lba, void *buff, uint32 count) {
+  return disk_transfer(d, BLK_WRITE, lba, buff, count);
+}
+
+void disk_batch_init(disk_batch *batch) {
+  batch->pending = 0;
+  batch->err = NO_ERROR;
+  wait_queue_init(&batch->cv.super); // the batch is usually on the stack
+}
+
+void disk_batch_done(blk_request *req) {
+  disk_batch *batch = CAST(disk_batch *, req->data);
+
+  if (ERROR(req->err))
+    batch->err = req->err;
+
+  if (--batch->pending == 0)
+    condvar_mutexless_signal(&batch->cv);
+}
+
+error_code disk_batch_wait(disk_batch *batch) {
+  disable_interrupts();
+
+  while (batch->pending > 0)
+    condvar_mutexless_wait(&batch->cv);
+
+  enable_interrupts();
+
+  return batch->err;
+}
+
+#define CACHE_BLOCK_OF(probe, field)                                           \
+  CAST(cache_block *,                                                          \
+       CAST(uint8 *, probe) - __builtin_offsetof(cache_block, field))
+
+static void deq_remove(cache_block_deq *x) {
+  x->next->prev = x->prev;
+  x->prev->next = x->next;
+}
+
+static void deq_push_front(cache_block_deq *deq, cache_block_deq *x) {
+  x->next = deq->next;
+  x->prev = deq;
+  deq->next->prev = x;
+  deq->next = x;
+}
+
+static disk_cache_segment *disk_cache_segment_of(uint32 sector_pos) {
+  return &disk_mod.cache_seg[sector_pos % DISK_CACHE_SEGMENTS];
+}
+
+static cache_block_deq *disk_cache_bucket(disk_cache_segment *seg,
+                                          uint32 sector_pos) {
+  return &seg->hash_table[(sector_pos / DISK_CACHE_SEGMENTS) %
+                          seg->hash_table_size];
+}
+
+// Lock the segment, keeping track of the time spent waiting for it
+static void disk_cache_lock(disk_cache_segment *seg) {
+  if (seg->mut->_locked) {
+    time start = current_time();
+    mutex_lock(seg->mut);
+    seg->lock_waits++;
+    seg->lock_wait_time =
+        add_time(seg->lock_wait_time, subtract_time(current_time(), start));
+  } else {
+    mutex_lock(seg->mut);
+  }
+}
+
+// Take the least recently used block of the queue that can be reused
+static cache_block *disk_cache_victim_in(disk_cache_segment *seg,
+                                         uint32 queue) {
+  cache_block_deq *probe = seg->queue[queue].prev;
+
+  while (probe != &seg->queue[queue]) {
+    cache_block *cb = CACHE_BLOCK_OF(probe, LRU_deq);
+
+    // A block being read ahead has no reference but isn't free. A dirty
+    // block is only reused once it has been written back.
+
+    if (cb->refcount == 0 && !cb->dirty && cb->err != IN_PROGRESS)
+      return cb;
+
+    probe = probe->prev;
+  }
+
+  return NULL;
+}
+
+#define GHOST_OF(probe)                                                        \
+  CAST(disk_cache_ghost *,                                                     \
+       CAST(uint8 *, probe) - __builtin_offsetof(disk_cache_ghost, hash_deq))
+
+static cache_block_deq *disk_cache_ghost_bucket(disk_cache_segment *seg,
+                                                uint32 sector_pos) {
+  return &seg->ghost_table[(sector_pos / DISK_CACHE_SEGMENTS) %
+                           seg->ghost_table_size];
+}
+
+static void disk_cache_unghost(disk_cache_ghost *g) {
+  deq_remove(&g->hash_deq);
+  g->hash_deq.next = &g->hash_deq;
+  g->hash_deq.prev = &g->hash_deq;
+  g->d = NULL;
+}
+
+// Put the sector of a block in A1out, in place of the oldest ghost
+static void disk_cache_remember(disk_cache_segment *seg, cache_block *cb) {
+  disk_cache_ghost *g = &seg->ghosts[seg->next_ghost];
+
+  disk_cache_unghost(g);
+
+  g->d = cb->d;
+  g->sector_pos = cb->sector_pos;
+  deq_push_front(disk_cache_ghost_bucket(seg, cb->sector_pos), &g->hash_deq);
+  seg->next_ghost = (seg->next_ghost + 1) % seg->nb_ghosts;
+}
+
+#ifdef USE_DISK_CACHE_2Q
+
+// Forget the sector if it is in A1out, telling if it was
+static bool disk_cache_forget(disk_cache_segment *seg, disk *d,
+                              uint32 sector_pos) {
+  cache_block_deq *bucket = disk_cache_ghost_bucket(seg, sector_pos);
+  cache_block_deq *probe = bucket->next;
+
+  while (probe != bucket) {
+    disk_cache_ghost *g = GHOST_OF(probe);
+    if (g->d == d && g->sector_pos == sector_pos) {
+      disk_cache_unghost(g);
+      return TRUE;
     }
+    probe = probe->next;
+  }
+
+  return FALSE;
+}
+
+#endif
+
+// Choose the block of the segment to reuse, NULL when there is none.
+// Nothing is changed until it is taken.
+static cache_block *disk_cache_choose_victim(disk_cache_segment *seg) {
+  uint32 queue = DISK_CACHE_MAIN;
+  cache_block *cb;
+
+  if (seg->queue_len[DISK_CACHE_IN] > seg->nb_blocks / DISK_CACHE_IN_SHARE)
+    queue = DISK_CACHE_IN;
+
+  if ((cb = disk_cache_victim_in(seg, queue)) == NULL)
+    cb = disk_cache_victim_in(seg, queue ^ 1);
+
+  return cb;
+}
+
+// Take the block chosen to be reused. A block read ahead and never used
+// is a wasted one, *ra_stream is then set to its stream.
+static void disk_cache_take_victim(disk_cache_segment *seg, cache_block *cb,
+                                   int32 *ra_stream) {
+  *ra_stream = -1;
+
+  if (cb->queue == DISK_CACHE_IN && cb->d != NULL)
+    disk_cache_remember(seg, cb);
+
+  if (cb->readahead) {
+    cb->readahead = 0;
+    *ra_stream = cb->ra_stream;
+    disk_mod.ra_wasted++;
+  }
+}
+
+// Take a block of the segment that can be reused, NULL when there is
+// none
+static cache_block *disk_cache_victim(disk_cache_segment *seg,
+                                      int32 *ra_stream) {
+  cache_block *cb = disk_cache_choose_victim(seg);
+
+  if (cb != NULL)
+    disk_cache_take_victim(seg, cb, ra_stream);
+
+  return cb;
+}
+
+static void disk_cache_enqueue(disk_cache_segment *seg, cache_block *cb,
+                               uint32 queue) {
+  deq_remove(&cb->LRU_deq);
+  seg->queue_len[cb->queue]--;
+
+  cb->queue = queue;
+  deq_push_front(&seg->queue[queue], &cb->LRU_deq);
+  seg->queue_len[queue]++;
+}
+
+// Give the block taken by disk_cache_victim to a sector
+static void disk_cache_insert(disk_cache_segment *seg, cache_block_deq *bucket,
+                              cache_block *cb, disk *d, uint32 sector_pos) {
+  uint32 queue = DISK_CACHE_MAIN;
+
+  deq_remove(&cb->hash_bucket_deq);
+  deq_push_front(bucket, &cb->hash_bucket_deq);
+
+#ifdef USE_DISK_CACHE_2Q
+  if (disk_cache_forget(seg, d, sector_pos))
+    seg->ghost_hits++;
+  else
+    queue = DISK_CACHE_IN;
+#endif
+
+  disk_cache_enqueue(seg, cb, queue);
+
+  cb->d = d;
+  cb->sector_pos = sector_pos;
+}
+
+// Account for a use of a cached block. A block in A1in stays where it is.
+static void disk_cache_touch(disk_cache_segment *seg, cache_block *cb) {
+  seg->hits++;
+
+  if (cb->queue == DISK_CACHE_MAIN) {
+    seg->main_hits++;
+    disk_cache_enqueue(seg, cb, DISK_CACHE_MAIN);
+  }
+}
+
+static cache_block *disk_cache_lookup(cache_block_deq *bucket, disk *d,
+                                      uint32 sector_pos) {
+  cache_block_deq *hash_bucket_probe = bucket->next;
+
+  while (hash_bucket_probe != bucket) {
+    cache_block *cb = CACHE_BLOCK_OF(hash_bucket_probe, hash_bucket_deq);
+    if (cb->d == d && cb->sector_pos == sector_pos)
+      return cb;
+    hash_bucket_probe = hash_bucket_probe->next;
+  }
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+// Dirty blocks
+
+#ifdef USE_CACHE_BLOCK_FLUSHER
+
+// Ask the flusher to write back every dirty block
+static void disk_flusher_wakeup() {
+  if (disk_mod.flusher_wakeup)
+    return;
+
+  mutex_lock(disk_mod.flusher_mut);
+  disk_mod.flusher_wakeup = TRUE;
+  condvar_signal(disk_mod.flusher_cv);
+  mutex_unlock(disk_mod.flusher_mut);
+}
+
+#endif
+
+void disk_cache_block_dirty(cache_block *block) {
+  if (block->dirty)
+    return;
+
+  block->dirty_time = current_time();
+
+  disable_interrupts();
+  block->dirty = 1;
+  disk_mod.nb_dirty++;
+  enable_interrupts();
+
+#ifdef USE_CACHE_BLOCK_FLUSHER
+  // A stale count only delays the wakeup to the next dirty block
+  if (disk_mod.nb_dirty * 100 > disk_mod.cache_nb_blocks * DISK_DIRTY_RATIO)
+    disk_flusher_wakeup();
+#endif
+}
+
+static void disk_cache_block_clean(cache_block *block) {
+  disable_interrupts();
+  if (block->dirty) {
+    block->dirty = 0;
+    disk_mod.nb_dirty--;
+  }
+  enable_interrupts();
+}
+
+//-----------------------------------------------------------------------------
+
+// Readahead
+
+// Adapt the window of the stream that read a block ahead
+static void disk_ra_feedback(int32 stream, bool used) {
+  disk_ra_stream *s;
+
+  if (stream < 0)
+    return;
+
+  mutex_lock(disk_mod.ra_mut);
+
+  s = &disk_mod.ra_stream[stream];
+
+  if (used) {
+    s->window *= 2;
+    if (s->window > DISK_RA_MAX_WINDOW)
+      s->window = DISK_RA_MAX_WINDOW;
   } else {
-    err = ARG_ERROR;
+    s->window /= 2;
+    if (s->window < DISK_RA_MIN_WINDOW)
+      s->window = DISK_RA_MIN_WINDOW;
   }
 
-  return err;
+  mutex_unlock(disk_mod.ra_mut);
 }
 
-error_code disk_write_sectors(disk *d, uint32 lba, void *buff, uint32 count) {
-  error_code err = UNKNOWN_ERROR;
+static blk_request *disk_ra_alloc_request() {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+  blk_request *req;
+
+  CLI();
+  req = disk_mod.ra_free;
+  if (req != NULL)
+    disk_mod.ra_free = req->next;
+  if (enabled)
+    STI();
+
+  return req;
+}
 
-  if (lba < d->partition_length && lba + count <= d->partition_length) {
-    switch (d->kind) {
-    case DISK_IDE:
-      err = ide_write_sectors(d->_.ide.dev, d->partition_start + lba, buff,
-                              count);
+// Called with interrupts disabled
+static void disk_ra_free_request(blk_request *req) {
+  req->next = disk_mod.ra_free;
+  disk_mod.ra_free = req;
+}
+
+static void disk_ra_done(blk_request *req) {
+  cache_block *cb = CAST(cache_block *, req->data);
+
+  cb->err = req->err;
+  disk_ra_free_request(req);
+  condvar_mutexless_signal(cb->cv);
+}
+
+// Start reading the blocks from lba to lba+count-1 that aren't cached.
+// Stops early when the cache or the requests run out, as readahead must
+// not get in the way of the blocks being used.
+static void disk_ra_issue(disk *d, uint32 lba, uint32 count, uint8 stream) {
+  blk_queue *q = disk_queue(d);
+  uint32 end = lba + count;
+
+  if (end > d->partition_length)
+    end = d->partition_length;
+
+  blk_plug(q);
+
+  for (; lba < end; lba++) {
+    disk_cache_segment *seg = disk_cache_segment_of(lba);
+    cache_block_deq *bucket = disk_cache_bucket(seg, lba);
+    cache_block *cb;
+    blk_request *req;
+    int32 wasted;
+    error_code err;
+
+    disk_cache_lock(seg);
+
+    if (disk_cache_lookup(bucket, d, lba) != NULL) {
+      mutex_unlock(seg->mut);
+      continue;
+    }
+
+    // The block is only taken once the read can be done, giving up
+    // mustn't account for an eviction
+
+    if ((req = disk_ra_alloc_request()) == NULL) {
+      mutex_unlock(seg->mut);
       break;
-    default:
-      err = UNIMPL_ERROR;
+    }
+
+    cb = disk_cache_choose_victim(seg);
+
+    if (cb == NULL || cb->dirty) {
+      mutex_unlock(seg->mut);
+      disable_interrupts();
+      disk_ra_free_request(req);
+      enable_interrupts();
+      break;
+    }
+
+    disk_cache_take_victim(seg, cb, &wasted);
+    disk_cache_insert(seg, bucket, cb, d, lba);
+
+    cb->err = IN_PROGRESS;
+    cb->readahead = 1;
+    cb->ra_stream = stream;
+    disk_mod.ra_blocks++;
+
+    mutex_unlock(seg->mut);
+
+    disk_ra_feedback(wasted, FALSE);
+
+    blk_request_init(req, BLK_READ, lba, disk_ra_done, cb);
+    blk_request_add(req, cb->buf,
+                    1 << (DISK_LOG2_BLOCK_SIZE - d->log2_sector_size));
+
+    if (ERROR(err = disk_submit(d, req))) {
+      disable_interrupts();
+      cb->err = err; // the block will be read again when acquired
+      disk_ra_free_request(req);
+      enable_interrupts();
       break;
     }
+  }
+
+  blk_unplug(q);
+}
+
+// Follow the streams with the block about to be acquired and read ahead
+// of the one it continues when that one is running short
+static void disk_readahead(disk *d, uint32 sector_pos) {
+  disk_ra_stream *s = NULL;
+  uint32 i;
+  uint32 start = 0;
+  uint32 count = 0;
+
+  if (disk_queue(d) == NULL)
+    return;
+
+  mutex_lock(disk_mod.ra_mut);
+
+  for (i = 0; i < DISK_RA_STREAMS; i++) {
+    s = &disk_mod.ra_stream[i];
+    if (s->d == d && s->next == sector_pos)
+      break;
+  }
+
+  if (i == DISK_RA_STREAMS) {
+    i = disk_mod.ra_replace;
+    disk_mod.ra_replace = (i + 1) % DISK_RA_STREAMS;
+    s = &disk_mod.ra_stream[i];
+    s->d = d;
+    s->next = sector_pos + 1;
+    s->ahead = sector_pos + 1;
+    s->window = DISK_RA_INIT_WINDOW;
   } else {
-    err = ARG_ERROR;
+    s->next = sector_pos + 1;
+    if (s->ahead < s->next)
+      s->ahead = s->next;
+    if (s->ahead - s->next < s->window / 2) {
+      start = s->ahead;
+      count = s->next + s->window - s->ahead;
+      s->ahead += count;
+    }
+  }
+
+  mutex_unlock(disk_mod.ra_mut);
+
+  if (count > 0)
+    disk_ra_issue(d, start, count, i);
+}
+
+//-----------------------------------------------------------------------------
+
+#ifdef DISK_CACHE_TRACE
+
+static void disk_cache_trace_record(disk *d, uint32 sector_pos) {
+  disk_cache_trace_entry *e;
+
+  disable_interrupts();
+  e = &disk_mod.trace[disk_mod.trace_count++ % DISK_CACHE_TRACE_LEN];
+  e->disk_id = d->id;
+  e->sector_pos = sector_pos;
+  enable_interrupts();
+}
+
+uint32 disk_cache_trace_length() {
+  uint32 n = disk_mod.trace_count;
+  return (n < DISK_CACHE_TRACE_LEN) ? n : DISK_CACHE_TRACE_LEN;
+}
+
+void disk_cache_trace_at(uint32 i, disk_cache_trace_entry *entry) {
+  uint32 first = disk_mod.trace_count - disk_cache_trace_length();
+  *entry = disk_mod.trace[(first + i) % DISK_CACHE_TRACE_LEN];
+}
+
+#endif
+
+#ifndef USE_CACHE_BLOCK_FLUSHER
+
+// The least recently used dirty block of the segment that nobody uses
+static cache_block *disk_cache_dirty_victim(disk_cache_segment *seg) {
+  for (uint32 k = 0; k < DISK_CACHE_QUEUES; k++) {
+    cache_block_deq *queue = &seg->queue[k];
+    cache_block_deq *probe = queue->prev;
+
+    while (probe != queue) {
+      cache_block *cb = CACHE_BLOCK_OF(probe, LRU_deq);
+
+      if (cb->refcount == 0 && cb->dirty && cb->err != IN_PROGRESS)
+        return cb;
+
+      probe = probe->prev;
+    }
   }
 
+  return NULL;
+}
+
+// Write a block the caller holds a reference to
+static error_code disk_cache_block_write_back(cache_block *cb) {
+  error_code err = NO_ERROR;
+
+  rwmutex_readlock(cb->mut); // the buffer is only read
+
+  // Make sure it hasn't been cleaned in the wait
+  if (cb->dirty &&
+      HAS_NO_ERROR(err = disk_write_sectors(
+                       cb->d, cb->sector_pos, cb->buf,
+                       1 << (DISK_LOG2_BLOCK_SIZE - cb->d->log2_sector_size))))
+    disk_cache_block_clean(cb);
+
+  rwmutex_readunlock(cb->mut);
+
   return err;
 }
 
+#endif
+
 error_code disk_cache_block_acquire(disk *d, uint32 sector_pos,
                                     cache_block **block) {
   error_code err;
+  disk_cache_segment *seg = disk_cache_segment_of(sector_pos);
+  cache_block_deq *bucket = disk_cache_bucket(seg, sector_pos);
   cache_block *cb = NULL;
-  cache_block_deq *LRU_deq;
-  cache_block_deq *LRU_probe;
-  cache_block_deq *hash_bucket_deq;
-  cache_block_deq *hash_bucket_probe;
+  int32 ra_stream;
+  bool ra_used;
 
-again:
+#ifdef DISK_CACHE_TRACE
+  disk_cache_trace_record(d, sector_pos);
+#endif
 
-  mutex_lock(disk_mod.cache_mut);
+  disk_readahead(d, sector_pos);
 
-  for (;;) {
-    LRU_deq = &disk_mod.LRU_deq;
+again:
 
-    hash_bucket_deq =
-        &disk_mod
-             .cache_block_hash_table[sector_pos % CACHE_BLOCK_HASH_TABLE_SIZE];
+  disk_cache_lock(seg);
 
-    hash_bucket_probe = hash_bucket_deq->next;
+  for (;;) {
+    cb = disk_cache_lookup(bucket, d, sector_pos);
 
-    while (hash_bucket_probe != hash_bucket_deq) {
-      cb = CAST(cache_block *,
-                CAST(uint8 *, hash_bucket_probe) -
-                    (CAST(uint8 *, &cb->hash_bucket_deq) - CAST(uint8 *, cb)));
-      if (cb->d == d && cb->sector_pos == sector_pos)
-        break;
-      hash_bucket_probe = hash_bucket_probe->next;
-    }
-
-    if (hash_bucket_probe != hash_bucket_deq) {
-      cache_block_deq *n;
-      cache_block_deq *p;
-
-      n = cb->hash_bucket_deq.next;
-      p = cb->hash_bucket_deq.prev;
-      n->prev = p;
-      p->next = n;
-      hash_bucket_deq->next->prev = &cb->hash_bucket_deq;
-      cb->hash_bucket_deq.next = hash_bucket_deq->next;
-      hash_bucket_deq->next = &cb->hash_bucket_deq;
-      cb->hash_bucket_deq.prev = hash_bucket_deq;
-
-      n = cb->LRU_deq.next;
-      p = cb->LRU_deq.prev;
-      n->prev = p;
-      p->next = n;
-      LRU_deq->next->prev = &cb->LRU_deq;
-      cb->LRU_deq.next = LRU_deq->next;
-      LRU_deq->next = &cb->LRU_deq;
-      cb->LRU_deq.prev = LRU_deq;
+    if (cb != NULL) {
+      disk_cache_touch(seg, cb);
 
       cb->refcount++;
 
+      ra_used = cb->readahead;
+      if (ra_used) {
+        cb->readahead = 0;
+        disk_mod.ra_hits++;
+      }
+
       rwmutex_writelock(cb->mut);
-      mutex_unlock(disk_mod.cache_mut);
+      mutex_unlock(seg->mut);
+
+      if (ra_used)
+        disk_ra_feedback(cb->ra_stream, TRUE);
+
+      // A block read ahead is done in an interrupt handler
+
+      disable_interrupts();
       while ((err = cb->err) == IN_PROGRESS) {
-        condvar_wait(cb->cv, &cb->mut->super);
+        condvar_mutexless_wait(cb->cv);
       }
+      enable_interrupts();
 
       rwmutex_writeunlock(cb->mut);
       condvar_signal(cb->cv);
 
       if (ERROR(err)) {
+        disk_cache_lock(seg);
+        cb->d = NULL; // so that it is read again
+        mutex_unlock(seg->mut);
         disk_cache_block_release(cb); // ignore error
         goto again;
       }
@@ -191,53 +832,16 @@ again:
       break;
     }
 
-    LRU_probe = LRU_deq->prev;
-
-    while (LRU_probe != &disk_mod.LRU_deq) {
-      cb = CAST(cache_block *,
-                CAST(uint8 *, LRU_probe) -
-                    (CAST(uint8 *, &cb->LRU_deq) - CAST(uint8 *, cb)));
-
-#ifdef USE_BLOCK_REF_COUNTER_FREE
-      if (cb->refcount == 0)
-        break;
-#else
-      // If we dont use the reference counting,
-      // we cannot allocate dirty blocks
-      if ((cb->refcount == 0) && (!cb->dirty))
-        break;
-#endif
-
-      LRU_probe = LRU_probe->prev;
-    }
-
-    if (LRU_probe != LRU_deq) {
-      cache_block_deq *n;
-      cache_block_deq *p;
-
-      n = cb->hash_bucket_deq.next;
-      p = cb->hash_bucket_deq.prev;
-      n->prev = p;
-      p->next = n;
-      hash_bucket_deq->next->prev = &cb->hash_bucket_deq;
-      cb->hash_bucket_deq.next = hash_bucket_deq->next;
-      hash_bucket_deq->next = &cb->hash_bucket_deq;
-      cb->hash_bucket_deq.prev = hash_bucket_deq;
+    cb = disk_cache_victim(seg, &ra_stream);
 
-      n = cb->LRU_deq.next;
-      p = cb->LRU_deq.prev;
-      n->prev = p;
-      p->next = n;
-      LRU_deq->next->prev = &cb->LRU_deq;
-      cb->LRU_deq.next = LRU_deq->next;
-      LRU_deq->next = &cb->LRU_deq;
-      cb->LRU_deq.prev = LRU_deq;
+    if (cb != NULL) {
+      disk_cache_insert(seg, bucket, cb, d, sector_pos);
 
       cb->refcount = 1;
-      cb->d = d;
-      cb->sector_pos = sector_pos;
+      seg->misses++;
       rwmutex_writelock(cb->mut);
-      mutex_unlock(disk_mod.cache_mut);
+      mutex_unlock(seg->mut);
+      disk_ra_feedback(ra_stream, FALSE);
       cb->err = IN_PROGRESS;
       err =
           disk_read_sectors(d, sector_pos, cb->buf,
@@ -247,9 +851,9 @@ again:
       condvar_signal(cb->cv);
 
       if (ERROR(err)) {
-        mutex_lock(disk_mod.cache_mut);
+        disk_cache_lock(seg);
         cb->d = NULL; // so that this cache block can't be found again
-        mutex_unlock(disk_mod.cache_mut);
+        mutex_unlock(seg->mut);
         disk_cache_block_release(cb); // ignore error
         return err;
       }
@@ -257,7 +861,25 @@ again:
       break;
     }
 
-    condvar_wait(disk_mod.cache_cv, disk_mod.cache_mut);
+#ifdef USE_CACHE_BLOCK_FLUSHER
+    // The blocks of the segment may all be dirty
+    disk_flusher_wakeup();
+#else
+    // Without a flusher a dirty block is written back here, an error
+    // is returned when it can't be
+
+    if ((cb = disk_cache_dirty_victim(seg)) != NULL) {
+      cb->refcount++;
+      mutex_unlock(seg->mut);
+      err = disk_cache_block_write_back(cb);
+      disk_cache_block_release(cb); // ignore error
+      if (ERROR(err))
+        return err;
+      goto again;
+    }
+#endif
+
+    condvar_wait(seg->cv, seg->mut);
   }
 
   *block = cb;
@@ -277,7 +899,7 @@ static error_code flush_block(cache_block *block, time timeout) {
     if (block->dirty) {
       if (HAS_NO_ERROR(err = disk_write_sectors(block->d, block->sector_pos,
                                                 block->buf, 1))) {
-        block->dirty = 0;
+        disk_cache_block_clean(block);
         err = 1; // We flushed a single block
       }
     }
@@ -290,6 +912,7 @@ static error_code flush_block(cache_block *block, time timeout) {
 
 error_code disk_cache_block_release(cache_block *block) {
   error_code err = NO_ERROR;
+  disk_cache_segment *seg = disk_cache_segment_of(block->sector_pos);
   uint32 n = 0;
 
 #ifdef USE_BLOCK_REF_COUNTER_FREE
@@ -310,12 +933,12 @@ error_code disk_cache_block_release(cache_block *block) {
 #endif
 
   if (HAS_NO_ERROR(err)) {
-    mutex_lock(disk_mod.cache_mut);
+    disk_cache_lock(seg);
     { n = --block->refcount; }
-    mutex_unlock(disk_mod.cache_mut);
+    mutex_unlock(seg->mut);
 
     if (n == 0) {
-      condvar_signal(disk_mod.cache_cv);
+      condvar_signal(seg->cv);
     }
   }
 
@@ -324,6 +947,309 @@ error_code disk_cache_block_release(cache_block *block) {
 
 //-----------------------------------------------------------------------------
 
+// Direct reads
+
+// Copy the cached blocks of a range over the sectors read from the media.
+// The cache is authoritative: a block that was dirty may be cleaned by a
+// write-back that the device completes after the read. A block holds one
+// sector, which goes at buf + (i << shift) as in the read from the media.
+static error_code disk_direct_overlay(disk *d, uint32 sector_pos, uint8 *buf,
+                                      uint32 count, uint32 shift) {
+  error_code err;
+
+  for (uint32 i = 0; i < count; i++) {
+    disk_cache_segment *seg = disk_cache_segment_of(sector_pos + i);
+    cache_block *cb;
+
+    disk_cache_lock(seg);
+
+    cb = disk_cache_lookup(disk_cache_bucket(seg, sector_pos + i), d,
+                           sector_pos + i);
+
+    if (cb == NULL || cb->err != NO_ERROR) {
+      mutex_unlock(seg->mut);
+      continue;
+    }
+
+    cb->refcount++;
+    mutex_unlock(seg->mut);
+
+    rwmutex_readlock(cb->mut);
+    memcpy(buf + (i << shift), cb->buf, 1 << shift);
+    rwmutex_readunlock(cb->mut);
+
+    if (ERROR(err = disk_cache_block_release(cb)))
+      return err;
+  }
+
+  return NO_ERROR;
+}
+
+error_code disk_read_direct(disk *d, uint32 sector_pos, void *buf,
+                            uint32 count) {
+  blk_queue *q = disk_queue(d);
+  uint8 *p = CAST(uint8 *, buf);
+  uint32 shift = d->log2_sector_size;
+  error_code err;
+
+  if (q == NULL)
+    return UNIMPL_ERROR;
+
+  if (CAST(uint32, p) & 1) // the controllers need word aligned buffers
+    return ARG_ERROR;
+
+  // A request is limited to what the driver does with one command
+
+  for (uint32 i = 0; i < count;) {
+    uint32 n = count - i;
+
+    if (n > q->max_count)
+      n = q->max_count;
+
+    if (ERROR(err = disk_read_sectors(d, sector_pos + i, p + (i << shift), n)))
+      return err;
+
+    i += n;
+  }
+
+  disk_mod.direct_reads++;
+  disk_mod.direct_sectors += count;
+
+  return disk_direct_overlay(d, sector_pos, p, count, shift);
+}
+
+void disk_cache_get_stats(disk_cache_stats *stats) {
+  time wait = seconds_to_time(0);
+
+  stats->nb_blocks = disk_mod.cache_nb_blocks;
+  stats->nb_segments = DISK_CACHE_SEGMENTS;
+  stats->hits = 0;
+  stats->misses = 0;
+  stats->lock_waits = 0;
+  stats->main_hits = 0;
+  stats->ghost_hits = 0;
+#ifdef USE_DISK_CACHE_2Q
+  stats->policy = "2q";
+#else
+  stats->policy = "lru";
+#endif
+
+  for (uint32 i = 0; i < DISK_CACHE_SEGMENTS; i++) {
+    disk_cache_segment *seg = &disk_mod.cache_seg[i];
+    stats->hits += seg->hits;
+    stats->misses += seg->misses;
+    stats->lock_waits += seg->lock_waits;
+    stats->main_hits += seg->main_hits;
+    stats->ghost_hits += seg->ghost_hits;
+    wait = add_time(wait, seg->lock_wait_time);
+  }
+
+  stats->lock_wait_usecs = wait.n * 1000000 / seconds_to_time(1).n;
+  stats->ra_blocks = disk_mod.ra_blocks;
+  stats->ra_hits = disk_mod.ra_hits;
+  stats->ra_wasted = disk_mod.ra_wasted;
+  stats->nb_dirty = disk_mod.nb_dirty;
+  stats->wb_blocks = disk_mod.wb_blocks;
+  stats->wb_writes = disk_mod.wb_writes;
+  stats->direct_reads = disk_mod.direct_reads;
+  stats->direct_sectors = disk_mod.direct_sectors;
+}
+
+static uint32 disk_device_lba(cache_block *cb) {
+  return cb->d->partition_start + cb->sector_pos;
+}
+
+// Order the blocks by device, then by LBA on the device
+static void disk_sort_blocks(cache_block **blocks, uint32 n) {
+  for (uint32 i = 1; i < n; i++) {
+    cache_block *cb = blocks[i];
+    blk_queue *q = disk_queue(cb->d);
+    uint32 lba = disk_device_lba(cb);
+    uint32 j = i;
+
+    while (j > 0) {
+      cache_block *prev = blocks[j - 1];
+      blk_queue *prev_q = disk_queue(prev->d);
+      if (prev_q < q || (prev_q == q && disk_device_lba(prev) <= lba))
+        break;
+      blocks[j] = prev;
+      j--;
+    }
+
+    blocks[j] = cb;
+  }
+}
+
+// Write back, a batch at a time, the dirty blocks of the device holding
+// d, or of every device when d is NULL. When sync is FALSE, only the
+// blocks dirty since before dirty_before that aren't in use are written.
+static error_code disk_write_back(disk *d, bool sync, time dirty_before) {
+  error_code err = NO_ERROR;
+  blk_queue *q = (d == NULL) ? NULL : disk_queue(d);
+  cache_block_deq *LRU_probe;
+  cache_block *cb;
+  cache_block *blocks[DISK_FLUSH_BATCH];
+  blk_request *reqs;
+  blk_request *req_of[DISK_FLUSH_BATCH];
+  disk_batch batch;
+
+  reqs = CAST(blk_request *, kmalloc(DISK_FLUSH_BATCH * sizeof(blk_request)));
+
+  if (reqs == NULL)
+    return MEM_ERROR;
+
+  while (HAS_NO_ERROR(err)) {
+    uint32 n = 0;
+    uint32 nb_reqs = 0;
+    blk_request *req = NULL;
+    cache_block *last = NULL;
+    blk_queue *plugged = NULL;
+
+    // Take the least recently used dirty blocks first
+
+    for (uint32 i = 0; i < DISK_CACHE_SEGMENTS && n < DISK_FLUSH_BATCH; i++) {
+      disk_cache_segment *seg = &disk_mod.cache_seg[i];
+
+      disk_cache_lock(seg);
+
+      for (uint32 k = 0; k < DISK_CACHE_QUEUES; k++) {
+        cache_block_deq *queue = &seg->queue[k];
+
+        LRU_probe = queue->prev;
+
+        while (LRU_probe != queue && n < DISK_FLUSH_BATCH) {
+          cb = CACHE_BLOCK_OF(LRU_probe, LRU_deq);
+
+          if (cb->dirty && cb->d != NULL && disk_queue(cb->d) != NULL &&
+              (q == NULL || disk_queue(cb->d) == q) &&
+              (sync || (cb->refcount == 0 &&
+                        less_time(cb->dirty_time, dirty_before)))) {
+            cb->refcount++;
+            blocks[n++] = cb;
+          }
+
+          LRU_probe = LRU_probe->prev;
+        }
+      }
+
+      mutex_unlock(seg->mut);
+    }
+
+    if (n == 0)
+      break;
+
+    disk_sort_blocks(blocks, n);
+
+    // A block continuing the previous one of the same partition is added
+    // to its request
+
+    disk_batch_init(&batch);
+
+    for (uint32 i = 0; i < n; i++) {
+      uint32 count;
+
+      cb = blocks[i];
+      count = 1 << (DISK_LOG2_BLOCK_SIZE - cb->d->log2_sector_size);
+
+      rwmutex_readlock(cb->mut); // the buffer is only read
+
+      req_of[i] = NULL;
+
+      // Make sure it hasn't been cleaned in the wait
+      if (!cb->dirty)
+        continue;
+
+      if (last == NULL || last->d != cb->d ||
+          last->sector_pos + count != cb->sector_pos ||
+          !blk_request_add(req, cb->buf, count)) {
+        req = &reqs[nb_reqs++];
+        blk_request_init(req, BLK_WRITE, cb->sector_pos, disk_batch_done,
+                         &batch);
+        blk_request_add(req, cb->buf, count);
+        batch.pending++; // nothing was submitted yet
+      }
+
+      req_of[i] = req;
+      last = cb;
+    }
+
+    // The requests of a device are queued together
+
+    req = NULL;
+
+    for (uint32 i = 0; i < n; i++) {
+      blk_queue *bq;
+
+      if (req_of[i] == NULL || req_of[i] == req)
+        continue;
+
+      req = req_of[i];
+      bq = disk_queue(blocks[i]->d);
+
+      if (bq != plugged) {
+        if (plugged != NULL)
+          blk_unplug(plugged);
+        blk_plug(plugged = bq);
+      }
+
+      if (ERROR(req->err = disk_submit(blocks[i]->d, req))) {
+        disable_interrupts();
+        batch.err = req->err;
+        batch.pending--;
+        enable_interrupts();
+      }
+    }
+
+    if (plugged != NULL)
+      blk_unplug(plugged);
+
+    disk_mod.wb_writes += nb_reqs;
+
+    err = disk_batch_wait(&batch);
+
+    for (uint32 i = 0; i < n; i++) {
+      cb = blocks[i];
+
+      if (req_of[i] != NULL && HAS_NO_ERROR(req_of[i]->err)) {
+        disk_cache_block_clean(cb);
+        disk_mod.wb_blocks++;
+      }
+
+      rwmutex_readunlock(cb->mut);
+    }
+
+    // Releasing a block locks its segment, which an acquire may hold while
+    // it waits for one of the blocks, so they are all unlocked first
+
+    for (uint32 i = 0; i < n; i++)
+      disk_cache_block_release(blocks[i]); // ignore error
+  }
+
+  kfree(reqs);
+
+  return err;
+}
+
+error_code disk_flush(disk *d) {
+  error_code err;
+  blk_request flush;
+
+  if (disk_queue(d) == NULL)
+    return UNIMPL_ERROR;
+
+  // The flush is a barrier: the blocks dirty when it is called are on
+  // the media when it returns
+
+  if (HAS_NO_ERROR(err = disk_write_back(d, TRUE, current_time()))) {
+    blk_request_init(&flush, BLK_FLUSH, 0, NULL, NULL);
+    err = disk_submit_wait(d, &flush);
+  }
+
+  return err;
+}
+
+//-----------------------------------------------------------------------------
+
 static native_string partition_name_from_type(uint8 type) {
   uint32 i;
   size_t total_entries =
@@ -346,16 +1272,26 @@ static void disk_print_path(uint32 path) {
 }
 
 void disk_print_id(disk *d) {
-  if (d->_.ide.dev->kind == IDE_DEVICE_ATA) {
-    term_write(cout, "ATA");
+  if (d->kind == DISK_VIRTIO) {
+    term_write(cout, "virtio");
+    term_write(cout, d->_.virtio.dev->id);
+  } else if (d->kind == DISK_AHCI) {
+    term_write(cout, "SATA ahci");
+    term_write(cout, d->_.ahci.port->ctrl->id);
+    term_write(cout, ".");
+    term_write(cout, d->_.ahci.port->id);
   } else {
-    term_write(cout, "ATAPI");
-  }
+    if (d->_.ide.dev->kind == IDE_DEVICE_ATA) {
+      term_write(cout, "ATA");
+    } else {
+      term_write(cout, "ATAPI");
+    }
 
-  term_write(cout, " ide");
-  term_write(cout, d->_.ide.dev->ctrl->id);
-  term_write(cout, ".");
-  term_write(cout, d->_.ide.dev->id);
+    term_write(cout, " ide");
+    term_write(cout, d->_.ide.dev->ctrl->id);
+    term_write(cout, ".");
+    term_write(cout, d->_.ide.dev->id);
+  }
 
   disk_print_path(d->partition_path);
 
@@ -402,7 +1338,8 @@ void disk_add_all_partitions() {
     {
       Master_Boot_Record mbr;
       uint32 i;
-      uint32 max_LBA_when_using_BIOS_CHS = disk_max_BIOS_CHS_to_LBA(d);
+      uint32 max_LBA_when_using_BIOS_CHS =
+          (d->kind == DISK_IDE) ? disk_max_BIOS_CHS_to_LBA(d) : 0;
       disk *part;
 
       if (!ERROR(disk_read_sectors(d, 0, &mbr, 1))) {
@@ -418,7 +1355,9 @@ void disk_add_all_partitions() {
           if (type == 0)
             continue;
 
-          bool only_lba = partition_type_table[type].lba;
+          // Only IDE disks have a BIOS geometry to check the CHS fields
+          bool only_lba =
+              partition_type_table[type].lba || d->kind != DISK_IDE;
 
           start_LBA = d->partition_start + as_uint32(p->start_LBA);
           nb_sectors = as_uint32(p->nb_sectors);
@@ -489,7 +1428,7 @@ void disk_add_all_partitions() {
           part->partition_path = d->partition_path * 10 + i + 1;
           part->partition_start = start_LBA;
           part->partition_length = nb_sectors;
-          part->_.ide.dev = d->_.ide.dev;
+          part->_ = d->_;
         }
       }
     }
@@ -497,50 +1436,160 @@ void disk_add_all_partitions() {
   }
 }
 
+static uint32 disk_cache_size() {
+#ifdef DISK_CACHE_BLOCKS
+  return DISK_CACHE_BLOCKS;
+#else
+  uint64 n = (total_usable_memory / DISK_CACHE_MEMORY_SHARE) >>
+             DISK_LOG2_BLOCK_SIZE;
+
+  if (n < DISK_CACHE_MIN_BLOCKS)
+    return DISK_CACHE_MIN_BLOCKS;
+  if (n > DISK_CACHE_MAX_BLOCKS)
+    return DISK_CACHE_MAX_BLOCKS;
+  return n;
+#endif
+}
+
 void setup_disk() {
   uint32 i;
+  uint32 per_seg;
+  cache_block *blocks;
+  rwmutex *muts;
+  condvar *cvs;
 
   disk_mod.nb_disks = 0;
 
   for (i = 0; i < MAX_NB_DISKS; i++)
     disk_mod.disk_table[i].id = i;
 
-  disk_mod.cache_mut = new_mutex(CAST(mutex *, kmalloc(sizeof(mutex))));
-  disk_mod.cache_cv = new_condvar(CAST(condvar *, kmalloc(sizeof(condvar))));
+  per_seg = (disk_cache_size() + DISK_CACHE_SEGMENTS - 1) / DISK_CACHE_SEGMENTS;
 
-  disk_mod.LRU_deq.next = &disk_mod.LRU_deq;
-  disk_mod.LRU_deq.prev = &disk_mod.LRU_deq;
+  disk_mod.cache_nb_blocks = per_seg * DISK_CACHE_SEGMENTS;
 
-  for (i = 0; i < CACHE_BLOCK_HASH_TABLE_SIZE; i++) {
-    cache_block_deq *deq = &disk_mod.cache_block_hash_table[i];
-    deq->next = deq;
-    deq->prev = deq;
-  }
+  disk_mod.ra_mut = new_mutex(CAST(mutex *, kmalloc(sizeof(mutex))));
+  disk_mod.ra_replace = 0;
+  disk_mod.ra_free = NULL;
+  disk_mod.ra_blocks = 0;
+  disk_mod.ra_hits = 0;
+  disk_mod.ra_wasted = 0;
+
+  disk_mod.nb_dirty = 0;
+  disk_mod.wb_blocks = 0;
+  disk_mod.wb_writes = 0;
+  disk_mod.flusher_mut = new_mutex(CAST(mutex *, kmalloc(sizeof(mutex))));
+  disk_mod.flusher_cv = new_condvar(CAST(condvar *, kmalloc(sizeof(condvar))));
+  disk_mod.flusher_wakeup = FALSE;
+
+  disk_mod.direct_reads = 0;
+  disk_mod.direct_sectors = 0;
+
+#ifdef DISK_CACHE_TRACE
+  disk_mod.trace_count = 0;
+#endif
 
-  for (i = 0; i < DISK_CACHE_SIZE; i++) {
-    cache_block_deq *LRU_deq;
-    cache_block_deq *hash_bucket_deq;
-    cache_block *cb = CAST(cache_block *, kmalloc(sizeof(cache_block)));
+  for (i = 0; i < DISK_RA_STREAMS; i++)
+    disk_mod.ra_stream[i].d = NULL;
 
-    if (cb == NULL)
+  for (i = 0; i < DISK_RA_REQUESTS; i++)
+    disk_ra_free_request(&disk_mod.ra_req[i]);
+
+  // The blocks are allocated together, rather than each on its own, to
+  // avoid the overhead of the small object allocator
+
+  blocks = CAST(cache_block *,
+                kmalloc(disk_mod.cache_nb_blocks * sizeof(cache_block)));
+  muts = CAST(rwmutex *, kmalloc(disk_mod.cache_nb_blocks * sizeof(rwmutex)));
+  cvs = CAST(condvar *, kmalloc(disk_mod.cache_nb_blocks * sizeof(condvar)));
+
+  if (blocks == NULL || muts == NULL || cvs == NULL)
+    panic(L"can't allocate disk cache");
+
+  for (uint32 s = 0; s < DISK_CACHE_SEGMENTS; s++) {
+    disk_cache_segment *seg = &disk_mod.cache_seg[s];
+
+    seg->mut = new_mutex(CAST(mutex *, kmalloc(sizeof(mutex))));
+    seg->cv = new_condvar(CAST(condvar *, kmalloc(sizeof(condvar))));
+
+    for (i = 0; i < DISK_CACHE_QUEUES; i++) {
+      seg->queue[i].next = &seg->queue[i];
+      seg->queue[i].prev = &seg->queue[i];
+      seg->queue_len[i] = 0;
+    }
+
+    seg->nb_blocks = per_seg;
+    seg->nb_ghosts = per_seg / DISK_CACHE_OUT_SHARE + 1;
+    seg->next_ghost = 0;
+    seg->ghosts = CAST(disk_cache_ghost *,
+                       kmalloc(seg->nb_ghosts * sizeof(disk_cache_ghost)));
+
+    if (seg->ghosts == NULL)
       panic(L"can't allocate disk cache");
 
-    LRU_deq = &cb->LRU_deq;
-    hash_bucket_deq = &cb->hash_bucket_deq;
+    for (i = 0; i < seg->nb_ghosts; i++) {
+      disk_cache_ghost *g = &seg->ghosts[i];
+      g->hash_deq.next = &g->hash_deq;
+      g->hash_deq.prev = &g->hash_deq;
+      g->d = NULL;
+    }
+
+    seg->ghost_table_size = seg->nb_ghosts;
+    seg->ghost_table = CAST(
+        cache_block_deq *,
+        kmalloc(seg->ghost_table_size * sizeof(cache_block_deq)));
 
-    LRU_deq->next = &disk_mod.LRU_deq;
-    LRU_deq->prev = disk_mod.LRU_deq.prev;
-    disk_mod.LRU_deq.prev->next = LRU_deq;
-    disk_mod.LRU_deq.prev = LRU_deq;
+    if (seg->ghost_table == NULL)
+      panic(L"can't allocate disk cache");
+
+    for (i = 0; i < seg->ghost_table_size; i++) {
+      cache_block_deq *deq = &seg->ghost_table[i];
+      deq->next = deq;
+      deq->prev = deq;
+    }
 
-    hash_bucket_deq->next = hash_bucket_deq;
-    hash_bucket_deq->prev = hash_bucket_deq;
+    seg->hash_table_size = 2 * per_seg + 1;
+    seg->hash_table = CAST(
+        cache_block_deq *,
+        kmalloc(seg->hash_table_size * sizeof(cache_block_deq)));
 
-    // cb->d and cb->sector_pos and cb->err can stay undefined
-    cb->dirty = 0;
-    cb->refcount = 0;
-    cb->mut = new_rwmutex(CAST(rwmutex *, kmalloc(sizeof(rwmutex))));
-    cb->cv = new_condvar(CAST(condvar *, kmalloc(sizeof(condvar))));
+    if (seg->hash_table == NULL)
+      panic(L"can't allocate disk cache");
+
+    for (i = 0; i < seg->hash_table_size; i++) {
+      cache_block_deq *deq = &seg->hash_table[i];
+      deq->next = deq;
+      deq->prev = deq;
+    }
+
+    seg->hits = 0;
+    seg->misses = 0;
+    seg->main_hits = 0;
+    seg->ghost_hits = 0;
+    seg->lock_waits = 0;
+    seg->lock_wait_time = seconds_to_time(0);
+
+    for (i = 0; i < per_seg; i++) {
+      uint32 j = s * per_seg + i;
+      cache_block *cb = &blocks[j];
+      cache_block_deq *hash_bucket_deq = &cb->hash_bucket_deq;
+
+      cb->queue = DISK_CACHE_MAIN;
+      deq_push_front(&seg->queue[DISK_CACHE_MAIN], &cb->LRU_deq);
+      seg->queue_len[DISK_CACHE_MAIN]++;
+
+      hash_bucket_deq->next = hash_bucket_deq;
+      hash_bucket_deq->prev = hash_bucket_deq;
+
+      // cb->sector_pos can stay undefined
+      cb->d = NULL;
+      cb->err = NO_ERROR;
+      cb->dirty = 0;
+      cb->dirty_time = seconds_to_time(0);
+      cb->readahead = 0;
+      cb->refcount = 0;
+      cb->mut = new_rwmutex(&muts[j]);
+      cb->cv = new_condvar(&cvs[j]);
+    }
   }
 }
 
@@ -555,23 +1604,304 @@ void cache_block_maid_run() {
   for (;;) {
     thread_sleep_seconds(60);
 
-    if (mutex_lock_or_timeout(disk_mod.cache_mut, seconds_to_time(5))) {
-      cb = NULL;
-      deq = &disk_mod.LRU_deq;
-      lru_probe = deq->prev;
-
-      while (lru_probe != deq) {
-        cb = CAST(cache_block *,
-                  CAST(uint8 *, lru_probe) -
-                      (CAST(uint8 *, &cb->LRU_deq) - CAST(uint8 *, cb)));
-        flush_block(cb, seconds_to_time(10));
-        lru_probe = lru_probe->prev;
+    for (uint32 i = 0; i < DISK_CACHE_SEGMENTS; i++) {
+      disk_cache_segment *seg = &disk_mod.cache_seg[i];
+
+      if (mutex_lock_or_timeout(seg->mut, seconds_to_time(5))) {
+        cb = NULL;
+
+        for (uint32 k = 0; k < DISK_CACHE_QUEUES; k++) {
+          deq = &seg->queue[k];
+          lru_probe = deq->prev;
+
+          while (lru_probe != deq) {
+            cb = CACHE_BLOCK_OF(lru_probe, LRU_deq);
+            flush_block(cb, seconds_to_time(10));
+            lru_probe = lru_probe->prev;
+          }
+        }
+
+        // Done the cleaning task
+        mutex_unlock(seg->mut);
       }
+    }
+  }
+}
+
+// Write back the blocks that have been dirty for a while, or all of
+// them when asked to
+void cache_block_flusher_run() {
+  mutex_lock(disk_mod.flusher_mut);
 
-      // Done the cleaning task
-      mutex_unlock(disk_mod.cache_mut);
+  for (;;) {
+    time now;
+    bool all;
+
+    if (!disk_mod.flusher_wakeup &&
+        !condvar_wait_or_timeout(
+            disk_mod.flusher_cv, disk_mod.flusher_mut,
+            add_time(current_time(), seconds_to_time(DISK_FLUSH_INTERVAL))))
+      mutex_lock(disk_mod.flusher_mut); // timed out without the lock
+
+    all = disk_mod.flusher_wakeup;
+    disk_mod.flusher_wakeup = FALSE;
+    mutex_unlock(disk_mod.flusher_mut);
+
+    now = current_time();
+
+    if (disk_mod.nb_dirty > 0)
+      disk_write_back(
+          NULL, FALSE,
+          all ? now : subtract_time(now, seconds_to_time(DISK_DIRTY_AGE)));
+
+    mutex_lock(disk_mod.flusher_mut);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+#ifdef DISK_CACHE_BENCHMARK
+
+// Replay of a multithreaded read workload on the cache of the first disk.
+// Each thread mostly reads sectors of a hot set shared by all of them and
+// otherwise goes on with a sequential scan of its own part of the disk.
+// The hit rate and the time spent waiting for the segment locks are
+// reported.
+
+#define DISK_BENCH_THREADS 8
+#define DISK_BENCH_HOT_SECTORS 1024
+#define DISK_BENCH_HOT_SHARE 4 // reads in 5 that are in the hot set
+#define DISK_BENCH_SECONDS 2
+
+static disk *disk_bench_disk;
+static time disk_bench_end;
+static volatile uint32 disk_bench_next_id;
+static volatile uint32 disk_bench_running;
+static volatile uint32 disk_bench_reads;
+static condvar disk_bench_done_cv;
+
+static void disk_bench_run() {
+  disk *d = disk_bench_disk;
+  uint32 part = d->partition_length / DISK_BENCH_THREADS;
+  uint32 reads = 0;
+  uint32 id;
+  uint32 seed;
+  uint32 scan;
+
+  disable_interrupts();
+  id = disk_bench_next_id++;
+  enable_interrupts();
+
+  seed = id * 2654435761U + 1;
+  scan = part * id;
+
+  while (less_time(current_time(), disk_bench_end)) {
+    cache_block *cb;
+    uint32 lba;
+
+    seed = seed * 1103515245 + 12345;
+
+    if ((seed >> 16) % 5 < DISK_BENCH_HOT_SHARE) {
+      lba = (seed >> 8) % DISK_BENCH_HOT_SECTORS;
+    } else {
+      lba = scan++;
+      if (scan == part * (id + 1))
+        scan = part * id;
+    }
+
+    if (HAS_NO_ERROR(disk_cache_block_acquire(d, lba, &cb))) {
+      rwmutex_readlock(cb->mut);
+      rwmutex_readunlock(cb->mut);
+      disk_cache_block_release(cb);
+      reads++;
+    }
+  }
+
+  disable_interrupts();
+  disk_bench_reads += reads;
+  disk_bench_running--;
+  condvar_mutexless_signal(&disk_bench_done_cv);
+  enable_interrupts();
+}
+
+void disk_cache_benchmark() {
+  disk_cache_stats before;
+  disk_cache_stats after;
+  uint32 hits;
+  uint32 misses;
+
+  disk_bench_disk = disk_find(0);
+
+  if (disk_bench_disk == NULL ||
+      disk_bench_disk->partition_length / DISK_BENCH_THREADS <
+          DISK_BENCH_HOT_SECTORS)
+    return;
+
+  wait_queue_init(&disk_bench_done_cv.super);
+  disk_bench_next_id = 0;
+  disk_bench_running = DISK_BENCH_THREADS;
+  disk_bench_reads = 0;
+
+  disk_cache_get_stats(&before);
+
+  disk_bench_end =
+      add_time(current_time(), seconds_to_time(DISK_BENCH_SECONDS));
+
+  for (uint32 i = 0; i < DISK_BENCH_THREADS; i++) {
+    thread *t = CAST(thread *, kmalloc(sizeof(thread)));
+    thread_start(new_thread(t, disk_bench_run, "Disk cache benchmark"));
+  }
+
+  disable_interrupts();
+  while (disk_bench_running > 0)
+    condvar_mutexless_wait(&disk_bench_done_cv);
+  enable_interrupts();
+
+  disk_cache_get_stats(&after);
+
+  hits = after.hits - before.hits;
+  misses = after.misses - before.misses;
+
+  term_write(cout, "Disk cache benchmark (");
+  term_write(cout, after.policy);
+  term_write(cout, "): ");
+  term_write(cout, disk_bench_reads);
+  term_write(cout, " reads by ");
+  term_write(cout, DISK_BENCH_THREADS);
+  term_write(cout, " threads in ");
+  term_write(cout, DISK_BENCH_SECONDS);
+  term_write(cout, " s\n  hit rate (%): ");
+  term_write(cout, (hits + misses == 0) ? 0 : hits * 100 / (hits + misses));
+  term_write(cout, ", lock waits: ");
+  term_write(cout, after.lock_waits - before.lock_waits);
+  term_write(cout, ", lock wait (us): ");
+  term_write(cout,
+             CAST(uint32, after.lock_wait_usecs - before.lock_wait_usecs));
+  term_writeline(cout);
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+#ifdef DISK_BENCHMARK
+
+// Sequential read throughput of each device, bypassing the cache, with one
+// request at a time and then with DISK_BENCH_DEPTH requests in flight.
+// Booting once with -drive if=ide and once with -drive if=virtio compares
+// the drivers on the same image.
+
+#define DISK_BENCH_MB 16
+#define DISK_BENCH_REQ_SECTORS 128
+#define DISK_BENCH_DEPTH 4
+
+static native_string disk_kind_name(disk *d) {
+  switch (d->kind) {
+  case DISK_IDE:
+    return "IDE";
+  case DISK_VIRTIO:
+    return "virtio";
+  case DISK_AHCI:
+    return "AHCI";
+  default:
+    return "?";
+  }
+}
+
+// Read total sectors from the start of the disk, depth requests at a
+// time, and set *ms to the time it took
+static error_code disk_bench_read(disk *d, uint8 *buf, uint32 total,
+                                  uint32 depth, uint32 *ms) {
+  blk_request reqs[DISK_BENCH_DEPTH];
+  disk_batch batch;
+  uint32 lba = 0;
+  uint32 req_bytes = DISK_BENCH_REQ_SECTORS << d->log2_sector_size;
+  time start = current_time();
+  error_code err = NO_ERROR;
+
+  while (lba < total && HAS_NO_ERROR(err)) {
+    disk_batch_init(&batch);
+
+    for (uint32 i = 0; i < depth && lba < total; i++) {
+      blk_request *req = &reqs[i];
+
+      blk_request_init(req, BLK_READ, lba, disk_batch_done, &batch);
+      blk_request_add(req, buf + i * req_bytes, DISK_BENCH_REQ_SECTORS);
+      lba += DISK_BENCH_REQ_SECTORS;
+
+      disable_interrupts();
+      batch.pending++;
+      enable_interrupts();
+
+      if (ERROR(req->err = disk_submit(d, req))) {
+        disable_interrupts();
+        batch.err = req->err;
+        batch.pending--;
+        enable_interrupts();
+      }
     }
+
+    err = disk_batch_wait(&batch);
   }
+
+  *ms = CAST(uint32, subtract_time(current_time(), start).n * 1000 /
+                         seconds_to_time(1).n);
+
+  return err;
 }
 
+void disk_benchmark() {
+  uint32 total_bytes = DISK_BENCH_MB << 20;
+
+  for (uint32 i = 0; i < disk_mod.nb_disks; i++) {
+    disk *d = disk_find(i);
+    uint32 req_bytes = DISK_BENCH_REQ_SECTORS << d->log2_sector_size;
+    uint32 total = total_bytes >> d->log2_sector_size;
+    uint8 *buf;
+
+    // A partition would only read the start of its disk again
+
+    if (d->partition_path != 0 || d->partition_length < total)
+      continue;
+
+    buf = CAST(uint8 *, kmalloc(DISK_BENCH_DEPTH * req_bytes));
+
+    if (buf == NULL) {
+      term_write(cout, "Disk benchmark: out of memory\n");
+      return;
+    }
+
+    for (uint32 depth = 1; depth <= DISK_BENCH_DEPTH;
+         depth *= DISK_BENCH_DEPTH) {
+      uint32 ms;
+      error_code err = disk_bench_read(d, buf, total, depth, &ms);
+
+      term_write(cout, "Disk benchmark: disk ");
+      term_write(cout, i);
+      term_write(cout, " (");
+      term_write(cout, disk_kind_name(d));
+      term_write(cout, "), ");
+      term_write(cout, depth);
+      term_write(cout, " in flight: ");
+
+      if (ERROR(err)) {
+        term_write(cout, "error ");
+        term_write(cout, err);
+      } else {
+        term_write(cout, DISK_BENCH_MB);
+        term_write(cout, " MB in ");
+        term_write(cout, ms);
+        term_write(cout, " ms, KB/s: ");
+        term_write(cout, (ms == 0) ? 0 : (total_bytes >> 10) * 1000 / ms);
+      }
+
+      term_writeline(cout);
+    }
+
+    kfree(buf);
+  }
+}
+
+#endif
+
 //-----------------------------------------------------------------------------
@@ -0,0 +1,711 @@
+// file: "ahci.cpp"
+
+//-----------------------------------------------------------------------------
+
+#include "ahci.h"
+#include "asm.h"
+#include "disk.h"
+#include "intr.h"
+#include "pci.h"
+#include "rtlib.h"
+#include "term.h"
+#include "thread.h"
+
+//-----------------------------------------------------------------------------
+
+#ifdef USE_AHCI
+
+typedef struct ahci_module_struct {
+  ahci_controller ctrl[AHCI_CONTROLLERS];
+  ahci_port port[AHCI_PORTS];
+  uint32 nb_ctrl;
+  uint32 nb_ports;
+  condvar recovery_cv; // signaled when a port needs to be recovered
+} ahci_module;
+
+static ahci_module ahci_mod;
+
+#define AHCI_REG(base, reg) (*CAST(volatile uint32 *, (base) + (reg)))
+
+// The command tables are in ordinary memory, which must be written
+// before the command is issued through a register
+#define AHCI_BARRIER() __asm__ __volatile__("" : : : "memory")
+
+// Register reads when waiting for the controller
+#define AHCI_SPIN_LIMIT 1000000
+
+// Recoveries in a row that can't tell which command failed after which
+// the commands in flight are failed
+#define AHCI_RETRIES 3
+
+#define AHCI_PORT_INTERRUPTS                                                   \
+  (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS |           \
+   AHCI_PxIS_DPS | AHCI_PxIS_ERRORS)
+
+// Wait until the bits of a port register are cleared
+static bool ahci_spin_clear(ahci_port *port, uint32 reg, uint32 mask) {
+  for (uint32 i = 0; i < AHCI_SPIN_LIMIT; i++)
+    if (!(AHCI_REG(port->regs, reg) & mask))
+      return TRUE;
+
+  return FALSE;
+}
+
+// Wait up to some milliseconds until the bits of a port register are
+// cleared, from a thread
+static bool ahci_wait_clear(ahci_port *port, uint32 reg, uint32 mask,
+                            uint32 msecs) {
+  for (;;) {
+    if (!(AHCI_REG(port->regs, reg) & mask))
+      return TRUE;
+    if (msecs-- == 0)
+      return FALSE;
+    thread_sleep(1000000); // 1 msec
+  }
+}
+
+// Stop processing the command list, which forgets the issued commands
+static bool ahci_port_stop(ahci_port *port) {
+  AHCI_REG(port->regs, AHCI_PxCMD) &= ~AHCI_PxCMD_ST;
+  return ahci_spin_clear(port, AHCI_PxCMD, AHCI_PxCMD_CR);
+}
+
+// Also stop receiving FISes, so that the memory of the port is unused
+static bool ahci_port_halt(ahci_port *port) {
+  if (!ahci_port_stop(port))
+    return FALSE;
+
+  AHCI_REG(port->regs, AHCI_PxCMD) &= ~AHCI_PxCMD_FRE;
+  return ahci_spin_clear(port, AHCI_PxCMD, AHCI_PxCMD_FR);
+}
+
+// Fill in the register FIS of a command
+static void ahci_set_fis(ahci_command_table *t, uint8 command, uint32 lba,
+                         uint16 count, uint16 features, uint8 device) {
+  uint8 *fis = t->cfis;
+
+  memset(fis, 0, AHCI_FIS_REG_H2D_DWORDS * 4);
+
+  fis[0] = AHCI_FIS_TYPE_REG_H2D;
+  fis[1] = AHCI_FIS_REG_H2D_COMMAND;
+  fis[2] = command;
+  fis[3] = features;
+  fis[4] = lba;
+  fis[5] = lba >> 8;
+  fis[6] = lba >> 16;
+  fis[7] = device;
+  fis[8] = lba >> 24;
+  fis[11] = features >> 8;
+  fis[12] = count;
+  fis[13] = count >> 8;
+}
+
+// Set up the command of a slot for the request. Returns FALSE when a
+// buffer can't be reached by DMA.
+static bool ahci_prepare(ahci_port *port, uint8 slot, blk_request *req) {
+  ahci_command_header *h = &port->cmd_list[slot];
+  ahci_command_table *t = &port->tables[slot];
+  bool write = req->op == BLK_WRITE;
+  uint8 device = AHCI_FIS_DEVICE_LBA;
+  uint8 command;
+  uint16 count = req->count; // 65536 sectors is 0
+  uint16 features = 0;
+
+  if (req->op == BLK_FLUSH) {
+    command = port->lba48 ? IDE_FLUSH_CACHE_EXT_CMD : IDE_FLUSH_CACHE_CMD;
+    count = 0;
+  } else if (port->ncq) {
+    // The sector count goes in the features and the tag in the count
+
+    command = write ? IDE_WRITE_FPDMA_QUEUED_CMD : IDE_READ_FPDMA_QUEUED_CMD;
+    features = count;
+    count = slot << 3;
+  } else if (port->lba48) {
+    command = write ? IDE_WRITE_DMA_EXT_CMD : IDE_READ_DMA_EXT_CMD;
+  } else {
+    command = write ? IDE_WRITE_DMA_CMD : IDE_READ_DMA_CMD;
+    device |= (req->lba >> 24) & 0x0f;
+  }
+
+  ahci_set_fis(t, command, req->lba, count, features, device);
+
+  h->prdtl = 0;
+
+  if (req->op != BLK_FLUSH) {
+    for (uint8 i = 0; i < req->nb_segments; i++) {
+      blk_segment *s = &req->segments[i];
+
+      if (CAST(uint32, s->buf) & 1)
+        return FALSE;
+
+      t->prdt[i].dba = CAST(uint32, s->buf);
+      t->prdt[i].dbau = 0;
+      t->prdt[i].dbc = (s->count << IDE_LOG2_SECTOR_SIZE) - 1;
+    }
+
+    h->prdtl = req->nb_segments;
+  }
+
+  h->flags = AHCI_CMD_FLAGS_CFL(AHCI_FIS_REG_H2D_DWORDS) |
+             (write ? AHCI_CMD_FLAGS_WRITE : 0);
+  h->prdbc = 0;
+
+  return TRUE;
+}
+
+static void ahci_issue(ahci_port *port, uint8 slot, blk_request *req) {
+  port->req[slot] = req;
+  port->issued |= CAST(uint32, 1) << slot;
+
+  AHCI_BARRIER();
+
+  if (port->ncq && req->op != BLK_FLUSH)
+    AHCI_REG(port->regs, AHCI_PxSACT) = CAST(uint32, 1) << slot;
+
+  AHCI_REG(port->regs, AHCI_PxCI) = CAST(uint32, 1) << slot;
+}
+
+// Give the device as many requests as it has free slots. A flush is
+// not queued, but the request layer only starts it when the port is
+// idle and starts nothing else until it is done.
+static void ahci_start(ahci_port *port) {
+  uint32 all = (port->nb_slots == 32) ? 0xffffffff
+                                      : (CAST(uint32, 1) << port->nb_slots) - 1;
+
+  ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
+
+  if (port->recovering)
+    return;
+
+  for (;;) {
+    uint32 free = all & ~port->issued;
+    blk_request *req;
+    uint8 slot;
+
+    if (free == 0 || (req = blk_queue_next(&port->queue)) == NULL)
+      break;
+
+    if (req->op != BLK_FLUSH && req->count == 0) {
+      blk_complete(req, NO_ERROR);
+      continue;
+    }
+
+    slot = __builtin_ctz(free);
+
+    if (!ahci_prepare(port, slot, req)) {
+      blk_complete(req, ARG_ERROR);
+      continue;
+    }
+
+    ahci_issue(port, slot, req);
+  }
+}
+
+static void ahci_queue_start(blk_queue *q) {
+  ahci_start(CAST(ahci_port *, q->driver_data));
+}
+
+// Complete the requests of a set of slots
+static void ahci_complete(ahci_port *port, uint32 slots, error_code err) {
+  port->issued &= ~slots;
+
+  while (slots != 0) {
+    uint8 slot = __builtin_ctz(slots);
+    blk_request *req = port->req[slot];
+
+    slots &= slots - 1;
+    port->req[slot] = NULL;
+    blk_complete(req, err);
+  }
+}
+
+// Give the requests of a set of slots back to the queue
+static void ahci_requeue(ahci_port *port, uint32 slots) {
+  port->issued &= ~slots;
+
+  while (slots != 0) {
+    uint8 slot = __builtin_ctz(slots);
+    blk_request *req = port->req[slot];
+
+    slots &= slots - 1;
+    port->req[slot] = NULL;
+    blk_requeue(req);
+  }
+}
+
+// Read a sector into buf with a command in slot 0, polling for its end.
+// Nothing else must be issued to the port.
+static bool ahci_read_polled(ahci_port *port, uint8 command, uint32 lba,
+                             uint16 count, void *buf) {
+  ahci_command_header *h = &port->cmd_list[0];
+  ahci_command_table *t = &port->tables[0];
+  bool ok = FALSE;
+  uint32 j;
+
+  ahci_set_fis(t, command, lba, count, 0, 0);
+
+  t->prdt[0].dba = CAST(uint32, buf);
+  t->prdt[0].dbau = 0;
+  t->prdt[0].dbc = (1 << IDE_LOG2_SECTOR_SIZE) - 1;
+
+  h->flags = AHCI_CMD_FLAGS_CFL(AHCI_FIS_REG_H2D_DWORDS);
+  h->prdtl = 1;
+  h->prdbc = 0;
+
+  AHCI_BARRIER();
+
+  AHCI_REG(port->regs, AHCI_PxCI) = 1;
+
+  for (j = 1000; j > 0; j--) // wait up to 1 second for a response
+  {
+    if (AHCI_REG(port->regs, AHCI_PxIS) & AHCI_PxIS_TFES)
+      break;
+
+    if (!(AHCI_REG(port->regs, AHCI_PxCI) & 1)) {
+      ok = !(AHCI_REG(port->regs, AHCI_PxTFD) & IDE_STATUS_ERR);
+      break;
+    }
+
+    thread_sleep(1000000); // 1 msec
+  }
+
+  AHCI_REG(port->regs, AHCI_PxIS) = 0xffffffff;
+
+  return ok;
+}
+
+// Reset the device with a COMRESET, the port being stopped, and wait for
+// it to be ready again
+static bool ahci_port_reset(ahci_port *port) {
+  uint32 sctl = AHCI_REG(port->regs, AHCI_PxSCTL) & ~AHCI_PxSCTL_DET_MASK;
+  uint32 j;
+
+  AHCI_REG(port->regs, AHCI_PxSCTL) = sctl | AHCI_PxSCTL_DET_INIT;
+  thread_sleep(1000000); // 1 msec, at least
+  AHCI_REG(port->regs, AHCI_PxSCTL) = sctl;
+
+  for (j = 1000; j > 0; j--) // wait up to 1 second for the link
+  {
+    if ((AHCI_REG(port->regs, AHCI_PxSSTS) & AHCI_PxSSTS_DET_MASK) ==
+        AHCI_PxSSTS_DET_PRESENT)
+      break;
+    thread_sleep(1000000); // 1 msec
+  }
+
+  AHCI_REG(port->regs, AHCI_PxSERR) = 0xffffffff;
+
+  return j > 0 && ahci_wait_clear(port, AHCI_PxTFD,
+                                  IDE_STATUS_BSY | IDE_STATUS_DRQ, 1000);
+}
+
+// The commands whose PxCI and PxSACT bits are cleared are done
+static uint32 ahci_reap(ahci_port *port) {
+  uint32 busy =
+      AHCI_REG(port->regs, AHCI_PxCI) | AHCI_REG(port->regs, AHCI_PxSACT);
+  uint32 done = port->issued & ~busy;
+
+  ahci_complete(port, done, NO_ERROR);
+
+  return done;
+}
+
+// After an error the controller stops processing the command list. The
+// recovery thread stops the port, resets the device when it stays busy
+// and restarts the port. A device that failed a queued command stays in
+// an error state until its NCQ error log is read, which also gives the
+// tag of the command. Only the command that failed is failed. The others
+// in flight were aborted by the device and are issued again.
+static void ahci_port_recover(ahci_port *port) {
+  bool reset = FALSE;
+  uint32 failed = 0; // slot of the command that failed, when known
+
+  // Stopping the port clears PxCI and PxSACT, the commands that were
+  // done meanwhile are finished first
+
+  disable_interrupts();
+  ahci_reap(port);
+  enable_interrupts();
+
+  if (port->issued != 0 && (port->issued & (port->issued - 1)) == 0)
+    failed = port->issued; // the only command in flight
+
+  AHCI_REG(port->regs, AHCI_PxCMD) &= ~AHCI_PxCMD_ST;
+
+  if (!ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CR, 500))
+    reset = TRUE;
+
+  AHCI_REG(port->regs, AHCI_PxSERR) = 0xffffffff;
+  AHCI_REG(port->regs, AHCI_PxIS) = 0xffffffff;
+
+  if (reset || !ahci_wait_clear(port, AHCI_PxTFD,
+                                IDE_STATUS_BSY | IDE_STATUS_DRQ, 500)) {
+    reset = TRUE;
+    if (!ahci_port_reset(port))
+      term_write(cout, "***AHCI PORT RESET FAILED***\n");
+  }
+
+  AHCI_REG(port->regs, AHCI_PxIS) = 0xffffffff;
+  AHCI_REG(port->regs, AHCI_PxCMD) |= AHCI_PxCMD_ST;
+
+  if (port->ncq && !reset) {
+    uint8 *log = CAST(uint8 *, kmalloc(1 << IDE_LOG2_SECTOR_SIZE));
+
+    if (log != NULL) {
+      if (ahci_read_polled(port, IDE_READ_LOG_EXT_CMD,
+                           IDE_LOG_NCQ_COMMAND_ERROR, 1, log) &&
+          !(log[0] & IDE_NCQ_LOG_NQ) && failed == 0)
+        failed = port->issued & (CAST(uint32, 1)
+                                 << (log[0] & IDE_NCQ_LOG_TAG_MASK));
+      kfree(log);
+    }
+  }
+
+  disable_interrupts();
+
+  port->recovering = FALSE;
+
+  // When the failed command is unknown, e.g. after a COMRESET, they are
+  // all tried again a few times
+
+  if (failed != 0)
+    port->retries = 0;
+  else if (++port->retries > AHCI_RETRIES)
+    failed = port->issued;
+
+  ahci_complete(port, failed, UNKNOWN_ERROR);
+  ahci_requeue(port, port->issued);
+  ahci_start(port);
+
+  enable_interrupts();
+}
+
+static void ahci_recovery_run() {
+  for (;;) {
+    ahci_port *port = NULL;
+
+    disable_interrupts();
+
+    while (port == NULL) {
+      for (uint32 i = 0; i < ahci_mod.nb_ports && port == NULL; i++)
+        if (ahci_mod.port[i].recovering)
+          port = &ahci_mod.port[i];
+
+      if (port == NULL)
+        condvar_mutexless_wait(&ahci_mod.recovery_cv);
+    }
+
+    enable_interrupts();
+
+    ahci_port_recover(port);
+  }
+}
+
+static void ahci_port_irq(ahci_port *port) {
+  uint32 is = AHCI_REG(port->regs, AHCI_PxIS);
+
+  AHCI_REG(port->regs, AHCI_PxIS) = is;
+
+  if (port->recovering)
+    return;
+
+  // A queued command is done when the device clears its PxSACT bit, the
+  // others when the controller clears their PxCI bit. After an error
+  // the bits of the commands that went through are cleared too.
+
+  if (ahci_reap(port) != 0)
+    port->retries = 0;
+
+  if (is & AHCI_PxIS_ERRORS) {
+    // The waits of the recovery are too long for an interrupt handler
+    port->recovering = TRUE;
+    condvar_mutexless_signal(&ahci_mod.recovery_cv);
+    return;
+  }
+
+  ahci_start(port);
+}
+
+static void ahci_irq(void *data) {
+  ahci_controller *ctrl = CAST(ahci_controller *, data);
+  uint32 is = AHCI_REG(ctrl->abar, AHCI_IS);
+
+  if (is == 0)
+    return; // another device on the IRQ
+
+  for (uint32 pending = is; pending != 0; pending &= pending - 1) {
+    uint8 id = __builtin_ctz(pending);
+
+    if (ctrl->port[id] != NULL)
+      ahci_port_irq(ctrl->port[id]);
+    else
+      AHCI_REG(ctrl->abar, AHCI_PORT_BASE(id) + AHCI_PxIS) = 0xffffffff;
+  }
+
+  // The controller's status can only be cleared after the ports'
+
+  AHCI_REG(ctrl->abar, AHCI_IS) = is;
+}
+
+//-----------------------------------------------------------------------------
+
+// Send IDENTIFY DEVICE, with the port's interrupts disabled, and learn
+// the capacity and queuing support of the device
+static bool ahci_identify(ahci_port *port) {
+  uint16 *ident = CAST(uint16 *, kmalloc(1 << IDE_LOG2_SECTOR_SIZE));
+  bool ok;
+
+  if (ident == NULL)
+    return FALSE;
+
+  ok = ahci_read_polled(port, IDE_IDENTIFY_DEVICE_CMD, 0, 0, ident);
+
+  if (ok) {
+    uint32 depth = (ident[75] & 0x1f) + 1;
+
+    port->total_sectors = (CAST(uint32, ident[61]) << 16) + ident[60];
+
+    // Words 100 to 103 are the capacity with 48 bit LBAs
+
+    port->lba48 = (ident[83] & (1 << 10)) && (ident[86] & (1 << 10));
+
+    if (port->lba48) {
+      if (ident[102] != 0 || ident[103] != 0)
+        port->total_sectors = 0xffffffff; // as much as a 32 bit LBA reaches
+      else
+        port->total_sectors = (CAST(uint32, ident[101]) << 16) + ident[100];
+    }
+
+    // NCQ needs 48 bit LBAs, the queue depth is in word 75
+
+    port->ncq = (ident[76] & (1 << 8)) && port->lba48 &&
+                (port->ctrl->cap & AHCI_CAP_SNCQ);
+
+    port->nb_slots = 1;
+
+    if (port->ncq) {
+      port->nb_slots = AHCI_CAP_NCS(port->ctrl->cap);
+      if (port->nb_slots > depth)
+        port->nb_slots = depth;
+    }
+  }
+
+  kfree(ident);
+
+  return ok;
+}
+
+static ahci_port *setup_ahci_port(ahci_controller *ctrl, uint8 id) {
+  ahci_port *port;
+  uint32 bytes;
+  uint8 *mem;
+  uint32 j;
+
+  if (ahci_mod.nb_ports == AHCI_PORTS)
+    return NULL;
+
+  port = &ahci_mod.port[ahci_mod.nb_ports];
+  port->ctrl = ctrl;
+  port->id = id;
+  port->regs = ctrl->abar + AHCI_PORT_BASE(id);
+
+  if ((AHCI_REG(port->regs, AHCI_PxSSTS) & AHCI_PxSSTS_DET_MASK) !=
+      AHCI_PxSSTS_DET_PRESENT)
+    return NULL; // no device
+
+  if (!ahci_port_halt(port))
+    return NULL;
+
+  // The command list is 1K aligned, followed by the received FIS area
+  // and the command tables, which are 128 byte aligned
+
+  bytes = AHCI_MAX_SLOTS * sizeof(ahci_command_header) +
+          AHCI_RECEIVED_FIS_SIZE + AHCI_MAX_SLOTS * sizeof(ahci_command_table);
+
+  port->mem = kmalloc(bytes + 1023);
+
+  if (port->mem == NULL)
+    return NULL;
+
+  mem = CAST(uint8 *, (CAST(uint32, port->mem) + 1023) & ~1023);
+
+  memset(mem, 0, bytes);
+
+  port->cmd_list = CAST(ahci_command_header *, mem);
+  port->received_fis = mem + AHCI_MAX_SLOTS * sizeof(ahci_command_header);
+  port->tables = CAST(ahci_command_table *,
+                      port->received_fis + AHCI_RECEIVED_FIS_SIZE);
+
+  for (j = 0; j < AHCI_MAX_SLOTS; j++) {
+    port->cmd_list[j].ctba = CAST(uint32, &port->tables[j]);
+    port->cmd_list[j].ctbau = 0;
+    port->req[j] = NULL;
+  }
+
+  port->issued = 0;
+  port->recovering = FALSE;
+  port->retries = 0;
+
+  AHCI_REG(port->regs, AHCI_PxCLB) = CAST(uint32, port->cmd_list);
+  AHCI_REG(port->regs, AHCI_PxCLBU) = 0;
+  AHCI_REG(port->regs, AHCI_PxFB) = CAST(uint32, port->received_fis);
+  AHCI_REG(port->regs, AHCI_PxFBU) = 0;
+
+  AHCI_REG(port->regs, AHCI_PxIE) = 0;
+  AHCI_REG(port->regs, AHCI_PxSERR) = 0xffffffff;
+  AHCI_REG(port->regs, AHCI_PxIS) = 0xffffffff;
+
+  AHCI_REG(port->regs, AHCI_PxCMD) |=
+      AHCI_PxCMD_FRE | ((ctrl->cap & AHCI_CAP_SSS) ? AHCI_PxCMD_SUD : 0);
+
+  for (j = 1000; j > 0; j--) // wait up to 1 second for the device
+  {
+    if (!(AHCI_REG(port->regs, AHCI_PxTFD) &
+          (IDE_STATUS_BSY | IDE_STATUS_DRQ)))
+      break;
+    thread_sleep(1000000); // 1 msec
+  }
+
+  // Only ATA devices are supported, ATAPI devices are left alone
+
+  if (j == 0 || AHCI_REG(port->regs, AHCI_PxSIG) != AHCI_SIG_ATA) {
+    ahci_port_halt(port);
+    kfree(port->mem);
+    return NULL;
+  }
+
+  AHCI_REG(port->regs, AHCI_PxCMD) |= AHCI_PxCMD_ST;
+
+  if (!ahci_identify(port)) {
+    ahci_port_halt(port);
+    kfree(port->mem);
+    return NULL;
+  }
+
+  blk_queue_init(&port->queue, ahci_queue_start, port,
+                 port->lba48 ? AHCI_MAX_COUNT : IDE_LBA28_MAX_COUNT);
+
+  AHCI_REG(port->regs, AHCI_PxIE) = AHCI_PORT_INTERRUPTS;
+
+  ahci_mod.nb_ports++;
+
+#ifdef SHOW_AHCI_INFO
+  term_write(cout, "ahci");
+  term_write(cout, ctrl->id);
+  term_write(cout, ".");
+  term_write(cout, id);
+  term_write(cout, port->ncq ? " NCQ depth " : " no NCQ");
+  if (port->ncq)
+    term_write(cout, port->nb_slots);
+  term_write(cout, " ");
+  term_write(cout, port->total_sectors >> (20 - IDE_LOG2_SECTOR_SIZE));
+  term_write(cout, "MB\n");
+#endif
+
+  return port;
+}
+
+static void setup_ahci_controller(ahci_controller *ctrl, pci_function *fn) {
+  uint32 pi;
+  uint32 first_port = ahci_mod.nb_ports;
+  bool used = FALSE;
+
+  ctrl->fn = *fn;
+  ctrl->irq = pci_read_config_byte(fn, PCI_INTERRUPT_LINE);
+
+  for (uint32 i = 0; i < AHCI_MAX_PORTS; i++)
+    ctrl->port[i] = NULL;
+
+  ctrl->abar = pci_bar_address(fn, AHCI_ABAR);
+
+  if (ctrl->abar == NULL)
+    return;
+
+  pci_enable_bus_master(fn);
+
+  AHCI_REG(ctrl->abar, AHCI_GHC) |= AHCI_GHC_AE;
+  AHCI_REG(ctrl->abar, AHCI_GHC) &= ~AHCI_GHC_IE;
+
+  ctrl->cap = AHCI_REG(ctrl->abar, AHCI_CAP);
+  pi = AHCI_REG(ctrl->abar, AHCI_PI);
+
+  for (uint32 i = 0; i < AHCI_MAX_PORTS; i++)
+    if (pi & (CAST(uint32, 1) << i)) {
+      ctrl->port[i] = setup_ahci_port(ctrl, i);
+      if (ctrl->port[i] != NULL)
+        used = TRUE;
+    }
+
+  if (!used)
+    return;
+
+  // The controller gets a vector of its own when it can send MSIs
+
+  if (!pci_enable_msi(fn, ahci_irq, ctrl) &&
+      !intr_add_handler(ctrl->irq, ahci_irq, ctrl)) {
+    for (uint32 i = 0; i < AHCI_MAX_PORTS; i++)
+      if (ctrl->port[i] != NULL) {
+        AHCI_REG(ctrl->port[i]->regs, AHCI_PxIE) = 0;
+        ahci_port_halt(ctrl->port[i]);
+        kfree(ctrl->port[i]->mem);
+        ctrl->port[i] = NULL;
+      }
+
+    // The controller's ports are the last ones set up, their entries
+    // are given back
+
+    ahci_mod.nb_ports = first_port;
+    return;
+  }
+
+  AHCI_REG(ctrl->abar, AHCI_IS) = 0xffffffff;
+  AHCI_REG(ctrl->abar, AHCI_GHC) |= AHCI_GHC_IE;
+
+  for (uint32 i = 0; i < AHCI_MAX_PORTS; i++)
+    if (ctrl->port[i] != NULL) {
+      disk *d = disk_alloc();
+      if (d != NULL) {
+        d->kind = DISK_AHCI;
+        d->log2_sector_size = IDE_LOG2_SECTOR_SIZE;
+        d->partition_type = 0;
+        d->partition_path = 0;
+        d->partition_start = 0;
+        d->partition_length = ctrl->port[i]->total_sectors;
+        d->_.ahci.port = ctrl->port[i];
+      }
+    }
+}
+
+void setup_ahci() {
+  pci_function fn;
+
+  ahci_mod.nb_ctrl = 0;
+  ahci_mod.nb_ports = 0;
+  wait_queue_init(&ahci_mod.recovery_cv.super);
+
+  for (uint32 i = 0; ahci_mod.nb_ctrl < AHCI_CONTROLLERS &&
+                     pci_find_class(PCI_CLASS_STORAGE,
+                                    PCI_SUBCLASS_STORAGE_SATA, i, &fn);
+       i++) {
+    if (pci_read_config_byte(&fn, PCI_PROG_IF) != AHCI_PROG_IF)
+      continue;
+
+    ahci_controller *ctrl = &ahci_mod.ctrl[ahci_mod.nb_ctrl];
+
+    ctrl->id = ahci_mod.nb_ctrl++;
+    setup_ahci_controller(ctrl, &fn);
+  }
+
+  if (ahci_mod.nb_ports > 0) {
+    thread *t = CAST(thread *, kmalloc(sizeof(thread)));
+    if (t != NULL)
+      thread_start(new_thread(t, ahci_recovery_run, "AHCI recovery"));
+  }
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+// Local Variables: //
+// mode: C++ //
+// End: //
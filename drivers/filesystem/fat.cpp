@@ -46,12 +46,18 @@ static error_code new_fat_file(fat_file **result) {
   allocated->link = NULL;
   allocated->first_cluster = 0;
   allocated->current_cluster = 0;
+  allocated->current_index = 0;
   allocated->current_section_start = 0;
   allocated->current_section_length = 0;
   allocated->current_pos = 0;
   allocated->length = 0;
+  allocated->extents.first_cluster = 0;
+  allocated->extents.runs = NULL;
+  allocated->extents.nb_runs = 0;
+  allocated->extents.max_runs = 0;
   allocated->parent.first_cluster = 0;
   allocated->entry.position = 0;
+  allocated->entry.dirty = FALSE;
 
   *result = allocated;
 
@@ -59,6 +65,7 @@ static error_code new_fat_file(fat_file **result) {
 }
 
 static error_code fat_remove(fs_header *header, file *file);
+static void fat_file_touch(fat_file *f);
 static error_code fat_rename(fs_header *header, file *source,
                              native_string name, uint8 depth);
 static error_code fat_mkdir(fs_header *header, native_string name, uint8 depth,
@@ -70,11 +77,12 @@ static void fat_reset_cursor(file *f);
 static error_code fat_move_cursor(file *f, int32 n);
 static error_code fat_set_to_absolute_position(file *f, uint32 position);
 static error_code fat_close_file(file *f);
+static error_code fat_sync_file(file *f);
 static error_code fat_write_file(file *f, void *buff, uint32 count);
 static error_code fat_read_file(file *f, void *buf, uint32 count);
 static error_code fat_open_root_dir(fat_file_system *fs, file **result);
 static error_code fat_32_find_first_empty_cluster(fat_file_system *fs,
-                                                  uint32 *result);
+                                                  uint32 goal, uint32 *result);
 static error_code fat_32_set_fat_link_value(fat_file_system *fs, uint32 cluster,
                                             uint32 value);
 static error_code fat_update_file_length(fat_file *f);
@@ -103,11 +111,70 @@ static error_code fat_fetch_parent(fat_file_system *fs, native_string *_parts,
 
 static error_code read_lfn(fs_header *fs, uint32 cluster, uint32 entry_position,
                            native_string *result);
+static void fat_dentry_invalidate(fat_file_system *fs, uint32 parent_cluster);
 
 // -------------------------------------------------------------
 // Mounting routines
 // -------------------------------------------------------------
 
+#define FAT_NB_CLUSTERS(fs)                                                    \
+  ((fs)->_.FAT121632.total_data_clusters + FAT32_FIRST_CLUSTER)
+
+// Take the free cluster hints of the FSInfo sector, if it is valid
+static error_code fat_32_read_FSInfo(fat_file_system *fs, uint32 sector) {
+  cache_block *cb = NULL;
+  error_code err;
+
+  if (ERROR(err = disk_cache_block_acquire(fs->_.FAT121632.d, sector, &cb)))
+    return err;
+  rwmutex_readlock(cb->mut);
+
+  FAT_FSInfo *info = CAST(FAT_FSInfo *, cb->buf);
+
+  if (as_uint32(info->FSI_LeadSig) == FAT_FSINFO_LEAD_SIG &&
+      as_uint32(info->FSI_StrucSig) == FAT_FSINFO_STRUC_SIG) {
+    uint32 free_count = as_uint32(info->FSI_Free_Count);
+    uint32 next_free = as_uint32(info->FSI_Nxt_Free);
+
+    fs->_.FAT121632.FSInfo_sector = sector;
+
+    if (free_count <= fs->_.FAT121632.total_data_clusters)
+      fs->_.FAT121632.free_count = free_count;
+
+    if (next_free >= FAT32_FIRST_CLUSTER && next_free < FAT_NB_CLUSTERS(fs))
+      fs->_.FAT121632.next_free = next_free;
+  }
+
+  rwmutex_readunlock(cb->mut);
+
+  return disk_cache_block_release(cb);
+}
+
+static error_code fat_32_write_FSInfo(fat_file_system *fs) {
+  cache_block *cb = NULL;
+  error_code err;
+
+  if (fs->_.FAT121632.FSInfo_sector == 0)
+    return NO_ERROR;
+
+  if (ERROR(err = disk_cache_block_acquire(
+                fs->_.FAT121632.d, fs->_.FAT121632.FSInfo_sector, &cb)))
+    return err;
+  rwmutex_writelock(cb->mut);
+
+  FAT_FSInfo *info = CAST(FAT_FSInfo *, cb->buf);
+
+  for (uint8 i = 0; i < 4; ++i) {
+    info->FSI_Free_Count[i] = as_uint8(fs->_.FAT121632.free_count, i);
+    info->FSI_Nxt_Free[i] = as_uint8(fs->_.FAT121632.next_free, i);
+  }
+
+  disk_cache_block_dirty(cb);
+  rwmutex_writeunlock(cb->mut);
+
+  return disk_cache_block_release(cb);
+}
+
 static error_code mount_FAT121632(disk *d, fat_file_system **result) {
   fat_file_system *fs = NULL;
   BIOS_Parameter_Block *p = NULL;
@@ -125,6 +192,8 @@ static error_code mount_FAT121632(disk *d, fat_file_system **result) {
   uint32 first_data_sector = 0;
   uint32 total_data_sectors = 0;
   uint32 total_data_clusters = 0;
+  uint32 root_cluster = 0;
+  uint32 FSInfo_sector = 0;
   uint8 kind = 0;
   cache_block *cb = NULL;
   error_code err = NO_ERROR, release_err = NO_ERROR;
@@ -181,6 +250,8 @@ static error_code mount_FAT121632(disk *d, fat_file_system **result) {
         err = UNKNOWN_ERROR;
       } else {
         FAT_size = as_uint32(p->_.FAT32.BPB_FATSz32);
+        root_cluster = as_uint32(p->_.FAT32.BPB_RootClus);
+        FSInfo_sector = as_uint16(p->_.FAT32.BPB_FSInfo);
 
         if (FAT_size == 0) {
           term_write(cout, "FATSz32 is 0\n");
@@ -279,6 +350,16 @@ static error_code mount_FAT121632(disk *d, fat_file_system **result) {
     fs->_.FAT121632.root_directory_sectors = root_directory_sectors;
     fs->_.FAT121632.first_data_sector = first_data_sector;
     fs->_.FAT121632.total_data_clusters = total_data_clusters;
+    fs->_.FAT121632.FAT_size = FAT_size;
+    fs->_.FAT121632.root_cluster = root_cluster;
+    fs->_.FAT121632.FSInfo_sector = 0;
+    fs->_.FAT121632.free_count = FAT_FSINFO_UNKNOWN;
+    fs->_.FAT121632.next_free = FAT32_FIRST_CLUSTER;
+    fs->_.FAT121632.free_map = NULL;
+
+    if (kind == FAT32_FS && FSInfo_sector != 0 &&
+        FSInfo_sector < reserved_sectors)
+      fat_32_read_FSInfo(fs, FSInfo_sector); // it's only a hint
 
     *result = fs;
   }
@@ -286,6 +367,23 @@ static error_code mount_FAT121632(disk *d, fat_file_system **result) {
   return err;
 }
 
+static uint16 pack_into_fat_time(uint8 hours, uint8 minutes, uint8 seconds);
+static uint16 pack_into_fat_date(int16 year, uint8 month, int8 day);
+
+// Note that the file was modified now, its directory entry is written later
+static void fat_file_touch(fat_file *f) {
+  uint8 hours, minutes, seconds;
+  int16 year;
+  uint8 month, day;
+
+  get_current_time(&hours, &minutes, &seconds);
+  get_current_date(&year, &month, &day);
+
+  f->entry.wrt_time = pack_into_fat_time(hours, minutes, seconds);
+  f->entry.wrt_date = pack_into_fat_date(year, month, day);
+  f->entry.dirty = TRUE;
+}
+
 static uint16 pack_into_fat_time(uint8 hours, uint8 minutes, uint8 seconds) {
   uint16 packed_time = 0;
   // According to the FAT specification, the FAT time is set that way:
@@ -518,6 +616,8 @@ static error_code fat_rename(fs_header *ffs, file *ff, native_string name,
     return err;
   }
 
+  fat_dentry_invalidate(fs, f->parent.first_cluster);
+
   // Prepare the SFN
   short_file_name sfe;
   name_to_short_file_name(name, &sfe);
@@ -584,6 +684,10 @@ fat_rename_end:
 error_code fat_close_file(file *ff) {
   fat_file_system *fs = CAST(fat_file_system *, ff->_fs_header);
   fat_file *f = CAST(fat_file *, ff);
+  error_code err = NO_ERROR;
+
+  if (f->entry.dirty)
+    err = fat_update_file_length(f);
 
   if (NULL != ff->name)
     kfree(ff->name);
@@ -599,8 +703,23 @@ error_code fat_close_file(file *ff) {
     }
   }
 
+  if (NULL != f->extents.runs)
+    kfree(f->extents.runs);
+
   kfree(f);
-  return NO_ERROR;
+  return err;
+}
+
+static error_code fat_sync_file(file *ff) {
+  fat_file_system *fs = CAST(fat_file_system *, ff->_fs_header);
+  fat_file *f = CAST(fat_file *, ff);
+  error_code err;
+
+  if (f->entry.dirty && ERROR(err = fat_update_file_length(f)))
+    return err;
+
+  // The directory entry and the FAT are in the disk cache as well
+  return disk_flush(fs->_.FAT121632.d);
 }
 
 /*
@@ -615,6 +734,7 @@ static void fat_reset_cursor(file *ff) {
   fat_file_system *fs = CAST(fat_file_system *, f->header._fs_header);
 
   f->current_cluster = f->first_cluster;
+  f->current_index = 0;
   f->current_section_length =
       1 << (fs->_.FAT121632.log2_bps + fs->_.FAT121632.log2_spc);
   f->current_section_start =
@@ -625,12 +745,11 @@ static void fat_reset_cursor(file *ff) {
 }
 
 /*
- Move a file cursor to the next FAT section. It will cross
- the boundaries of a cluster.
+ Read the link of cluster n in the FAT. EOF_ERROR is returned at the end
+ of the chain.
 */
-static error_code next_FAT_section(fat_file *f) {
-  fat_file_system *fs = CAST(fat_file_system *, f->header._fs_header);
-  uint32 n = f->current_cluster;
+static error_code fat_next_cluster(fat_file_system *fs, uint32 n,
+                                   uint32 *result) {
   uint32 offset;
   uint32 sector_pos;
   uint32 cluster;
@@ -737,72 +856,181 @@ static error_code next_FAT_section(fat_file *f) {
     }
   }
 
+  *result = cluster;
+
+  return NO_ERROR;
+}
+
+static void fat_set_section(fat_file *f, uint32 index, uint32 cluster) {
+  fat_file_system *fs = CAST(fat_file_system *, f->header._fs_header);
+
   f->current_cluster = cluster;
+  f->current_index = index;
   f->current_section_length =
       1 << (fs->_.FAT121632.log2_bps + fs->_.FAT121632.log2_spc);
   f->current_section_start = ((cluster - 2) << fs->_.FAT121632.log2_spc) +
                              fs->_.FAT121632.first_data_sector;
-
   f->current_section_pos = 0;
-
-  return NO_ERROR;
 }
 
 /*
-Set the cursor position to the position in parameter, but starting the
-mouvements from the absolute start of the file (it will set the cursor to zero,
-then move to the position). This is useful to perform cluster boundary-crossing
-mouvements backwards, but is slower than doing small relatives movements (not
-always possible).
+ Extend the extents of a file until they map the cluster of the given
+ index. The FAT is only read past the last cluster mapped, so that a file
+ that grew gets the rest of its chain mapped.
 */
-static error_code fat_file_set_pos_from_start(fat_file *f, uint32 position) {
-  error_code err, release_error = NO_ERROR;
+static error_code fat_extend_extents(fat_file *f, uint32 index) {
   fat_file_system *fs = CAST(fat_file_system *, f->header._fs_header);
-  BIOS_Parameter_Block *p = NULL;
-  cache_block *cb = NULL;
-  disk *d = fs->_.FAT121632.d;
+  error_code err;
 
-  if (IS_REGULAR_FILE(f->header.type) && (position > f->length)) {
-    return ARG_ERROR;
+  if (f->extents.first_cluster != f->first_cluster) {
+    f->extents.first_cluster = f->first_cluster;
+    f->extents.nb_runs = 0;
   }
 
-  // FAT32 only
-  if (HAS_NO_ERROR(err = disk_cache_block_acquire(d, 0, &cb))) {
-    rwmutex_readlock(cb->mut);
+  for (;;) {
+    fat_extent *last = NULL;
+    uint32 cluster = f->first_cluster;
+    uint32 next_index = 0;
 
-    p = CAST(BIOS_Parameter_Block *, cb->buf);
-    uint16 bytes_per_sector = as_uint16(p->BPB_BytsPerSec);
-
-    uint32 cluster_sz = bytes_per_sector * p->BPB_SecPerClus;
-    uint32 no_of_clusters =
-        position /
-        cluster_sz; // determines how many cluster links we have to jump
-    uint32 bytes_left_cluster = position % cluster_sz;
-
-    fat_reset_cursor(CAST(file *, f));
-    // We are now at the beginning of the file.
-    // We want to go to the position wanted, so
-    // we walk through the FAT chain until we read
-    // as many clusters as required to get a correct position.
-    for (uint32 i = 0; i < no_of_clusters; ++i) {
-      if (ERROR(err = next_FAT_section(f))) {
-        break;
+    if (f->extents.nb_runs > 0) {
+      last = &f->extents.runs[f->extents.nb_runs - 1];
+      next_index = last->index + last->count;
+
+      if (next_index > index)
+        return NO_ERROR;
+
+      if (ERROR(err = fat_next_cluster(fs, last->cluster + last->count - 1,
+                                       &cluster)))
+        return err;
+
+      if (cluster == last->cluster + last->count) {
+        last->count++;
+        continue;
       }
     }
 
-    f->current_section_pos += bytes_left_cluster;
-    f->current_pos = position;
+    if (f->extents.nb_runs == f->extents.max_runs) {
+      uint32 max_runs =
+          (f->extents.max_runs == 0) ? 4 : 2 * f->extents.max_runs;
+      fat_extent *runs =
+          CAST(fat_extent *, kmalloc(max_runs * sizeof(fat_extent)));
 
-    rwmutex_readunlock(cb->mut);
-    release_error = disk_cache_block_release(cb);
+      if (NULL == runs)
+        return MEM_ERROR;
+
+      if (NULL != f->extents.runs) {
+        memcpy(runs, f->extents.runs,
+               f->extents.nb_runs * sizeof(fat_extent));
+        kfree(f->extents.runs);
+      }
+
+      f->extents.runs = runs;
+      f->extents.max_runs = max_runs;
+    }
+
+    last = &f->extents.runs[f->extents.nb_runs++];
+    last->index = next_index;
+    last->cluster = cluster;
+    last->count = 1;
+  }
+}
+
+/*
+ Find the run of the extents of a file holding the cluster of the given
+ index, which must be mapped. It is the last run that starts at or before
+ the index.
+*/
+static fat_extent *fat_find_extent(fat_file *f, uint32 index) {
+  fat_extent *runs = f->extents.runs;
+  uint32 lo = 0;
+  uint32 hi = f->extents.nb_runs - 1;
+
+  while (lo < hi) {
+    uint32 mid = (lo + hi + 1) >> 1;
+    if (runs[mid].index <= index)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return &runs[lo];
+}
+
+/*
+ Move a file cursor to the start of the cluster of the given index in the
+ file.
+*/
+static error_code fat_seek_cluster(fat_file *f, uint32 index) {
+  fat_extent *run;
+  error_code err;
+
+  if (ERROR(err = fat_extend_extents(f, index)))
+    return err;
 
-    if (ERROR(err))
+  run = fat_find_extent(f, index);
+
+  fat_set_section(f, index, run->cluster + (index - run->index));
+
+  return NO_ERROR;
+}
+
+/*
+ Move a file cursor to the next FAT section. It will cross
+ the boundaries of a cluster.
+*/
+static error_code next_FAT_section(fat_file *f) {
+  fat_file_system *fs = CAST(fat_file_system *, f->header._fs_header);
+  uint32 cluster;
+  error_code err;
+
+  if (f->first_cluster < FAT32_FIRST_CLUSTER) {
+    // The FAT12 and FAT16 root directory, which isn't a chain
+    if (ERROR(err = fat_next_cluster(fs, f->current_cluster, &cluster)))
       return err;
-    if (ERROR(release_error))
-      return release_error;
+    fat_set_section(f, f->current_index + 1, cluster);
+    return NO_ERROR;
   }
 
-  return err;
+  return fat_seek_cluster(f, f->current_index + 1);
+}
+
+/*
+Set the cursor position to the position in parameter. The cluster is found
+in the extents of the file. A position at the end of a cluster stays in that
+cluster, reading or writing moves on to the next one when it is needed.
+*/
+static error_code fat_file_set_pos(fat_file *f, uint32 position) {
+  fat_file_system *fs = CAST(fat_file_system *, f->header._fs_header);
+  uint8 log2_bpc = fs->_.FAT121632.log2_bps + fs->_.FAT121632.log2_spc;
+  uint32 index = position >> log2_bpc;
+  uint32 section_pos = position & ~(~0U << log2_bpc);
+  error_code err;
+
+  if (IS_REGULAR_FILE(f->header.type) && (position > f->length)) {
+    return ARG_ERROR;
+  }
+
+  if (f->first_cluster < FAT32_FIRST_CLUSTER) {
+    // The FAT12 and FAT16 root directory is a single section
+    if (position > f->current_section_length)
+      return EOF_ERROR;
+    f->current_section_pos = position;
+    f->current_pos = position;
+    return NO_ERROR;
+  }
+
+  if (index > 0 && section_pos == 0) {
+    index--;
+    section_pos = 1 << log2_bpc;
+  }
+
+  if (index != f->current_index && ERROR(err = fat_seek_cluster(f, index)))
+    return err;
+
+  f->current_section_pos = section_pos;
+  f->current_pos = position;
+
+  return NO_ERROR;
 }
 
 /*
@@ -812,77 +1040,26 @@ movement indicates a "forward" movement in the same file.
 */
 static error_code fat_move_cursor(file *ff, int32 n) {
   fat_file *f = CAST(fat_file *, ff);
-  uint32 displacement;
-  BIOS_Parameter_Block *p = NULL;
-  cache_block *cb = NULL;
-  error_code err = NO_ERROR;
-  fat_file_system *fs = CAST(fat_file_system *, f->header._fs_header);
-  disk *d = fs->_.FAT121632.d;
 
   if (n == 0) {
     // No mvmt
-    return err;
+    return NO_ERROR;
   }
 
-  if (n < 0) {
-    // Backwards mvmt
-    displacement = -n;
-    bool crosses_section_boundary = displacement > f->current_section_pos;
-
-    // If we cross a section boundary, the design of the FAT FS requires to
-    // start from the beginning.
-    if (crosses_section_boundary) {
-      return fat_file_set_pos_from_start(f, f->current_pos - displacement);
-    } else {
-      // Simply update the position
-      f->current_pos -= displacement;
-      f->current_section_pos -= displacement;
-    }
-  } else {
-    // Forward mvmt
-    displacement = n;
-    bool crosses_section_boundary =
-        ((displacement + f->current_section_pos) >= f->current_section_length);
-
-    if (crosses_section_boundary) {
-      // We are moving forward.
-      if (HAS_NO_ERROR(err = disk_cache_block_acquire(d, 0, &cb))) {
-        uint32 cluster_sz;
+  // Moving in the current section only updates the position
 
-        {
-          rwmutex_readlock(cb->mut);
-          p = CAST(BIOS_Parameter_Block *, cb->buf);
-          uint16 bytes_per_sector = as_uint16(p->BPB_BytsPerSec);
-          cluster_sz = bytes_per_sector * p->BPB_SecPerClus;
-          rwmutex_readunlock(cb->mut);
-          if (ERROR(err = disk_cache_block_release(cb)))
-            return err;
-        }
-
-        uint32 current_section_pos = f->current_section_pos;
-        uint32 new_section_pos = current_section_pos + displacement;
-        uint32 no_of_clusters = (new_section_pos / cluster_sz);
-        new_section_pos %= cluster_sz; // We put back in "section length" units
-
-        for (uint32 i = 0; i < no_of_clusters; ++i) {
-          if (ERROR(err = next_FAT_section(f))) {
-            break;
-          }
-        }
-
-        if (HAS_NO_ERROR(err)) {
-          f->current_section_pos = new_section_pos;
-          f->current_pos += displacement;
-        }
-      }
-    } else {
-      // Simply update the position
-      f->current_pos += displacement;
-      f->current_section_pos += displacement;
-    }
+  if ((n < 0) ? (CAST(uint32, -n) <= f->current_section_pos)
+              : (CAST(uint32, n) <
+                 f->current_section_length - f->current_section_pos)) {
+    f->current_pos += n;
+    f->current_section_pos += n;
+    return NO_ERROR;
   }
 
-  return err;
+  if (n < 0 && CAST(uint32, -n) > f->current_pos)
+    return ARG_ERROR;
+
+  return fat_file_set_pos(f, f->current_pos + n);
 }
 
 /*
@@ -935,7 +1112,10 @@ error_code fat_write_file(file *ff, void *buff, uint32 count) {
             // Writing a file should not OEF, we allocate more
             uint32 cluster;
 
-            if (ERROR(err = fat_32_find_first_empty_cluster(fs, &cluster))) {
+            // Preferably the cluster that follows, to keep the file
+            // contiguous
+            if (ERROR(err = fat_32_find_first_empty_cluster(
+                          fs, f->current_cluster + 1, &cluster))) {
               return err;
             }
 
@@ -993,7 +1173,7 @@ error_code fat_write_file(file *ff, void *buff, uint32 count) {
           // Update the cache_block buffer
           memcpy(sector_buffer, p, left2);
 
-          cb->dirty = TRUE;
+          disk_cache_block_dirty(cb);
           rwmutex_writeunlock(cb->mut);
 
           if (ERROR(err = disk_cache_block_release(cb)))
@@ -1017,13 +1197,53 @@ error_code fat_write_file(file *ff, void *buff, uint32 count) {
   }
 
   if (!ERROR(err) && !IS_FOLDER(f->header.type)) {
-    f->length += count;
-    err = fat_update_file_length(f);
+    // Overwritten bytes don't make the file longer
+    if (f->current_pos > f->length)
+      f->length = f->current_pos;
+    fat_file_touch(f);
   }
 
   return err;
 }
 
+/*
+ Read whole clusters of a file, from the start of the current one, straight
+ into the buffer. The clusters that follow on the disk are read with the
+ same requests, up to the count of bytes. The cursor is left at the end of
+ the last cluster read and the number of bytes read is put in len.
+*/
+static error_code fat_read_direct(fat_file *f, uint8 *buf, uint32 count,
+                                  uint32 *len) {
+  fat_file_system *fs = CAST(fat_file_system *, f->header._fs_header);
+  uint8 log2_bpc = fs->_.FAT121632.log2_bps + fs->_.FAT121632.log2_spc;
+  uint32 nb_clusters = count >> log2_bpc;
+  uint32 last;
+  fat_extent *run;
+  error_code err;
+
+  if (ERROR(err = fat_extend_extents(f, f->current_index + nb_clusters - 1)))
+    return err;
+
+  run = fat_find_extent(f, f->current_index);
+
+  if (nb_clusters > run->index + run->count - f->current_index)
+    nb_clusters = run->index + run->count - f->current_index;
+
+  if (ERROR(err = disk_read_direct(fs->_.FAT121632.d,
+                                   f->current_section_start, buf,
+                                   nb_clusters << fs->_.FAT121632.log2_spc)))
+    return err;
+
+  last = f->current_index + nb_clusters - 1;
+  fat_set_section(f, last, run->cluster + (last - run->index));
+  f->current_section_pos = f->current_section_length;
+  f->current_pos += nb_clusters << log2_bpc;
+
+  *len = nb_clusters << log2_bpc;
+
+  return NO_ERROR;
+}
+
 error_code fat_read_file(file *ff, void *buf, uint32 count) {
   fat_file *f = CAST(fat_file *, ff);
   if (count > 0) {
@@ -1071,6 +1291,19 @@ error_code fat_read_file(file *ff, void *buf, uint32 count) {
           }
         }
 
+        // Whole clusters bypass the cache, only the partial clusters at the
+        // ends of the read are copied from it
+
+        if (NULL != buf && f->current_section_pos == 0 &&
+            n >= f->current_section_length && !IS_FOLDER(f->header.type) &&
+            !(CAST(uint32, p) & 1)) {
+          if (ERROR(err = fat_read_direct(f, p, n, &left1)))
+            return err;
+          n -= left1;
+          p += left1;
+          continue;
+        }
+
         left1 = f->current_section_length - f->current_section_pos;
 
         if (left1 > n)
@@ -1135,12 +1368,204 @@ error_code fat_read_file(file *ff, void *buf, uint32 count) {
   return NO_ERROR;
 }
 
+// Open the file described by the directory entry de, which is at the given
+// position in the directory starting at cluster
+static error_code fat_file_from_entry(fat_file_system *fs,
+                                      FAT_directory_entry *de,
+                                      native_string name, uint32 cluster,
+                                      uint32 position, fat_file **result) {
+  error_code err;
+  fat_file *f = NULL;
+  uint32 name_len = kstrlen(name);
+
+  if (ERROR(err = new_fat_file(&f)))
+    return err;
+
+  f->header._fs_header = CAST(fs_header *, fs);
+  f->first_cluster = f->current_cluster =
+      (CAST(uint32, as_uint16(de->DIR_FstClusHI)) << 16) +
+      as_uint16(de->DIR_FstClusLO);
+  f->current_section_start =
+      fs->_.FAT121632.first_data_sector +
+      ((f->current_cluster - 2) << fs->_.FAT121632.log2_spc);
+  f->current_section_length =
+      1 << (fs->_.FAT121632.log2_bps + fs->_.FAT121632.log2_spc);
+  f->current_section_pos = 0;
+  f->current_pos = 0;
+  f->length = as_uint32(de->DIR_FileSize);
+
+  if (de->DIR_Attr & FAT_ATTR_DIRECTORY) {
+    f->header.type = TYPE_FOLDER;
+  } else {
+    f->header.type = TYPE_REGULAR;
+  }
+
+  // Setup the entry file. It is relative to the file's
+  // directory
+  f->parent.first_cluster = cluster;
+  f->entry.position = position;
+
+  f->header.name =
+      CAST(native_string, kmalloc(sizeof(unicode_char) * (name_len + 1)));
+  memcpy(f->header.name, name, name_len + 1);
+
+  *result = f;
+
+  return NO_ERROR;
+}
+
+// -------------------------------------------------------------
+// Directory entry cache
+// -------------------------------------------------------------
+
+// The result of looking up a name in a directory is remembered, whether the
+// file was found or not, so that opening a file doesn't scan each directory
+// of its path again. Only the location of the entry is kept: the entry is
+// read again on a hit since its length changes. The entries of a directory
+// are forgotten when a file is added to it or removed from it.
+
+static fat_dentry fat_dentries[FAT_DENTRY_CACHE_SIZE];
+static fat_dentry_stats fat_dentry_counters;
+
+static uint32 fat_dentry_hash(fat_file_system *fs, uint32 parent_cluster,
+                              native_string name) {
+  uint32 h = CAST(uint32, fs) ^ (parent_cluster * 0x9e3779b1);
+
+  while (*name != '\0')
+    h = (h ^ CAST(uint8, *name++)) * 0x01000193;
+
+  return h;
+}
+
+static fat_dentry *fat_dentry_lookup(fat_file_system *fs, uint32 parent_cluster,
+                                     native_string name) {
+  uint32 h = fat_dentry_hash(fs, parent_cluster, name);
+  fat_dentry *e = &fat_dentries[h % FAT_DENTRY_CACHE_SIZE];
+
+  if (e->fs == fs && e->parent_cluster == parent_cluster && e->hash == h &&
+      0 == kstrcmp(e->name, name))
+    return e;
+
+  return NULL;
+}
+
+static void fat_dentry_add(fat_file_system *fs, uint32 parent_cluster,
+                           native_string name, fat_file *f) {
+  uint32 h;
+  fat_dentry *e;
+
+  if (kstrlen(name) > FAT_DENTRY_NAME_MAX)
+    return; // not worth the space
+
+  h = fat_dentry_hash(fs, parent_cluster, name);
+  e = &fat_dentries[h % FAT_DENTRY_CACHE_SIZE];
+
+  e->fs = fs;
+  e->parent_cluster = parent_cluster;
+  e->hash = h;
+  memcpy(e->name, name, kstrlen(name) + 1);
+
+  if (NULL == f) {
+    e->found = FALSE;
+  } else {
+    e->found = TRUE;
+    e->position = f->entry.position;
+    e->first_cluster = f->first_cluster;
+  }
+}
+
+static void fat_dentry_invalidate(fat_file_system *fs, uint32 parent_cluster) {
+  for (uint32 i = 0; i < FAT_DENTRY_CACHE_SIZE; i++) {
+    fat_dentry *e = &fat_dentries[i];
+    if (e->fs == fs && e->parent_cluster == parent_cluster)
+      e->fs = NULL;
+  }
+}
+
+void fat_dentry_get_stats(fat_dentry_stats *stats) {
+  *stats = fat_dentry_counters;
+}
+
+// Open the file of a cached entry, after checking that the entry is still
+// there. The parent's cursor is moved.
+static error_code fat_dentry_open(fat_file *parent, fat_dentry *e,
+                                  native_string name, fat_file **result) {
+  fat_file_system *fs = CAST(fat_file_system *, parent->header._fs_header);
+  FAT_directory_entry de;
+  error_code err;
+
+  if (ERROR(err = fat_set_to_absolute_position(CAST(file *, parent),
+                                               e->position)))
+    return err;
+
+  err = fat_read_file(CAST(file *, parent), &de, sizeof(de));
+
+  if (ERROR(err))
+    return err;
+
+  if (err != sizeof(de) || de.DIR_Name[0] == 0 ||
+      de.DIR_Name[0] == FAT_UNUSED_ENTRY ||
+      ((CAST(uint32, as_uint16(de.DIR_FstClusHI)) << 16) +
+       as_uint16(de.DIR_FstClusLO)) != e->first_cluster)
+    return FNF_ERROR;
+
+  return fat_file_from_entry(fs, &de, name, parent->first_cluster,
+                             e->position, result);
+}
+
+static error_code fat_scan_directory(fat_file *parent, native_string name,
+                                     fat_file **result);
+
 /*
 Fetch a file of name "name" from the parent directory (parent).
 The result is passed back and an error code is returned.
 */
 static error_code fat_fetch_file(fat_file *parent, native_string name,
                                  fat_file **result) {
+  fat_file_system *fs = CAST(fat_file_system *, parent->header._fs_header);
+  fat_dentry *e;
+  error_code err;
+
+  // The entries are for a scan from the start of the directory
+
+  if ('\0' == name[0] || !IS_FOLDER(parent->header.type) ||
+      0 != parent->current_pos)
+    return fat_scan_directory(parent, name, result);
+
+  if (NULL != (e = fat_dentry_lookup(fs, parent->first_cluster, name))) {
+    if (!e->found) {
+      fat_dentry_counters.negative_hits++;
+      return FNF_ERROR;
+    }
+
+    if (HAS_NO_ERROR(err = fat_dentry_open(parent, e, name, result))) {
+      fat_dentry_counters.hits++;
+      return err;
+    }
+
+    // The entry moved, look for it again
+    e->fs = NULL;
+    fat_reset_cursor(CAST(file *, parent));
+  }
+
+  fat_dentry_counters.misses++;
+
+  err = fat_scan_directory(parent, name, result);
+
+  if (HAS_NO_ERROR(err))
+    fat_dentry_add(fs, parent->first_cluster, name, *result);
+  else if (err == FNF_ERROR)
+    fat_dentry_add(fs, parent->first_cluster, name, NULL);
+
+  return err;
+}
+
+/*
+Look for the file of name "name" in the parent directory, from the cursor
+of the parent on.
+*/
+static error_code fat_scan_directory(fat_file *parent, native_string name,
+                                     fat_file **result) {
   native_char lfn_buff[256];
   uint8 name_len;
   uint8 lfn_index = 254;
@@ -1221,37 +1646,10 @@ static error_code fat_fetch_file(fat_file *parent, native_string name,
 
       if (name_match) {
         // All the characters have been compared successfuly
-        if (ERROR(err = new_fat_file(&f)))
+        if (ERROR(err = fat_file_from_entry(fs, &de, name, cluster, position,
+                                            &f)))
           return err;
 
-        f->header._fs_header = CAST(fs_header *, fs);
-        f->first_cluster = f->current_cluster =
-            (CAST(uint32, as_uint16(de.DIR_FstClusHI)) << 16) +
-            as_uint16(de.DIR_FstClusLO);
-        f->current_section_start =
-            fs->_.FAT121632.first_data_sector +
-            ((f->current_cluster - 2) << fs->_.FAT121632.log2_spc);
-        f->current_section_length =
-            1 << (fs->_.FAT121632.log2_bps + fs->_.FAT121632.log2_spc);
-        f->current_section_pos = 0;
-        f->current_pos = 0;
-        f->length = as_uint32(de.DIR_FileSize);
-
-        if (de.DIR_Attr & FAT_ATTR_DIRECTORY) {
-          f->header.type = TYPE_FOLDER;
-        } else {
-          f->header.type = TYPE_REGULAR;
-        }
-
-        // Setup the entry file. It is relative to the file's
-        // directory
-        f->parent.first_cluster = cluster;
-        f->entry.position = position;
-
-        f->header.name =
-            CAST(native_string, kmalloc(sizeof(unicode_char) * (name_len + 1)));
-        memcpy(f->header.name, name, name_len + 1);
-
         goto found;
       } else {
         invalidate_lfn();
@@ -1277,27 +1675,7 @@ static error_code fat_32_open_root_dir(fat_file_system *fs, fat_file *f) {
 #ifdef SHOW_DISK_INFO
   term_write(cout, "Loading FAT32 root dir\n\r");
 #endif
-  cache_block *cb = NULL;
-  disk *d = fs->_.FAT121632.d;
-  error_code err;
-  uint16 bytes_per_sector;
-  uint32 root_cluster;
-  uint8 sectors_per_clusters;
-
-  {
-    if (ERROR(err = disk_cache_block_acquire(d, 0, &cb)))
-      return err;
-    rwmutex_readlock(cb->mut);
-
-    BIOS_Parameter_Block *p = CAST(BIOS_Parameter_Block *, cb->buf);
-    root_cluster = as_uint32(p->_.FAT32.BPB_RootClus);
-    bytes_per_sector = as_uint16(p->BPB_BytsPerSec);
-    sectors_per_clusters = p->BPB_SecPerClus;
-
-    rwmutex_readunlock(cb->mut);
-    if (ERROR(err = disk_cache_block_release(cb)))
-      return err;
-  }
+  uint32 root_cluster = fs->_.FAT121632.root_cluster;
 
   f->header._fs_header = CAST(fs_header *, fs);
   f->first_cluster = f->current_cluster = root_cluster;
@@ -1308,8 +1686,10 @@ static error_code fat_32_open_root_dir(fat_file_system *fs, fat_file *f) {
   term_writeline(cout);
 #endif
 
-  f->current_section_start = fs->_.FAT121632.first_data_sector;
-  f->current_section_length = bytes_per_sector * sectors_per_clusters;
+  f->current_section_start = fs->_.FAT121632.first_data_sector +
+                             ((root_cluster - 2) << fs->_.FAT121632.log2_spc);
+  f->current_section_length =
+      1 << (fs->_.FAT121632.log2_bps + fs->_.FAT121632.log2_spc);
 
 #ifdef SHOW_DISK_INFO
   term_write(cout, "FAT32 ROOT DIR [sector] start=");
@@ -1391,67 +1771,111 @@ error_code fat_32_get_fat_link_value(fat_file_system *fs, uint32 cluster,
     panic(L"Cannot inspect lower than the second cluster entry");
   }
 
-  { // Cache block section
-    if (ERROR(err = disk_cache_block_acquire(d, 0, &cb)))
+  lba = (cluster / entries_per_sector) + fs->_.FAT121632.reserved_sectors;
+
+  uint32 offset = cluster % entries_per_sector;
+
+  {
+    if (ERROR(err = disk_cache_block_acquire(d, lba, &cb)))
       return err;
     rwmutex_readlock(cb->mut);
 
-    BIOS_Parameter_Block *p = CAST(BIOS_Parameter_Block *, cb->buf);
-
-    lba = (cluster / entries_per_sector) + as_uint16(p->BPB_RsvdSecCnt);
+    *value = *(CAST(uint32 *, cb->buf) + offset);
 
     rwmutex_readunlock(cb->mut);
     if (ERROR(err = disk_cache_block_release(cb)))
       return err;
   }
 
-  uint32 offset = cluster % entries_per_sector;
+  return err;
+}
 
-  {
-    if (ERROR(err = disk_cache_block_acquire(d, lba, &cb)))
+#define FAT_CLUSTER_USED(map, n) ((map)[(n) >> 3] & (1 << ((n)&7)))
+
+/*
+Build the bitmap of the used clusters with a single pass over the FAT, and
+count the free clusters on the way.
+*/
+static error_code fat_32_build_free_map(fat_file_system *fs) {
+  error_code err;
+  cache_block *cb = NULL;
+  uint32 nb_clusters = FAT_NB_CLUSTERS(fs);
+  uint16 entries_per_sector = (1 << fs->_.FAT121632.log2_bps) >> 2;
+  uint32 lba = fs->_.FAT121632.reserved_sectors;
+  uint32 free_count = 0;
+  uint32 clus = 0;
+  uint8 *map = CAST(uint8 *, kmalloc((nb_clusters + 7) >> 3));
+
+  if (NULL == map)
+    return MEM_ERROR;
+
+  while (clus < nb_clusters) {
+    if (ERROR(err = disk_cache_block_acquire(fs->_.FAT121632.d, lba, &cb))) {
+      kfree(map);
       return err;
+    }
     rwmutex_readlock(cb->mut);
 
-    *value = *(CAST(uint32 *, cb->buf) + offset);
+    for (uint16 i = 0; i < entries_per_sector && clus < nb_clusters;
+         ++i, ++clus) {
+      uint32 entry = CAST(uint32 *, cb->buf)[i] & 0x0fffffff;
+      uint8 bit = 1 << (clus & 7);
+
+      if (entry == 0 && clus >= FAT32_FIRST_CLUSTER) {
+        map[clus >> 3] &= ~bit;
+        free_count++;
+      } else {
+        map[clus >> 3] |= bit;
+      }
+    }
 
     rwmutex_readunlock(cb->mut);
-    if (ERROR(err = disk_cache_block_release(cb)))
+    if (ERROR(err = disk_cache_block_release(cb))) {
+      kfree(map);
       return err;
+    }
+    ++lba;
   }
 
-  return err;
+  fs->_.FAT121632.free_map = map;
+
+  if (fs->_.FAT121632.free_count != free_count) {
+    fs->_.FAT121632.free_count = free_count;
+    return fat_32_write_FSInfo(fs);
+  }
+
+  return NO_ERROR;
 }
 
 /*
-Scan the FAT chain to find the first empty, usable cluster.
+Find a free cluster without the bitmap, by reading the FAT from the
+FSInfo hint on.
 */
-static error_code fat_32_find_first_empty_cluster(fat_file_system *fs,
-                                                  uint32 *result) {
+static error_code fat_32_scan_for_empty_cluster(fat_file_system *fs,
+                                                uint32 *result) {
   error_code err = NO_ERROR;
   cache_block *cb = NULL;
-  uint32 max_lba = fs->_.FAT121632.total_sectors;
+  uint32 nb_clusters = FAT_NB_CLUSTERS(fs);
   uint16 entries_per_sector = (1 << fs->_.FAT121632.log2_bps) >> 2;
+  uint32 nb_sectors = (nb_clusters + entries_per_sector - 1) /
+                      entries_per_sector;
+  uint32 clus = fs->_.FAT121632.next_free;
 
-  uint32 lba = fs->_.FAT121632.reserved_sectors;
+  // It is faster to read a sector at a time than to make repeated calls
+  // to fat_32_get_fat_link_value, which gets a cache block per request.
+  // The sector of the hint is visited twice when the search wraps around.
+  for (uint32 n = 0; n <= nb_sectors; n++) {
+    uint32 lba = fs->_.FAT121632.reserved_sectors + clus / entries_per_sector;
+    bool found = FALSE;
 
-  bool found = FALSE;
-  // Inspect all sectors starting from *cluster
-  // It is faster to use this method than repeated calls to
-  // fat_32_get_fat_link_value since the latter will get a
-  // cache block per request.
-  uint32 clus;
-  uint16 i;
-  clus = i = 2;
-  // We start from the first cluster because we have no clue where data has been
-  // overwritten
-  while ((lba < max_lba) && !found) {
     if (ERROR(err = disk_cache_block_acquire(fs->_.FAT121632.d, lba, &cb))) {
       return err;
     }
     rwmutex_readlock(cb->mut);
 
-    for (; i < entries_per_sector; ++i, ++clus) {
-      uint32 entry = CAST(uint32 *, cb->buf)[i];
+    for (uint16 i = clus % entries_per_sector;
+         i < entries_per_sector && clus < nb_clusters; ++i, ++clus) {
+      uint32 entry = CAST(uint32 *, cb->buf)[i] & 0x0fffffff;
       if ((found = (entry == 0))) {
         break;
       }
@@ -1460,15 +1884,71 @@ static error_code fat_32_find_first_empty_cluster(fat_file_system *fs,
     rwmutex_readunlock(cb->mut);
     if (ERROR(err = disk_cache_block_release(cb)))
       return err;
-    ++lba;
-    i = 0;
+
+    if (found) {
+      *result = clus;
+      return NO_ERROR;
+    }
+
+    if (clus >= nb_clusters)
+      clus = FAT32_FIRST_CLUSTER;
   }
 
-  // Could not find an entry: disk out of space
-  if (!found)
-    err = DISK_OUT_OF_SPACE;
-  *result = clus;
-  return err;
+  return DISK_OUT_OF_SPACE;
+}
+
+/*
+Find a free cluster, preferably the goal so that files stay contiguous,
+otherwise the first one from the FSInfo hint on. A goal of 0 means there
+is no preference. The free clusters are tracked by a bitmap built on the
+first allocation.
+*/
+static error_code fat_32_find_first_empty_cluster(fat_file_system *fs,
+                                                  uint32 goal, uint32 *result) {
+  error_code err;
+  uint32 nb_clusters = FAT_NB_CLUSTERS(fs);
+  uint8 *map;
+  uint32 clus;
+
+  if (NULL == fs->_.FAT121632.free_map &&
+      ERROR(err = fat_32_build_free_map(fs))) {
+    if (err != MEM_ERROR)
+      return err;
+    return fat_32_scan_for_empty_cluster(fs, result);
+  }
+
+  map = fs->_.FAT121632.free_map;
+
+  if (fs->_.FAT121632.free_count == 0)
+    return DISK_OUT_OF_SPACE;
+
+  if (goal >= FAT32_FIRST_CLUSTER && goal < nb_clusters &&
+      !FAT_CLUSTER_USED(map, goal)) {
+    *result = goal;
+    return NO_ERROR;
+  }
+
+  clus = fs->_.FAT121632.next_free;
+
+  for (uint32 n = 0; n < nb_clusters; n++, clus++) {
+    if (clus >= nb_clusters)
+      clus = FAT32_FIRST_CLUSTER;
+
+    // Skip the bytes of used clusters 8 at a time
+    if ((clus & 7) == 0 && map[clus >> 3] == 0xff &&
+        clus + 8 <= nb_clusters) {
+      clus += 7;
+      n += 7;
+      continue;
+    }
+
+    if (!FAT_CLUSTER_USED(map, clus)) {
+      *result = clus;
+      return NO_ERROR;
+    }
+  }
+
+  return DISK_OUT_OF_SPACE;
 }
 
 /*
@@ -1487,38 +1967,54 @@ static error_code fat_32_set_fat_link_value(fat_file_system *fs, uint32 cluster,
     panic(L"Cannot inspect lower than the second cluster entry");
   }
 
-  { // Cache block section
-    if (ERROR(err = disk_cache_block_acquire(d, 0, &cb)))
-      return err;
-    rwmutex_readlock(cb->mut);
-
-    BIOS_Parameter_Block *p = CAST(BIOS_Parameter_Block *, cb->buf);
-    lba = (cluster / entries_per_sector) + as_uint16(p->BPB_RsvdSecCnt);
-
-    rwmutex_readunlock(cb->mut);
-    if (ERROR(err = disk_cache_block_release(cb)))
-      return err;
-  }
+  lba = (cluster / entries_per_sector) + fs->_.FAT121632.reserved_sectors;
 
   uint32 offset_in_bytes = (cluster % entries_per_sector) << 2;
 
+  uint32 old_value;
+
   // Read the cache in order to update it
   { // Very important to lock this write.
     if (ERROR(err = disk_cache_block_acquire(d, lba, &cb)))
       return err;
     rwmutex_writelock(cb->mut);
 
+    old_value = *CAST(uint32 *, cb->buf + offset_in_bytes) & 0x0fffffff;
+
     for (int i = 0; i < 4; ++i) {
       cb->buf[i + offset_in_bytes] = as_uint8(value, i);
     }
 
-    cb->dirty = TRUE;
+    disk_cache_block_dirty(cb);
     rwmutex_writeunlock(cb->mut);
     if (ERROR(err = disk_cache_block_release(cb)))
       return err;
   }
 
-  return err;
+  // Keep the bitmap and the FSInfo sector in step with the FAT
+
+  if ((old_value == 0) == ((value & 0x0fffffff) == 0))
+    return err;
+
+  uint8 *map = fs->_.FAT121632.free_map;
+  uint32 *free_count = &fs->_.FAT121632.free_count;
+
+  if ((value & 0x0fffffff) == 0) {
+    if (NULL != map)
+      map[cluster >> 3] &= ~(1 << (cluster & 7));
+    if (*free_count != FAT_FSINFO_UNKNOWN)
+      ++*free_count;
+  } else {
+    if (NULL != map)
+      map[cluster >> 3] |= 1 << (cluster & 7);
+    if (*free_count != FAT_FSINFO_UNKNOWN && *free_count > 0)
+      --*free_count;
+    fs->_.FAT121632.next_free = cluster + 1;
+    if (fs->_.FAT121632.next_free >= FAT_NB_CLUSTERS(fs))
+      fs->_.FAT121632.next_free = FAT32_FIRST_CLUSTER;
+  }
+
+  return fat_32_write_FSInfo(fs);
 }
 
 /*
@@ -1587,6 +2083,8 @@ static error_code fat_allocate_directory_entry(fat_file_system *fs,
   long_file_name_entry lfe;
   error_code err = NO_ERROR;
 
+  fat_dentry_invalidate(fs, parent_folder->first_cluster);
+
   uint8 checksum = lfn_checksum(de->DIR_Name);
   uint8 name_len = kstrlen(name);
   // We need to find enough empty directory entries to
@@ -1715,7 +2213,7 @@ static error_code fat_32_create_empty_file(fat_file_system *fs,
   // Find a cluster to write the file into
   uint32 cluster = FAT32_FIRST_CLUSTER;
 
-  if (ERROR(err = fat_32_find_first_empty_cluster(fs, &cluster))) {
+  if (ERROR(err = fat_32_find_first_empty_cluster(fs, 0, &cluster))) {
     return err;
   }
 
@@ -1974,32 +2472,24 @@ static error_code fat_update_file_length(fat_file *f) {
   error_code err = NO_ERROR;
   FAT_directory_entry de;
 
+  if (!f->entry.dirty)
+    fat_file_touch(f);
+
   if (ERROR(err = fat_open_directory_entry(f, &de))) {
     return err;
   }
 
-  uint8 hours, minutes, seconds;
-  int16 year;
-  uint8 month, day;
-
-  uint16 time, date;
-
-  get_current_time(&hours, &minutes, &seconds);
-  get_current_date(&year, &month, &day);
-
-  time = pack_into_fat_time(hours, minutes, seconds);
-  date = pack_into_fat_date(year, month, day);
-
   for (uint8 i = 0; i < 2; ++i) {
-    de.DIR_WrtTime[i] = as_uint8(time, i);
-    de.DIR_WrtDate[i] = as_uint8(date, i);
+    de.DIR_WrtTime[i] = as_uint8(f->entry.wrt_time, i);
+    de.DIR_WrtDate[i] = as_uint8(f->entry.wrt_date, i);
   }
 
   for (uint8 i = 0; i < 4; ++i) {
     de.DIR_FileSize[i] = as_uint8(f->length, i);
   }
 
-  err = fat_write_directory_entry(f, &de);
+  if (HAS_NO_ERROR(err = fat_write_directory_entry(f, &de)))
+    f->entry.dirty = FALSE;
 
   return err;
 }
@@ -2022,7 +2512,9 @@ static error_code fat_unlink_file(fat_file *f) {
             err = fat_32_set_fat_link_value(
                 CAST(fat_file_system *, f->header._fs_header), cluster, NULL)))
       break;
-  } while (next_clus != FAT_32_EOF && next_clus > 0);
+    next_clus &= 0x0fffffff;
+    cluster = next_clus;
+  } while (next_clus < FAT_32_EOF && next_clus >= FAT32_FIRST_CLUSTER);
 
   return err;
 }
@@ -2041,6 +2533,7 @@ static error_code fat_truncate_file(fat_file *f) {
     return err;
 
   f->length = 0;
+  f->extents.nb_runs = 0; // the chain is now a single cluster
   if (ERROR(err = fat_update_file_length(f)))
     return err;
 
@@ -2175,8 +2668,11 @@ this file is not open by any process, since it could result in a file being
 overwritten incorrectly.
 */
 static error_code fat_actual_remove(fat_file_system *fs, fat_file *f) {
-  error_code err = fat_unlink_file(f);
-  if (ERROR(err))
+  error_code err;
+
+  fat_dentry_invalidate(fs, f->parent.first_cluster);
+
+  if (ERROR(err = fat_unlink_file(f)))
     return err;
 
   FAT_directory_entry de;
@@ -2534,6 +3030,12 @@ static error_code fat_stat(fs_header *header, file *ff, stat_buff *buf) {
   uint16 fat_creation_date = as_uint16(de.DIR_CrtDate);
   uint16 fat_modification_date = as_uint16(de.DIR_WrtDate);
 
+  if (f->entry.dirty) {
+    // The entry is behind
+    fat_modification_time = f->entry.wrt_time;
+    fat_modification_date = f->entry.wrt_date;
+  }
+
   buf->bytes = f->length;
   buf->fs = header;
   buf->fs_block_size =
@@ -2591,6 +3093,7 @@ error_code mount_fat(vfnode *parent) {
 
   // Init the file vtable
   _fat_file_vtable._file_close = fat_close_file;
+  _fat_file_vtable._file_sync = fat_sync_file;
   _fat_file_vtable._file_move_cursor = fat_move_cursor;
   _fat_file_vtable._file_read = fat_read_file;
   _fat_file_vtable._file_set_to_absolute_position =
@@ -2604,3 +3107,206 @@ error_code mount_fat(vfnode *parent) {
 
   return NO_ERROR;
 }
+
+#ifdef FAT_SELF_TEST
+
+// Checks of the FAT driver, run at startup on the first partition. They
+// create and remove FAT_SELF_TEST_PATH.
+
+#define FAT_SELF_TEST_PATH "/dsk1/fattest.bin"
+#define FAT_SELF_TEST_LEN 3000
+
+static uint32 fat_test_failures;
+
+static void fat_test_check(native_string what, bool ok) {
+  term_write(cout, ok ? "[ok] " : "[FAILED] ");
+  term_write(cout, what);
+  term_writeline(cout);
+
+  if (!ok)
+    fat_test_failures++;
+}
+
+// The byte at a position of the file after a number of writes
+static uint8 fat_test_byte(uint32 pos, uint8 pass) {
+  return (pos * 7 + pass * 101) & 0xff;
+}
+
+static uint32 fat_test_size(native_string path) {
+  stat_buff sb;
+
+  if (ERROR(file_stat(path, &sb)))
+    return ~0U;
+
+  return sb.bytes;
+}
+
+// Write count bytes of a pass at a position of an open file
+static bool fat_test_write(file *f, uint8 *buf, uint32 pos, uint32 count,
+                           uint8 pass) {
+  for (uint32 i = 0; i < count; i++)
+    buf[i] = fat_test_byte(pos + i, pass);
+
+  return HAS_NO_ERROR(file_set_to_absolute_position(f, pos)) &&
+         file_write(f, buf, count) == CAST(error_code, count);
+}
+
+// Overwriting bytes keeps the length of a file and writing past its end
+// extends it. The length is in the directory entry once it is closed.
+static void fat_test_overwrite(uint8 *buf) {
+  uint32 len = FAT_SELF_TEST_LEN;
+  file *f;
+  bool ok;
+
+  ok = HAS_NO_ERROR(file_open(FAT_SELF_TEST_PATH, "w+", &f));
+
+  if (ok) {
+    ok = fat_test_write(f, buf, 0, len, 0) &&
+         fat_test_write(f, buf, 100, 200, 1);
+    ok = HAS_NO_ERROR(file_close(f)) && ok;
+  }
+
+  fat_test_check("overwrite in the middle", ok);
+  fat_test_check("size after the overwrite",
+                 fat_test_size(FAT_SELF_TEST_PATH) == len);
+
+  ok = HAS_NO_ERROR(file_open(FAT_SELF_TEST_PATH, "r+", &f));
+
+  if (ok) {
+    ok = fat_test_write(f, buf, len - 50, 100, 2);
+    ok = HAS_NO_ERROR(file_close(f)) && ok;
+  }
+
+  fat_test_check("overwrite past the end", ok);
+  fat_test_check("size after extending",
+                 fat_test_size(FAT_SELF_TEST_PATH) == len + 50);
+
+  ok = HAS_NO_ERROR(file_open(FAT_SELF_TEST_PATH, "r", &f));
+
+  if (ok) {
+    ok = file_read(f, buf, len + 100) == CAST(error_code, len + 50);
+
+    for (uint32 i = 0; ok && i < len + 50; i++) {
+      uint8 pass = (i >= len - 50) ? 2 : (i >= 100 && i < 300) ? 1 : 0;
+      ok = buf[i] == fat_test_byte(i, pass);
+    }
+
+    ok = HAS_NO_ERROR(file_close(f)) && ok;
+  }
+
+  fat_test_check("content after the overwrites", ok);
+}
+
+#define FAT_SELF_TEST_PATH2 "/dsk1/fattest2.bin"
+#define FAT_SELF_TEST_CLUSTERS 16
+#define FAT_SELF_TEST_SEEKS 1000
+
+// Writing two files a cluster at a time interleaves their chains. Reading
+// bytes of one of them in a scattered order checks the seeks through its
+// extents, whose cost is measured in cache block acquisitions and time.
+static void fat_test_fragmented() {
+  fat_file_system *fs = NULL;
+  file *f[2] = {NULL, NULL};
+  uint32 cluster_len;
+  uint32 len;
+  uint8 *buf;
+  bool ok;
+
+  ok = HAS_NO_ERROR(file_open(FAT_SELF_TEST_PATH, "w+", &f[0])) &&
+       HAS_NO_ERROR(file_open(FAT_SELF_TEST_PATH2, "w+", &f[1]));
+
+  if (!ok) {
+    fat_test_check("open two files", FALSE);
+    return;
+  }
+
+  fs = CAST(fat_file_system *, f[0]->_fs_header);
+  cluster_len = 1 << (fs->_.FAT121632.log2_bps + fs->_.FAT121632.log2_spc);
+  len = cluster_len * FAT_SELF_TEST_CLUSTERS;
+
+  if ((buf = CAST(uint8 *, kmalloc(cluster_len))) == NULL) {
+    file_close(f[0]);
+    file_close(f[1]);
+    return;
+  }
+
+  for (uint32 pos = 0; ok && pos < len; pos += cluster_len)
+    for (uint32 i = 0; ok && i < 2; i++)
+      ok = fat_test_write(f[i], buf, pos, cluster_len, 3 + i);
+
+  ok = HAS_NO_ERROR(file_close(f[0])) && ok;
+  ok = HAS_NO_ERROR(file_close(f[1])) && ok;
+
+  fat_test_check("write two interleaved files", ok);
+
+  if (ok && HAS_NO_ERROR(file_open(FAT_SELF_TEST_PATH, "r", &f[0]))) {
+    fat_file *ff = CAST(fat_file *, f[0]);
+    disk_cache_stats before;
+    disk_cache_stats after;
+    uint32 pos = 0;
+    time start;
+    time elapsed;
+    uint8 b;
+
+    ok = file_read(f[0], NULL, len) == CAST(error_code, len);
+
+    fat_test_check("fragmented chain", ok && ff->extents.nb_runs > 1);
+
+    disk_cache_get_stats(&before);
+    start = current_time();
+
+    // Positions all over the file, backwards as well as forwards
+
+    for (uint32 i = 0; ok && i < FAT_SELF_TEST_SEEKS; i++) {
+      pos = (pos * 1103515245 + 12345) % len;
+      ok = HAS_NO_ERROR(file_set_to_absolute_position(f[0], pos)) &&
+           file_read(f[0], &b, 1) == 1 && b == fat_test_byte(pos, 3);
+    }
+
+    elapsed = subtract_time(current_time(), start);
+    disk_cache_get_stats(&after);
+
+    fat_test_check("seeks in the fragmented file", ok);
+
+    term_write(cout, "  extents: ");
+    term_write(cout, ff->extents.nb_runs);
+    term_write(cout, ", cache acquisitions per seek: ");
+    term_write(cout, (after.hits + after.misses - before.hits - before.misses) /
+                         FAT_SELF_TEST_SEEKS);
+    term_write(cout, ", nsecs per seek: ");
+    term_write(cout, CAST(uint32, elapsed.n * 1000000 / seconds_to_time(1).n *
+                                      1000 / FAT_SELF_TEST_SEEKS));
+    term_writeline(cout);
+
+    file_close(f[0]);
+  }
+
+  file_remove(FAT_SELF_TEST_PATH2);
+
+  kfree(buf);
+}
+
+void fat_self_test() {
+  uint8 *buf = CAST(uint8 *, kmalloc(FAT_SELF_TEST_LEN + 100));
+
+  if (buf == NULL)
+    return;
+
+  fat_test_failures = 0;
+
+  term_write(cout, "FAT self test on " FAT_SELF_TEST_PATH "\n");
+
+  fat_test_overwrite(buf);
+  file_remove(FAT_SELF_TEST_PATH);
+
+  fat_test_fragmented();
+  file_remove(FAT_SELF_TEST_PATH);
+
+  term_write(cout, "FAT self test failures: ");
+  term_write(cout, fat_test_failures);
+  term_writeline(cout);
+
+  kfree(buf);
+}
+
+#endif
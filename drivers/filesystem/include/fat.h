@@ -81,6 +81,22 @@ typedef struct BIOS_Parameter_Block_struct {
   } _;
 } BIOS_Parameter_Block;
 
+// Layout of the FSInfo sector of FAT32, with hints on the free clusters
+
+#define FAT_FSINFO_LEAD_SIG 0x41615252
+#define FAT_FSINFO_STRUC_SIG 0x61417272
+#define FAT_FSINFO_UNKNOWN 0xFFFFFFFF
+
+typedef struct FAT_FSInfo_struct {
+  uint8 FSI_LeadSig[4];
+  uint8 FSI_Reserved1[480];
+  uint8 FSI_StrucSig[4];
+  uint8 FSI_Free_Count[4];  // FAT_FSINFO_UNKNOWN when unknown
+  uint8 FSI_Nxt_Free[4];    // where to look for a free cluster
+  uint8 FSI_Reserved2[12];
+  uint8 FSI_TrailSig[4];
+} FAT_FSInfo;
+
 typedef struct fat_file_system_struct {
   fs_header header;
   uint8 kind;  // FAT12_FS, FAT16_FS or FAT32_FS
@@ -94,6 +110,12 @@ typedef struct fat_file_system_struct {
       uint32 root_directory_sectors;
       uint32 first_data_sector;
       uint32 total_data_clusters;
+      uint32 FAT_size;      // in sectors
+      uint32 root_cluster;  // FAT32 only
+      uint32 FSInfo_sector; // FAT32 only, 0 when there is none
+      uint32 free_count;    // FAT_FSINFO_UNKNOWN until counted
+      uint32 next_free;
+      uint8* free_map;      // a bit per cluster, set when used
     } FAT121632;
   } _;
 } fat_file_system;
@@ -109,16 +131,32 @@ struct fat_open_chain_link_struct {
   uint8 remove_on_close:1;
 };
 
+// A run of contiguous clusters of a file
+typedef struct fat_extent_struct {
+  uint32 index;    // of its first cluster in the file
+  uint32 cluster;  // its first cluster
+  uint32 count;
+} fat_extent;
+
 typedef struct fat_file {
   file header;
   uint32 first_cluster;
   uint32 current_cluster;          // the "logical cluster"
+  uint32 current_index;            // of the current cluster in the file
   uint32 current_section_start;    // the current LBA of the section
   uint32 current_section_length;   // length in bytes of the current section
   uint32 current_section_pos;      // the offset in bytes from the section
   uint32 current_pos;              // the absolute position
   uint32 length;                   // in bytes
   fat_open_chain* link;
+  struct {
+    // The clusters of the file, mapped as they are reached, so that a
+    // seek doesn't walk the FAT chain again
+    uint32 first_cluster;  // of the chain that is mapped
+    fat_extent* runs;      // sorted by index
+    uint32 nb_runs;
+    uint32 max_runs;
+  } extents;
   struct {
     uint32 first_cluster;
   } parent;
@@ -128,6 +166,11 @@ typedef struct fat_file {
     // modifications of the entry because we know exactly
     // where it is on the disk.
     uint32 position;
+    // The length and the modification time are written to the entry when
+    // the file is closed or synced, rather than on every write
+    bool dirty;
+    uint16 wrt_time;
+    uint16 wrt_date;
   } entry;
 } fat_file;
 
@@ -158,6 +201,29 @@ typedef struct long_file_name_entry_struct {
 } long_file_name_entry;
 
 
+// Entry of the directory entry cache, a negative one when found is FALSE
+
+#define FAT_DENTRY_CACHE_SIZE 256
+#define FAT_DENTRY_NAME_MAX 31
+
+typedef struct fat_dentry_struct {
+  fat_file_system* fs;  // NULL when unused
+  uint32 parent_cluster;
+  uint32 hash;
+  native_char name[FAT_DENTRY_NAME_MAX + 1];
+  bool found;
+  uint32 position;  // of the entry in the parent directory
+  uint32 first_cluster;
+} fat_dentry;
+
+typedef struct fat_dentry_stats_struct {
+  uint32 hits;
+  uint32 negative_hits;
+  uint32 misses;
+} fat_dentry_stats;
+
+void fat_dentry_get_stats(fat_dentry_stats* stats);
+
 error_code mount_fat(vfnode* parent);
 
 error_code fat_open_file(native_string path, file_mode mode, file** f);
@@ -166,5 +232,11 @@ void inline set_dir_entry_size(FAT_directory_entry* de, uint32 sz);
 
 error_code stat(native_string path, struct stat* buf);
 
+#ifdef FAT_SELF_TEST
+
+void fat_self_test();
+
+#endif
+
 
 #endif
@@ -0,0 +1,28 @@
+#ifndef __SYSFILE_H
+#define __SYSFILE_H
+
+#include "vfs.h"
+
+// Read-only files of /sys describing the system. Their text is
+// generated when they are opened, so a file shows the state at that
+// time.
+
+typedef struct sys_file_struct sys_file;
+
+extern native_string PCI_PATH;
+extern native_string DISK_CACHE_PATH;
+extern native_string DENTRY_CACHE_PATH;
+#ifdef DISK_CACHE_TRACE
+extern native_string DISK_TRACE_PATH;
+#endif
+
+struct sys_file_struct {
+  file header;
+  native_string _text;
+  uint32 _len;
+  uint32 _pos;
+};
+
+error_code mount_sysfiles(vfnode* parent);
+
+#endif
@@ -78,6 +78,7 @@ typedef struct file_vtable_struct {
   error_code (*_file_move_cursor)(file* f, int32 mvmt);
   error_code (*_file_set_to_absolute_position)(file* f, uint32 position);
   error_code (*_file_close)(file* f);
+  error_code (*_file_sync)(file* f);
   error_code (*_file_write)(file* f, void* buff, uint32 count);
   error_code (*_file_read)(file* f, void* buff, uint32 count);
   size_t (*_file_len)(file* f);
@@ -161,6 +162,14 @@ vfnode* new_vfnode(vfnode* vf, native_string name, file_type type);
 
 #define file_close(f) CAST(file*, f)->_vtable->_file_close(CAST(file*, f))
 
+/**
+ * error_code file_sync(file* f)
+ *
+ * Wait until the data written to the file f is on the media.
+ *
+ */
+#define file_sync(f) CAST(file*, f)->_vtable->_file_sync(CAST(file*, f))
+
 /**
  * error_code file_write(file* f, void* b, uint32 n)
  *
@@ -26,6 +26,7 @@ static error_code stream_set_to_absolute_position(file* f, uint32 position);
 static size_t stream_len(file* f);
 
 static error_code stream_close(file* f);
+static error_code stream_sync(file* f);
 static error_code stream_write(file* f, void* buff, uint32 count);
 static error_code stream_read(file* f, void* buf, uint32 count);
 
@@ -36,6 +37,8 @@ void stream_reset_cursor(file* f) { return; }
 
 static error_code stream_move_cursor(file* f, int32 n) { return ARG_ERROR; }
 
+static error_code stream_sync(file* f) { return NO_ERROR; }
+
 static error_code stream_set_to_absolute_position(file* f, uint32 position) {
   return ARG_ERROR;
 }
@@ -270,6 +273,7 @@ error_code mount_streams(vfnode* parent) {
   error_code err = NO_ERROR;
 
   __std_rw_file_stream_vtable._file_close = stream_close;
+  __std_rw_file_stream_vtable._file_sync = stream_sync;
   __std_rw_file_stream_vtable._file_len = stream_len;
   __std_rw_file_stream_vtable._file_move_cursor = stream_move_cursor;
   __std_rw_file_stream_vtable._file_read = stream_read;
@@ -0,0 +1,347 @@
+#include "include/sysfile.h"
+#include "disk.h"
+#include "general.h"
+#include "include/fat.h"
+#include "include/vfs.h"
+#include "pci.h"
+#include "rtlib.h"
+
+native_string PCI_PATH = "/sys/pci";
+native_string DISK_CACHE_PATH = "/sys/diskcache";
+native_string DENTRY_CACHE_PATH = "/sys/dentrycache";
+#ifdef DISK_CACHE_TRACE
+native_string DISK_TRACE_PATH = "/sys/disktrace";
+#endif
+
+static native_string SYS_PART = "SYS";
+
+static file_vtable __sys_file_vtable;
+
+static error_code sys_file_move_cursor(file* f, int32 n);
+static error_code sys_file_set_to_absolute_position(file* f, uint32 position);
+static size_t sys_file_len(file* f);
+
+static error_code sys_file_close(file* f);
+static error_code sys_file_sync(file* f);
+static error_code sys_file_write(file* f, void* buff, uint32 count);
+static error_code sys_file_read(file* f, void* buf, uint32 count);
+
+// -------------------------------------------------------------
+// Text generation
+// -------------------------------------------------------------
+
+// The text is generated twice: once without a buffer to get its
+// length, then in a buffer of that length.
+
+typedef struct sys_text_struct {
+  native_string buf;
+  uint32 len;
+  uint32 pos;  // may go past len, to compute the full length
+} sys_text;
+
+static void sys_put_char(sys_text* t, native_char c) {
+  if (t->pos < t->len) t->buf[t->pos] = c;
+  t->pos++;
+}
+
+static void sys_put_string(sys_text* t, native_string s) {
+  while (*s != '\0') sys_put_char(t, *s++);
+}
+
+static void sys_put_hex(sys_text* t, uint64 n, uint32 digits) {
+  for (uint32 i = digits; i > 0; i--)
+    sys_put_char(t, "0123456789abcdef"[(n >> ((i - 1) * 4)) & 15]);
+}
+
+// Fewest hex digits for n, at least one
+static uint32 sys_hex_digits(uint64 n) {
+  uint32 digits = 1;
+  while ((n >>= 4) != 0) digits++;
+  return digits;
+}
+
+static void sys_put_decimal(sys_text* t, uint64 n) {
+  if (n >= 10) sys_put_decimal(t, n / 10);
+  sys_put_char(t, '0' + n % 10);
+}
+
+static void sys_put_field(sys_text* t, native_string name, uint64 n) {
+  sys_put_string(t, name);
+  sys_put_char(t, ' ');
+  sys_put_decimal(t, n);
+  sys_put_char(t, '\n');
+}
+
+// A line per PCI function:
+//
+//   00:1f.2 8086:2922 01.06.01 rev 02 irq 11 msi bar5=mem:febf1000+1000
+//
+// BAR types are io, mem and mem64 with a p suffix when prefetchable.
+static void sys_format_pci(sys_text* t) {
+  for (uint32 i = 0; i < pci_device_count(); i++) {
+    pci_device* dev = pci_device_at(i);
+
+    sys_put_hex(t, dev->fn.bus, 2);
+    sys_put_char(t, ':');
+    sys_put_hex(t, dev->fn.device, 2);
+    sys_put_char(t, '.');
+    sys_put_hex(t, dev->fn.function, 1);
+    sys_put_char(t, ' ');
+    sys_put_hex(t, dev->vendor_id, 4);
+    sys_put_char(t, ':');
+    sys_put_hex(t, dev->device_id, 4);
+    sys_put_char(t, ' ');
+    sys_put_hex(t, dev->class_code, 2);
+    sys_put_char(t, '.');
+    sys_put_hex(t, dev->subclass_code, 2);
+    sys_put_char(t, '.');
+    sys_put_hex(t, dev->prog_if, 2);
+    sys_put_string(t, " rev ");
+    sys_put_hex(t, dev->revision, 2);
+    sys_put_string(t, " irq ");
+    sys_put_decimal(t, dev->irq);
+
+    if (dev->msi != 0) sys_put_string(t, " msi");
+
+    for (uint32 j = 0; j < PCI_BARS; j++) {
+      pci_bar* bar = &dev->bar[j];
+
+      if (bar->base == 0) continue;
+
+      sys_put_string(t, " bar");
+      sys_put_decimal(t, j);
+      sys_put_char(t, '=');
+
+      if (bar->flags & PCI_BAR_IO) {
+        sys_put_string(t, "io");
+      } else if (bar->flags & PCI_BAR_MEM64) {
+        sys_put_string(t, "mem64");
+      } else {
+        sys_put_string(t, "mem");
+      }
+
+      if (bar->flags & PCI_BAR_PREFETCH) sys_put_char(t, 'p');
+
+      sys_put_char(t, ':');
+      sys_put_hex(t, bar->base, sys_hex_digits(bar->base));
+      sys_put_char(t, '+');
+      sys_put_hex(t, bar->size, sys_hex_digits(bar->size));
+    }
+
+    sys_put_char(t, '\n');
+  }
+}
+
+// A "name value" line per counter of the disk block cache
+static void sys_format_disk_cache(sys_text* t) {
+  disk_cache_stats stats;
+
+  disk_cache_get_stats(&stats);
+
+  sys_put_field(t, "blocks", stats.nb_blocks);
+  sys_put_field(t, "segments", stats.nb_segments);
+  sys_put_string(t, "policy ");
+  sys_put_string(t, stats.policy);
+  sys_put_char(t, '\n');
+  sys_put_field(t, "hits", stats.hits);
+  sys_put_field(t, "misses", stats.misses);
+  sys_put_field(t, "main-hits", stats.main_hits);
+  sys_put_field(t, "ghost-hits", stats.ghost_hits);
+  sys_put_field(t, "lock-waits", stats.lock_waits);
+  sys_put_field(t, "lock-wait-usecs", stats.lock_wait_usecs);
+  sys_put_field(t, "readahead-blocks", stats.ra_blocks);
+  sys_put_field(t, "readahead-hits", stats.ra_hits);
+  sys_put_field(t, "readahead-wasted", stats.ra_wasted);
+  sys_put_field(t, "dirty", stats.nb_dirty);
+  sys_put_field(t, "written-back-blocks", stats.wb_blocks);
+  sys_put_field(t, "written-back-writes", stats.wb_writes);
+  sys_put_field(t, "direct-reads", stats.direct_reads);
+  sys_put_field(t, "direct-sectors", stats.direct_sectors);
+}
+
+// A "name value" line per counter of the FAT directory entry cache
+static void sys_format_dentry_cache(sys_text* t) {
+  fat_dentry_stats stats;
+
+  fat_dentry_get_stats(&stats);
+
+  sys_put_field(t, "entries", FAT_DENTRY_CACHE_SIZE);
+  sys_put_field(t, "hits", stats.hits);
+  sys_put_field(t, "negative-hits", stats.negative_hits);
+  sys_put_field(t, "misses", stats.misses);
+}
+
+#ifdef DISK_CACHE_TRACE
+
+// A "disk sector" line per acquisition of a disk cache block, oldest first
+static void sys_format_disk_trace(sys_text* t) {
+  uint32 n = disk_cache_trace_length();
+
+  for (uint32 i = 0; i < n; i++) {
+    disk_cache_trace_entry e;
+
+    disk_cache_trace_at(i, &e);
+    sys_put_decimal(t, e.disk_id);
+    sys_put_char(t, ' ');
+    sys_put_decimal(t, e.sector_pos);
+    sys_put_char(t, '\n');
+  }
+}
+
+#endif
+
+static const struct {
+  native_string name;
+  void (*format)(sys_text* t);
+} sys_files[] = {{"PCI", sys_format_pci},
+                 {"DISKCACHE", sys_format_disk_cache},
+                 {"DENTRYCACHE", sys_format_dentry_cache}
+#ifdef DISK_CACHE_TRACE
+                 ,
+                 {"DISKTRACE", sys_format_disk_trace}
+#endif
+};
+
+#define SYS_FILES (sizeof(sys_files) / sizeof(sys_files[0]))
+
+// -------------------------------------------------------------
+// Methods that don't make sense on a read-only file
+// -------------------------------------------------------------
+
+static error_code sys_file_sync(file* f) { return NO_ERROR; }
+
+static error_code sys_file_write(file* f, void* buff, uint32 count) {
+  return ARG_ERROR;
+}
+
+// -------------------------------------------------------------
+// Reading the text
+// -------------------------------------------------------------
+
+static error_code sys_file_move_cursor(file* ff, int32 n) {
+  sys_file* f = CAST(sys_file*, ff);
+  int32 pos = CAST(int32, f->_pos) + n;
+
+  if (pos < 0 || CAST(uint32, pos) > f->_len) return ARG_ERROR;
+
+  f->_pos = pos;
+
+  return NO_ERROR;
+}
+
+static error_code sys_file_set_to_absolute_position(file* ff,
+                                                    uint32 position) {
+  sys_file* f = CAST(sys_file*, ff);
+
+  if (position > f->_len) return ARG_ERROR;
+
+  f->_pos = position;
+
+  return NO_ERROR;
+}
+
+static size_t sys_file_len(file* ff) { return CAST(sys_file*, ff)->_len; }
+
+// Returns the number of bytes read, like the other file systems
+static error_code sys_file_read(file* ff, void* buf, uint32 count) {
+  sys_file* f = CAST(sys_file*, ff);
+  uint32 left = f->_len - f->_pos;
+
+  if (count > left) count = left;
+
+  memcpy(buf, f->_text + f->_pos, count);
+  f->_pos += count;
+
+  return count;
+}
+
+static error_code sys_file_close(file* ff) {
+  sys_file* f = CAST(sys_file*, ff);
+
+  kfree(f->_text);
+  kfree(f);
+
+  return NO_ERROR;
+}
+
+// -------------------------------------------------------------
+// Opening
+// -------------------------------------------------------------
+
+static error_code sys_file_open(uint32 id, file_mode mode, file** result) {
+  sys_file* f;
+  sys_text t;
+
+  *result = NULL;
+
+  if (id >= SYS_FILES) return FNF_ERROR;
+
+  if (IS_MODE_WRITE_ONLY(mode)) return ARG_ERROR;
+
+  t.buf = NULL;
+  t.len = 0;
+  t.pos = 0;
+  sys_files[id].format(&t);
+
+  f = CAST(sys_file*, kmalloc(sizeof(sys_file)));
+
+  if (NULL == f) return MEM_ERROR;
+
+  f->_text = CAST(native_string, kmalloc(t.pos + 1));
+
+  if (NULL == f->_text) {
+    kfree(f);
+    return MEM_ERROR;
+  }
+
+  // The text may have grown since it was measured, it is cut if so
+
+  t.buf = f->_text;
+  t.len = t.pos;
+  t.pos = 0;
+  sys_files[id].format(&t);
+
+  f->header._fs_header = NULL;
+  f->header._vtable = &__sys_file_vtable;
+  f->header.name = sys_files[id].name;
+  f->header.type = TYPE_VFILE;
+  f->header.mode = mode;
+  f->_len = (t.pos < t.len) ? t.pos : t.len;
+  f->_pos = 0;
+
+  *result = CAST(file*, f);
+
+  return NO_ERROR;
+}
+
+error_code mount_sysfiles(vfnode* parent) {
+  vfnode* sys_node;
+
+  __sys_file_vtable._file_close = sys_file_close;
+  __sys_file_vtable._file_sync = sys_file_sync;
+  __sys_file_vtable._file_len = sys_file_len;
+  __sys_file_vtable._file_move_cursor = sys_file_move_cursor;
+  __sys_file_vtable._file_read = sys_file_read;
+  __sys_file_vtable._file_set_to_absolute_position =
+      sys_file_set_to_absolute_position;
+  __sys_file_vtable._file_write = sys_file_write;
+
+  // The folder is created with the standard streams
+
+  for (sys_node = parent->_first_child; NULL != sys_node;
+       sys_node = sys_node->_next_sibling)
+    if (0 == kstrcmp(sys_node->name, SYS_PART)) break;
+
+  if (NULL == sys_node) return FNF_ERROR;
+
+  for (uint32 i = 0; i < SYS_FILES; i++) {
+    vfnode* node = CAST(vfnode*, kmalloc(sizeof(vfnode)));
+    if (NULL == node) return MEM_ERROR;
+    new_vfnode(node, sys_files[i].name, TYPE_VFILE);
+    node->_value.file_gate.identifier = i;
+    node->_value.file_gate._vf_node_open = sys_file_open;
+    vfnode_add_child(sys_node, node);
+  }
+
+  return NO_ERROR;
+}
@@ -2,6 +2,7 @@
 #include "general.h"
 #include "include/fat.h"
 #include "include/stdstream.h"
+#include "include/sysfile.h"
 #include "rtlib.h"
 #include "term.h"
 #include "uart.h"
@@ -13,6 +14,7 @@ static vfnode sys_root;
 static vfnode dev_mnt_pt;
 
 static error_code vfnode_close(file* f);
+static error_code vfnode_sync(file* f);
 static size_t vfnode_len(file* f);
 static error_code vfnode_move_cursor(file* f, int32 mvmt);
 static error_code vfnode_set_abs(file* f, uint32 pos);
@@ -24,6 +26,10 @@ static error_code vfnode_close(file* f) {
   return PERMISSION_ERROR;
 }
 
+static error_code vfnode_sync(file* f) {
+  return NO_ERROR;
+}
+
 static size_t vfnode_len(file* f) {
   return 0;
 }
@@ -531,6 +537,7 @@ error_code init_vfs() {
   __vfs.kind = NONE; 
 
   __vfnode_vtable._file_close = vfnode_close;
+  __vfnode_vtable._file_sync = vfnode_sync;
   __vfnode_vtable._file_len = vfnode_len;
   __vfnode_vtable._file_move_cursor = vfnode_move_cursor;
   __vfnode_vtable._file_set_to_absolute_position = vfnode_set_abs;
@@ -547,6 +554,10 @@ error_code init_vfs() {
     return err;
   }
 
+  if (ERROR(err = mount_sysfiles(&sys_root))) {
+    return err;
+  }
+
   if (ERROR(err = mount_fat(&sys_root))) {
     return err;
   }
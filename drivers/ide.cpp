@@ -12,6 +12,7 @@
 #include "disk.h"
 #include "ide.h"
 #include "intr.h"
+#include "pci.h"
 #include "rtlib.h"
 #include "term.h"
 #include "thread.h"
@@ -33,78 +34,518 @@ typedef struct ide_module_struct {
 
 static ide_module ide_mod;
 
+// Status reads waiting for the device to ask for the first block of a PIO
+// write before the wait is left to a timer, a few microseconds
+#define IDE_DRQ_POLLS 8
+
+// Time between the checks of a waiting controller, and the longest
+// waits for the first block of a PIO write and for a reset
+#define IDE_POLL_NSECS 1000000
+#define IDE_DRQ_TIMEOUT_SECS 1
+#define IDE_RESET_TIMEOUT_SECS 31
+
+// ide_delay calls that hold SRST for at least 5 usecs
+#define IDE_SRST_DELAYS 8
+
 static void ide_delay(uint16 port) {
   for (int i = 0; i < 4; i++)
     inb(port + IDE_ALT_STATUS_REG);
 }
 
-ide_cmd_queue_entry *ide_cmd_queue_alloc(ide_device *dev) {
-  int32 i;
-  ide_controller *ctrl;
-  ide_cmd_queue_entry *entry;
+// A transfer needs the 48 bit LBA commands when it goes past the first
+// 2^28 sectors or moves more than 256 sectors
+static bool ide_needs_lba48(uint32 lba, uint32 count) {
+  return count > IDE_LBA28_MAX_COUNT || lba >= IDE_LBA28_SECTORS ||
+         count > IDE_LBA28_SECTORS - lba;
+}
 
-  ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
+static void ide_write_task_file(ide_device *dev, uint16 base, uint32 lba,
+                                uint32 count, bool lba48) {
+  if (lba48) {
+    // Each register is a 2 byte FIFO, the high order bytes go first
+    outb(IDE_DEV_HEAD_LBA | IDE_DEV_HEAD_DEV(dev->id), base + IDE_DEV_HEAD_REG);
+    outb((count >> 8), base + IDE_SECT_COUNT_REG);
+    outb((lba >> 24), base + IDE_SECT_NUM_REG);
+    outb(0, base + IDE_CYL_LO_REG); // the LBA is only 32 bits
+    outb(0, base + IDE_CYL_HI_REG);
+  } else {
+    outb(IDE_DEV_HEAD_LBA | IDE_DEV_HEAD_DEV(dev->id) | (lba >> 24),
+         base + IDE_DEV_HEAD_REG);
+  }
+
+  outb(count, base + IDE_SECT_COUNT_REG);
+  outb(lba, base + IDE_SECT_NUM_REG);
+  outb((lba >> 8), base + IDE_CYL_LO_REG);
+  outb((lba >> 16), base + IDE_CYL_HI_REG);
+}
 
-  ctrl = dev->ctrl;
+// Number of sectors moved by the next command of a transfer
+static uint32 ide_transfer_count(ide_device *dev, uint32 count) {
+  uint32 max = dev->lba48 ? IDE_LBA48_MAX_COUNT : IDE_LBA28_MAX_COUNT;
 
-  while ((i = ctrl->cmd_queue_freelist) < 0)
-    condvar_mutexless_wait(ctrl->cmd_queue_condvar);
+#ifdef USE_IDE_DMA
+  if (dev->dma && max > IDE_DMA_MAX_COUNT)
+    max = IDE_DMA_MAX_COUNT;
+#endif
 
-  entry = &ctrl->cmd_queue[i];
+  return (count < max) ? count : max;
+}
 
-  entry->dev = dev;
-  entry->refcount = 2; // the interrupt handler and the client have to free me
+// Move the PIO position n sectors forward
+static void ide_advance(ide_command *c, uint32 n) {
+  blk_request *req = c->req;
 
-  i = entry->next;
+  c->seg_pos += n;
 
-  ctrl->cmd_queue_freelist = i;
+  while (c->seg < req->nb_segments && c->seg_pos >= req->segments[c->seg].count) {
+    c->seg_pos -= req->segments[c->seg].count;
+    c->seg++;
+  }
+}
 
-  if (i >= 0)
-    condvar_mutexless_signal(ctrl->cmd_queue_condvar);
+static uint16 *ide_pio_buffer(ide_command *c) {
+  blk_segment *seg = &c->req->segments[c->seg];
 
-  return entry;
+  return CAST(uint16 *,
+              CAST(uint8 *, seg->buf) + (c->seg_pos << IDE_LOG2_SECTOR_SIZE));
 }
 
-void ide_cmd_queue_free(ide_cmd_queue_entry *entry) {
-  ide_device *dev;
-  ide_controller *ctrl;
+static void ide_pio_read(uint16 base, ide_command *c, uint32 sectors) {
+  c->moved += sectors;
 
-  ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
+  while (sectors-- > 0) {
+    uint16 *p = ide_pio_buffer(c);
 
-  dev = entry->dev;
-  ctrl = dev->ctrl;
+    for (uint32 i = 1 << (IDE_LOG2_SECTOR_SIZE - 1); i > 0; i--)
+      *p++ = inw(base + IDE_DATA_REG);
 
-  if (--entry->refcount == 0) {
-    entry->next = ctrl->cmd_queue_freelist;
-    ctrl->cmd_queue_freelist = entry->id;
-    condvar_mutexless_signal(ctrl->cmd_queue_condvar);
+    ide_advance(c, 1);
   }
 }
 
-void ide_irq(ide_controller *ctrl) {
-  uint8 s;
-  uint32 i;
-  ide_cmd_queue_entry *entry;
-  uint16 base;
-  uint16 *p = NULL;
+static void ide_pio_write(uint16 base, ide_command *c, uint32 sectors) {
+  c->moved += sectors;
 
-  entry = &ctrl->cmd_queue[0]; // We only handle one operation at a time
-  base = ide_controller_map[ctrl->id].base;
+  while (sectors-- > 0) {
+    uint16 *p = ide_pio_buffer(c);
+
+    for (uint32 i = 1 << (IDE_LOG2_SECTOR_SIZE - 1); i > 0; i--)
+      outw(*p++, base + IDE_DATA_REG);
+
+    ide_advance(c, 1);
+  }
+}
+
+// Sectors of the DRQ block the device expects next
+static uint32 ide_pio_block(ide_command *c) {
+  uint32 n = c->count - c->moved;
+
+  return (n < c->block) ? n : c->block;
+}
+
+#ifdef USE_IDE_DMA
+
+// One physical region descriptor table per controller. Aligning a
+// table on its size keeps it from crossing a 64K boundary.
+
+static ide_prd ide_prdt[IDE_CONTROLLERS][IDE_PRD_ENTRIES]
+    __attribute__((aligned(IDE_PRD_ENTRIES * sizeof(ide_prd))));
+
+// Describe up to count sectors of the request, from the PIO position,
+// in the controller's PRD table. Returns the number of sectors that
+// fit, 0 when the transfer must be done with PIO.
+static uint32 ide_dma_prepare(ide_controller *ctrl, ide_command *c,
+                              uint32 count) {
+  ide_prd *prd = ide_prdt[ctrl->id];
+  blk_request *req = c->req;
+  uint32 total = count << IDE_LOG2_SECTOR_SIZE;
+  uint32 bytes = 0;
+  uint32 n = 0;
+  uint32 mark_bytes = 0; // the table up to the last sector boundary
+  uint32 mark_n = 0;
+
+  for (uint8 seg = c->seg; bytes < total; seg++) {
+    blk_segment *s = &req->segments[seg];
+    uint32 from = (seg == c->seg) ? c->seg_pos : 0;
+    uint32 addr = CAST(uint32, s->buf) + (from << IDE_LOG2_SECTOR_SIZE);
+    uint32 left = (s->count - from) << IDE_LOG2_SECTOR_SIZE;
+
+    if (left > total - bytes)
+      left = total - bytes;
+
+    if (addr & 1)
+      break; // regions must be word aligned
+
+    while (left > 0) {
+      uint32 len = 0x10000 - (addr & 0xffff); // up to the next 64K boundary
+
+      if (len > left)
+        len = left;
+
+      if (n == IDE_PRD_ENTRIES)
+        goto full;
+
+      prd[n].addr = addr; // there is no paging
+      prd[n].count = len; // 64K is truncated to 0 as required
+      prd[n].flags = 0;
+
+      addr += len;
+      left -= len;
+      bytes += len;
+      n++;
+
+      if ((bytes & ((1 << IDE_LOG2_SECTOR_SIZE) - 1)) == 0) {
+        mark_bytes = bytes;
+        mark_n = n;
+      }
+    }
+  }
+
+full:
+
+  if (mark_n == 0)
+    return 0;
+
+  prd[mark_n - 1].flags = IDE_PRD_EOT;
+
+  return mark_bytes >> IDE_LOG2_SECTOR_SIZE;
+}
+
+// Load the PRD table and the direction. The transfer is started with
+// ide_dma_start once the command has been sent to the device.
+static void ide_dma_setup(ide_controller *ctrl, uint8 dir) {
+  uint16 bm = ctrl->bm_base;
+
+  outl(CAST(uint32, ide_prdt[ctrl->id]), bm + IDE_BM_PRDT_REG);
+  outb(dir, bm + IDE_BM_COMMAND_REG);
+  outb(inb(bm + IDE_BM_STATUS_REG) | IDE_BM_STATUS_ERR | IDE_BM_STATUS_INTR,
+       bm + IDE_BM_STATUS_REG);
+}
+
+static void ide_dma_start(ide_controller *ctrl, uint8 dir) {
+  outb(dir | IDE_BM_COMMAND_START, ctrl->bm_base + IDE_BM_COMMAND_REG);
+}
+
+// Stop the transfer and return the bus master status
+static uint8 ide_dma_stop(ide_controller *ctrl) {
+  uint16 bm = ctrl->bm_base;
+  uint8 status = inb(bm + IDE_BM_STATUS_REG);
+
+  outb(0, bm + IDE_BM_COMMAND_REG);
+  outb(status | IDE_BM_STATUS_ERR | IDE_BM_STATUS_INTR,
+       bm + IDE_BM_STATUS_REG);
+
+  return status;
+}
+
+// Find the PCI IDE function driving the legacy channels and get its
+// bus master registers
+static void setup_ide_bus_master() {
+  pci_function fn;
+
+  for (uint32 i = 0; pci_find_class(PCI_CLASS_STORAGE,
+                                    PCI_SUBCLASS_STORAGE_IDE, i, &fn);
+       i++) {
+    uint8 prog_if = pci_read_config_byte(&fn, PCI_PROG_IF);
+    uint32 bar = pci_read_config_dword(&fn, PCI_BASE_ADDRESS_4);
 
-  cmd_type type = entry->cmd;
+    if (!(prog_if & IDE_PROG_IF_BUS_MASTER) ||
+        !(bar & PCI_BASE_ADDRESS_SPACE_IO) ||
+        (bar & PCI_BASE_ADDRESS_IO_MASK) == 0)
+      continue;
 
-  if (type == cmd_read_sectors) {
-    p = CAST(uint16 *, entry->_.read_sectors.buf);
-  } else if (type == cmd_write_sectors) {
-    p = CAST(uint16 *, entry->_.write_sectors.buf);
-  } else if (type == cmd_flush_cache) {
-    p = NULL;
+    // A channel in native PCI mode is not at the legacy ports
+
+    if ((prog_if & IDE_PROG_IF_PRIMARY_NATIVE) &&
+        (prog_if & IDE_PROG_IF_SECONDARY_NATIVE))
+      continue;
+
+    pci_enable_bus_master(&fn);
+
+    uint16 bm = bar & PCI_BASE_ADDRESS_IO_MASK;
+
+    if (!(prog_if & IDE_PROG_IF_PRIMARY_NATIVE))
+      ide_mod.ide[0].bm_base = bm;
+
+    if (!(prog_if & IDE_PROG_IF_SECONDARY_NATIVE))
+      ide_mod.ide[1].bm_base = bm + IDE_BM_CHANNEL_STRIDE;
+
+#ifdef SHOW_IDE_INFO
+    term_write(cout, "Bus master IDE at port ");
+    term_write(cout, bm);
+    term_writeline(cout);
+#endif
+
+    return;
+  }
+}
+
+#endif
+
+static void ide_start(ide_controller *ctrl);
+
+static void ide_finish(ide_controller *ctrl, error_code err);
+
+static void ide_poll(timer *t, void *data);
+
+static void ide_poll_later(ide_controller *ctrl) {
+  timer_add(&ctrl->poll,
+            add_time(current_time_no_interlock(),
+                     nanoseconds_to_time(IDE_POLL_NSECS)),
+            ide_poll, ctrl);
+}
+
+// Soft reset the devices of the controller after a command that didn't
+// go through. No command is started until they are ready again.
+static void ide_reset(ide_controller *ctrl) {
+  uint16 base = ide_controller_map[ctrl->id].base;
+
+  outb(IDE_DEV_CTRL_nIEN | IDE_DEV_CTRL_SRST, base + IDE_DEV_CTRL_REG);
+  for (uint32 i = 0; i < IDE_SRST_DELAYS; i++)
+    ide_delay(base);
+  outb(0, base + IDE_DEV_CTRL_REG);
+
+  ctrl->resetting = TRUE;
+  ctrl->deadline = add_time(current_time_no_interlock(),
+                            seconds_to_time(IDE_RESET_TIMEOUT_SECS));
+  ide_poll_later(ctrl);
+}
+
+// Write the first block of a PIO write if the device asks for it. Returns
+// FALSE while the device is busy. On an error the device interrupts
+// without asking for data.
+static bool ide_drq_ready(ide_controller *ctrl) {
+  ide_command *c = &ctrl->cmd;
+  uint16 base = ide_controller_map[ctrl->id].base;
+  uint8 s = inb(base + IDE_ALT_STATUS_REG);
+
+  if ((s & IDE_STATUS_BSY) || !(s & (IDE_STATUS_DRQ | IDE_STATUS_ERR)))
+    return FALSE;
+
+  c->drq_wait = FALSE;
+
+  if (!(s & IDE_STATUS_ERR))
+    ide_pio_write(base, c, ide_pio_block(c));
+
+  return TRUE;
+}
+
+// Check the status of a controller whose wait isn't signaled by an
+// interrupt. Runs from the timer interrupt.
+static void ide_poll(timer *t, void *data) {
+  ide_controller *ctrl = CAST(ide_controller *, data);
+  ide_command *c = &ctrl->cmd;
+  uint16 base = ide_controller_map[ctrl->id].base;
+  bool expired = !less_time(current_time_no_interlock(), ctrl->deadline);
+
+  if (ctrl->resetting) {
+    if (!(inb(base + IDE_ALT_STATUS_REG) & IDE_STATUS_BSY) || expired) {
+      if (expired)
+        term_write(cout, "***IDE RESET TIMEOUT***\n");
+      ctrl->resetting = FALSE;
+      ide_start(ctrl);
+      return;
+    }
+  } else if (c->req != NULL && c->drq_wait) {
+    if (ide_drq_ready(ctrl))
+      return;
+
+    if (expired) {
+      term_write(cout, "***IDE WRITE TIMEOUT***\n");
+      c->drq_wait = FALSE;
+      ide_reset(ctrl);
+      ide_finish(ctrl, UNKNOWN_ERROR);
+      return;
+    }
   } else {
-    panic(L"[IDE.CPP] Unknown command type...");
+    return;
+  }
+
+  ide_poll_later(ctrl);
+}
+
+// Send the next command of the controller's request
+static void ide_issue(ide_controller *ctrl) {
+  ide_command *c = &ctrl->cmd;
+  ide_device *dev = c->dev;
+  blk_request *req = c->req;
+  uint16 base = ide_controller_map[ctrl->id].base;
+  uint32 lba = req->lba + c->done;
+  bool lba48;
+
+  c->moved = 0;
+  c->block = 1;
+
+  if (req->op == BLK_FLUSH) {
+    c->cmd = cmd_flush_cache;
+    c->count = 0;
+    outb(IDE_DEV_HEAD_LBA | IDE_DEV_HEAD_DEV(dev->id), base + IDE_DEV_HEAD_REG);
+    outb(dev->lba48 ? IDE_FLUSH_CACHE_EXT_CMD : IDE_FLUSH_CACHE_CMD,
+         base + IDE_COMMAND_REG);
+    return;
+  }
+
+  c->count = ide_transfer_count(dev, req->count - c->done);
+
+#ifdef USE_IDE_DMA
+  if (dev->dma) {
+    uint32 n = ide_dma_prepare(ctrl, c, c->count);
+
+    if (n > 0) {
+      uint8 dir = (req->op == BLK_READ) ? IDE_BM_COMMAND_READ : 0;
+
+      c->count = n;
+      lba48 = ide_needs_lba48(lba, n);
+
+      ide_dma_setup(ctrl, dir);
+      ide_write_task_file(dev, base, lba, n, lba48);
+
+      if (req->op == BLK_READ) {
+        c->cmd = cmd_read_dma;
+        outb(lba48 ? IDE_READ_DMA_EXT_CMD : IDE_READ_DMA_CMD,
+             base + IDE_COMMAND_REG);
+      } else {
+        c->cmd = cmd_write_dma;
+        outb(lba48 ? IDE_WRITE_DMA_EXT_CMD : IDE_WRITE_DMA_CMD,
+             base + IDE_COMMAND_REG);
+      }
+
+      ide_dma_start(ctrl, dir);
+      return;
+    }
+  }
+#endif
+
+  if (dev->multiple > 1 && c->count > 1)
+    c->block = dev->multiple;
+
+  lba48 = ide_needs_lba48(lba, c->count);
+
+  ide_write_task_file(dev, base, lba, c->count, lba48);
+
+  if (req->op == BLK_READ) {
+    c->cmd = cmd_read_sectors;
+
+    if (c->block > 1) {
+      outb(lba48 ? IDE_READ_MULTIPLE_EXT_CMD : IDE_READ_MULTIPLE_CMD,
+           base + IDE_COMMAND_REG);
+    } else {
+      outb(lba48 ? IDE_READ_SECTORS_EXT_CMD : IDE_READ_SECTORS_CMD,
+           base + IDE_COMMAND_REG);
+    }
+  } else {
+    c->cmd = cmd_write_sectors;
+
+    if (c->block > 1) {
+      outb(lba48 ? IDE_WRITE_MULTIPLE_EXT_CMD : IDE_WRITE_MULTIPLE_CMD,
+           base + IDE_COMMAND_REG);
+    } else {
+      outb(lba48 ? IDE_WRITE_SECTORS_EXT_CMD : IDE_WRITE_SECTORS_CMD,
+           base + IDE_COMMAND_REG);
+    }
+
+    // The first block is written without waiting for an interrupt,
+    // the following ones are written by ide_irq. This runs with
+    // interrupts disabled, so a device that is slow to ask for the
+    // data is checked again from a timer. One that never does is
+    // reset and the request fails.
+
+    c->drq_wait = TRUE;
+
+    for (uint32 i = 0; i < IDE_DRQ_POLLS && c->drq_wait; i++) {
+      ide_delay(base);
+      ide_drq_ready(ctrl);
+    }
+
+    if (c->drq_wait) {
+      ctrl->deadline = add_time(current_time_no_interlock(),
+                                seconds_to_time(IDE_DRQ_TIMEOUT_SECS));
+      ide_poll_later(ctrl);
+    }
+  }
+}
+
+// Start the next request when the controller is idle. The devices of
+// the controller take turns.
+static void ide_start(ide_controller *ctrl) {
+  ide_command *c = &ctrl->cmd;
+
+  ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
+
+  if (ctrl->resetting)
+    return; // ide_poll starts the requests once the reset is over
+
+  while (c->req == NULL) {
+    blk_request *req = NULL;
+    ide_device *dev;
+
+    for (uint32 i = 0; i < IDE_DEVICES_PER_CONTROLLER && req == NULL; i++) {
+      dev = &ctrl->device[(ctrl->next_dev + i) % IDE_DEVICES_PER_CONTROLLER];
+      req = blk_queue_next(&dev->queue);
+    }
+
+    if (req == NULL)
+      return;
+
+    ctrl->next_dev = (dev->id + 1) % IDE_DEVICES_PER_CONTROLLER;
+
+    if (req->op != BLK_FLUSH && req->count == 0) {
+      blk_complete(req, NO_ERROR);
+      continue;
+    }
+
+    c->req = req;
+    c->dev = dev;
+    c->done = 0;
+    c->seg = 0;
+    c->seg_pos = 0;
+
+    ide_issue(ctrl);
+  }
+}
+
+static void ide_queue_start(blk_queue *q) {
+  ide_device *dev = CAST(ide_device *, q->driver_data);
+
+  ide_start(dev->ctrl);
+}
+
+static void ide_finish(ide_controller *ctrl, error_code err) {
+  blk_request *req = ctrl->cmd.req;
+
+  if (ctrl->cmd.drq_wait) {
+    ctrl->cmd.drq_wait = FALSE;
+    timer_cancel(&ctrl->poll);
+  }
+
+  ctrl->cmd.req = NULL;
+  blk_complete(req, err);
+  ide_start(ctrl);
+}
+
+void ide_irq(ide_controller *ctrl) {
+  ide_command *c = &ctrl->cmd;
+  uint16 base = ide_controller_map[ctrl->id].base;
+  uint8 bm_status = 0;
+  uint8 s;
+
+  if (c->req == NULL) {
+    inb(base + IDE_STATUS_REG); // acknowledge a spurious interrupt
+    return;
   }
 
+#ifdef USE_IDE_DMA
+  if (c->cmd == cmd_read_dma || c->cmd == cmd_write_dma)
+    bm_status = ide_dma_stop(ctrl);
+#endif
+
   s = inb(base + IDE_STATUS_REG);
 
+  if (bm_status & IDE_BM_STATUS_ERR) {
+    term_write(cout, "***IDE DMA ERROR***\n");
+    s |= IDE_STATUS_ERR;
+  }
+
   if (s & IDE_STATUS_ERR) {
     // #ifdef SHOW_DISK_INFO
     uint8 err = inb(base + IDE_ERROR_REG);
@@ -124,47 +565,54 @@ void ide_irq(ide_controller *ctrl) {
       term_write(cout, "Data address mark not found after ID field\n");
     // #endif
 
-    if (type == cmd_read_sectors) {
-      entry->_.read_sectors.err = UNKNOWN_ERROR;
-    } else if (type == cmd_write_sectors) {
-      entry->_.write_sectors.err = UNKNOWN_ERROR;
-    }
-    condvar_mutexless_signal(entry->done);
-    ide_cmd_queue_free(entry);
-  } else if (type == cmd_read_sectors) {
-    for (i = entry->_.read_sectors.count << (IDE_LOG2_SECTOR_SIZE - 1); i > 0;
-         i--)
-      *p++ = inw(base + IDE_DATA_REG);
+    ide_finish(ctrl, UNKNOWN_ERROR);
+    return;
+  }
+
+  switch (c->cmd) {
+  case cmd_read_dma:
+  case cmd_write_dma:
+    ide_advance(c, c->count); // the data was moved by the controller
+    break;
+
+  case cmd_read_sectors:
+    // Each interrupt brings a block of sectors
+    ide_pio_read(base, c, ide_pio_block(c));
+
+    if (c->moved < c->count)
+      return; // wait for the next block
 
     if (inb(base + IDE_ALT_STATUS_REG) & IDE_STATUS_DRQ) {
-      entry->_.read_sectors.err = UNKNOWN_ERROR;
-    } else {
-      entry->_.read_sectors.err = NO_ERROR;
+      ide_finish(ctrl, UNKNOWN_ERROR);
+      return;
     }
-    condvar_mutexless_signal(entry->done);
-    ide_cmd_queue_free(entry);
-  } else if (type == cmd_write_sectors) {
-    if (entry->_.write_sectors.written < entry->_.write_sectors.count) {
-      // Write the next sector to write
-      for (uint16 i = 1 << (IDE_LOG2_SECTOR_SIZE - 1); i > 0; i--) {
-        outw(*p++, base + IDE_DATA_REG);
-      }
-      entry->_.write_sectors.buf = p;
-      entry->_.write_sectors.written++;
-    } else {
-      // This is the status interrupt
-      if (inb(base + IDE_ALT_STATUS_REG) & IDE_STATUS_DRQ) {
-        entry->_.write_sectors.err = UNKNOWN_ERROR;
-      } else {
-        entry->_.write_sectors.err = NO_ERROR;
-      }
-      condvar_mutexless_signal(entry->done);
-      ide_cmd_queue_free(entry);
+    break;
+
+  case cmd_write_sectors:
+    if (c->drq_wait) {
+      if (ide_drq_ready(ctrl))
+        timer_cancel(&ctrl->poll);
+      return;
     }
-  } else if (type == cmd_flush_cache) {
-    condvar_mutexless_signal(entry->done);
-    ide_cmd_queue_free(entry);
+
+    if (c->moved < c->count) {
+      ide_pio_write(base, c, ide_pio_block(c));
+      return;
+    }
+    break; // the last block is written
+
+  case cmd_flush_cache:
+    break;
+  }
+
+  c->done += c->count;
+
+  if (c->done < c->req->count) {
+    ide_issue(ctrl);
+    return;
   }
+
+  ide_finish(ctrl, NO_ERROR);
 }
 
 #ifdef USE_IRQ14_FOR_IDE0
@@ -203,110 +651,6 @@ extern "C" void irq15() {
 
 #endif
 
-error_code ide_read_sectors(ide_device *dev, uint32 lba, void *buf,
-                            uint32 count) {
-  error_code err = NO_ERROR;
-
-  ASSERT_INTERRUPTS_ENABLED(); // Interrupts should be enabled at this point
-
-  if (count > 0) {
-    ide_controller *ctrl = dev->ctrl;
-    uint16 base = ide_controller_map[ctrl->id].base;
-    ide_cmd_queue_entry *entry;
-
-    disable_interrupts();
-    entry = ide_cmd_queue_alloc(dev);
-
-    if (count > 256)
-      count = 256;
-
-    entry->cmd = cmd_read_sectors;
-    entry->_.read_sectors.buf = buf;
-    entry->_.read_sectors.count = count;
-
-    outb(IDE_DEV_HEAD_LBA | IDE_DEV_HEAD_DEV(dev->id) | (lba >> 24),
-         base + IDE_DEV_HEAD_REG);
-    outb(count, base + IDE_SECT_COUNT_REG);
-    outb(lba, base + IDE_SECT_NUM_REG);
-    outb((lba >> 8), base + IDE_CYL_LO_REG);
-    outb((lba >> 16), base + IDE_CYL_HI_REG);
-    outb(IDE_READ_SECTORS_CMD, base + IDE_COMMAND_REG);
-
-    condvar_mutexless_wait(entry->done);
-
-    err = entry->_.read_sectors.err;
-
-    ide_cmd_queue_free(entry);
-
-    enable_interrupts();
-  }
-
-  return err;
-}
-
-error_code ide_write_sectors(ide_device *dev, uint32 lba, void *buf,
-                             uint32 count) {
-  error_code err = NO_ERROR;
-
-  ASSERT_INTERRUPTS_ENABLED(); // Interrupts should be enabled at this point
-
-  if (count > 0) {
-    ide_controller *ctrl = dev->ctrl;
-    uint16 base = ide_controller_map[ctrl->id].base;
-    ide_cmd_queue_entry *entry;
-
-    disable_interrupts();
-
-    if (count != 1)
-      panic(L"Only one sector supported...");
-    if (count > 256)
-      count = 256;
-
-    entry = ide_cmd_queue_alloc(dev);
-    entry->cmd = cmd_write_sectors;
-    entry->_.write_sectors.buf = buf;
-    entry->_.write_sectors.count = count;
-    entry->_.write_sectors.written = 1; // We write a sector right now
-
-    outb(IDE_DEV_HEAD_LBA | IDE_DEV_HEAD_DEV(dev->id) | (lba >> 24),
-         base + IDE_DEV_HEAD_REG);
-    outb(count, base + IDE_SECT_COUNT_REG);
-    outb(lba, base + IDE_SECT_NUM_REG);
-    outb((lba >> 8), base + IDE_CYL_LO_REG);
-    outb((lba >> 16), base + IDE_CYL_HI_REG);
-    outb(IDE_WRITE_SECTORS_CMD, base + IDE_COMMAND_REG);
-
-    while ((inb(base + IDE_STATUS_REG) & IDE_STATUS_BSY) ||
-           !(inb(base + IDE_STATUS_REG) & IDE_STATUS_DRQ))
-      ide_delay(base);
-
-    uint16 *p = CAST(uint16 *, entry->_.write_sectors.buf);
-
-    // Write the first sector immediately
-    for (uint16 i = (1 << (IDE_LOG2_SECTOR_SIZE - 1)); i > 0; i--) {
-      outw(*p++, base + IDE_DATA_REG);
-    }
-
-    entry->_.write_sectors.buf = p; // So we can write from there
-
-    condvar_mutexless_wait(entry->done);
-    err = entry->_.write_sectors.err;
-    ide_cmd_queue_free(entry);
-
-    // Flush the command buffer
-    entry = ide_cmd_queue_alloc(dev);
-    entry->cmd = cmd_flush_cache;
-
-    outb(IDE_FLUSH_CACHE_CMD, base + IDE_COMMAND_REG);
-    condvar_mutexless_wait(entry->done);
-
-    ide_cmd_queue_free(entry);
-    enable_interrupts();
-  };
-
-  return err;
-}
-
 static void swap_and_trim(native_string dst, uint16 *src, uint32 len) {
   uint32 i;
   uint32 end = 0;
@@ -328,6 +672,9 @@ static void setup_ide_device(ide_controller *ctrl, ide_device *dev, uint8 id) {
 
   dev->id = id;
   dev->ctrl = ctrl;
+  dev->dma = FALSE;
+  dev->lba48 = FALSE;
+  dev->multiple = 0;
 
   if (dev->kind == IDE_DEVICE_ABSENT)
     return;
@@ -389,6 +736,55 @@ static void setup_ide_device(ide_controller *ctrl, ide_device *dev, uint8 id) {
       dev->total_sectors_when_using_CHS =
           (CAST(uint32, ident[58]) << 16) + ident[57];
     }
+
+    // Words 100 to 103 are the capacity with 48 bit LBAs
+
+    if ((ident[83] & (1 << 10)) && (ident[86] & (1 << 10))) {
+      dev->lba48 = TRUE;
+
+      if (ident[102] != 0 || ident[103] != 0)
+        dev->total_sectors = 0xffffffff; // as much as a 32 bit LBA reaches
+      else
+        dev->total_sectors = (CAST(uint32, ident[101]) << 16) + ident[100];
+    }
+
+    // Transfer up to the maximum number of sectors per interrupt with
+    // READ/WRITE MULTIPLE
+
+    if ((ident[47] & 0xff) > 1) {
+      uint8 multiple = ident[47] & 0xff;
+
+      outb(multiple, base + IDE_SECT_COUNT_REG);
+      outb(IDE_SET_MULTIPLE_MODE_CMD, base + IDE_COMMAND_REG);
+
+      for (j = 1000000; j > 0; j--) // wait up to 1 second for a response
+      {
+        uint8 stat = inb(base + IDE_STATUS_REG);
+
+        if (!(stat & IDE_STATUS_BSY)) {
+          if (!(stat & IDE_STATUS_ERR))
+            dev->multiple = multiple;
+          break;
+        }
+
+        thread_sleep(1000); // 1 usec
+      }
+    }
+
+#ifdef USE_IDE_DMA
+
+    // Word 49 tells if the device supports DMA. The transfer mode
+    // itself was selected by the BIOS.
+
+    if (ctrl->bm_base != 0 && (ident[49] & (1 << 8))) {
+      uint16 bm = ctrl->bm_base;
+      dev->dma = TRUE;
+      outb(inb(bm + IDE_BM_STATUS_REG) |
+               (id == 0 ? IDE_BM_STATUS_DRV0_DMA : IDE_BM_STATUS_DRV1_DMA),
+           bm + IDE_BM_STATUS_REG);
+    }
+
+#endif
   }
 
 #if 0
@@ -858,20 +1254,20 @@ static void setup_ide_controller(ide_controller *ctrl, uint8 id) {
       candidates++;
   }
 
-  // setup command queue
+  // setup the request queues, a merged request is done with a single
+  // command
 
-  for (i = 0; i < MAX_NB_IDE_CMD_QUEUE_ENTRIES; i++) {
-    ide_cmd_queue_entry *entry = &ctrl->cmd_queue[i];
-    entry->id = i;
-    entry->next = i + 1;
-    entry->done = new_condvar(CAST(condvar *, kmalloc(sizeof(condvar))));
+  for (i = 0; i < IDE_DEVICES_PER_CONTROLLER; i++) {
+    ide_device *dev = &ctrl->device[i];
+    blk_queue_init(&dev->queue, ide_queue_start, dev,
+                   ide_transfer_count(dev, 0xffffffff));
   }
 
-  ctrl->cmd_queue[MAX_NB_IDE_CMD_QUEUE_ENTRIES - 1].next = -1;
-
-  ctrl->cmd_queue_freelist = 0;
-  ctrl->cmd_queue_condvar =
-      new_condvar(CAST(condvar *, kmalloc(sizeof(condvar))));
+  ctrl->cmd.req = NULL;
+  ctrl->cmd.drq_wait = FALSE;
+  ctrl->next_dev = 0;
+  ctrl->resetting = FALSE;
+  timer_init(&ctrl->poll);
 
   if (candidates > 0) {
     // enable interrupts
@@ -887,6 +1283,10 @@ void setup_ide() {
   uint32 i;
   uint32 j;
 
+#ifdef USE_IDE_DMA
+  setup_ide_bus_master();
+#endif
+
   for (i = 0; i < IDE_CONTROLLERS; i++)
     setup_ide_controller(&ide_mod.ide[i], i);
 
@@ -0,0 +1,338 @@
+// file: "pci.cpp"
+
+//-----------------------------------------------------------------------------
+
+#include "asm.h"
+#include "pci.h"
+#include "rtlib.h"
+#include "thread.h"
+
+//-----------------------------------------------------------------------------
+
+#define PCI_ADDRESS(fn, reg)                                                   \
+  (PCI_CONFIG_ENABLE | (CAST(uint32, (fn)->bus) << 16) |                       \
+   (CAST(uint32, (fn)->device) << 11) | (CAST(uint32, (fn)->function) << 8) |  \
+   ((reg)&0xfc))
+
+// The address and data ports must be used as a pair, so an interrupt
+// handler touching the configuration space must not come in between.
+
+uint32 pci_read_config_dword(pci_function *fn, uint8 reg) {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+  uint32 val;
+
+  CLI();
+  outl(PCI_ADDRESS(fn, reg), PCI_CONFIG_ADDRESS);
+  val = inl(PCI_CONFIG_DATA);
+  if (enabled)
+    STI();
+
+  return val;
+}
+
+uint16 pci_read_config_word(pci_function *fn, uint8 reg) {
+  return pci_read_config_dword(fn, reg) >> ((reg & 2) * 8);
+}
+
+uint8 pci_read_config_byte(pci_function *fn, uint8 reg) {
+  return pci_read_config_dword(fn, reg) >> ((reg & 3) * 8);
+}
+
+void pci_write_config_dword(pci_function *fn, uint8 reg, uint32 val) {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+
+  CLI();
+  outl(PCI_ADDRESS(fn, reg), PCI_CONFIG_ADDRESS);
+  outl(val, PCI_CONFIG_DATA);
+  if (enabled)
+    STI();
+}
+
+void pci_write_config_word(pci_function *fn, uint8 reg, uint16 val) {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+
+  CLI();
+  outl(PCI_ADDRESS(fn, reg), PCI_CONFIG_ADDRESS);
+  outw(val, PCI_CONFIG_DATA + (reg & 2));
+  if (enabled)
+    STI();
+}
+
+// The functions are enumerated once, at boot, so that the drivers
+// don't scan the whole configuration space on every lookup.
+
+static pci_device pci_devices[PCI_MAX_DEVICES];
+static uint32 pci_nb_devices;
+
+uint32 pci_device_count() { return pci_nb_devices; }
+
+pci_device *pci_device_at(uint32 index) {
+  return (index < pci_nb_devices) ? &pci_devices[index] : NULL;
+}
+
+pci_device *pci_lookup(pci_function *fn) {
+  for (uint32 i = 0; i < pci_nb_devices; i++) {
+    pci_device *dev = &pci_devices[i];
+    if (dev->fn.bus == fn->bus && dev->fn.device == fn->device &&
+        dev->fn.function == fn->function)
+      return dev;
+  }
+
+  return NULL;
+}
+
+// Find the index-th function for which match is TRUE
+static bool pci_find(bool (*match)(pci_device *dev, uint32 a, uint32 b),
+                     uint32 a, uint32 b, uint32 index, pci_function *fn) {
+  for (uint32 i = 0; i < pci_nb_devices; i++) {
+    if (match(&pci_devices[i], a, b) && index-- == 0) {
+      *fn = pci_devices[i].fn;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static bool pci_match_class(pci_device *dev, uint32 class_code,
+                            uint32 subclass_code) {
+  return dev->class_code == class_code && dev->subclass_code == subclass_code;
+}
+
+static bool pci_match_device(pci_device *dev, uint32 vendor_id,
+                             uint32 device_id) {
+  return dev->vendor_id == vendor_id && dev->device_id == device_id;
+}
+
+bool pci_find_class(uint8 class_code, uint8 subclass_code, uint32 index,
+                    pci_function *fn) {
+  return pci_find(pci_match_class, class_code, subclass_code, index, fn);
+}
+
+bool pci_find_device(uint16 vendor_id, uint16 device_id, uint32 index,
+                     pci_function *fn) {
+  return pci_find(pci_match_device, vendor_id, device_id, index, fn);
+}
+
+uint8 pci_find_capability(pci_function *fn, uint8 cap_id, uint8 after) {
+  uint8 reg;
+  uint32 limit = 48; // protects against a looping list
+
+  if (after == 0) {
+    if (!(pci_read_config_word(fn, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+      return 0;
+    reg = pci_read_config_byte(fn, PCI_CAPABILITY_LIST);
+  } else {
+    reg = pci_read_config_byte(fn, after + PCI_CAP_NEXT);
+  }
+
+  while (reg >= 0x40 && limit-- > 0) {
+    reg &= ~3;
+    if (pci_read_config_byte(fn, reg + PCI_CAP_ID) == cap_id)
+      return reg;
+    reg = pci_read_config_byte(fn, reg + PCI_CAP_NEXT);
+  }
+
+  return 0;
+}
+
+volatile uint8 *pci_bar_address(pci_function *fn, uint8 bar) {
+  pci_device *dev = pci_lookup(fn);
+  pci_bar *b;
+
+  if (dev == NULL || bar >= PCI_BARS)
+    return NULL;
+
+  b = &dev->bar[bar];
+
+  if (b->base == 0 || (b->flags & PCI_BAR_IO) ||
+      b->base + b->size > CAST(uint64, 1) << 32)
+    return NULL;
+
+  return CAST(volatile uint8 *, CAST(uint32, b->base));
+}
+
+void pci_enable_bus_master(pci_function *fn) {
+  pci_device *dev = pci_lookup(fn);
+  uint16 cmd = pci_read_config_word(fn, PCI_COMMAND);
+
+  cmd |= PCI_COMMAND_MASTER;
+
+  if (dev == NULL)
+    cmd |= PCI_COMMAND_IO | PCI_COMMAND_MEM;
+  else
+    for (uint32 i = 0; i < PCI_BARS; i++)
+      if (dev->bar[i].base != 0)
+        cmd |= (dev->bar[i].flags & PCI_BAR_IO) ? PCI_COMMAND_IO
+                                                : PCI_COMMAND_MEM;
+
+  pci_write_config_word(fn, PCI_COMMAND, cmd);
+}
+
+bool pci_enable_msi(pci_function *fn, intr_handler handler, void *data) {
+  pci_device *dev = pci_lookup(fn);
+  uint32 address;
+  uint16 msg;
+  uint16 flags;
+  uint8 cap;
+
+  if (dev == NULL || dev->msi == 0 ||
+      !intr_add_msi_handler(handler, data, &address, &msg))
+    return FALSE;
+
+  cap = dev->msi;
+  flags = pci_read_config_word(fn, cap + PCI_MSI_FLAGS);
+
+  pci_write_config_dword(fn, cap + PCI_MSI_ADDRESS_LO, address);
+
+  if (flags & PCI_MSI_FLAGS_64BIT) {
+    pci_write_config_dword(fn, cap + PCI_MSI_ADDRESS_HI, 0);
+    pci_write_config_word(fn, cap + PCI_MSI_DATA_64, msg);
+  } else {
+    pci_write_config_word(fn, cap + PCI_MSI_DATA_32, msg);
+  }
+
+  flags &= ~PCI_MSI_FLAGS_QSIZE; // a single vector
+  flags |= PCI_MSI_FLAGS_ENABLE;
+
+  pci_write_config_word(fn, cap + PCI_MSI_FLAGS, flags);
+
+  pci_write_config_word(fn, PCI_COMMAND,
+                        pci_read_config_word(fn, PCI_COMMAND) |
+                            PCI_COMMAND_INTX_DISABLE);
+
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+
+// The size of a BAR is found by writing all ones to it: the address
+// bits that stay 0 are those within the region. The decoding is turned
+// off meanwhile so that the device doesn't answer at that address.
+static void pci_decode_bars(pci_device *dev) {
+  pci_function *fn = &dev->fn;
+  uint16 cmd = pci_read_config_word(fn, PCI_COMMAND);
+  uint32 nb_bars;
+
+  switch (dev->header_type & PCI_HEADER_TYPE_MASK) {
+  case PCI_HEADER_TYPE_NORMAL:
+    nb_bars = 6;
+    break;
+  case PCI_HEADER_TYPE_BRIDGE:
+    nb_bars = 2;
+    break;
+  default:
+    nb_bars = 0;
+    break;
+  }
+
+  pci_write_config_word(fn, PCI_COMMAND,
+                        cmd & ~(PCI_COMMAND_IO | PCI_COMMAND_MEM));
+
+  for (uint32 i = 0; i < nb_bars; i++) {
+    uint8 reg = PCI_BASE_ADDRESS_0 + i * 4;
+    uint32 val = pci_read_config_dword(fn, reg);
+    uint32 mask;
+    pci_bar *bar = &dev->bar[i];
+
+    pci_write_config_dword(fn, reg, 0xffffffff);
+    mask = pci_read_config_dword(fn, reg);
+    pci_write_config_dword(fn, reg, val);
+
+    if (val & PCI_BASE_ADDRESS_SPACE_IO) {
+      mask &= PCI_BASE_ADDRESS_IO_MASK;
+      if (mask == 0)
+        continue;
+      bar->flags = PCI_BAR_IO;
+      bar->base = val & PCI_BASE_ADDRESS_IO_MASK;
+      bar->size = (~mask + 1) & 0xffff; // the upper bits may not stick
+    } else {
+      uint64 base = val & PCI_BASE_ADDRESS_MEM_MASK;
+      uint64 m = mask & PCI_BASE_ADDRESS_MEM_MASK;
+
+      if ((val & PCI_BASE_ADDRESS_MEM_TYPE_64) && i + 1 < nb_bars) {
+        uint32 hi = pci_read_config_dword(fn, reg + 4);
+
+        pci_write_config_dword(fn, reg + 4, 0xffffffff);
+        m |= CAST(uint64, pci_read_config_dword(fn, reg + 4)) << 32;
+        pci_write_config_dword(fn, reg + 4, hi);
+
+        base |= CAST(uint64, hi) << 32;
+        bar->flags = PCI_BAR_MEM64;
+        i++; // the upper half of the address
+      } else {
+        m |= CAST(uint64, 0xffffffff) << 32;
+        bar->flags = 0;
+      }
+
+      if (CAST(uint32, m) == 0)
+        continue;
+
+      if (val & PCI_BASE_ADDRESS_MEM_PREFETCH)
+        bar->flags |= PCI_BAR_PREFETCH;
+
+      bar->base = base;
+      bar->size = ~m + 1;
+    }
+  }
+
+  pci_write_config_word(fn, PCI_COMMAND, cmd);
+}
+
+static void pci_add_device(pci_function *fn) {
+  pci_device *dev;
+
+  if (pci_nb_devices == PCI_MAX_DEVICES)
+    return;
+
+  dev = &pci_devices[pci_nb_devices++];
+
+  memset(dev, 0, sizeof(pci_device));
+
+  dev->fn = *fn;
+  dev->vendor_id = pci_read_config_word(fn, PCI_VENDOR_ID);
+  dev->device_id = pci_read_config_word(fn, PCI_DEVICE_ID);
+  dev->class_code = pci_read_config_byte(fn, PCI_CLASS_CODE);
+  dev->subclass_code = pci_read_config_byte(fn, PCI_SUBCLASS_CODE);
+  dev->prog_if = pci_read_config_byte(fn, PCI_PROG_IF);
+  dev->revision = pci_read_config_byte(fn, PCI_REVISION);
+  dev->header_type = pci_read_config_byte(fn, PCI_HEADER_TYPE);
+  dev->irq = pci_read_config_byte(fn, PCI_INTERRUPT_LINE);
+  dev->msi = pci_find_capability(fn, PCI_CAP_ID_MSI, 0);
+
+  pci_decode_bars(dev);
+}
+
+void setup_pci() {
+  pci_function fn;
+
+  pci_nb_devices = 0;
+
+  for (uint32 bus = 0; bus < PCI_BUSES; bus++) {
+    for (uint32 dev = 0; dev < PCI_DEVICES_PER_BUS; dev++) {
+      for (uint32 func = 0; func < PCI_FUNCTIONS_PER_DEVICE; func++) {
+        fn.bus = bus;
+        fn.device = dev;
+        fn.function = func;
+
+        if (pci_read_config_word(&fn, PCI_VENDOR_ID) == PCI_VENDOR_NONE) {
+          if (func == 0)
+            break; // no device in this slot
+          continue;
+        }
+
+        pci_add_device(&fn);
+
+        if (func == 0 && !(pci_read_config_byte(&fn, PCI_HEADER_TYPE) &
+                           PCI_HEADER_TYPE_MULTI_FN))
+          break; // single function device
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,517 @@
+// file: "virtio.cpp"
+
+//-----------------------------------------------------------------------------
+
+#include "asm.h"
+#include "disk.h"
+#include "intr.h"
+#include "pci.h"
+#include "rtlib.h"
+#include "term.h"
+#include "thread.h"
+#include "virtio.h"
+
+//-----------------------------------------------------------------------------
+
+#ifdef USE_VIRTIO_BLK
+
+typedef struct virtio_module_struct {
+  virtio_blk_device blk[VIRTIO_BLK_DEVICES];
+  uint32 nb_blk;
+} virtio_module;
+
+static virtio_module virtio_mod;
+
+#define VIRTIO_COMMON8(dev, reg)                                               \
+  (*CAST(volatile uint8 *, (dev)->common + (reg)))
+#define VIRTIO_COMMON16(dev, reg)                                              \
+  (*CAST(volatile uint16 *, (dev)->common + (reg)))
+#define VIRTIO_COMMON32(dev, reg)                                              \
+  (*CAST(volatile uint32 *, (dev)->common + (reg)))
+
+// Stores are seen in program order on x86, so the device can't see the
+// index of the available ring before the entries. Only the compiler
+// must be kept from moving the stores.
+#define VIRTIO_BARRIER() __asm__ __volatile__("" : : : "memory")
+
+//-----------------------------------------------------------------------------
+
+// Transport
+
+static uint8 virtio_get_status(virtio_blk_device *dev) {
+  if (dev->modern)
+    return VIRTIO_COMMON8(dev, VIRTIO_PCI_COMMON_STATUS);
+  return inb(dev->io_base + VIRTIO_PCI_STATUS);
+}
+
+static void virtio_set_status(virtio_blk_device *dev, uint8 status) {
+  if (dev->modern)
+    VIRTIO_COMMON8(dev, VIRTIO_PCI_COMMON_STATUS) = status;
+  else
+    outb(status, dev->io_base + VIRTIO_PCI_STATUS);
+}
+
+static void virtio_add_status(virtio_blk_device *dev, uint8 status) {
+  virtio_set_status(dev, virtio_get_status(dev) | status);
+}
+
+static void virtio_reset(virtio_blk_device *dev) {
+  virtio_set_status(dev, 0);
+
+  // A modern device may take some time to reset
+
+  for (uint32 i = 0; i < 1000 && virtio_get_status(dev) != 0; i++)
+    thread_sleep(1000000); // 1 msec
+}
+
+static uint8 virtio_read_isr(virtio_blk_device *dev) {
+  if (dev->modern)
+    return *dev->isr;
+  return inb(dev->io_base + VIRTIO_PCI_ISR);
+}
+
+static uint32 virtio_read_config_dword(virtio_blk_device *dev, uint32 reg) {
+  if (dev->modern)
+    return *CAST(volatile uint32 *, dev->device_cfg + reg);
+  return inl(dev->io_base + VIRTIO_PCI_CONFIG + reg);
+}
+
+// Locate the structures of the modern transport
+static bool virtio_find_modern(virtio_blk_device *dev) {
+  pci_function *fn = &dev->fn;
+  uint8 cap = 0;
+
+  dev->common = NULL;
+  dev->isr = NULL;
+  dev->device_cfg = NULL;
+  dev->notify_base = NULL;
+
+  while ((cap = pci_find_capability(fn, PCI_CAP_ID_VENDOR, cap)) != 0) {
+    uint8 type = pci_read_config_byte(fn, cap + VIRTIO_PCI_CAP_CFG_TYPE);
+    uint8 bar = pci_read_config_byte(fn, cap + VIRTIO_PCI_CAP_BAR);
+    volatile uint8 *base = pci_bar_address(fn, bar);
+
+    if (base == NULL)
+      continue;
+
+    base += pci_read_config_dword(fn, cap + VIRTIO_PCI_CAP_OFFSET);
+
+    // The first capability of each type is the preferred one
+
+    switch (type) {
+    case VIRTIO_PCI_CAP_COMMON_CFG:
+      if (dev->common == NULL)
+        dev->common = base;
+      break;
+    case VIRTIO_PCI_CAP_NOTIFY_CFG:
+      if (dev->notify_base == NULL) {
+        dev->notify_base = base;
+        dev->notify_mult =
+            pci_read_config_dword(fn, cap + VIRTIO_PCI_CAP_NOTIFY_MULT);
+      }
+      break;
+    case VIRTIO_PCI_CAP_ISR_CFG:
+      if (dev->isr == NULL)
+        dev->isr = base;
+      break;
+    case VIRTIO_PCI_CAP_DEVICE_CFG:
+      if (dev->device_cfg == NULL)
+        dev->device_cfg = base;
+      break;
+    }
+  }
+
+  return dev->common != NULL && dev->isr != NULL && dev->device_cfg != NULL &&
+         dev->notify_base != NULL;
+}
+
+static bool virtio_negotiate(virtio_blk_device *dev) {
+  uint32 features;
+
+  if (dev->modern) {
+    VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_DFSELECT) = 1;
+    if (!(VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_DF) &
+          (1 << (VIRTIO_F_VERSION_1 - 32))))
+      return FALSE;
+    VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_DFSELECT) = 0;
+    features = VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_DF);
+  } else {
+    features = inl(dev->io_base + VIRTIO_PCI_HOST_FEATURES);
+  }
+
+  features &= 1 << VIRTIO_BLK_F_FLUSH;
+  dev->flush = features != 0;
+
+  if (!dev->modern) {
+    outl(features, dev->io_base + VIRTIO_PCI_GUEST_FEATURES);
+    return TRUE;
+  }
+
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_GFSELECT) = 0;
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_GF) = features;
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_GFSELECT) = 1;
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_GF) = 1 << (VIRTIO_F_VERSION_1 - 32);
+
+  virtio_add_status(dev, VIRTIO_STATUS_FEATURES_OK);
+
+  return (virtio_get_status(dev) & VIRTIO_STATUS_FEATURES_OK) != 0;
+}
+
+// Allocate the rings of the request queue, with the layout of the
+// legacy transport which also suits the modern one
+static bool virtio_setup_queue(virtio_blk_device *dev) {
+  uint16 size;
+  uint32 used_offset;
+  uint32 bytes;
+  uint8 *mem;
+
+  if (dev->modern) {
+    VIRTIO_COMMON16(dev, VIRTIO_PCI_COMMON_Q_SELECT) = 0;
+    size = VIRTIO_COMMON16(dev, VIRTIO_PCI_COMMON_Q_SIZE);
+    if (size > VIRTIO_BLK_MAX_QUEUE_SIZE) {
+      size = VIRTIO_BLK_MAX_QUEUE_SIZE;
+      VIRTIO_COMMON16(dev, VIRTIO_PCI_COMMON_Q_SIZE) = size;
+    }
+  } else {
+    outw(0, dev->io_base + VIRTIO_PCI_QUEUE_SEL);
+    size = inw(dev->io_base + VIRTIO_PCI_QUEUE_SIZE);
+  }
+
+  if (size < VIRTIO_BLK_DESC_PER_REQUEST || (size & (size - 1)) != 0)
+    return FALSE;
+
+  used_offset = size * sizeof(vring_desc) + sizeof(vring_avail) +
+                (size + 1) * sizeof(uint16);
+  used_offset = (used_offset + VIRTIO_PCI_VRING_ALIGN - 1) &
+                ~(VIRTIO_PCI_VRING_ALIGN - 1);
+  bytes = used_offset + sizeof(vring_used) + size * sizeof(vring_used_elem) +
+          sizeof(uint16);
+
+  dev->ring_mem = kmalloc(bytes + VIRTIO_PCI_VRING_ALIGN - 1);
+
+  if (dev->ring_mem == NULL)
+    return FALSE;
+
+  mem = CAST(uint8 *,
+             (CAST(uint32, dev->ring_mem) + VIRTIO_PCI_VRING_ALIGN - 1) &
+                 ~(VIRTIO_PCI_VRING_ALIGN - 1));
+
+  memset(mem, 0, bytes);
+
+  dev->queue_size = size;
+  dev->desc = CAST(volatile vring_desc *, mem);
+  dev->avail = CAST(volatile vring_avail *, mem + size * sizeof(vring_desc));
+  dev->used = CAST(volatile vring_used *, mem + used_offset);
+  dev->last_used = 0;
+
+  for (uint32 i = 0; i < size; i++)
+    dev->desc[i].next = i + 1;
+
+  dev->free_desc = 0;
+
+  // Each slot has the descriptors for a request of BLK_MAX_SEGMENTS
+  // segments, so there are always enough free ones when a slot is free
+
+  dev->nb_slots = size / VIRTIO_BLK_DESC_PER_REQUEST;
+
+  if (dev->nb_slots > VIRTIO_BLK_SLOTS)
+    dev->nb_slots = VIRTIO_BLK_SLOTS;
+
+  for (uint32 i = 0; i < dev->nb_slots; i++)
+    dev->slot[i].req = NULL;
+
+  if (!dev->modern) {
+    outl(CAST(uint32, mem) >> VIRTIO_PCI_QUEUE_ADDR_SHIFT,
+         dev->io_base + VIRTIO_PCI_QUEUE_PFN);
+    return TRUE;
+  }
+
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_Q_DESCLO) = CAST(uint32, dev->desc);
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_Q_DESCHI) = 0;
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_Q_AVAILLO) = CAST(uint32, dev->avail);
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_Q_AVAILHI) = 0;
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_Q_USEDLO) = CAST(uint32, dev->used);
+  VIRTIO_COMMON32(dev, VIRTIO_PCI_COMMON_Q_USEDHI) = 0;
+
+  dev->notify = CAST(volatile uint16 *,
+                     dev->notify_base +
+                         VIRTIO_COMMON16(dev, VIRTIO_PCI_COMMON_Q_NOFF) *
+                             dev->notify_mult);
+
+  VIRTIO_COMMON16(dev, VIRTIO_PCI_COMMON_Q_ENABLE) = 1;
+
+  return TRUE;
+}
+
+static void virtio_notify(virtio_blk_device *dev) {
+  VIRTIO_BARRIER();
+
+  if (dev->modern)
+    *dev->notify = 0;
+  else
+    outw(0, dev->io_base + VIRTIO_PCI_QUEUE_NOTIFY);
+}
+
+//-----------------------------------------------------------------------------
+
+// Requests
+
+// Place the request's chain of descriptors in the available ring
+static void virtio_blk_post(virtio_blk_device *dev, virtio_blk_slot *slot,
+                            blk_request *req) {
+  volatile vring_desc *d;
+  uint16 i = dev->free_desc;
+  uint16 data_flags = VRING_DESC_F_NEXT;
+
+  slot->req = req;
+  slot->head = i;
+  slot->status = VIRTIO_BLK_S_IOERR; // in case the device doesn't set it
+  slot->header.reserved = 0;
+
+  switch (req->op) {
+  case BLK_READ:
+    slot->header.type = VIRTIO_BLK_T_IN;
+    slot->header.sector = req->lba;
+    data_flags |= VRING_DESC_F_WRITE;
+    break;
+  case BLK_WRITE:
+    slot->header.type = VIRTIO_BLK_T_OUT;
+    slot->header.sector = req->lba;
+    break;
+  default:
+    slot->header.type = VIRTIO_BLK_T_FLUSH;
+    slot->header.sector = 0;
+    break;
+  }
+
+  d = &dev->desc[i];
+  d->addr = CAST(uint32, &slot->header);
+  d->len = sizeof(virtio_blk_header);
+  d->flags = VRING_DESC_F_NEXT;
+  i = d->next;
+
+  if (req->op != BLK_FLUSH) {
+    for (uint8 s = 0; s < req->nb_segments; s++) {
+      d = &dev->desc[i];
+      d->addr = CAST(uint32, req->segments[s].buf);
+      d->len = req->segments[s].count << VIRTIO_BLK_LOG2_SECTOR_SIZE;
+      d->flags = data_flags;
+      i = d->next;
+    }
+  }
+
+  d = &dev->desc[i];
+  d->addr = CAST(uint32, &slot->status);
+  d->len = 1;
+  d->flags = VRING_DESC_F_WRITE;
+
+  dev->free_desc = d->next;
+
+  dev->avail->ring[dev->avail->idx & (dev->queue_size - 1)] = slot->head;
+  VIRTIO_BARRIER();
+  dev->avail->idx++;
+}
+
+// Start as many requests as there are free slots. The device is
+// notified once for all of them.
+static void virtio_blk_start(virtio_blk_device *dev) {
+  bool posted = FALSE;
+
+  ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
+
+  for (;;) {
+    virtio_blk_slot *slot = NULL;
+    blk_request *req;
+
+    for (uint32 i = 0; i < dev->nb_slots; i++)
+      if (dev->slot[i].req == NULL) {
+        slot = &dev->slot[i];
+        break;
+      }
+
+    if (slot == NULL || (req = blk_queue_next(&dev->queue)) == NULL)
+      break;
+
+    // A device without a write cache has nothing to flush
+
+    if (req->op == BLK_FLUSH ? !dev->flush : req->count == 0) {
+      blk_complete(req, NO_ERROR);
+      continue;
+    }
+
+    virtio_blk_post(dev, slot, req);
+    posted = TRUE;
+  }
+
+  if (posted)
+    virtio_notify(dev);
+}
+
+static void virtio_blk_queue_start(blk_queue *q) {
+  virtio_blk_start(CAST(virtio_blk_device *, q->driver_data));
+}
+
+// Complete the requests that the device has returned
+static void virtio_blk_reap(virtio_blk_device *dev) {
+  while (dev->last_used != dev->used->idx) {
+    VIRTIO_BARRIER();
+
+    volatile vring_used_elem *e =
+        &dev->used->ring[dev->last_used & (dev->queue_size - 1)];
+    uint16 head = e->id;
+    uint16 last = head;
+    virtio_blk_slot *slot = NULL;
+    blk_request *req;
+
+    dev->last_used++;
+
+    for (uint32 i = 0; i < dev->nb_slots; i++)
+      if (dev->slot[i].req != NULL && dev->slot[i].head == head) {
+        slot = &dev->slot[i];
+        break;
+      }
+
+    if (slot == NULL)
+      continue; // not a chain we posted
+
+    while (dev->desc[last].flags & VRING_DESC_F_NEXT)
+      last = dev->desc[last].next;
+
+    dev->desc[last].next = dev->free_desc;
+    dev->free_desc = head;
+
+    req = slot->req;
+    slot->req = NULL;
+
+    switch (slot->status) {
+    case VIRTIO_BLK_S_OK:
+      blk_complete(req, NO_ERROR);
+      break;
+    case VIRTIO_BLK_S_UNSUPP:
+      blk_complete(req, UNIMPL_ERROR);
+      break;
+    default:
+      blk_complete(req, UNKNOWN_ERROR);
+      break;
+    }
+  }
+}
+
+static void virtio_blk_irq(void *data) {
+  virtio_blk_device *dev = CAST(virtio_blk_device *, data);
+
+  // Reading the ISR status deasserts the interrupt
+
+  if (!(virtio_read_isr(dev) & VIRTIO_ISR_QUEUE))
+    return; // another device on the IRQ or a configuration change
+
+  virtio_blk_reap(dev);
+  virtio_blk_start(dev);
+}
+
+//-----------------------------------------------------------------------------
+
+static bool setup_virtio_blk_device(virtio_blk_device *dev, pci_function *fn,
+                                    bool modern_only) {
+  uint32 bar = pci_read_config_dword(fn, PCI_BASE_ADDRESS_0);
+  uint64 capacity;
+
+  dev->fn = *fn;
+  dev->irq = pci_read_config_byte(fn, PCI_INTERRUPT_LINE);
+  dev->ring_mem = NULL;
+
+  pci_enable_bus_master(fn);
+
+  dev->modern = virtio_find_modern(dev);
+
+  if (!dev->modern) {
+    if (modern_only || !(bar & PCI_BASE_ADDRESS_SPACE_IO))
+      return FALSE;
+    dev->io_base = bar & PCI_BASE_ADDRESS_IO_MASK;
+  }
+
+  virtio_reset(dev);
+  virtio_add_status(dev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+  if (!virtio_negotiate(dev) || !virtio_setup_queue(dev) ||
+      !intr_add_handler(dev->irq, virtio_blk_irq, dev)) {
+    virtio_add_status(dev, VIRTIO_STATUS_FAILED);
+    if (dev->ring_mem != NULL)
+      kfree(dev->ring_mem);
+    return FALSE;
+  }
+
+  capacity = virtio_read_config_dword(dev, VIRTIO_BLK_CFG_CAPACITY) |
+             (CAST(uint64, virtio_read_config_dword(
+                               dev, VIRTIO_BLK_CFG_CAPACITY + 4))
+              << 32);
+
+  dev->total_sectors =
+      (capacity > 0xffffffff) ? 0xffffffff : CAST(uint32, capacity);
+
+  blk_queue_init(&dev->queue, virtio_blk_queue_start, dev,
+                 VIRTIO_BLK_MAX_COUNT);
+
+  virtio_add_status(dev, VIRTIO_STATUS_DRIVER_OK);
+
+#ifdef SHOW_VIRTIO_INFO
+  term_write(cout, "virtio-blk");
+  term_write(cout, dev->id);
+  term_write(cout, dev->modern ? " modern" : " legacy");
+  term_write(cout, " irq ");
+  term_write(cout, dev->irq);
+  term_write(cout, " queue ");
+  term_write(cout, dev->queue_size);
+  term_write(cout, " ");
+  term_write(cout, dev->total_sectors >> (20 - VIRTIO_BLK_LOG2_SECTOR_SIZE));
+  term_write(cout, "MB\n");
+#endif
+
+  return TRUE;
+}
+
+void setup_virtio_blk() {
+  static const struct {
+    uint16 device_id;
+    bool modern_only;
+  } ids[] = {{VIRTIO_PCI_DEVICE_BLK_TRANSITIONAL, FALSE},
+             {VIRTIO_PCI_DEVICE_BLK_MODERN, TRUE}};
+  pci_function fn;
+
+  virtio_mod.nb_blk = 0;
+
+  for (uint32 k = 0; k < sizeof(ids) / sizeof(ids[0]); k++) {
+    for (uint32 i = 0;
+         virtio_mod.nb_blk < VIRTIO_BLK_DEVICES &&
+         pci_find_device(VIRTIO_PCI_VENDOR_ID, ids[k].device_id, i, &fn);
+         i++) {
+      virtio_blk_device *dev = &virtio_mod.blk[virtio_mod.nb_blk];
+
+      dev->id = virtio_mod.nb_blk;
+
+      if (!setup_virtio_blk_device(dev, &fn, ids[k].modern_only))
+        continue;
+
+      virtio_mod.nb_blk++;
+
+      disk *d = disk_alloc();
+      if (d != NULL) {
+        d->kind = DISK_VIRTIO;
+        d->log2_sector_size = VIRTIO_BLK_LOG2_SECTOR_SIZE;
+        d->partition_type = 0;
+        d->partition_path = 0;
+        d->partition_start = 0;
+        d->partition_length = dev->total_sectors;
+        d->_.virtio.dev = dev;
+      }
+    }
+  }
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -4,7 +4,8 @@
 #include "term.h"
 
 #define block_used(b) (1 == ((b)->head.parts.used))
-#define block_size(b) ((b)->head.sz & 0x7fffffff)
+// The used bit is the lowest bit of the size, which is a multiple of 4
+#define block_size(b) ((b)->head.sz & ~CAST(uint32, 3))
 #define MIN_SPLIT_DELTA 512
 
 // The kernel heap
@@ -14,11 +15,41 @@ heap appheap;
 
 static const uint32 block_size = sizeof(block);
 
+// Object sizes of the slab caches. Between powers of two, a middle
+// class keeps the internal fragmentation under 33%.
+static const uint32 slab_class_sizes[SLAB_CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+    4096};
+
+// Maps ((size - 1) / SLAB_MIN_SIZE) to the smallest class that fits
+static uint8 slab_class_of[SLAB_MAX_SIZE / SLAB_MIN_SIZE];
+
+static void setup_slab_classes() {
+  uint8 c = 0;
+  for (uint32 i = 0; i < SLAB_MAX_SIZE / SLAB_MIN_SIZE; ++i) {
+    while ((i + 1) * SLAB_MIN_SIZE > slab_class_sizes[c]) {
+      c++;
+    }
+    slab_class_of[i] = c;
+  }
+}
+
 void heap_init(heap *h, void *start, size_t size) {
   h->start = start;
   h->size = size;
   h->alloc = 0;
   h->f = h->l = h->ff = h->lf = NULL;
+
+  if (0 == slab_class_of[SLAB_MAX_SIZE / SLAB_MIN_SIZE - 1]) {
+    setup_slab_classes();
+  }
+
+  for (uint8 i = 0; i < SLAB_CLASS_COUNT; ++i) {
+    slab_cache *c = &h->caches[i];
+    c->obj_size = slab_class_sizes[i];
+    c->per_slab = (SLAB_SIZE - sizeof(slab)) / (c->obj_size + sizeof(uint32));
+    c->partial = c->empty = NULL;
+  }
 }
 
 static void *heap_sbrk(heap *h, int32 size) {
@@ -178,7 +209,12 @@ static void mark_as_free(heap *h, block *bk) {
 
   if (NULL == scout) { // we are the first one
     block *old_first = h->ff;
-    old_first->tail.free.prev = bk;
+    if (NULL != old_first) {
+      old_first->tail.free.prev = bk;
+    } else {
+      // the free list was empty
+      h->lf = bk;
+    }
     bk->tail.free.next = old_first;
     h->ff = bk;
   } else {
@@ -216,16 +252,17 @@ static block *get_block(heap *h, size_t sz) {
   return blk;
 }
 
+// Merge leftmost with the `until` blocks that follow it
 static block *merge(heap *h, block *leftmost, uint8 until) {
   block *scout = leftmost;
   block *left_bound = leftmost->prev;
   block *right_bound = NULL;
   size_t nsize = 0;
-  for (uint8 i = 0; i < until; ++i) {
+  for (uint8 i = 0; i <= until; ++i) {
     if (!block_used(scout)) {
       detach(h, scout);
     }
-    nsize += block_size + scout->head.sz - (2 * sizeof(block *));
+    nsize += block_size + block_size(scout) - (2 * sizeof(block *));
     scout = scout->next;
   }
 
@@ -254,7 +291,7 @@ static block *merge(heap *h, block *leftmost, uint8 until) {
   return leftmost;
 }
 
-void heap_free(heap *h, void *ptr) {
+static void block_free(heap *h, void *ptr) {
   block *bk = get_block_ptr(ptr);
 
   block *left = bk->prev;
@@ -276,7 +313,7 @@ void heap_free(heap *h, void *ptr) {
 
 #define MIN_ALLOC_SIZE (2 * sizeof(void *))
 
-void *heap_malloc(heap *h, size_t size) {
+static void *block_malloc(heap *h, size_t size) {
 
   if (size < MIN_ALLOC_SIZE) {
     size = MIN_ALLOC_SIZE;
@@ -297,6 +334,295 @@ void *heap_malloc(heap *h, size_t size) {
   return ptr;
 }
 
+// Bytes of a block that are not part of its data section
+#define BLOCK_OVERHEAD (sizeof(block) - 2 * sizeof(void *))
+
+// Give back the end of a used block if it is big enough to be reused
+static void trim_block(heap *h, block *bk, size_t sz) {
+  if (block_size(bk) >= MIN_SPLIT_DELTA + sz) {
+    block *other_half = split(h, bk, sz);
+    bk->head.parts.used = 1;
+    other_half->head.parts.used = 1;
+    // Freeing it merges it with the next block if that one is free
+    block_free(h, get_data_ptr(other_half));
+  }
+}
+
+// Grow the block in place, first by taking the following block if it
+// is free and then, for the last block, by moving the sbrk frontier
+static bool grow_block(heap *h, block *bk, size_t sz) {
+  block *right = bk->next;
+
+  if (NULL != right && !block_used(right)) {
+    merge(h, bk, 1);
+    bk->head.parts.used = 1;
+  }
+
+  if (block_size(bk) < sz && bk == h->l) {
+    size_t delta = sz - block_size(bk);
+    if (NULL != heap_sbrk(h, delta)) {
+      bk->head.sz += delta;
+    }
+  }
+
+  return block_size(bk) >= sz;
+}
+
+static void *block_realloc(heap *h, void *ptr, size_t size) {
+  block *bk = get_block_ptr(ptr);
+  size_t old_size = block_size(bk);
+
+  size = (size + 3) & ~CAST(size_t, 3);
+
+  if (size < MIN_ALLOC_SIZE) {
+    size = MIN_ALLOC_SIZE;
+  }
+
+  if (size <= old_size || grow_block(h, bk, size)) {
+    trim_block(h, bk, size);
+    return ptr;
+  }
+
+  void *nptr = block_malloc(h, size);
+
+  if (NULL != nptr) {
+    memcpy(nptr, ptr, old_size);
+    block_free(h, ptr);
+  }
+
+  return nptr;
+}
+
+static void *block_memalign(heap *h, size_t alignment, size_t size) {
+  size = (size + 3) & ~CAST(size_t, 3);
+
+  if (size < MIN_ALLOC_SIZE) {
+    size = MIN_ALLOC_SIZE;
+  }
+
+  // Leave room in front of the aligned data for a free block
+  size_t lead_min = BLOCK_OVERHEAD + MIN_ALLOC_SIZE;
+  void *ptr = block_malloc(h, size + alignment + lead_min);
+
+  if (NULL == ptr) {
+    return NULL;
+  }
+
+  uint8 *aligned =
+      CAST(uint8 *, (CAST(uint32, ptr) + lead_min + alignment - 1) &
+                        ~(alignment - 1));
+
+  block *bk = get_block_ptr(ptr);
+  block *abk = get_block_ptr(aligned);
+  size_t lead = CAST(uint8 *, abk) - CAST(uint8 *, bk);
+
+  // Cut the leading part off as its own block and release it
+  abk->head.sz = block_size(bk) - lead;
+  abk->head.parts.used = 1;
+  abk->prev = bk;
+  abk->next = bk->next;
+
+  if (NULL != bk->next) {
+    bk->next->prev = abk;
+  } else {
+    h->l = abk;
+  }
+
+  bk->next = abk;
+  bk->head.sz = lead - BLOCK_OVERHEAD;
+  bk->head.parts.used = 1;
+
+  block_free(h, ptr);
+  trim_block(h, abk, size);
+
+  return aligned;
+}
+
+//-----------------------------------------------------------------------------
+
+// Slab caches
+
+#define SLAB_TAG 1
+#define slab_header(ptr) (CAST(uint32 *, ptr)[-1])
+#define is_slab_object(ptr) (SLAB_TAG == (slab_header(ptr) & SLAB_TAG))
+
+static void partial_push(slab_cache *c, slab *s) {
+  s->prev = NULL;
+  s->next = c->partial;
+  if (NULL != c->partial) {
+    c->partial->prev = s;
+  }
+  c->partial = s;
+}
+
+static void partial_remove(slab_cache *c, slab *s) {
+  if (NULL != s->prev) {
+    s->prev->next = s->next;
+  } else {
+    c->partial = s->next;
+  }
+
+  if (NULL != s->next) {
+    s->next->prev = s->prev;
+  }
+
+  s->next = s->prev = NULL;
+}
+
+static slab *new_slab(heap *h, slab_cache *c) {
+  slab *s = c->empty;
+
+  if (NULL != s) {
+    c->empty = NULL;
+    return s;
+  }
+
+  s = CAST(slab *, block_malloc(h, SLAB_SIZE));
+
+  if (NULL == s) {
+    return NULL;
+  }
+
+  // Objects are carved lazily from the bump pointer so creating a slab
+  // does not depend on the number of objects it holds
+  s->cache = c;
+  s->next = s->prev = NULL;
+  s->free = NULL;
+  s->bump = CAST(uint8 *, s) + sizeof(slab);
+  s->inuse = 0;
+  s->carved = 0;
+
+  return s;
+}
+
+static void *slab_malloc(heap *h, size_t size) {
+  slab_cache *c = &h->caches[slab_class_of[(size - 1) / SLAB_MIN_SIZE]];
+  slab *s = c->partial;
+
+  if (NULL == s) {
+    if (NULL == (s = new_slab(h, c))) {
+      return NULL;
+    }
+    partial_push(c, s);
+  }
+
+  void *ptr;
+
+  if (NULL != s->free) {
+    ptr = s->free;
+    s->free = *CAST(void **, ptr);
+  } else {
+    uint8 *obj = s->bump;
+    s->bump += c->obj_size + sizeof(uint32);
+    s->carved++;
+    *CAST(uint32 *, obj) = CAST(uint32, s) | SLAB_TAG;
+    ptr = CAST(void *, obj + sizeof(uint32));
+  }
+
+  s->inuse++;
+
+  if (NULL == s->free && s->carved == c->per_slab) {
+    // The slab is full, it will come back on the partial list once an
+    // object is released
+    partial_remove(c, s);
+  }
+
+  return ptr;
+}
+
+static void slab_free(heap *h, void *ptr) {
+  slab *s = CAST(slab *, slab_header(ptr) & ~SLAB_TAG);
+  slab_cache *c = s->cache;
+
+  bool was_full = (NULL == s->free && s->carved == c->per_slab);
+
+  *CAST(void **, ptr) = s->free;
+  s->free = ptr;
+  s->inuse--;
+
+  if (was_full) {
+    partial_push(c, s);
+  }
+
+  if (0 == s->inuse) {
+    partial_remove(c, s);
+
+    if (NULL == c->empty) {
+      c->empty = s;
+    } else {
+      block_free(h, CAST(void *, s));
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void *heap_malloc(heap *h, size_t size) {
+#ifdef USE_SLAB_ALLOCATOR
+  if (size <= SLAB_MAX_SIZE) {
+    return slab_malloc(h, (0 == size) ? 1 : size);
+  }
+#endif
+  return block_malloc(h, size);
+}
+
+void heap_free(heap *h, void *ptr) {
+  if (NULL == ptr) {
+    return;
+  }
+
+  if (is_slab_object(ptr)) {
+    slab_free(h, ptr);
+  } else {
+    block_free(h, ptr);
+  }
+}
+
+void *heap_realloc(heap *h, void *ptr, size_t size) {
+  if (NULL == ptr) {
+    return heap_malloc(h, size);
+  }
+
+  if (0 == size) {
+    heap_free(h, ptr);
+    return NULL;
+  }
+
+  if (!is_slab_object(ptr)) {
+    return block_realloc(h, ptr, size);
+  }
+
+  slab *s = CAST(slab *, slab_header(ptr) & ~SLAB_TAG);
+  size_t obj_size = s->cache->obj_size;
+
+  if (size <= obj_size) {
+    return ptr;
+  }
+
+  void *nptr = heap_malloc(h, size);
+
+  if (NULL != nptr) {
+    memcpy(nptr, ptr, obj_size);
+    slab_free(h, ptr);
+  }
+
+  return nptr;
+}
+
+void *heap_memalign(heap *h, size_t alignment, size_t size) {
+  // Slab objects and blocks are word aligned
+  if (alignment <= sizeof(void *)) {
+    return heap_malloc(h, size);
+  }
+
+  return block_memalign(h, alignment, size);
+}
+
+#undef SLAB_TAG
+#undef slab_header
+#undef is_slab_object
 #undef block_used
 #undef block_size
 #undef MIN_SPLIT_DELTA
+#undef MIN_ALLOC_SIZE
+#undef BLOCK_OVERHEAD
@@ -0,0 +1,179 @@
+// file: "ahci.h"
+
+#ifndef __AHCI_H
+#define __AHCI_H
+
+//-----------------------------------------------------------------------------
+
+#include "blk.h"
+#include "general.h"
+#include "ide.h"
+#include "pci.h"
+
+//-----------------------------------------------------------------------------
+
+//
+// Definitions for the Advanced Host Controller Interface (AHCI) of
+// SATA controllers. ATA commands are sent to the devices as frame
+// information structures (FIS) and the data is moved by the controller
+// with DMA. Devices that support native command queuing (NCQ) get up
+// to 32 commands at once.
+//
+
+#define PCI_SUBCLASS_STORAGE_SATA 0x06
+#define AHCI_PROG_IF 0x01
+
+#define AHCI_CONTROLLERS 2
+#define AHCI_PORTS 8 // for all the controllers
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+
+#define AHCI_ABAR 5 // BAR of the registers
+
+// Generic host control registers, from the base of the ABAR (BAR 5)
+
+#define AHCI_CAP 0x00 // host capabilities
+#define AHCI_GHC 0x04 // global host control
+#define AHCI_IS 0x08  // interrupt status, a bit per port
+#define AHCI_PI 0x0c  // ports implemented
+
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1) // command slots
+#define AHCI_CAP_SSS (1 << 27)                        // staggered spin-up
+#define AHCI_CAP_SNCQ (1 << 30)                       // NCQ supported
+
+#define AHCI_GHC_IE (1 << 1)                // interrupt enable
+#define AHCI_GHC_AE (CAST(uint32, 1) << 31) // AHCI enable
+
+// Port registers, from the base of the port
+
+#define AHCI_PORT_BASE(port) (0x100 + (port)*0x80)
+
+#define AHCI_PxCLB 0x00  // command list base address
+#define AHCI_PxCLBU 0x04 // upper 32 bits
+#define AHCI_PxFB 0x08   // FIS base address
+#define AHCI_PxFBU 0x0c  // upper 32 bits
+#define AHCI_PxIS 0x10   // interrupt status
+#define AHCI_PxIE 0x14   // interrupt enable
+#define AHCI_PxCMD 0x18  // command and status
+#define AHCI_PxTFD 0x20  // task file data
+#define AHCI_PxSIG 0x24  // signature
+#define AHCI_PxSSTS 0x28 // SATA status
+#define AHCI_PxSCTL 0x2c // SATA control
+#define AHCI_PxSERR 0x30 // SATA error
+#define AHCI_PxSACT 0x34 // SATA active, a bit per queued command
+#define AHCI_PxCI 0x38   // command issue, a bit per command
+
+#define AHCI_PxCMD_ST (1 << 0)  // start processing the command list
+#define AHCI_PxCMD_SUD (1 << 1) // spin-up device
+#define AHCI_PxCMD_FRE (1 << 4) // FIS receive enable
+#define AHCI_PxCMD_FR (1 << 14) // FIS receive running
+#define AHCI_PxCMD_CR (1 << 15) // command list running
+
+#define AHCI_PxIS_DHRS (1 << 0)  // device to host register FIS
+#define AHCI_PxIS_PSS (1 << 1)   // PIO setup FIS
+#define AHCI_PxIS_DSS (1 << 2)   // DMA setup FIS
+#define AHCI_PxIS_SDBS (1 << 3)  // set device bits FIS
+#define AHCI_PxIS_DPS (1 << 5)   // descriptor processed
+#define AHCI_PxIS_INFS (1 << 26) // interface non-fatal error
+#define AHCI_PxIS_IFS (1 << 27)  // interface fatal error
+#define AHCI_PxIS_HBDS (1 << 28) // host bus data error
+#define AHCI_PxIS_HBFS (1 << 29) // host bus fatal error
+#define AHCI_PxIS_TFES (1 << 30) // task file error
+
+#define AHCI_PxIS_ERRORS                                                       \
+  (AHCI_PxIS_INFS | AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS |          \
+   AHCI_PxIS_TFES)
+
+#define AHCI_PxSSTS_DET_MASK 0xf
+#define AHCI_PxSSTS_DET_PRESENT 3 // device present and communicating
+
+#define AHCI_PxSCTL_DET_MASK 0xf
+#define AHCI_PxSCTL_DET_INIT 1 // COMRESET, resets the device
+
+#define AHCI_SIG_ATA 0x00000101
+
+// Command list, with a header per command slot
+
+typedef struct ahci_command_header_struct {
+  uint16 flags;          // FIS length in dwords, write, ...
+  uint16 prdtl;          // entries in the PRD table
+  volatile uint32 prdbc; // bytes transferred
+  uint32 ctba;           // command table base address, 128 byte aligned
+  uint32 ctbau;
+  uint32 reserved[4];
+} ahci_command_header;
+
+#define AHCI_CMD_FLAGS_CFL(dwords) (dwords)
+#define AHCI_CMD_FLAGS_WRITE (1 << 6)
+
+// Command table, with the command FIS and the PRD table
+
+#define AHCI_PRD_ENTRIES BLK_MAX_SEGMENTS
+#define AHCI_PRD_MAX_BYTES (CAST(uint32, 1) << 22)
+
+typedef struct ahci_prd_struct {
+  uint32 dba; // data base address, word aligned
+  uint32 dbau;
+  uint32 reserved;
+  uint32 dbc; // byte count - 1, bit 31 is interrupt on completion
+} ahci_prd;
+
+typedef struct ahci_command_table_struct {
+  uint8 cfis[64];
+  uint8 acmd[16];
+  uint8 reserved[48];
+  ahci_prd prdt[AHCI_PRD_ENTRIES];
+} ahci_command_table;
+
+#define AHCI_FIS_TYPE_REG_H2D 0x27
+#define AHCI_FIS_REG_H2D_DWORDS 5
+#define AHCI_FIS_REG_H2D_COMMAND (1 << 7)
+#define AHCI_FIS_DEVICE_LBA (1 << 6) // bit 7 would be FUA for queued commands
+
+#define AHCI_RECEIVED_FIS_SIZE 256
+
+// Largest request, so that a segment fits in a PRD entry
+#define AHCI_MAX_COUNT (AHCI_PRD_MAX_BYTES >> IDE_LOG2_SECTOR_SIZE)
+
+typedef struct ahci_controller_struct ahci_controller;
+
+typedef struct ahci_port_struct {
+  ahci_controller *ctrl;
+  uint8 id; // index of the port on the controller
+  volatile uint8 *regs;
+
+  ahci_command_header *cmd_list;
+  uint8 *received_fis;
+  ahci_command_table *tables; // one per slot
+  void *mem;
+
+  bool ncq;
+  bool lba48;
+  uint8 nb_slots;
+  uint32 issued; // slots with a command the controller hasn't finished
+  bool recovering; // from an error, nothing is issued meanwhile
+  uint8 retries;   // recoveries in a row that couldn't tell what failed
+  blk_request *req[AHCI_MAX_SLOTS];
+  uint32 total_sectors;
+
+  blk_queue queue;
+} ahci_port;
+
+struct ahci_controller_struct {
+  uint8 id;
+  pci_function fn;
+  uint8 irq;
+  volatile uint8 *abar;
+  uint32 cap;
+  ahci_port *port[AHCI_MAX_PORTS]; // NULL when the port isn't used
+};
+
+void setup_ahci();
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
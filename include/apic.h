@@ -77,6 +77,13 @@
 #define APIC_LVT_VECTOR_MASK 0xff
 
 #define APIC_LVTT_PERIODIC (1 << 17)
+#define APIC_LVTT_TSC_DEADLINE (2 << 17)
+#define APIC_LVTT_MODE_MASK (3 << 17)
+
+// Writing a TSC value arms the timer in TSC-deadline mode, writing 0
+// disarms it
+
+#define MSR_TSC_DEADLINE 0x6e0
 
 //-----------------------------------------------------------------------------
 
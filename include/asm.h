@@ -55,6 +55,13 @@
                        : "=a"(a), "=b"(b), "=c"(c), "=d"(d)                    \
                        : "0"(fn))
 
+// Same as cpuid, for the functions that take a subfunction in %ecx
+
+#define cpuid_count(fn, subfn, a, b, c, d)                                     \
+  __asm__ __volatile__(".byte 0x0f,0xa2"                                       \
+                       : "=a"(a), "=b"(b), "=c"(c), "=d"(d)                    \
+                       : "0"(fn), "2"(subfn))
+
 #define HAS_FPU (1 << 0)        // Floating Point Unit
 #define HAS_VME (1 << 1)        // V86 Mode Extensions
 #define HAS_DE (1 << 2)         // Debug Extensions
@@ -84,6 +91,14 @@
 #define HAS_ACC (1 << 29)       // Automatic clock control
 #define HAS_IA64 (1 << 30)      // IA64 instructions
 
+// Function 1, in %ecx
+
+#define HAS_TSC_DEADLINE (1 << 24) // APIC timer TSC-deadline mode
+
+// Function 7 (structured extended features), in %ebx
+
+#define HAS_ERMS (1 << 9) // Enhanced REP MOVSB/STOSB
+
 #define wrmsr(msr, val)                                                        \
   __asm__ __volatile__(".byte 0x0f,0x30" : : "A"(CAST(uint64, val)), "c"(msr))
 
@@ -0,0 +1,117 @@
+// file: "blk.h"
+
+#ifndef __BLK_H
+#define __BLK_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+//
+// Block request layer.
+//
+// A block device driver owns one request queue per device. Requests
+// are submitted from any context and completed by the driver, usually
+// from its interrupt handler, by calling the request's done function
+// with interrupts disabled: it must not block. Pending requests are
+// served in elevator order (C-LOOK) and a request that extends a
+// pending one is merged into it, so that the driver sees a single
+// scatter-gather transfer. A flush request is a barrier: the requests
+// submitted before it are done before it starts and the ones submitted
+// after it wait for it to finish.
+//
+// Apart from flushes, the ordering only covers pending requests. A
+// request that overlaps an earlier pending one is started after it, but
+// nothing holds it back for a request the driver has already taken: the
+// two can be in flight together and finish in either order. A caller
+// that needs a write done before another access to its sectors waits
+// for its completion first.
+//
+
+#define BLK_READ 0
+#define BLK_WRITE 1
+#define BLK_FLUSH 2
+
+#define BLK_MAX_SEGMENTS 16
+
+typedef struct blk_segment_struct {
+  void *buf;
+  uint32 count; // in sectors
+} blk_segment;
+
+typedef struct blk_request_struct blk_request;
+typedef struct blk_queue_struct blk_queue;
+
+typedef void (*blk_done_fn)(blk_request *req);
+typedef void (*blk_start_fn)(blk_queue *q);
+
+struct blk_request_struct {
+  blk_request *next;   // in the queue or in the list of merged requests
+  blk_request *merged; // requests completed along with this one
+  blk_queue *q;        // queue the request was submitted to
+  uint8 op;            // BLK_READ, BLK_WRITE or BLK_FLUSH
+  uint8 nb_segments;
+  uint32 lba;   // first sector, from the start of the device
+  uint32 count; // in sectors, grows when requests are merged in
+  blk_segment segments[BLK_MAX_SEGMENTS];
+  error_code err; // IN_PROGRESS until the request is done
+  blk_done_fn done;
+  void *data; // for the done function
+};
+
+struct blk_queue_struct {
+  blk_request *head; // pending requests in the order of submission
+  blk_request *tail;
+  uint32 position;  // sector following the last request started
+  uint32 max_count; // largest merged request
+  uint32 active;    // requests taken by the driver and not yet done
+  bool barrier;     // a flush is being done
+  uint8 plugged;    // the driver isn't started while > 0
+  blk_start_fn start;
+  void *driver_data;
+};
+
+void blk_queue_init(blk_queue *q, blk_start_fn start, void *driver_data,
+                    uint32 max_count);
+
+void blk_request_init(blk_request *req, uint8 op, uint32 lba, blk_done_fn done,
+                      void *data);
+
+// Append a buffer of count sectors to the request. Returns FALSE when
+// there are too many segments.
+bool blk_request_add(blk_request *req, void *buf, uint32 count);
+
+// Queue the request and start the driver if it is idle
+void blk_submit(blk_queue *q, blk_request *req);
+
+// Submit a request and wait until it is done. The done function and
+// data of the request are replaced.
+error_code blk_submit_wait(blk_queue *q, blk_request *req);
+
+// Hold back the driver while a batch of requests is submitted, to give
+// them a chance to be merged
+void blk_plug(blk_queue *q);
+void blk_unplug(blk_queue *q);
+
+// For drivers, with interrupts disabled: take the next request to
+// start, or NULL when there is none
+blk_request *blk_queue_next(blk_queue *q);
+
+// For drivers, with interrupts disabled: finish a request and the ones
+// merged with it
+void blk_complete(blk_request *req, error_code err);
+
+// For drivers, with interrupts disabled: give back a request that was
+// taken but not done, e.g. after the device was reset. It is the next
+// one started.
+void blk_requeue(blk_request *req);
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
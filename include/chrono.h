@@ -99,8 +99,10 @@ typedef struct time {
 #define time_to_pit_counts(x) ((x).n * PIT_COUNTS_PER_SEC / IRQ8_COUNTS_PER_SEC)
 
 #define time_to_apic_timer_counts(x)                                           \
-  ((x).n * _tsc_counts_per_sec * _cpu_bus_multiplier.den /                     \
-   (APIC_TIMER_DIVIDER * IRQ8_COUNTS_PER_SEC * _cpu_bus_multiplier.num))
+  ((x).n * _apic_timer_counts_per_sec / IRQ8_COUNTS_PER_SEC)
+
+#define time_to_tsc_counts(x)                                                  \
+  ((x).n * _tsc_counts_per_sec / IRQ8_COUNTS_PER_SEC)
 
 #define add_time(x, y)                                                         \
   ({                                                                           \
@@ -123,6 +125,11 @@ extern volatile uint64 _irq8_counter;
 extern time pos_infinity;
 extern time neg_infinity;
 
+#ifdef USE_APIC_FOR_TIMER
+extern uint32 _tsc_counts_per_sec;
+extern uint32 _apic_timer_counts_per_sec;
+#endif
+
 #endif
 
 #ifdef USE_TSC_FOR_TIME
@@ -172,6 +179,8 @@ typedef struct time {
   ((x).n * _cpu_bus_multiplier.den /                                           \
    (APIC_TIMER_DIVIDER * _cpu_bus_multiplier.num))
 
+#define time_to_tsc_counts(x) ((x).n)
+
 #define add_time(x, y)                                                         \
   ({                                                                           \
     time val;                                                                  \
@@ -194,6 +203,7 @@ extern time pos_infinity;
 extern time neg_infinity;
 
 #ifdef USE_APIC_FOR_TIMER
+extern uint32 _apic_timer_counts_per_sec;
 extern rational _cpu_bus_multiplier;
 #endif
 
@@ -11,8 +11,11 @@
 
 //-----------------------------------------------------------------------------
 
+#include "ahci.h"
+#include "blk.h"
 #include "general.h"
 #include "ide.h"
+#include "virtio.h"
 
 //-----------------------------------------------------------------------------
 
@@ -21,10 +24,13 @@
 //
 
 #define DISK_IDE 0
+#define DISK_VIRTIO 1
+#define DISK_AHCI 2
 #define MAX_NB_DISKS 32
 #define DISK_LOG2_BLOCK_SIZE 9
 
 void cache_block_maid_run();
+void cache_block_flusher_run();
 
 const struct {
   uint8 type;
@@ -105,7 +111,7 @@ const struct {
 
 typedef struct disk_struct {
   uint8 id;   // 0 to MAX_NB_DISKS-1
-  uint8 kind; // DISK_IDE is currently the only possibility
+  uint8 kind; // DISK_IDE, DISK_VIRTIO or DISK_AHCI
 
   uint8 log2_sector_size;
   uint8 partition_type;
@@ -117,6 +123,12 @@ typedef struct disk_struct {
     struct {
       ide_device *dev;
     } ide;
+    struct {
+      virtio_blk_device *dev;
+    } virtio;
+    struct {
+      ahci_port *port;
+    } ahci;
   } _;
 } disk;
 
@@ -135,7 +147,11 @@ typedef struct cache_block_struct {
   condvar *cv;
   error_code err;
   uint8 buf[1 << DISK_LOG2_BLOCK_SIZE];
+  time dirty_time; // when it became dirty
   uint8 dirty : 1;
+  uint8 readahead : 1; // read ahead and not acquired since
+  uint8 ra_stream;     // stream that read it ahead
+  uint8 queue;         // replacement queue it is in
 } cache_block;
 
 disk *disk_alloc();
@@ -149,19 +165,103 @@ void disk_print_id(disk *d);
 
 void disk_add_all_partitions();
 
+// Submit a request whose LBA is relative to the partition. The LBA is
+// made relative to the device.
+error_code disk_submit(disk *d, blk_request *req);
+error_code disk_submit_wait(disk *d, blk_request *req);
+
+// Requests submitted together and waited for as a group. The requests
+// use disk_batch_done as done function and the batch as data, pending
+// counts them.
+
+typedef struct disk_batch_struct {
+  uint32 pending;
+  error_code err; // of the last request that failed
+  condvar cv;
+} disk_batch;
+
+void disk_batch_init(disk_batch *batch);
+void disk_batch_done(blk_request *req);
+error_code disk_batch_wait(disk_batch *batch);
+
 error_code disk_read_sectors(disk *d, uint32 sector_pos, void *buf,
                              uint32 count);
 
 error_code disk_write_sectors(disk *d, uint32 sector_pos, void *sector_buff,
                               uint32 sector_count);
 
+// Write the dirty cache blocks of the device holding d and wait until
+// the device has them on its media
+error_code disk_flush(disk *d);
+
 error_code disk_cache_block_acquire(disk *d, uint32 sector_pos,
                                     cache_block **block);
 
 error_code disk_cache_block_release(cache_block *block);
 
+// Read sectors straight into buf, which must have an even address, without
+// going through the cache. The sectors that are in the cache are taken from
+// it since the media may not have them yet.
+error_code disk_read_direct(disk *d, uint32 sector_pos, void *buf,
+                            uint32 count);
+
+// Mark a block that was modified, with its lock held, so that it gets
+// written back
+void disk_cache_block_dirty(cache_block *block);
+
+typedef struct disk_cache_stats_struct {
+  uint32 nb_blocks;
+  uint32 nb_segments;
+  native_string policy; // "lru" or "2q"
+  uint32 hits;
+  uint32 misses;
+  uint32 main_hits;  // with 2Q, hits of blocks in the LRU list
+  uint32 ghost_hits; // with 2Q, misses of sectors recently evicted
+  uint32 lock_waits; // acquisitions of a segment lock that had to wait
+  uint64 lock_wait_usecs;
+  uint32 ra_blocks; // blocks read ahead
+  uint32 ra_hits;   // of those, the ones acquired
+  uint32 ra_wasted; // and the ones evicted without being acquired
+  uint32 nb_dirty;
+  uint32 wb_blocks; // dirty blocks written back
+  uint32 wb_writes; // write requests that wrote them
+  uint32 direct_reads;   // reads that bypassed the cache
+  uint32 direct_sectors; // sectors they read
+} disk_cache_stats;
+
+void disk_cache_get_stats(disk_cache_stats *stats);
+
+#ifdef DISK_CACHE_TRACE
+
+// The last sectors acquired from the cache, oldest first, to replay them
+// on the host with utils/cache_replay.py
+
+#define DISK_CACHE_TRACE_LEN 65536
+
+typedef struct disk_cache_trace_entry_struct {
+  uint32 disk_id;
+  uint32 sector_pos;
+} disk_cache_trace_entry;
+
+uint32 disk_cache_trace_length();
+void disk_cache_trace_at(uint32 i, disk_cache_trace_entry *entry);
+
+#endif
+
 void setup_disk();
 
+#ifdef DISK_BENCHMARK
+
+void disk_benchmark();
+
+#endif
+
+#ifdef DISK_CACHE_BENCHMARK
+
+void disk_cache_benchmark();
+
+#endif
+
 //-----------------------------------------------------------------------------
 
 #endif
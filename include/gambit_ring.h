@@ -0,0 +1,87 @@
+// file: "gambit_ring.h"
+
+// The shared memory through which the kernel passes interrupts to Gambit
+
+#ifndef __GAMBIT_RING_H
+#define __GAMBIT_RING_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+const uint32 GAMBIT_SHARED_MEM_LEN = 32768;
+const uint32 GAMBIT_SHARED_MEM_CMD = 33554432;
+
+/*
+ * Each kind of interrupt has its own single producer, single consumer
+ * ring in the shared memory. The kernel only moves the head and Gambit
+ * only moves the tail, so neither side needs a lock. Both indices are
+ * byte offsets in the data, which is a power of 2 in size, and the ring
+ * is full when the head is one byte behind the tail. The head and the
+ * tail are on different cache lines.
+ *
+ * A frame is | INTERRUPT NUMBER | SZ OF PARAMS | PARAM 0 | PARAM 1 | ...
+ * and may wrap around the end of the data.
+ *
+ * Keep these offsets in sync with ./scheme/interpreted/gambini.scm,
+ * utils/hosttest/ring_test checks that they are.
+ */
+typedef struct gambit_ring {
+  volatile uint32 head;    // next byte written by the kernel
+  volatile uint32 dropped; // frames discarded because the ring was full
+  uint8 _producer_pad[56];
+  volatile uint32 tail; // next byte read by Gambit
+  uint8 _consumer_pad[60];
+  uint8 data[];
+} gambit_ring;
+
+const uint32 GAMBIT_RING_HEADER_LEN = 128;
+
+const uint32 GAMBIT_FLOW_CONTROLLED_START = GAMBIT_SHARED_MEM_CMD;
+const uint32 GAMBIT_FLOW_CONTROLLED_LEN = 64;
+
+const uint32 GAMBIT_FLOW_UNCONTROLLED_START = GAMBIT_FLOW_CONTROLLED_START +
+                                              GAMBIT_RING_HEADER_LEN +
+                                              GAMBIT_FLOW_CONTROLLED_LEN;
+
+const uint32 GAMBIT_FLOW_UNCONTROLLED_LEN = 16384;
+
+// Append a frame to the ring of size bytes, or count it as dropped when
+// it doesn't fit. Returns TRUE when the frame was appended.
+static inline bool gambit_ring_put(gambit_ring *ring, uint32 size,
+                                   uint8 int_no, uint8 *params, uint8 len) {
+  uint32 mask = size - 1;
+  uint32 required_len = 2 + len; // number, size, + params
+  uint32 head = ring->head;
+  uint32 free = (ring->tail - head - 1) & mask;
+
+  if (required_len > free) {
+    // This should be avoided at all cost
+    ring->dropped++;
+    return FALSE;
+  }
+
+  ring->data[head] = int_no;
+  ring->data[(head + 1) & mask] = len;
+
+  for (uint8 i = 0; i < len; ++i) {
+    ring->data[(head + 2 + i) & mask] = params[i];
+  }
+
+  // The frame must be complete before Gambit can see it
+  __asm__ __volatile__("" : : : "memory");
+
+  ring->head = (head + required_len) & mask;
+
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -81,10 +81,12 @@ typedef int32 error_code;
 // For the interval timer, the programmable interval timer (PIT) IRQ0
 // interrupt or the local APIC timer can be used.  The PIT time
 // interval can be configured using a 1 byte or 2 byte count.  Note
-// that "bochs" does not implement the 1 byte mode.
+// that "bochs" does not implement the 1 byte mode.  When both are
+// enabled, the local APIC timer is used if CPUID reports a local APIC
+// (in TSC-deadline mode if available) and the PIT otherwise.
 
 #define USE_PIT_FOR_TIMER
-// #define USE_APIC_FOR_TIMER
+#define USE_APIC_FOR_TIMER
 
 #ifdef USE_PIT_FOR_TIMER
 // #define USE_PIT_1_BYTE_COUNT
@@ -119,6 +121,22 @@ typedef int32 error_code;
 #define USE_IRQ14_FOR_IDE0
 #define USE_IRQ15_FOR_IDE1
 
+// Transfer sectors with bus master DMA when the IDE controller is a PCI
+// IDE function that supports it, rather than through the data port.
+
+#define USE_IDE_DMA
+
+// Use the virtio block devices of a virtual machine (e.g. QEMU's
+// "-drive if=virtio") as disks, alongside the IDE disks.
+
+#define USE_VIRTIO_BLK
+
+// Use the SATA disks of AHCI controllers (e.g. QEMU's q35 machine or
+// "-device ich9-ahci"), with native command queuing when the disks
+// support it.
+
+#define USE_AHCI
+
 // UART requires IRQ4 and IRQ3
 #define USE_IRQ3_FOR_UART
 #define USE_IRQ4_FOR_UART
@@ -141,6 +159,21 @@ typedef int32 error_code;
 
 // #define BIOS_CALL_TEST
 
+// Measure context switches and wakeups per second at startup
+// #define SCHED_BENCHMARK
+
+// Record the sectors acquired from the disk cache in /sys/disktrace
+// #define DISK_CACHE_TRACE
+
+// Measure the sequential read throughput of each disk at startup
+// #define DISK_BENCHMARK
+
+// Replay a multithreaded read workload on the disk cache at startup
+// #define DISK_CACHE_BENCHMARK
+
+// Check the FAT driver on /dsk1 at startup, with a file it then removes
+// #define FAT_SELF_TEST
+
 #ifdef GAMBIT_REPL
 #ifdef MIMOSA_REPL
 #error "Only one REPL should be used"
@@ -156,6 +189,15 @@ typedef int32 error_code;
 #define SHOW_HEARTBEAT
 // #define KIND_MALLOC
 
+// Serve allocations of at most SLAB_MAX_SIZE bytes from per-size-class
+// slab caches instead of the first-fit block free list
+#define USE_SLAB_ALLOCATOR
+
+// Back the libc malloc (the applications heap) with the two-level
+// segregated fit allocator, which has bounded O(1) malloc and free,
+// instead of the kernel block allocator
+#define USE_TLSF_FOR_APPHEAP
+
 #ifdef KIND_MALLOC
 
 #warning                                                                       \
@@ -175,11 +217,16 @@ typedef int32 error_code;
 // #define SHOW_TIMER_INTERRUPTS
 #define SHOW_CPU_INFO
 // #define SHOW_IDE_INFO
+// #define SHOW_VIRTIO_INFO
+// #define SHOW_AHCI_INFO
 // #define SHOW_DISK_INFO
 #define CHECK_ASSERTIONS
 // #define PRINT_ASSERTIONS
 // #define USE_CACHE_BLOCK_MAID
-#define USE_BLOCK_REF_COUNTER_FREE
+// #define DISK_CACHE_BLOCKS 100 // default is sized from the usable memory
+// #define USE_BLOCK_REF_COUNTER_FREE
+#define USE_CACHE_BLOCK_FLUSHER
+#define USE_DISK_CACHE_2Q // scan resistant replacement, LRU when undefined
 #define SHOW_UART_MESSAGES
 #define RED_PANIC_SCREEN
 // If the Gambit runtime is to be run in 'real time' high priority, never
@@ -200,9 +247,11 @@ typedef int32 error_code;
 
 #ifndef USE_CACHE_BLOCK_MAID
 #ifndef USE_BLOCK_REF_COUNTER_FREE
+#ifndef USE_CACHE_BLOCK_FLUSHER
 #error "A cache block cleaning strategy must be defined"
 #endif
 #endif
+#endif
 
 #define USE_MIMOSA
 #define GAMBIT_GSTATE
@@ -8,6 +8,8 @@
 typedef struct heap_struct heap;
 typedef struct mem_block_struct block;
 typedef struct free_block_struct free_block;
+typedef struct slab_struct slab;
+typedef struct slab_cache_struct slab_cache;
 
 struct mem_block_struct {
   // The length is stored as an uint32
@@ -44,6 +46,44 @@ struct mem_block_struct {
   } tail;
 };
 
+// Small allocations are served from per-size-class slab caches layered
+// over the block allocator. A slab is a single SLAB_SIZE block obtained
+// from the heap and cut into objects of the same size. Every object is
+// preceded by a word pointing to its slab with the low bit set. Block
+// data is preceded by the (word aligned) prev pointer of the block, so
+// the low bit is enough to tell on which path a pointer must be freed.
+
+#define SLAB_SIZE (32 * (1 << 10))
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 4096
+#define SLAB_CLASS_COUNT 16
+
+struct slab_struct {
+  slab_cache *cache;
+  // partial list of the cache
+  slab *next;
+  slab *prev;
+  // chain of freed objects
+  void *free;
+  // next never used object
+  uint8 *bump;
+  // objects in use
+  uint32 inuse;
+  // objects taken from the bump pointer
+  uint32 carved;
+};
+
+struct slab_cache_struct {
+  // size of an object, without its header
+  uint32 obj_size;
+  // number of objects in a slab
+  uint32 per_slab;
+  // slabs with at least a free object
+  slab *partial;
+  // a completely free slab kept to avoid ping-ponging with the heap
+  slab *empty;
+};
+
 struct heap_struct {
   void *start;
   // size of the heap
@@ -58,6 +98,8 @@ struct heap_struct {
   block *ff;
   // last free (smallest to biggest size)
   block *lf;
+  // small allocation caches
+  slab_cache caches[SLAB_CLASS_COUNT];
 };
 
 void heap_init(heap *h, void *start, size_t size);
@@ -66,6 +108,13 @@ void *heap_malloc(heap *h, size_t size);
 
 void heap_free(heap *h, void *ptr);
 
+// Resize an allocation, in place when the following block is free or
+// when the block is at the end of the heap
+void *heap_realloc(heap *h, void *ptr, size_t size);
+
+// Allocate size bytes aligned on alignment, a power of two
+void *heap_memalign(heap *h, size_t alignment, size_t size);
+
 extern heap kheap;
 extern heap appheap;
 
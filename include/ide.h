@@ -11,6 +11,7 @@
 
 //-----------------------------------------------------------------------------
 
+#include "blk.h"
 #include "general.h"
 #include "thread.h"
 
@@ -85,34 +86,103 @@
 #define IDE_WRITE_DMA_QUEUED_CMD 0xcc
 #define IDE_WRITE_MULTIPLE_CMD 0xc5
 #define IDE_WRITE_SECTORS_CMD 0x30
+#define IDE_SET_MULTIPLE_MODE_CMD 0xc6
+
+// 48 bit LBA variants of the commands
+
+#define IDE_FLUSH_CACHE_EXT_CMD 0xea
+#define IDE_READ_DMA_EXT_CMD 0x25
+#define IDE_READ_MULTIPLE_EXT_CMD 0x29
+#define IDE_READ_SECTORS_EXT_CMD 0x24
+#define IDE_WRITE_DMA_EXT_CMD 0x35
+#define IDE_WRITE_MULTIPLE_EXT_CMD 0x39
+#define IDE_WRITE_SECTORS_EXT_CMD 0x34
+
+// Native command queuing, for SATA devices
+
+#define IDE_READ_FPDMA_QUEUED_CMD 0x60
+#define IDE_WRITE_FPDMA_QUEUED_CMD 0x61
+
+// Reading the NCQ command error log page gets a device out of the error
+// state of a failed queued command
+
+#define IDE_READ_LOG_EXT_CMD 0x2f
+#define IDE_LOG_NCQ_COMMAND_ERROR 0x10
+#define IDE_NCQ_LOG_NQ (1 << 7) // the error isn't from a queued command
+#define IDE_NCQ_LOG_TAG_MASK 0x1f // in the first byte of the log
+
+// Sectors that can be reached with a 28 bit LBA, and sectors per
+// command with 28 and 48 bit LBAs
+
+#define IDE_LBA28_SECTORS (CAST(uint32, 1) << 28)
+#define IDE_LBA28_MAX_COUNT 256
+#define IDE_LBA48_MAX_COUNT 65536
 
 #define IDE_LOG2_SECTOR_SIZE 9
 
-#define MAX_NB_IDE_CMD_QUEUE_ENTRIES 1
+// Bus master IDE (PCI IDE controllers such as the PIIX). The registers
+// are offsets from the base of a channel, the secondary channel's base
+// being IDE_BM_CHANNEL_STRIDE above the primary's.
+
+#define IDE_BM_COMMAND_REG 0 // 8 bit, start/stop and direction
+#define IDE_BM_STATUS_REG 2  // 8 bit, status
+#define IDE_BM_PRDT_REG 4    // 32 bit, physical address of the PRD table
+#define IDE_BM_CHANNEL_STRIDE 8
+
+#define IDE_BM_COMMAND_START (1 << 0) // Start bus master operation
+#define IDE_BM_COMMAND_READ (1 << 3)  // Transfer from device to memory
 
-typedef enum { cmd_read_sectors, cmd_write_sectors, cmd_flush_cache } cmd_type;
+#define IDE_BM_STATUS_ACTIVE (1 << 0)   // Bus master IDE active
+#define IDE_BM_STATUS_ERR (1 << 1)      // Error (write 1 to clear)
+#define IDE_BM_STATUS_INTR (1 << 2)     // Interrupt (write 1 to clear)
+#define IDE_BM_STATUS_DRV0_DMA (1 << 5) // Drive 0 DMA capable
+#define IDE_BM_STATUS_DRV1_DMA (1 << 6) // Drive 1 DMA capable
 
-typedef struct ide_cmd_queue_entry_struct {
-  uint8 id; // index of entry in cmd_queue
-  uint8 refcount;
-  struct ide_device_struct *dev; // the device of this command
-  int32 next; // index of next free entry (-1 means end of list)
-  condvar *done;
+#define IDE_PROG_IF_PRIMARY_NATIVE (1 << 0)   // Primary in native PCI mode
+#define IDE_PROG_IF_SECONDARY_NATIVE (1 << 2) // Secondary in native PCI mode
+#define IDE_PROG_IF_BUS_MASTER (1 << 7)       // Bus master IDE capable
+
+// A physical region descriptor gives a piece of the buffer of a DMA
+// transfer. A region cannot cross a 64K boundary.
+
+#define IDE_PRD_EOT (1 << 15) // Last descriptor of the table
+#define IDE_PRD_ENTRIES 32
+
+// Largest DMA transfer that fits in a PRD table whatever the alignment
+// of the buffer
+
+#define IDE_DMA_MAX_COUNT                                                      \
+  ((IDE_PRD_ENTRIES - 1) << (16 - IDE_LOG2_SECTOR_SIZE))
+
+typedef struct ide_prd_struct {
+  uint32 addr;
+  uint16 count; // in bytes, 0 means 64K
+  uint16 flags;
+} ide_prd;
+
+typedef enum {
+  cmd_read_sectors,
+  cmd_write_sectors,
+  cmd_flush_cache,
+  cmd_read_dma,
+  cmd_write_dma
+} cmd_type;
+
+// The request a controller is working on. A request that is too large
+// for a single command is done with several commands.
+
+typedef struct ide_command_struct {
+  blk_request *req; // NULL when the controller is idle
+  struct ide_device_struct *dev;
   cmd_type cmd;
-  union {
-    struct {
-      void *buf;
-      uint32 count;
-      error_code err;
-    } read_sectors;
-    struct {
-      void *buf;
-      uint8 count;
-      uint8 written;
-      error_code err;
-    } write_sectors;
-  } _;
-} ide_cmd_queue_entry;
+  uint32 done;    // sectors of the request moved by the previous commands
+  uint32 count;   // sectors of the command in progress
+  uint32 moved;   // sectors of the command moved so far with PIO
+  uint32 block;   // sectors per interrupt (DRQ block)
+  uint8 seg;      // segment of the request at the PIO position
+  uint32 seg_pos; // sector of the segment at the PIO position
+  bool drq_wait;  // a PIO write waits for the device to ask for data
+} ide_command;
 
 typedef struct ide_device_struct {
   uint8 id;   // 0 to IDE_DEVICES_PER_CONTROLLER-1
@@ -129,22 +199,23 @@ typedef struct ide_device_struct {
   uint16 sectors_per_track;
   uint32 total_sectors_when_using_CHS;
   uint32 total_sectors;
+  bool dma;       // transfers use bus master DMA
+  bool lba48;     // supports the 48 bit LBA feature set
+  uint8 multiple; // sectors per READ/WRITE MULTIPLE block, 0 if unused
+  blk_queue queue;
 } ide_device;
 
 typedef struct ide_controller_struct {
   uint8 id; // 0 to IDE_CONTROLLERS-1
+  uint16 bm_base; // bus master registers, 0 when DMA is not available
   ide_device device[IDE_DEVICES_PER_CONTROLLER];
-  ide_cmd_queue_entry cmd_queue[MAX_NB_IDE_CMD_QUEUE_ENTRIES];
-  volatile int cmd_queue_freelist;
-  condvar *cmd_queue_condvar;
+  ide_command cmd;
+  uint8 next_dev; // device whose queue is served first
+  bool resetting; // no command is started until the reset is over
+  timer poll;     // checks the status while a wait isn't signaled by an IRQ
+  time deadline;  // of the wait
 } ide_controller;
 
-error_code ide_read_sectors(ide_device *dev, uint32 sector_pos, void *buf,
-                            uint32 count);
-
-error_code ide_write_sectors(ide_device *dev, uint32 sector_pos, void *buf,
-                             uint32 count);
-
 void setup_ide();
 
 //-----------------------------------------------------------------------------
@@ -46,6 +46,14 @@ typedef struct interrupt_data {
 
 void setup_intr();
 
+// Source of the scheduler's timer interrupt, probed by "setup_intr".
+
+#define TIMER_SOURCE_PIT 0
+#define TIMER_SOURCE_APIC 1         // local APIC timer, one-shot mode
+#define TIMER_SOURCE_TSC_DEADLINE 2 // local APIC timer, TSC-deadline mode
+
+extern uint8 timer_source;
+
 // Enabling, disabling and acknowledging IRQs.
 
 #define ENABLE_IRQ(n)                                                          \
@@ -79,6 +87,29 @@ void setup_intr();
     }                                                                          \
   } while (0)
 
+// Handlers for the IRQs that PCI devices are routed to (5, 9, 10 and
+// 11), which the devices may share. A handler is called with interrupts
+// disabled on each of the IRQ's interrupts and must check whether its
+// device is the one interrupting. Adding a handler enables the IRQ.
+// Returns FALSE when the IRQ can't be handled.
+
+#define INTR_HANDLERS_PER_IRQ 4
+
+typedef void (*intr_handler)(void *data);
+
+bool intr_add_handler(uint8 irq, intr_handler fn, void *data);
+
+// Handlers for message signalled interrupts (MSI), which are delivered
+// to the local APIC on vectors of their own. Gives the address and the
+// data that the device must write to call fn. Returns FALSE when the
+// local APIC isn't enabled or all the vectors are used.
+
+#define MSI_VECTOR_BASE 0xc0
+#define MSI_VECTORS 8
+
+bool intr_add_msi_handler(intr_handler fn, void *data, uint32 *msi_address,
+                          uint16 *msi_data);
+
 //-----------------------------------------------------------------------------
 
 // Interrupt handlers must use C linkage.
@@ -101,6 +132,7 @@ extern "C" void irq14();
 extern "C" void irq15();
 extern "C" void APIC_timer_irq();
 extern "C" void APIC_spurious_irq();
+extern "C" void msi_irq(uint32 n);
 extern "C" void unhandled_interrupt(int num);
 extern "C" void interrupt_handle(interrupt_data data);
 extern "C" void sys_irq(void *esp);
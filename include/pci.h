@@ -0,0 +1,171 @@
+// file: "pci.h"
+
+#ifndef __PCI_H
+#define __PCI_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+#include "intr.h"
+
+//-----------------------------------------------------------------------------
+
+//
+// Definitions for the PCI bus, accessed with configuration mechanism #1.
+//
+
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+#define PCI_CONFIG_ENABLE (1 << 31)
+
+#define PCI_BUSES 256
+#define PCI_DEVICES_PER_BUS 32
+#define PCI_FUNCTIONS_PER_DEVICE 8
+
+// Configuration space registers (type 0 header)
+
+#define PCI_VENDOR_ID 0x00     // 16 bits
+#define PCI_DEVICE_ID 0x02     // 16 bits
+#define PCI_COMMAND 0x04       // 16 bits
+#define PCI_STATUS 0x06        // 16 bits
+#define PCI_REVISION 0x08      // 8 bits
+#define PCI_PROG_IF 0x09       // 8 bits
+#define PCI_SUBCLASS_CODE 0x0a // 8 bits
+#define PCI_CLASS_CODE 0x0b    // 8 bits
+#define PCI_HEADER_TYPE 0x0e   // 8 bits
+#define PCI_BASE_ADDRESS_0 0x10
+#define PCI_BASE_ADDRESS_1 0x14
+#define PCI_BASE_ADDRESS_2 0x18
+#define PCI_BASE_ADDRESS_3 0x1c
+#define PCI_BASE_ADDRESS_4 0x20
+#define PCI_BASE_ADDRESS_5 0x24
+#define PCI_CAPABILITY_LIST 0x34 // 8 bits
+#define PCI_INTERRUPT_LINE 0x3c // 8 bits
+
+#define PCI_VENDOR_NONE 0xffff
+
+#define PCI_COMMAND_IO (1 << 0)     // Enable response in I/O space
+#define PCI_COMMAND_MEM (1 << 1)    // Enable response in memory space
+#define PCI_COMMAND_MASTER (1 << 2) // Enable bus mastering
+#define PCI_COMMAND_INTX_DISABLE (1 << 10) // No legacy interrupts
+
+#define PCI_STATUS_CAP_LIST (1 << 4) // Capability list present
+
+#define PCI_HEADER_TYPE_MASK 0x7f
+#define PCI_HEADER_TYPE_NORMAL 0
+#define PCI_HEADER_TYPE_BRIDGE 1
+#define PCI_HEADER_TYPE_MULTI_FN (1 << 7)
+
+#define PCI_BASE_ADDRESS_SPACE_IO (1 << 0)
+#define PCI_BASE_ADDRESS_IO_MASK (~CAST(uint32, 3))
+#define PCI_BASE_ADDRESS_MEM_TYPE_64 (2 << 1)
+#define PCI_BASE_ADDRESS_MEM_PREFETCH (1 << 3)
+#define PCI_BASE_ADDRESS_MEM_MASK (~CAST(uint32, 15))
+
+// Capability list entries
+
+#define PCI_CAP_ID 0   // 8 bits
+#define PCI_CAP_NEXT 1 // 8 bits
+
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_VENDOR 0x09
+
+// Message signalled interrupts capability
+
+#define PCI_MSI_FLAGS 2      // 16 bits
+#define PCI_MSI_ADDRESS_LO 4 // 32 bits
+#define PCI_MSI_ADDRESS_HI 8 // 32 bits, when the address is 64 bits
+#define PCI_MSI_DATA_32 8    // 16 bits
+#define PCI_MSI_DATA_64 12   // 16 bits
+
+#define PCI_MSI_FLAGS_ENABLE (1 << 0)
+#define PCI_MSI_FLAGS_QSIZE (7 << 4) // log2 of the vectors enabled
+#define PCI_MSI_FLAGS_64BIT (1 << 7)
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_STORAGE_IDE 0x01
+
+typedef struct pci_function_struct {
+  uint8 bus;
+  uint8 device;
+  uint8 function;
+} pci_function;
+
+// The functions found by "setup_pci", with their decoded BARs
+
+#define PCI_MAX_DEVICES 64
+#define PCI_BARS 6
+
+#define PCI_BAR_IO (1 << 0)
+#define PCI_BAR_MEM64 (1 << 1)
+#define PCI_BAR_PREFETCH (1 << 2)
+
+typedef struct pci_bar_struct {
+  uint64 base; // 0 when the BAR isn't implemented
+  uint64 size;
+  uint8 flags;
+} pci_bar;
+
+typedef struct pci_device_struct {
+  pci_function fn;
+  uint16 vendor_id;
+  uint16 device_id;
+  uint8 class_code;
+  uint8 subclass_code;
+  uint8 prog_if;
+  uint8 revision;
+  uint8 header_type;
+  uint8 irq;
+  uint8 msi; // offset of the MSI capability, 0 when there is none
+  pci_bar bar[PCI_BARS]; // a 64 bit BAR also uses the next one
+} pci_device;
+
+void setup_pci();
+
+uint32 pci_device_count();
+pci_device *pci_device_at(uint32 index);
+pci_device *pci_lookup(pci_function *fn); // NULL when fn wasn't found
+
+uint32 pci_read_config_dword(pci_function *fn, uint8 reg);
+uint16 pci_read_config_word(pci_function *fn, uint8 reg);
+uint8 pci_read_config_byte(pci_function *fn, uint8 reg);
+
+void pci_write_config_dword(pci_function *fn, uint8 reg, uint32 val);
+void pci_write_config_word(pci_function *fn, uint8 reg, uint16 val);
+
+// Find the index-th function of the given class and subclass. Returns
+// FALSE when there are fewer such functions.
+bool pci_find_class(uint8 class_code, uint8 subclass_code, uint32 index,
+                    pci_function *fn);
+
+// Same, for the functions with the given vendor and device IDs
+bool pci_find_device(uint16 vendor_id, uint16 device_id, uint32 index,
+                     pci_function *fn);
+
+// Offset in the configuration space of the first capability with the
+// given ID that comes after the one at offset after (0 to start from
+// the beginning of the list). Returns 0 when there is none.
+uint8 pci_find_capability(pci_function *fn, uint8 cap_id, uint8 after);
+
+// Address of a memory BAR, NULL when the BAR isn't a memory BAR
+// below 4 GB
+volatile uint8 *pci_bar_address(pci_function *fn, uint8 bar);
+
+// Enable the decoding of the address spaces used by the BARs and bus
+// mastering
+void pci_enable_bus_master(pci_function *fn);
+
+// Send the interrupts of the function as a message to the local APIC
+// instead of asserting its interrupt pin, and have fn called for them.
+// Returns FALSE when the function or the system can't do it, in which
+// case the interrupt pin must be used.
+bool pci_enable_msi(pci_function *fn, intr_handler handler, void *data);
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -112,6 +112,23 @@ inline void NAMESPACE_PREFIX(insert)(ELEMTYPE *elem, QUEUETYPE *queue) {
   PREV_SET(node2, CAST(NODETYPE *, elem));
 }
 
+/*
+ * Insert elem at the end of the queue regardless of BEFORE.  This is
+ * constant time and keeps the queue FIFO when every element has the
+ * same ordering.
+ */
+
+inline void NAMESPACE_PREFIX(append)(ELEMTYPE *elem, QUEUETYPE *queue) {
+  NODETYPE *node2 = CAST(NODETYPE *, queue);
+  NODETYPE *node1 = PREV(node2);
+
+  NEXT_SET(node1, CAST(NODETYPE *, elem));
+  PREV_SET(CAST(NODETYPE *, elem), node1);
+
+  NEXT_SET(CAST(NODETYPE *, elem), node2);
+  PREV_SET(node2, CAST(NODETYPE *, elem));
+}
+
 inline void NAMESPACE_PREFIX(remove)(ELEMTYPE *elem) {
   NODETYPE *prev_node = PREV(CAST(NODETYPE *, elem));
   NODETYPE *next_node = NEXT(CAST(NODETYPE *, elem));
@@ -50,10 +50,19 @@ uint8 log2(uint32 n);
 
 // Memory management.
 
+// Sum of the lengths of the usable memory zones reported by the BIOS
+extern uint64 total_usable_memory;
+
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 
 extern "C" void *memcpy(void *dest, const void *src, size_t n);
+extern "C" void *memmove(void *dest, const void *src, size_t n);
+extern "C" void *memset(void *dest, int c, size_t n);
+extern "C" int memcmp(const void *a, const void *b, size_t n);
+
+// Copy and fill with "rep movsb" and "rep stosb", for CPUs with ERMS
+void mem_use_erms();
 
 // ----------------------------------------------------------------------------
 // Strings
@@ -12,8 +12,10 @@
 //-----------------------------------------------------------------------------
 
 #include "chrono.h"
+#include "gambit_ring.h"
 #include "general.h"
 #include "intr.h"
+#include "timer.h"
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -30,18 +32,6 @@
 #define GAMBIT_COMM_INT 5
 const uint32 GAMBIT_START = 0x100000;
 
-const uint32 GAMBIT_SHARED_MEM_LEN = 32768;
-const uint32 GAMBIT_SHARED_MEM_CMD = 33554432;
-
-const uint32 GAMBIT_FLOW_CONTROLLED_START = 33554432;
-const uint32 GAMBIT_FLOW_CONTROLLED_LEN = 10;
-
-const uint32 GAMBIT_FLOW_UNCONTROLLED_START =
-    GAMBIT_FLOW_CONTROLLED_START + GAMBIT_FLOW_CONTROLLED_LEN;
-
-const uint32 GAMBIT_FLOW_UNCONTROLLED_LEN =
-    GAMBIT_SHARED_MEM_LEN - GAMBIT_FLOW_CONTROLLED_LEN;
-
 //-----------------------------------------------------------------------------
 
 #define STI()                                                                  \
@@ -236,9 +226,6 @@ typedef int priority;
 #define USE_DOUBLY_LINKED_LIST_FOR_MUTEX_QUEUE
 //#define USE_RED_BLACK_TREE_FOR_MUTEX_QUEUE
 
-#define USE_DOUBLY_LINKED_LIST_FOR_SLEEP_QUEUE
-//#define USE_RED_BLACK_TREE_FOR_SLEEP_QUEUE
-
 typedef void (*void_fn)();
 typedef int (*libc_startup_fn)(int argc, char *argv[], char *env[]);
 //-----------------------------------------------------------------------------
@@ -309,7 +296,6 @@ int pthread_cond_destroy (pthread_cond_t* cond);
 
 struct wait_queue;
 struct mutex_queue;
-struct sleep_queue;
 
 typedef struct wait_mutex_node {
   // Wait queue part for maintaining the set of threads waiting on a
@@ -372,35 +358,12 @@ typedef struct wait_mutex_sleep_node {
   mutex_queue super;
 
 protected:
-  // Sleep queue part for maintaining the set of threads waiting for
-  // a timeout.  If this object is a thread it is an element of the
-  // queue; if this object is the run queue it is the queue of
-  // threads waiting for a timeout.
-
-#ifdef USE_DOUBLY_LINKED_LIST_FOR_SLEEP_QUEUE
-  wait_mutex_sleep_node *volatile _next_in_sleep_queue;
-  wait_mutex_sleep_node *volatile _prev_in_sleep_queue;
-#endif
+  // Sleep part for threads waiting for a timeout.  The timer is armed
+  // on the kernel timer wheel while the thread sleeps.
 
-#ifdef USE_RED_BLACK_TREE_FOR_SLEEP_QUEUE
-  sleep_queue *volatile _color_in_sleep_queue;
-  wait_mutex_sleep_node *volatile _parent_in_sleep_queue;
-  wait_mutex_sleep_node *volatile _left_in_sleep_queue;
-#endif
+  timer _sleep_timer;
 } wait_mutex_sleep_node;
 
-typedef struct sleep_queue {
-  wait_mutex_sleep_node super;
-
-protected:
-#ifdef USE_DOUBLY_LINKED_LIST_FOR_SLEEP_QUEUE
-#endif
-
-#ifdef USE_RED_BLACK_TREE_FOR_SLEEP_QUEUE
-  wait_mutex_sleep_node *volatile _leftmost_in_sleep_queue;
-#endif
-} sleep_queue;
-
 typedef struct mutex {
   wait_queue super;
   // The inherited "wait queue" part of wait_queue is used to
@@ -483,13 +446,6 @@ typedef struct thread {
   wait_mutex_node *volatile _right_in_wait_queue;
 #endif
 
-#ifdef USE_DOUBLY_LINKED_LIST_FOR_SLEEP_QUEUE
-#endif
-
-#ifdef USE_RED_BLACK_TREE_FOR_SLEEP_QUEUE
-  wait_mutex_sleep_node *volatile _right_in_sleep_queue;
-#endif
-
   uint32 *_stack; // the thread's stack
   uint32 *_sp;    // the thread's stack pointer
 
@@ -560,6 +516,8 @@ void _sched_switch_to_next_thread(uint32 cs, uint32 eflags, uint32 *sp,
 void _sched_suspend_on_wait_queue(uint32 cs, uint32 eflags, uint32 *sp,
                                   void *dummy);
 
+void _sched_sleep_timeout(timer *t, void *data);
+
 void _sched_suspend_on_sleep_queue(uint32 cs, uint32 eflags, uint32 *sp,
                                    void *dummy);
 
@@ -567,12 +525,25 @@ void _sched_setup_timer();
 
 void _sched_set_timer(time t, time now);
 
+void _sched_set_next_timer(time end_of_quantum, time now);
+
 void _sched_timer_elapsed();
 
 void _sched_resume_next_thread();
 
+// Halt the CPU until the next interrupt, for the idle thread
+void sched_idle();
+
+void _sched_idle_end();
+
 void sys_irq(void *esp);
 
+#ifdef SCHED_BENCHMARK
+
+void sched_benchmark();
+
+#endif
+
 #ifdef USE_PIT_FOR_TIMER
 
 void irq0();
@@ -677,48 +648,97 @@ void APIC_timer_irq();
 
 //-----------------------------------------------------------------------------
 
-// "wait_mutex_sleep_node" class implementation.
+// Run queue.  There is one FIFO of ready threads per priority level,
+// linked through the wait queue part of the threads, and a bitmap of
+// the levels that may be non-empty, so that making a thread ready and
+// finding the next thread to run take constant time.  The running
+// thread is the head of the highest non-empty level.
 
-#define NODETYPE wait_mutex_sleep_node
-#define QUEUETYPE sleep_queue
-#define ELEMTYPE thread
-#define NAMESPACE_PREFIX(name) sleep_queue_##name
-#define BEFORE(elem1, elem2) less_time((elem1)->_timeout, (elem2)->_timeout)
+#define SCHED_PRIO_LEVELS 32
+#define SCHED_PRIO_LEVEL_WIDTH 10 // consecutive priorities sharing a level
 
-#ifdef USE_DOUBLY_LINKED_LIST_FOR_SLEEP_QUEUE
-#define USE_DOUBLY_LINKED_LIST
-#define NEXT(node) (node)->_next_in_sleep_queue
-#define NEXT_SET(node, next_node) NEXT(node) = (next_node)
-#define PREV(node) (node)->_prev_in_sleep_queue
-#define PREV_SET(node, prev_node) PREV(node) = (prev_node)
-#include "queue.h"
-#undef USE_DOUBLY_LINKED_LIST
-#undef NEXT
-#undef NEXT_SET
-#undef PREV
-#undef PREV_SET
-#endif
+typedef struct ready_queue {
+  // Bit i is set when level i may be non-empty.  Threads leave the run
+  // queue with "wait_queue_remove", which does not know about levels,
+  // so the bit of a level that became empty is only cleared the next
+  // time the head of the run queue is looked up.
+  uint32 bitmap;
+  wait_queue levels[SCHED_PRIO_LEVELS];
+} ready_queue;
 
-#ifdef USE_RED_BLACK_TREE_FOR_SLEEP_QUEUE
-#include "queue.h"
+// The operations are here rather than in thread.cpp so that the host
+// tests can check them (see utils/hosttest/sched_test.cpp).
+
+inline uint32 ready_queue_level(int prio) {
+  if (prio <= 0)
+    return 0;
+
+  uint32 level = prio / SCHED_PRIO_LEVEL_WIDTH;
+
+  if (level >= SCHED_PRIO_LEVELS)
+    return SCHED_PRIO_LEVELS - 1;
+
+  return level;
+}
+
+inline void ready_queue_init(ready_queue *rq) {
+  rq->bitmap = 0;
+  for (int i = 0; i < SCHED_PRIO_LEVELS; ++i) {
+    wait_queue_init(&rq->levels[i]);
+  }
+}
+
+inline void ready_queue_insert(thread *t, ready_queue *rq) {
+  uint32 level = ready_queue_level(t->_prio);
+
+#ifdef USE_DOUBLY_LINKED_LIST_FOR_WAIT_QUEUE
+  wait_queue_append(t, &rq->levels[level]);
+#else
+  wait_queue_insert(t, &rq->levels[level]);
 #endif
 
-#undef NODETYPE
-#undef QUEUETYPE
-#undef ELEMTYPE
-#undef NAMESPACE_PREFIX
-#undef BEFORE
+  rq->bitmap |= 1 << level;
+}
 
-//-----------------------------------------------------------------------------
+inline thread *ready_queue_head(ready_queue *rq) {
+  uint32 bitmap = rq->bitmap;
+
+  while (bitmap != 0) {
+    uint32 level;
+    __asm__("bsrl %1,%0" : "=r"(level) : "rm"(bitmap));
+
+    thread *t = wait_queue_head(&rq->levels[level]);
+
+    if (t != NULL)
+      return t;
+
+    // The last thread of this level has left it
+    bitmap &= ~(1 << level);
+    rq->bitmap = bitmap;
+  }
+
+  return NULL;
+}
+
+// TRUE when no other thread of the same or a higher priority is ready
+inline bool ready_queue_alone(thread *t, ready_queue *rq) {
+  wait_queue *level = &rq->levels[ready_queue_level(t->_prio)];
+
+  // The queue itself is the sentinel node of its list (see queue.h)
+  return ready_queue_head(rq) == t &&
+         CAST(wait_mutex_node *, t)->_next_in_wait_queue ==
+             CAST(wait_mutex_node *, level);
+}
 
 //-----------------------------------------------------------------------
 // Static declarations
 //-----------------------------------------------------------------------
 
-extern wait_queue *readyq;
-extern sleep_queue *sleepq;
+extern ready_queue *readyq;
 extern thread *sched_primordial_thread;
 extern thread *sched_current_thread;
+extern time sched_idle_time;
+extern uint32 sched_idle_halts;
 extern thread_vtable _thread_vtable;
 extern thread_vtable _program_thread_vtable;
 
@@ -0,0 +1,73 @@
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include "chrono.h"
+#include "general.h"
+
+// Kernel timers. A timer calls a function once a moment in time has
+// passed. Pending timers are kept in a hierarchical timing wheel
+// (G. Varghese, T. Lauck, "Hashed and hierarchical timing wheels"), so
+// arming and cancelling a timer take constant time. Expired timers are
+// run from the scheduler's timer interrupt with interrupts disabled:
+// their function must not block.
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOTS_LOG2 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOTS_LOG2)
+
+// Timers further than this many ticks are parked in the last level
+// and moved down when it comes around
+#define TIMER_WHEEL_RANGE                                                      \
+  (CAST(uint32, 1) << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS_LOG2))
+
+// Length of a tick, about a millisecond
+#define TIMER_TICK_FREQ 1000
+
+typedef struct timer_struct timer;
+
+typedef void (*timer_fn)(timer *t, void *data);
+
+struct timer_struct {
+  // Links in a slot of the wheel, next is NULL when the timer is idle
+  timer *next;
+  timer *prev;
+  uint32 expires; // in ticks
+  timer_fn fn;
+  void *data;
+};
+
+typedef struct timer_wheel_struct {
+  // Time shift giving ticks
+  uint8 shift;
+  // Next tick to process
+  uint32 tick;
+  uint32 pending;
+  // Slots of the first level that may hold timers. A bit is set when a
+  // timer is put in its slot and only cleared when the slot is run.
+  uint32 first_level_map[TIMER_WHEEL_SLOTS / 32];
+  timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+void setup_timers();
+
+void timer_init(timer *t);
+
+// Arm t to call fn(t, data) once expires has passed. An armed timer is
+// first cancelled. Interrupts must be disabled.
+void timer_add(timer *t, time expires, timer_fn fn, void *data);
+
+// Returns TRUE if t was armed. Interrupts must be disabled.
+bool timer_cancel(timer *t);
+
+#define timer_pending(t) ((t)->next != NULL)
+
+// Run the timers that expired by now
+void timer_run_expired(time now);
+
+// Earliest moment, not before now, at which the wheel needs to be
+// run again. Returns FALSE when no timer is armed.
+bool timer_next_expiry(time now, time *t);
+
+extern timer_wheel timers;
+
+#endif
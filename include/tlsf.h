@@ -0,0 +1,72 @@
+#ifndef __TLSF_H
+#define __TLSF_H
+
+#include "general.h"
+
+// Two-level segregated fit allocator (M. Masmano, I. Ripoll, A. Crespo,
+// "TLSF: a new dynamic memory allocator for real-time systems"). Free
+// blocks are kept in segregated lists indexed by a first level (power
+// of two) and a second level (linear subdivision of that power of
+// two). Two bitmaps give the first non-empty list in constant time, so
+// malloc and free never walk the heap.
+
+#define TLSF_ALIGN_SIZE_LOG2 2
+#define TLSF_ALIGN_SIZE (1 << TLSF_ALIGN_SIZE_LOG2)
+
+#define TLSF_SL_INDEX_COUNT_LOG2 5
+#define TLSF_SL_INDEX_COUNT (1 << TLSF_SL_INDEX_COUNT_LOG2)
+
+// Blocks are at most 2^TLSF_FL_INDEX_MAX bytes
+#define TLSF_FL_INDEX_MAX 31
+#define TLSF_FL_INDEX_SHIFT (TLSF_SL_INDEX_COUNT_LOG2 + TLSF_ALIGN_SIZE_LOG2)
+#define TLSF_FL_INDEX_COUNT (TLSF_FL_INDEX_MAX - TLSF_FL_INDEX_SHIFT + 1)
+
+// Blocks under this size all live in the first level list 0
+#define TLSF_SMALL_BLOCK_SIZE (1 << TLSF_FL_INDEX_SHIFT)
+
+typedef struct tlsf_block_struct tlsf_block;
+typedef struct tlsf_struct tlsf;
+
+struct tlsf_block_struct {
+  // Only valid if the previous physical block is free. It is stored in
+  // the last word of the previous block's data section.
+  tlsf_block *prev_phys;
+  // Size of the data section. Bit 0 is set when the block is free and
+  // bit 1 when the previous physical block is free.
+  size_t size;
+  // Those fields are valid iff the block is free, otherwise they are
+  // the start of the data section
+  tlsf_block *next_free;
+  tlsf_block *prev_free;
+};
+
+struct tlsf_struct {
+  void *start;
+  // size of the pool
+  size_t size;
+  // allocated size (data sections and block headers)
+  size_t alloc;
+  // end of every free list
+  tlsf_block null_block;
+  // non-empty first level lists
+  uint32 fl_bitmap;
+  // non-empty second level lists
+  uint32 sl_bitmap[TLSF_FL_INDEX_COUNT];
+  tlsf_block *blocks[TLSF_FL_INDEX_COUNT][TLSF_SL_INDEX_COUNT];
+};
+
+void tlsf_init(tlsf *t, void *start, size_t size);
+
+void *tlsf_malloc(tlsf *t, size_t size);
+
+void tlsf_free(tlsf *t, void *ptr);
+
+// Resize an allocation, in place when the next physical block is free
+void *tlsf_realloc(tlsf *t, void *ptr, size_t size);
+
+// Allocate size bytes aligned on alignment, a power of two
+void *tlsf_memalign(tlsf *t, size_t alignment, size_t size);
+
+extern tlsf apptlsf;
+
+#endif
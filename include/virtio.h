@@ -0,0 +1,191 @@
+// file: "virtio.h"
+
+#ifndef __VIRTIO_H
+#define __VIRTIO_H
+
+//-----------------------------------------------------------------------------
+
+#include "blk.h"
+#include "general.h"
+#include "pci.h"
+
+//-----------------------------------------------------------------------------
+
+//
+// Definitions for virtio block devices, the paravirtualized disks of
+// virtual machines, through the legacy and the modern (virtio 1.0) PCI
+// transports.
+//
+
+#define VIRTIO_PCI_VENDOR_ID 0x1af4
+#define VIRTIO_PCI_DEVICE_BLK_TRANSITIONAL 0x1001
+#define VIRTIO_PCI_DEVICE_BLK_MODERN 0x1042
+
+#define VIRTIO_BLK_DEVICES 4
+
+// Legacy transport, registers in the I/O space of BAR 0
+
+#define VIRTIO_PCI_HOST_FEATURES 0x00  // 32 bits
+#define VIRTIO_PCI_GUEST_FEATURES 0x04 // 32 bits
+#define VIRTIO_PCI_QUEUE_PFN 0x08      // 32 bits
+#define VIRTIO_PCI_QUEUE_SIZE 0x0c     // 16 bits
+#define VIRTIO_PCI_QUEUE_SEL 0x0e      // 16 bits
+#define VIRTIO_PCI_QUEUE_NOTIFY 0x10   // 16 bits
+#define VIRTIO_PCI_STATUS 0x12         // 8 bits
+#define VIRTIO_PCI_ISR 0x13            // 8 bits
+#define VIRTIO_PCI_CONFIG 0x14         // device configuration, without MSI-X
+
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT 12
+#define VIRTIO_PCI_VRING_ALIGN 4096
+
+// Modern transport, structures in memory BARs located by vendor
+// specific PCI capabilities
+
+#define VIRTIO_PCI_CAP_CFG_TYPE 3     // 8 bits
+#define VIRTIO_PCI_CAP_BAR 4          // 8 bits
+#define VIRTIO_PCI_CAP_OFFSET 8       // 32 bits
+#define VIRTIO_PCI_CAP_NOTIFY_MULT 16 // 32 bits, notification capability
+
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_PCI_COMMON_DFSELECT 0x00  // 32 bits
+#define VIRTIO_PCI_COMMON_DF 0x04        // 32 bits
+#define VIRTIO_PCI_COMMON_GFSELECT 0x08  // 32 bits
+#define VIRTIO_PCI_COMMON_GF 0x0c        // 32 bits
+#define VIRTIO_PCI_COMMON_STATUS 0x14    // 8 bits
+#define VIRTIO_PCI_COMMON_Q_SELECT 0x16  // 16 bits
+#define VIRTIO_PCI_COMMON_Q_SIZE 0x18    // 16 bits
+#define VIRTIO_PCI_COMMON_Q_ENABLE 0x1c  // 16 bits
+#define VIRTIO_PCI_COMMON_Q_NOFF 0x1e    // 16 bits
+#define VIRTIO_PCI_COMMON_Q_DESCLO 0x20  // 32 bits
+#define VIRTIO_PCI_COMMON_Q_DESCHI 0x24  // 32 bits
+#define VIRTIO_PCI_COMMON_Q_AVAILLO 0x28 // 32 bits
+#define VIRTIO_PCI_COMMON_Q_AVAILHI 0x2c // 32 bits
+#define VIRTIO_PCI_COMMON_Q_USEDLO 0x30  // 32 bits
+#define VIRTIO_PCI_COMMON_Q_USEDHI 0x34  // 32 bits
+
+#define VIRTIO_STATUS_ACKNOWLEDGE (1 << 0)
+#define VIRTIO_STATUS_DRIVER (1 << 1)
+#define VIRTIO_STATUS_DRIVER_OK (1 << 2)
+#define VIRTIO_STATUS_FEATURES_OK (1 << 3)
+#define VIRTIO_STATUS_FAILED (1 << 7)
+
+#define VIRTIO_ISR_QUEUE (1 << 0) // a used ring was updated
+
+// Feature bits
+
+#define VIRTIO_BLK_F_FLUSH 9 // the device has a write cache
+#define VIRTIO_F_VERSION_1 32
+
+// Block device configuration
+
+#define VIRTIO_BLK_CFG_CAPACITY 0 // 64 bits, in 512 byte sectors
+
+#define VIRTIO_BLK_LOG2_SECTOR_SIZE 9
+
+// Requests
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+// Split virtqueue. The driver places chains of descriptors in the
+// available ring and the device returns them in the used ring.
+
+#define VRING_DESC_F_NEXT (1 << 0)
+#define VRING_DESC_F_WRITE (1 << 1) // the device writes the buffer
+
+typedef struct vring_desc_struct {
+  uint64 addr;
+  uint32 len;
+  uint16 flags;
+  uint16 next;
+} vring_desc;
+
+typedef struct vring_avail_struct {
+  uint16 flags;
+  uint16 idx;
+  uint16 ring[];
+} vring_avail;
+
+typedef struct vring_used_elem_struct {
+  uint32 id; // head of the chain
+  uint32 len;
+} vring_used_elem;
+
+typedef struct vring_used_struct {
+  uint16 flags;
+  uint16 idx;
+  vring_used_elem ring[];
+} vring_used;
+
+// A request in flight is a chain of a descriptor for its header, one
+// per segment and one for its status. The queue is cut down to what
+// the slots can use.
+
+#define VIRTIO_BLK_SLOTS 16
+#define VIRTIO_BLK_DESC_PER_REQUEST (BLK_MAX_SEGMENTS + 2)
+#define VIRTIO_BLK_MAX_QUEUE_SIZE 512
+#define VIRTIO_BLK_MAX_COUNT 65536
+
+typedef struct virtio_blk_header_struct {
+  uint32 type;
+  uint32 reserved;
+  uint64 sector;
+} virtio_blk_header;
+
+typedef struct virtio_blk_slot_struct {
+  blk_request *req; // NULL when the slot is free
+  uint16 head;      // first descriptor of the chain
+  virtio_blk_header header;
+  volatile uint8 status;
+} virtio_blk_slot;
+
+typedef struct virtio_blk_device_struct {
+  uint8 id;
+  pci_function fn;
+  uint8 irq;
+  bool modern;
+
+  uint16 io_base; // legacy transport
+
+  volatile uint8 *common; // modern transport
+  volatile uint8 *isr;
+  volatile uint8 *device_cfg;
+  volatile uint8 *notify_base;
+  uint32 notify_mult;
+  volatile uint16 *notify; // of the queue
+
+  void *ring_mem;
+  uint16 queue_size;
+  volatile vring_desc *desc;
+  volatile vring_avail *avail;
+  volatile vring_used *used;
+  uint16 free_desc; // first of the list of free descriptors
+  uint16 last_used; // index of the next used ring entry to look at
+
+  bool flush; // the device has a write cache to flush
+  uint32 total_sectors;
+
+  uint8 nb_slots;
+  virtio_blk_slot slot[VIRTIO_BLK_SLOTS];
+
+  blk_queue queue;
+} virtio_blk_device;
+
+void setup_virtio_blk();
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -14,6 +14,7 @@
 #include "pic.h"
 #include "rtlib.h"
 #include "term.h"
+#include "thread.h"
 
 //-----------------------------------------------------------------------------
 
@@ -21,50 +22,56 @@
 // Interrupt handlers.
 //
 
+uint8 timer_source = TIMER_SOURCE_PIT;
+
+static bool local_apic_enabled = FALSE; // needed for MSIs
+
 void setup_intr() {
 #ifdef USE_APIC_FOR_TIMER
 
-  // Make sure that the local APIC is mapped to the default memory
-  // location and that it is enabled.
+  // Use the local APIC timer for the scheduler when there is a local
+  // APIC, otherwise fall back to the PIT.
 
-  uint32 dummy, features;
+  uint32 dummy, ext_features, features;
 
-  cpuid(1, dummy, dummy, dummy, features);
+  cpuid(1, dummy, dummy, ext_features, features);
 
-  if (features & HAS_MSR) {
-    uint64 x = rdmsr(MSR_APIC);
-    x &= MSR_APIC_BSP;
-    x |= MSR_APIC_BASE | MSR_APIC_E;
-    wrmsr(MSR_APIC, x);
-  }
+  if (features & HAS_APIC) {
 
-  uint32 x;
+    // Make sure that the local APIC is mapped to the default memory
+    // location and that it is enabled.
 
-  x = APIC_SVR;
-  x |= APIC_SVR_SW_ENABLE;    // Enable APIC
-  x &= ~APIC_SVR_FPC_DISABLE; // Enable Focus Processor Checking
-  x &= ~APIC_SVR_VECTOR_MASK;
-  x |= 0xcf; // low 4 bits of vector should be ones
-  APIC_SVR = x;
+    if (features & HAS_MSR) {
+      uint64 x = rdmsr(MSR_APIC);
+      x &= MSR_APIC_BSP;
+      x |= MSR_APIC_BASE | MSR_APIC_E;
+      wrmsr(MSR_APIC, x);
+    }
 
-  x = APIC_TPR;
-  x &= ~APIC_TPR_PRIO_MASK; // Accept all interrupts
-  APIC_TPR = x;
+    uint32 x;
 
-  x = APIC_LDR;
-  x &= ~APIC_LDR_LOGID_MASK; // Logical APIC ID = 0
-  APIC_LDR = x;
+    x = APIC_SVR;
+    x |= APIC_SVR_SW_ENABLE;    // Enable APIC
+    x &= ~APIC_SVR_FPC_DISABLE; // Enable Focus Processor Checking
+    x &= ~APIC_SVR_VECTOR_MASK;
+    x |= 0xcf; // low 4 bits of vector should be ones
+    APIC_SVR = x;
 
-  x = APIC_DFR;
-  x |= APIC_DFR_CONFIG(0x0f); // Flat model
-  APIC_DFR = x;
+    x = APIC_TPR;
+    x &= ~APIC_TPR_PRIO_MASK; // Accept all interrupts
+    APIC_TPR = x;
 
-#ifdef USE_APIC_FOR_TIMER
+    x = APIC_LDR;
+    x &= ~APIC_LDR_LOGID_MASK; // Logical APIC ID = 0
+    APIC_LDR = x;
+
+    x = APIC_DFR;
+    x |= APIC_DFR_CONFIG(0x0f); // Flat model
+    APIC_DFR = x;
 
 #if APIC_TIMER_DIVIDER == 1
 #define APIC_TIMER_DIV_CONF 0xb
 #endif
-
 #if APIC_TIMER_DIVIDER == 2
 #define APIC_TIMER_DIV_CONF 0x0
 #endif
@@ -87,41 +94,50 @@ void setup_intr() {
 #define APIC_TIMER_DIV_CONF 0xa
 #endif
 
-  APIC_TIMER_DIVIDE_CONFIG = APIC_TIMER_DIV_CONF; // configure divider
+    APIC_TIMER_DIVIDE_CONFIG = APIC_TIMER_DIV_CONF; // configure divider
 
-  x = APIC_LVTT;
-  x |= APIC_LVT_MASKED;     // Mask timer interrupt
-  x &= ~APIC_LVTT_PERIODIC; // One-shot mode
-  x &= ~APIC_LVT_VECTOR_MASK;
-  x |= 0xa0;
-  APIC_LVTT = x;
+    x = APIC_LVTT;
+    x |= APIC_LVT_MASKED;      // Mask timer interrupt
+    x &= ~APIC_LVTT_MODE_MASK; // One-shot mode
+    x &= ~APIC_LVT_VECTOR_MASK;
+    x |= 0xa0;
+    APIC_LVTT = x;
 
-#endif
+    x = APIC_LVTTM;
+    x |= APIC_LVT_MASKED; // Mask thermal sensor interrupt
+    APIC_LVTTM = x;
+
+    x = APIC_LVTPC;
+    x |= APIC_LVT_MASKED; // Mask performance counter interrupt
+    APIC_LVTPC = x;
+
+    // The PICs still deliver the device interrupts, through local
+    // interrupt 0 (virtual wire mode), so it must stay unmasked.
 
-  x = APIC_LVTTM;
-  x |= APIC_LVT_MASKED; // Mask thermal sensor interrupt
-  APIC_LVTTM = x;
+    x = APIC_LVT0;
+    x &= ~APIC_LVT_MASKED; // Unmask local interrupt 0 interrupt
+    x &= ~APIC_LVT_LTM;    // Edge trigger mode
+    x &= ~APIC_LVT_POL;    // Interrupt input pin polarity = 0
+    x &= ~APIC_LVT_DM_MASK;
+    x |= APIC_LVT_DM_EXTINT; // Delivery mode = ExtINT
+    APIC_LVT0 = x;
 
-  x = APIC_LVTPC;
-  x |= APIC_LVT_MASKED; // Mask performance counter interrupt
-  APIC_LVTPC = x;
+    x = APIC_LVT1;
+    x |= APIC_LVT_MASKED; // Mask local interrupt 1 interrupt
+    APIC_LVT1 = x;
 
-  x = APIC_LVT0;
-  x |= APIC_LVT_MASKED; // Mask local interrupt 0 interrupt
-  x |= APIC_LVT_LTM;    // Level trigger mode
-  x |= APIC_LVT_RIRR;   // Remote IRR
-  x |= APIC_LVT_POL;    // Interrupt input pin polarity = 1
-  x &= ~APIC_LVT_DM_MASK;
-  x |= APIC_LVT_DM_EXTINT; // Delivery mode = ExtINT
-  APIC_LVT0 = x;
+    x = APIC_LVTE;
+    x |= APIC_LVT_MASKED; // Mask error interrupt
+    APIC_LVTE = x;
 
-  x = APIC_LVT1;
-  x |= APIC_LVT_MASKED; // Mask local interrupt 1 interrupt
-  APIC_LVT1 = x;
+    local_apic_enabled = TRUE;
 
-  x = APIC_LVTE;
-  x |= APIC_LVT_MASKED; // Mask error interrupt
-  APIC_LVTE = x;
+    if ((ext_features & HAS_TSC_DEADLINE) && (features & HAS_TSC) &&
+        (features & HAS_MSR))
+      timer_source = TIMER_SOURCE_TSC_DEADLINE;
+    else
+      timer_source = TIMER_SOURCE_APIC;
+  }
 
 #endif
 
@@ -162,6 +178,90 @@ void setup_intr() {
        PIC_PORT_SLAVE_OCW1);
 }
 
+// Handlers of the PCI devices. The devices of a PCI interrupt pin can
+// share the IRQ it is routed to, so every handler of the IRQ is called
+// and checks whether its device interrupted.
+
+typedef struct intr_handler_entry_struct {
+  intr_handler fn;
+  void *data;
+} intr_handler_entry;
+
+static intr_handler_entry intr_handlers[16][INTR_HANDLERS_PER_IRQ];
+
+static bool intr_irq_is_shareable(uint8 irq) {
+  return irq == 5 || irq == 9 || irq == 10 || irq == 11;
+}
+
+bool intr_add_handler(uint8 irq, intr_handler fn, void *data) {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+  bool added = FALSE;
+
+  if (!intr_irq_is_shareable(irq))
+    return FALSE;
+
+  CLI();
+
+  for (uint32 i = 0; i < INTR_HANDLERS_PER_IRQ; i++) {
+    intr_handler_entry *e = &intr_handlers[irq][i];
+    if (e->fn == NULL) {
+      e->data = data;
+      e->fn = fn;
+      ENABLE_IRQ(irq);
+      added = TRUE;
+      break;
+    }
+  }
+
+  if (enabled)
+    STI();
+
+  return added;
+}
+
+static intr_handler_entry intr_msi_handlers[MSI_VECTORS];
+
+bool intr_add_msi_handler(intr_handler fn, void *data, uint32 *msi_address,
+                          uint16 *msi_data) {
+  bool enabled = ARE_INTERRUPTS_ENABLED();
+  bool added = FALSE;
+
+  if (!local_apic_enabled)
+    return FALSE;
+
+  CLI();
+
+  for (uint32 i = 0; i < MSI_VECTORS; i++) {
+    intr_handler_entry *e = &intr_msi_handlers[i];
+    if (e->fn == NULL) {
+      e->data = data;
+      e->fn = fn;
+
+      // Fixed delivery, edge triggered, to this CPU's local APIC
+
+      *msi_address = MSR_APIC_BASE | ((APIC_LOCAL_APIC_ID >> 24) << 12);
+      *msi_data = MSI_VECTOR_BASE + i;
+      added = TRUE;
+      break;
+    }
+  }
+
+  if (enabled)
+    STI();
+
+  return added;
+}
+
+// Called before the IRQ is acknowledged, so that a level triggered
+// line is deasserted by the handlers first
+static void intr_dispatch(uint8 irq) {
+  for (uint32 i = 0; i < INTR_HANDLERS_PER_IRQ; i++) {
+    intr_handler_entry *e = &intr_handlers[irq][i];
+    if (e->fn != NULL)
+      e->fn(e->data);
+  }
+}
+
 #ifndef USE_PIT_FOR_TIMER
 
 void irq0() {
@@ -221,6 +321,7 @@ void irq5() {
   term_write(cout, "\033[41m irq5 \033[0m");
 #endif
 
+  intr_dispatch(5);
   ACKNOWLEDGE_IRQ(5);
 }
 
@@ -257,6 +358,7 @@ void irq9() {
   term_write(cout, "\033[41m irq9 \033[0m");
 #endif
 
+  intr_dispatch(9);
   ACKNOWLEDGE_IRQ(9);
 }
 
@@ -265,6 +367,7 @@ void irq10() {
   term_write(cout, "\033[41m irq10 \033[0m");
 #endif
 
+  intr_dispatch(10);
   ACKNOWLEDGE_IRQ(10);
 }
 
@@ -273,6 +376,7 @@ void irq11() {
   term_write(cout, "\033[41m irq11 \033[0m");
 #endif
 
+  intr_dispatch(11);
   ACKNOWLEDGE_IRQ(11);
 }
 
@@ -332,6 +436,19 @@ void APIC_timer_irq() {
 
 #endif
 
+void msi_irq(uint32 n) {
+#ifdef SHOW_INTERRUPTS
+  term_write(cout, "\033[41m msi irq \033[0m");
+#endif
+
+  intr_handler_entry *e = &intr_msi_handlers[n];
+
+  if (e->fn != NULL)
+    e->fn(e->data);
+
+  APIC_EOI = 0;
+}
+
 void APIC_spurious_irq() {
 #ifdef SHOW_INTERRUPTS
   term_write(cout, "\033[41m APIC spurious irq \033[0m");
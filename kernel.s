@@ -597,6 +597,62 @@ APIC_TIMER_INTR = 0xa0
   movl  %eax,%es:8*APIC_TIMER_INTR+0
   movl  %ebx,%es:8*APIC_TIMER_INTR+4
 
+MSI0_INTR = 0xc0
+
+  movl  $msi0_intr,%ebx
+  call  gen_intr_descr
+  movl  %eax,%es:8*MSI0_INTR+0
+  movl  %ebx,%es:8*MSI0_INTR+4
+
+MSI1_INTR = 0xc1
+
+  movl  $msi1_intr,%ebx
+  call  gen_intr_descr
+  movl  %eax,%es:8*MSI1_INTR+0
+  movl  %ebx,%es:8*MSI1_INTR+4
+
+MSI2_INTR = 0xc2
+
+  movl  $msi2_intr,%ebx
+  call  gen_intr_descr
+  movl  %eax,%es:8*MSI2_INTR+0
+  movl  %ebx,%es:8*MSI2_INTR+4
+
+MSI3_INTR = 0xc3
+
+  movl  $msi3_intr,%ebx
+  call  gen_intr_descr
+  movl  %eax,%es:8*MSI3_INTR+0
+  movl  %ebx,%es:8*MSI3_INTR+4
+
+MSI4_INTR = 0xc4
+
+  movl  $msi4_intr,%ebx
+  call  gen_intr_descr
+  movl  %eax,%es:8*MSI4_INTR+0
+  movl  %ebx,%es:8*MSI4_INTR+4
+
+MSI5_INTR = 0xc5
+
+  movl  $msi5_intr,%ebx
+  call  gen_intr_descr
+  movl  %eax,%es:8*MSI5_INTR+0
+  movl  %ebx,%es:8*MSI5_INTR+4
+
+MSI6_INTR = 0xc6
+
+  movl  $msi6_intr,%ebx
+  call  gen_intr_descr
+  movl  %eax,%es:8*MSI6_INTR+0
+  movl  %ebx,%es:8*MSI6_INTR+4
+
+MSI7_INTR = 0xc7
+
+  movl  $msi7_intr,%ebx
+  call  gen_intr_descr
+  movl  %eax,%es:8*MSI7_INTR+0
+  movl  %ebx,%es:8*MSI7_INTR+4
+
 APIC_SPURIOUS_INTR = 0xcf
 
   movl  $APIC_spurious_intr,%ebx
@@ -1161,6 +1217,110 @@ APIC_timer_intr:
   popl  %eax
   iret
 
+msi0_intr:
+
+  .globl msi_irq
+
+  cli
+  pusha
+  pushl $0
+  call  msi_irq
+  addl  $4,%esp
+  popa
+  sti
+  iret
+
+msi1_intr:
+
+  .globl msi_irq
+
+  cli
+  pusha
+  pushl $1
+  call  msi_irq
+  addl  $4,%esp
+  popa
+  sti
+  iret
+
+msi2_intr:
+
+  .globl msi_irq
+
+  cli
+  pusha
+  pushl $2
+  call  msi_irq
+  addl  $4,%esp
+  popa
+  sti
+  iret
+
+msi3_intr:
+
+  .globl msi_irq
+
+  cli
+  pusha
+  pushl $3
+  call  msi_irq
+  addl  $4,%esp
+  popa
+  sti
+  iret
+
+msi4_intr:
+
+  .globl msi_irq
+
+  cli
+  pusha
+  pushl $4
+  call  msi_irq
+  addl  $4,%esp
+  popa
+  sti
+  iret
+
+msi5_intr:
+
+  .globl msi_irq
+
+  cli
+  pusha
+  pushl $5
+  call  msi_irq
+  addl  $4,%esp
+  popa
+  sti
+  iret
+
+msi6_intr:
+
+  .globl msi_irq
+
+  cli
+  pusha
+  pushl $6
+  call  msi_irq
+  addl  $4,%esp
+  popa
+  sti
+  iret
+
+msi7_intr:
+
+  .globl msi_irq
+
+  cli
+  pusha
+  pushl $7
+  call  msi_irq
+  addl  $4,%esp
+  popa
+  sti
+  iret
+
 APIC_spurious_intr:
 
   .globl APIC_spurious_irq
@@ -7,8 +7,10 @@
 #define ENOENT 2  // No such file or directory
 #define EINTR  4  // Interrupted system call
 #define EAGAIN 11 // Try again
+#define ENOMEM 12 // Out of memory
 #define EEXIST 17 // File exists
 #define ENOTDIR 20 // Not a directory
+#define EINVAL 22 // Invalid argument
 #define	ERANGE 34 // Math result not representable
 
 extern int errno;
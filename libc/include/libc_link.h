@@ -93,13 +93,6 @@ struct libc_link {
   char *(*_getenv)(const char *__name);
   int (*_system)(const char *__command);
 
-  // string.h
-#if 0
-  void *(*_memcpy)(void *__restrict __dest, const void *__restrict __src,
-                   size_t __n);
-  void *(*_memmove)(void *__dest, const void *__src, size_t __n);
-#endif
-
   // termios.h
   int (*_tcgetattr)(int __fd, struct termios *__termios_p);
   int (*_tcsetattr)(int __fd, int __optional_actions,
@@ -146,6 +139,22 @@ struct libc_link {
 #endif
 
   // *** add new things below here for backward compatibility ***
+
+  // stdlib.h
+  void *(*_realloc)(void *__ptr, size_t __size);
+  void *(*_calloc)(size_t __nmemb, size_t __size);
+  void *(*_memalign)(size_t __alignment, size_t __size);
+  int (*_posix_memalign)(void **__memptr, size_t __alignment, size_t __size);
+  void *(*_aligned_alloc)(size_t __alignment, size_t __size);
+
+  // string.h
+  void *(*_memcpy)(void *__restrict __dest, const void *__restrict __src,
+                   size_t __n);
+  void *(*_memmove)(void *__dest, const void *__src, size_t __n);
+  void *(*_memset)(void *__s, int __c, size_t __n);
+  int (*_memcmp)(const void *__s1, const void *__s2, size_t __n);
+  size_t (*_strlen)(const char *__s);
+  int (*_strcmp)(const char *__s1, const char *__s2);
 };
 
 #ifdef USE_MIMOSA_LIBC_LINK
@@ -9,6 +9,17 @@ extern void *REDIRECT_NAME(malloc)(size_t __size);
 
 extern void REDIRECT_NAME(free)(void *__ptr);
 
+extern void *REDIRECT_NAME(realloc)(void *__ptr, size_t __size);
+
+extern void *REDIRECT_NAME(calloc)(size_t __nmemb, size_t __size);
+
+extern void *REDIRECT_NAME(memalign)(size_t __alignment, size_t __size);
+
+extern int REDIRECT_NAME(posix_memalign)(void **__memptr, size_t __alignment,
+                                         size_t __size);
+
+extern void *REDIRECT_NAME(aligned_alloc)(size_t __alignment, size_t __size);
+
 extern void REDIRECT_NAME(exit)(int __status);
 
 //extern char **environ;
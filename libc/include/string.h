@@ -13,6 +13,14 @@ void *REDIRECT_NAME(memcpy)(void *__restrict __dest, const void *__restrict __sr
 
 extern void *REDIRECT_NAME(memmove)(void *__dest, const void *__src, size_t __n);
 
+extern void *REDIRECT_NAME(memset)(void *__s, int __c, size_t __n);
+
+extern int REDIRECT_NAME(memcmp)(const void *__s1, const void *__s2, size_t __n);
+
+extern size_t REDIRECT_NAME(strlen)(const char *__s);
+
+extern int REDIRECT_NAME(strcmp)(const char *__s1, const char *__s2);
+
 #ifndef USE_LIBC_LINK
 
 extern void libc_init_string(void);
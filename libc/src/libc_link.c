@@ -92,12 +92,6 @@ void libc_init(void) {
   LIBC_LINK._getenv = REDIRECT_NAME(getenv);
   LIBC_LINK._system = REDIRECT_NAME(system);
 
-  // string.h
-#if 0
-  LIBC_LINK._memcpy = REDIRECT_NAME(memcpy);
-  LIBC_LINK._memmove = REDIRECT_NAME(memmove);
-#endif
-
   // termios.h
   LIBC_LINK._tcgetattr = REDIRECT_NAME(tcgetattr);
   LIBC_LINK._tcsetattr = REDIRECT_NAME(tcsetattr);
@@ -134,6 +128,21 @@ void libc_init(void) {
   LIBC_LINK._set_gstate = REDIRECT_NAME(set_gstate);
 #endif
 
+  // stdlib.h
+  LIBC_LINK._realloc = REDIRECT_NAME(realloc);
+  LIBC_LINK._calloc = REDIRECT_NAME(calloc);
+  LIBC_LINK._memalign = REDIRECT_NAME(memalign);
+  LIBC_LINK._posix_memalign = REDIRECT_NAME(posix_memalign);
+  LIBC_LINK._aligned_alloc = REDIRECT_NAME(aligned_alloc);
+
+  // string.h
+  LIBC_LINK._memcpy = REDIRECT_NAME(memcpy);
+  LIBC_LINK._memmove = REDIRECT_NAME(memmove);
+  LIBC_LINK._memset = REDIRECT_NAME(memset);
+  LIBC_LINK._memcmp = REDIRECT_NAME(memcmp);
+  LIBC_LINK._strlen = REDIRECT_NAME(strlen);
+  LIBC_LINK._strcmp = REDIRECT_NAME(strcmp);
+
   libc_trace("libc_init_dirent");
   libc_init_dirent();
   libc_trace("libc_init_errno");
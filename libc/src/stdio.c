@@ -26,6 +26,14 @@ FILE FILE_stdout;
 FILE FILE_stderr;
 FILE FILE_root_dir;
 
+// Streams backed by a file of a file system, as opposed to the
+// console streams and the root directory
+static bool is_file_stream(FILE *__stream) {
+  return __stream != &FILE_stdin && __stream != &FILE_stdout &&
+         __stream != &FILE_stderr && __stream != &FILE_root_dir &&
+         __stream->f != NULL;
+}
+
 #endif
 
 #endif
@@ -224,6 +232,13 @@ int REDIRECT_NAME(fclose)(FILE *__restrict __stream) {
   return fclose(__stream);
 
 #else
+
+  // Nothing is buffered in the stream, but what was written must reach
+  // the disk
+  if (is_file_stream(__stream) && ERROR(file_sync(__stream->f))) {
+    return (-1);
+  }
+
   return 0;
 
   // Before doing actual flclose, all streams must be actually streams (STDERR and STDOUT) 
@@ -256,7 +271,15 @@ int REDIRECT_NAME(fflush)(FILE *__restrict __stream) {
 
 #else
 
-  // TODO: implement
+  // Writes go through to the disk cache, but the size of a file reaches
+  // its directory entry only when its stream is flushed or closed, which
+  // a NULL stream doesn't do for the open streams
+  if (NULL != __stream && is_file_stream(__stream) &&
+      ERROR(file_sync(__stream->f))) {
+    __stream->err = UNKNOWN_ERROR;
+    return (-1);
+  }
+
   return 0;
 
 #endif
@@ -1,10 +1,13 @@
 #include "include/libc_common.h"
+#include "include/errno.h"
 #include "include/stdlib.h"
+#include "include/string.h"
 
 #ifdef USE_MIMOSA
 
 mutex *allocator_mutex = NULL;
 #include "heap.h"
+#include "tlsf.h"
 
 #endif
 
@@ -31,7 +34,11 @@ void *REDIRECT_NAME(malloc)(size_t __size) {
   void* result;
 
   mutex_lock(allocator_mutex);
+#ifdef USE_TLSF_FOR_APPHEAP
+  result = tlsf_malloc(&apptlsf, __size);
+#else
   result = heap_malloc(&appheap, __size);
+#endif
   mutex_unlock(allocator_mutex);
 
   return result; 
@@ -80,7 +87,11 @@ void REDIRECT_NAME(free)(void *__ptr) {
 
 #ifdef USE_MIMOSA
   mutex_lock(allocator_mutex);
+#ifdef USE_TLSF_FOR_APPHEAP
+  tlsf_free(&apptlsf, __ptr);
+#else
   heap_free(&appheap, __ptr);
+#endif
   mutex_unlock(allocator_mutex);
   return;
 
@@ -93,6 +104,187 @@ void REDIRECT_NAME(free)(void *__ptr) {
 #endif
 }
 
+void *REDIRECT_NAME(realloc)(void *__ptr, size_t __size) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._realloc(__ptr, __size);
+
+#else
+
+  libc_trace("realloc");
+
+#ifdef USE_HOST_LIBC
+
+  return realloc(__ptr, __size);
+
+#else
+
+#ifdef USE_MIMOSA
+
+  void* result;
+
+  mutex_lock(allocator_mutex);
+#ifdef USE_TLSF_FOR_APPHEAP
+  result = tlsf_realloc(&apptlsf, __ptr, __size);
+#else
+  result = heap_realloc(&appheap, __ptr, __size);
+#endif
+  mutex_unlock(allocator_mutex);
+
+  return result;
+
+#else
+
+  // TODO: implement
+  return NULL;
+
+#endif
+
+#endif
+#endif
+}
+
+void *REDIRECT_NAME(calloc)(size_t __nmemb, size_t __size) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._calloc(__nmemb, __size);
+
+#else
+
+  libc_trace("calloc");
+
+#ifdef USE_HOST_LIBC
+
+  return calloc(__nmemb, __size);
+
+#else
+
+  size_t bytes = __nmemb * __size;
+
+  if (__size != 0 && bytes / __size != __nmemb) {
+    return NULL; // overflow
+  }
+
+  void *result = REDIRECT_NAME(malloc)(bytes);
+
+  if (result != NULL) {
+    REDIRECT_NAME(memset)(result, 0, bytes);
+  }
+
+  return result;
+
+#endif
+#endif
+}
+
+void *REDIRECT_NAME(memalign)(size_t __alignment, size_t __size) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._memalign(__alignment, __size);
+
+#else
+
+  libc_trace("memalign");
+
+#ifdef USE_HOST_LIBC
+
+  return memalign(__alignment, __size);
+
+#else
+
+  if (__alignment == 0 || (__alignment & (__alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+#ifdef USE_MIMOSA
+
+  void* result;
+
+  mutex_lock(allocator_mutex);
+#ifdef USE_TLSF_FOR_APPHEAP
+  result = tlsf_memalign(&apptlsf, __alignment, __size);
+#else
+  result = heap_memalign(&appheap, __alignment, __size);
+#endif
+  mutex_unlock(allocator_mutex);
+
+  return result;
+
+#else
+
+  // TODO: implement
+  return NULL;
+
+#endif
+
+#endif
+#endif
+}
+
+int REDIRECT_NAME(posix_memalign)(void **__memptr, size_t __alignment,
+                                  size_t __size) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._posix_memalign(__memptr, __alignment, __size);
+
+#else
+
+  libc_trace("posix_memalign");
+
+#ifdef USE_HOST_LIBC
+
+  return posix_memalign(__memptr, __alignment, __size);
+
+#else
+
+  void *result;
+
+  if (__alignment < sizeof(void*) ||
+      (__alignment & (__alignment - 1)) != 0) {
+    return EINVAL;
+  }
+
+  result = REDIRECT_NAME(memalign)(__alignment, __size);
+
+  if (result == NULL) {
+    return ENOMEM;
+  }
+
+  *__memptr = result;
+
+  return 0;
+
+#endif
+#endif
+}
+
+void *REDIRECT_NAME(aligned_alloc)(size_t __alignment, size_t __size) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._aligned_alloc(__alignment, __size);
+
+#else
+
+  libc_trace("aligned_alloc");
+
+#ifdef USE_HOST_LIBC
+
+  return aligned_alloc(__alignment, __size);
+
+#else
+
+  return REDIRECT_NAME(memalign)(__alignment, __size);
+
+#endif
+#endif
+}
+
 void REDIRECT_NAME(exit)(int __status) {
 
 #ifdef USE_LIBC_LINK
@@ -1,22 +1,68 @@
 #include "include/libc_common.h"
 #include "include/string.h"
 
-#ifndef USE_MIMOSA
+#ifdef USE_MIMOSA
+
+#include "rtlib.h"
+
+#endif
+
 #ifdef __cplusplus
 extern "C"
 #endif
 void *REDIRECT_NAME(memcpy)(void *__restrict __dest, const void *__restrict __src,
                                        size_t __n) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._memcpy(__dest, __src, __n);
+
+#else
+
+#ifdef USE_HOST_LIBC
+
+  return memcpy(__dest, __src, __n);
+
+#else
+
+#ifdef USE_MIMOSA
+
+  return memcpy(__dest, __src, __n);
+
+#else
+
   return REDIRECT_NAME(memmove)(__dest, __src, __n);
-}
+
 #endif
 
+#endif
+#endif
+}
+
 void *REDIRECT_NAME(memmove)(void *__dest, const void *__src, size_t __n) {
 
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._memmove(__dest, __src, __n);
+
+#else
+
+#ifdef USE_HOST_LIBC
+
+  return memmove(__dest, __src, __n);
+
+#else
+
+#ifdef USE_MIMOSA
+
+  return memmove(__dest, __src, __n);
+
+#else
+
   char *s = (char*)__src;
   char *d = (char*)__dest;
   if (s != d) {
-    if (s < d) {
+    if (d < s) {
       char *e = s + __n;
       while (s < e) *d++ = *s++;
     } else {
@@ -27,6 +73,139 @@ void *REDIRECT_NAME(memmove)(void *__dest, const void *__src, size_t __n) {
     }
   }
   return __dest;
+
+#endif
+
+#endif
+#endif
+}
+
+void *REDIRECT_NAME(memset)(void *__s, int __c, size_t __n) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._memset(__s, __c, __n);
+
+#else
+
+#ifdef USE_HOST_LIBC
+
+  return memset(__s, __c, __n);
+
+#else
+
+#ifdef USE_MIMOSA
+
+  return memset(__s, __c, __n);
+
+#else
+
+  unsigned char *p = (unsigned char*)__s;
+  while (__n-- > 0) *p++ = __c;
+  return __s;
+
+#endif
+
+#endif
+#endif
+}
+
+int REDIRECT_NAME(memcmp)(const void *__s1, const void *__s2, size_t __n) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._memcmp(__s1, __s2, __n);
+
+#else
+
+#ifdef USE_HOST_LIBC
+
+  return memcmp(__s1, __s2, __n);
+
+#else
+
+#ifdef USE_MIMOSA
+
+  return memcmp(__s1, __s2, __n);
+
+#else
+
+  unsigned char *p1 = (unsigned char*)__s1;
+  unsigned char *p2 = (unsigned char*)__s2;
+  for (; __n > 0; __n--, p1++, p2++) {
+    if (*p1 != *p2) return *p1 - *p2;
+  }
+  return 0;
+
+#endif
+
+#endif
+#endif
+}
+
+size_t REDIRECT_NAME(strlen)(const char *__s) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._strlen(__s);
+
+#else
+
+#ifdef USE_HOST_LIBC
+
+  return strlen(__s);
+
+#else
+
+#ifdef USE_MIMOSA
+
+  // kstrlen counts the terminator
+  return kstrlen(CAST(native_string, __s)) - 1;
+
+#else
+
+  const char *p = __s;
+  while (*p != '\0') p++;
+  return p - __s;
+
+#endif
+
+#endif
+#endif
+}
+
+int REDIRECT_NAME(strcmp)(const char *__s1, const char *__s2) {
+
+#ifdef USE_LIBC_LINK
+
+  return LIBC_LINK._strcmp(__s1, __s2);
+
+#else
+
+#ifdef USE_HOST_LIBC
+
+  return strcmp(__s1, __s2);
+
+#else
+
+#ifdef USE_MIMOSA
+
+  return kstrcmp(CAST(native_string, __s1), CAST(native_string, __s2));
+
+#else
+
+  unsigned char *p1 = (unsigned char*)__s1;
+  unsigned char *p2 = (unsigned char*)__s2;
+  while (*p1 != '\0' && *p1 == *p2) {
+    p1++;
+    p2++;
+  }
+  return *p1 - *p2;
+
+#endif
+
+#endif
+#endif
 }
 
 #ifndef USE_LIBC_LINK
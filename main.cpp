@@ -99,8 +99,11 @@ int main() {
     } else if (err != EOF_ERROR) {
       panic(L"Error!");
     }
-#endif
     thread_yield();
+#else
+    // Nothing left to do here, let the CPU idle
+    thread_sleep_seconds(3600);
+#endif
   } while (1);
 
   return 0;
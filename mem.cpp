@@ -0,0 +1,212 @@
+// file: "mem.cpp"
+
+// Memory routines and the word-at-a-time string scans of the kernel.
+// They are apart from rtlib.cpp so the host tests can link them alone.
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+#include "rtlib.h"
+
+//-----------------------------------------------------------------------------
+
+// The bulk copy and fill routines are selected by "identify_cpu" once
+// the CPU features are known. Until then the "rep movsd" routines,
+// which work on every CPU, are used. CPUs with enhanced "rep movsb" and
+// "rep stosb" (ERMS) move whole cache lines with the byte variants.
+// SSE is not used since CR4.OSFXSR is not set and the context switch
+// does not save the XMM registers.
+
+// Under this size a plain loop is cheaper than setting up a "rep"
+#define REP_THRESHOLD 16
+
+// Nonzero iff one of the bytes of the word w is zero
+#define HAS_ZERO_BYTE(w) (((w)-0x01010101) & ~(w)&0x80808080)
+
+static void memcpy_rep_movsd(void *dest, const void *src, size_t n) {
+  uint32 d0, d1, d2;
+  __asm__ __volatile__("rep movsl       \n\t"
+                       "movl %4,%%ecx   \n\t"
+                       "rep movsb"
+                       : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                       : "0"(n >> 2), "g"(n & 3), "1"(dest), "2"(src)
+                       : "memory");
+}
+
+static void memcpy_rep_movsb(void *dest, const void *src, size_t n) {
+  uint32 d0, d1, d2;
+  __asm__ __volatile__("rep movsb"
+                       : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                       : "0"(n), "1"(dest), "2"(src)
+                       : "memory");
+}
+
+static void memset_rep_stosd(void *dest, uint8 c, size_t n) {
+  uint32 d0, d1;
+  __asm__ __volatile__("rep stosl       \n\t"
+                       "movl %3,%%ecx   \n\t"
+                       "rep stosb"
+                       : "=&c"(d0), "=&D"(d1)
+                       : "a"(c * 0x01010101), "g"(n & 3), "0"(n >> 2),
+                         "1"(dest)
+                       : "memory");
+}
+
+static void memset_rep_stosb(void *dest, uint8 c, size_t n) {
+  uint32 d0, d1;
+  __asm__ __volatile__("rep stosb"
+                       : "=&c"(d0), "=&D"(d1)
+                       : "a"(c), "0"(n), "1"(dest)
+                       : "memory");
+}
+
+static void (*memcpy_bulk)(void *dest, const void *src,
+                           size_t n) = memcpy_rep_movsd;
+
+static void (*memset_bulk)(void *dest, uint8 c, size_t n) = memset_rep_stosd;
+
+extern "C" void *memcpy(void *dest, const void *src, size_t n) {
+  if (n < REP_THRESHOLD) {
+    uint8 *d = CAST(uint8 *, dest);
+    uint8 *s = CAST(uint8 *, src);
+    while (n-- > 0)
+      *d++ = *s++;
+  } else {
+    memcpy_bulk(dest, src, n);
+  }
+  return dest;
+}
+
+extern "C" void *memmove(void *dest, const void *src, size_t n) {
+  uint8 *d = CAST(uint8 *, dest);
+  uint8 *s = CAST(uint8 *, src);
+
+  if (d <= s || d >= s + n) {
+    // A forward copy never overwrites bytes it has yet to read
+    return memcpy(dest, src, n);
+  }
+
+  // Copy backward. This is not done with "std; rep movs" because the
+  // interrupt handlers expect the direction flag to be clear.
+  d += n;
+  s += n;
+
+  while (n >= sizeof(uint32)) {
+    d -= sizeof(uint32);
+    s -= sizeof(uint32);
+    n -= sizeof(uint32);
+    *CAST(uint32 *, d) = *CAST(uint32 *, s);
+  }
+
+  while (n-- > 0)
+    *--d = *--s;
+
+  return dest;
+}
+
+extern "C" void *memset(void *dest, int c, size_t n) {
+  if (n < REP_THRESHOLD) {
+    uint8 *d = CAST(uint8 *, dest);
+    while (n-- > 0)
+      *d++ = c;
+  } else {
+    memset_bulk(dest, c, n);
+  }
+  return dest;
+}
+
+extern "C" int memcmp(const void *a, const void *b, size_t n) {
+  uint8 *p1 = CAST(uint8 *, a);
+  uint8 *p2 = CAST(uint8 *, b);
+
+  // Skip the equal words, the difference is then found bytewise
+  while (n >= sizeof(uint32) && *CAST(uint32 *, p1) == *CAST(uint32 *, p2)) {
+    p1 += sizeof(uint32);
+    p2 += sizeof(uint32);
+    n -= sizeof(uint32);
+  }
+
+  while (n-- > 0) {
+    if (*p1 != *p2)
+      return *p1 - *p2;
+    p1++;
+    p2++;
+  }
+
+  return 0;
+}
+
+void mem_use_erms() {
+  memcpy_bulk = memcpy_rep_movsb;
+  memset_bulk = memset_rep_stosb;
+}
+
+uint32 kstrlen(native_string a) {
+  native_char *p = a;
+
+  // Go bytewise up to a word boundary and then look for the
+  // terminator a word at a time
+  while ((CAST(uint32, p) & (sizeof(uint32) - 1)) != 0) {
+    if (*p == '\0')
+      return CAST(uint32, (p - a) + 1);
+    p++;
+  }
+
+  uint32 *w = CAST(uint32 *, p);
+  while (!HAS_ZERO_BYTE(*w)) {
+    w++;
+  }
+
+  p = CAST(native_char *, w);
+  while (*p != '\0') {
+    p++;
+  }
+
+  return CAST(uint32, (p - a) + 1);
+}
+
+// Based off glibc's strcmp
+// I roughly modified it to fit in the general code style of mimosa
+int16 kstrcmp(native_string a, native_string b) {
+  uint8 *s1 = CAST(uint8 *, a);
+  uint8 *s2 = CAST(uint8 *, b);
+  uint8 c1, c2;
+
+  if (((CAST(uint32, s1) ^ CAST(uint32, s2)) & (sizeof(uint32) - 1)) == 0) {
+    // Both strings reach a word boundary at the same time, so the
+    // common prefix can be skipped a word at a time
+    while ((CAST(uint32, s1) & (sizeof(uint32) - 1)) != 0) {
+      if (*s1 != *s2 || *s1 == '\0')
+        return *s1 - *s2;
+      s1++;
+      s2++;
+    }
+
+    uint32 *w1 = CAST(uint32 *, s1);
+    uint32 *w2 = CAST(uint32 *, s2);
+    while (*w1 == *w2 && !HAS_ZERO_BYTE(*w1)) {
+      w1++;
+      w2++;
+    }
+
+    s1 = CAST(uint8 *, w1);
+    s2 = CAST(uint8 *, w2);
+  }
+
+  do {
+    c1 = *s1++;
+    c2 = *s2++;
+    if (c1 == '\0')
+      return c1 - c2;
+  } while (c1 == c2);
+  return c1 - c2;
+}
+
+//-----------------------------------------------------------------------------
+
+#undef REP_THRESHOLD
+#undef HAS_ZERO_BYTE
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -8,8 +8,10 @@
 
 //-----------------------------------------------------------------------------
 
+#include "ahci.h"
 #include "chrono.h"
 #include "disk.h"
+#include "drivers/filesystem/include/fat.h"
 #include "drivers/filesystem/include/stdstream.h"
 #include "drivers/filesystem/include/vfs.h"
 #include "heap.h"
@@ -20,7 +22,9 @@
 #include "rtlib.h"
 #include "term.h"
 #include "thread.h"
+#include "tlsf.h"
 #include "video.h"
+#include "virtio.h"
 
 void __rtlib_setup(); // forward declaration
 
@@ -151,6 +155,8 @@ uint8 log2(uint32 n) {
 
 // Memory management functions.
 
+uint64 total_usable_memory;
+
 void *kmalloc(size_t size) { return heap_malloc(&kheap, size); }
 
 void kfree(void *ptr) { heap_free(&kheap, ptr); }
@@ -161,16 +167,17 @@ static void setup_kheap() {
 }
 
 static void setup_appheap(void *start, uint64 len) {
+#ifdef USE_TLSF_FOR_APPHEAP
+  tlsf_init(&apptlsf, CAST(void *, start), len);
+#else
   heap_init(&appheap, CAST(void *, start), len);
+#endif
 }
 
-extern "C" void *memcpy(void *dest, const void *src, size_t n) {
-  uint8 *d = CAST(uint8 *, dest);
-  uint8 *s = CAST(uint8 *, src);
-  while (n-- > 0)
-    *d++ = *s++;
-  return dest;
-}
+//-----------------------------------------------------------------------------
+
+// String routines. The memory routines, kstrlen and kstrcmp are in
+// mem.cpp.
 
 native_string copy_without_trailing_spaces(uint8 *src, native_string dst,
                                            uint32 n) {
@@ -186,29 +193,6 @@ native_string copy_without_trailing_spaces(uint8 *src, native_string dst,
   return dst + end;
 }
 
-uint32 kstrlen(native_string a) {
-  native_char *p = a;
-  while (*p != '\0') {
-    p++;
-  }
-  return CAST(uint32, (p - a) + 1);
-}
-
-// Based off glibc's strcmp
-// I roughly modified it to fit in the general code style of mimosa
-int16 kstrcmp(native_string a, native_string b) {
-  native_string s1 = CAST(native_string, a);
-  native_string s2 = CAST(native_string, b);
-  native_char c1, c2;
-  do {
-    c1 = CAST(native_char, *s1++);
-    c2 = CAST(native_char, *s2++);
-    if (c1 == '\0')
-      return c1 - c2;
-  } while (c1 == c2);
-  return c1 - c2;
-}
-
 native_string kstrconcat(native_string a, native_string b) {
   uint32 alen = 0, blen = 0;
   native_char *p;
@@ -350,6 +334,8 @@ extern "C" void __rtlib_entry() {
 
       init(&z);
 
+      total_usable_memory += z.length;
+
 #ifdef PRINT_MEMORY_LAYOUT
       debug_write("USABLE");
 #endif
@@ -386,12 +372,22 @@ static void identify_cpu() {
   uint32 max_fn;
   native_char vendor[13];
   uint32 processor, dummy, features;
+  uint32 ext_features = 0;
 
   cpuid(0, max_fn, CAST(uint32 *, vendor)[0], CAST(uint32 *, vendor)[2],
         CAST(uint32 *, vendor)[1]);
   vendor[12] = '\0';
+
   cpuid(1, processor, dummy, dummy, features);
 
+  if (max_fn >= 7) {
+    cpuid_count(7, 0, dummy, ext_features, dummy, dummy);
+  }
+
+  if (ext_features & HAS_ERMS) {
+    mem_use_erms();
+  }
+
 #ifdef SHOW_CPU_INFO
 
   term_write(cout, "CPU is ");
@@ -463,6 +459,8 @@ static void identify_cpu() {
     term_write(cout, "  Automatic clock control\n");
   if (features & HAS_IA64)
     term_write(cout, "  IA64 instructions\n");
+  if (ext_features & HAS_ERMS)
+    term_write(cout, "  Enhanced REP MOVSB/STOSB\n");
 
 #ifdef USE_TSC_FOR_TIME
 
@@ -485,6 +483,23 @@ static void identify_cpu() {
 
 #endif
 #endif
+
+#ifdef USE_APIC_FOR_TIMER
+
+  term_write(cout, "Scheduler timer = ");
+  if (timer_source == TIMER_SOURCE_TSC_DEADLINE) {
+    term_write(cout, "local APIC, TSC-deadline mode (");
+    term_write(cout, _tsc_counts_per_sec);
+    term_write(cout, " Hz)\n");
+  } else if (timer_source == TIMER_SOURCE_APIC) {
+    term_write(cout, "local APIC, one-shot mode (");
+    term_write(cout, _apic_timer_counts_per_sec);
+    term_write(cout, " Hz)\n");
+  } else {
+    term_write(cout, "PIT\n");
+  }
+
+#endif
 #endif
 }
 
@@ -502,9 +517,6 @@ bool has_cut_ide_support() { return cut; }
 
 bool bridge_up() { return BU; }
 
-uint32 flow_uncontrolled_writer = 0;
-uint32 flow_controlled_writer = 0;
-
 /**
  * Send a Gambit interrupt. If
  * the gambit bridge is not configured,
@@ -516,67 +528,16 @@ uint8 send_gambit_int(uint8 int_no, uint8 *params, uint8 len) {
 
   if (BU) {
     /*
-     * For more details in how the interrupt queue synchronizes itself with
-     * the Scheme layer, @see the ./scheme/gambini.scm file.
+     * For more details in how the interrupt rings are laid out and
+     * drained, @see include/gambit_ring.h and the ./scheme/gambini.scm file.
      */
 
-    uint8 *mem = NULL;
-    uint32 *gambit_writer = NULL;
-    uint32 max_len = 0;
-
     if (FLOW_CONTROLLED(int_no)) {
-      mem = CAST(uint8 *, GAMBIT_FLOW_CONTROLLED_START);
-      max_len = GAMBIT_FLOW_CONTROLLED_LEN;
-      gambit_writer = &flow_controlled_writer;
+      gambit_ring_put(CAST(gambit_ring *, GAMBIT_FLOW_CONTROLLED_START),
+                      GAMBIT_FLOW_CONTROLLED_LEN, int_no, params, len);
     } else {
-      mem = CAST(uint8 *, GAMBIT_FLOW_UNCONTROLLED_START);
-      max_len = GAMBIT_FLOW_UNCONTROLLED_LEN;
-      gambit_writer = &flow_uncontrolled_writer;
-    }
-
-    /**
-     * Interrupts arguments are sent to gambit in the following way:
-     *  |                   |              |
-     *  |  INTERRUPT NUMBER | SZ OF PARAMS | PARAM 0 | PARAM 1 | ...
-     *  |                   |              |
-     *  This structure is called an interrupt frame. The interrupt number (and
-     * thus the frame) never starts by zero, which is how we can detect that the
-     * memory is accessible.
-     */
-    uint8 required_len = 2 + len; // number, size, + params
-
-    // By convention, if the interrupt number is 0, we are ok
-    uint32 scout = *gambit_writer;
-
-    uint32 i;
-
-    /* __debug_write("Int no: "); */
-    /* debug_write(int_no); */
-    /* debug_write("-----------------"); */
-    /* for(i = 0; i < 512; ++i) { */
-    /*     __debug_write(mem[i]); */
-    /* } */
-    /* debug_write("-----------------"); */
-
-    for (i = 0; i < required_len; ++i, scout = (scout + 1) % max_len) {
-      if (0 != mem[scout]) {
-        break;
-      }
-    }
-
-    if (i != required_len) {
-      // This should be avoided at all cost
-      /* debug_write("Interrupt queue full. Discarding"); */
-    } else {
-      scout = *gambit_writer;
-      mem[scout % max_len] = int_no;
-      mem[(scout + 1) % max_len] = len;
-
-      for (uint8 i = 0; i < len; ++i) {
-        mem[(scout + 2 + i) % max_len] = params[i];
-      }
-
-      *gambit_writer = (*gambit_writer + required_len) % max_len;
+      gambit_ring_put(CAST(gambit_ring *, GAMBIT_FLOW_UNCONTROLLED_START),
+                      GAMBIT_FLOW_UNCONTROLLED_LEN, int_no, params, len);
     }
 
     // Tell Gambit something is ready. This interrupt
@@ -628,7 +589,7 @@ void idle_thread_run() {
 
 #endif
     ASSERT_INTERRUPTS_ENABLED();
-    thread_yield();
+    sched_idle();
   }
 }
 
@@ -642,6 +603,11 @@ void __rtlib_setup() {
 
   thread *cache_block_maid_thread;
 
+#endif
+#ifdef USE_CACHE_BLOCK_FLUSHER
+
+  thread *cache_block_flusher_thread;
+
 #endif
 
   uint8 *mem = CAST(uint8 *, GAMBIT_SHARED_MEM_CMD);
@@ -660,23 +626,52 @@ void __rtlib_setup() {
 
   the_idle = CAST(thread *, kmalloc(sizeof(thread)));
   the_idle = new_thread(the_idle, idle_thread_run, "Idle thread");
-  // the_idle->_prio = null_priority;
+  the_idle->_prio = null_priority; // only runs when nothing else can
   the_idle->_quantum = frequency_to_time(10000); // Temp path for issue #56
 
   thread_start(the_idle);
 
+#ifdef SCHED_BENCHMARK
+  sched_benchmark();
+#endif
+
+  term_write(cout, "Loading up PCI devices...\n");
+  setup_pci();
+
   term_write(cout, "Loading up disks...\n");
   setup_disk();
 
   term_write(cout, "Loading up IDE controllers...\n");
   setup_ide();
 
+#ifdef USE_VIRTIO_BLK
+  term_write(cout, "Loading up virtio block devices...\n");
+  setup_virtio_blk();
+#endif
+
+#ifdef USE_AHCI
+  term_write(cout, "Loading up AHCI controllers...\n");
+  setup_ahci();
+#endif
+
+#ifdef DISK_BENCHMARK
+  disk_benchmark();
+#endif
+
+#ifdef DISK_CACHE_BENCHMARK
+  disk_cache_benchmark();
+#endif
+
   term_write(cout, "Loading up the virtual file system...\n");
 
   if (ERROR(err = init_vfs())) {
     goto setup_panic;
   }
 
+#ifdef FAT_SELF_TEST
+  fat_self_test();
+#endif
+
   if (ERROR(err = setup_ps2()))
     goto setup_panic;
 
@@ -704,6 +699,15 @@ void __rtlib_setup() {
   thread_start(new_thread(cache_block_maid_thread, cache_block_maid_run,
                           "Cache block maid"));
 
+#endif
+
+#ifdef USE_CACHE_BLOCK_FLUSHER
+
+  term_write(cout, "Loading the cache block flusher...\n");
+  cache_block_flusher_thread = CAST(thread *, kmalloc(sizeof(thread)));
+  thread_start(new_thread(cache_block_flusher_thread, cache_block_flusher_run,
+                          "Cache block flusher"));
+
 #endif
 
   main();
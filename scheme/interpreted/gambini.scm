@@ -17,6 +17,7 @@
         (fat32)
         (disk)
         (ide)
+        (pci)
         )
 
 (define (reboot)
@@ -30,10 +31,16 @@
 
 (define SHARED-MEMORY-AREA-LEN 32768)
 
+;; Interrupt rings, see include/gambit_ring.h
+(define RING-HEAD 0)
+(define RING-DROPPED 4)
+(define RING-TAIL 64)
+(define RING-DATA 128)
+
 (define FLOW-CONTROLLED-FIFO-START 33554432)
-(define FLOW-CONTROLLED-FIFO-LEN 10)
-(define FLOW-UNCONTROLLED-FIFO-START (+ FLOW-CONTROLLED-FIFO-LEN FLOW-CONTROLLED-FIFO-START))
-(define FLOW-UNCONTROLLED-FIFO-LEN (- SHARED-MEMORY-AREA-LEN FLOW-CONTROLLED-FIFO-LEN))
+(define FLOW-CONTROLLED-FIFO-LEN 64)
+(define FLOW-UNCONTROLLED-FIFO-START (+ FLOW-CONTROLLED-FIFO-START RING-DATA FLOW-CONTROLLED-FIFO-LEN))
+(define FLOW-UNCONTROLLED-FIFO-LEN 16384)
 
 ;;----------------------------------------------------
 ;;                    INIT SYS
@@ -53,68 +60,49 @@
     (if int-pair
         (thread-send (cdr int-pair) args))))
 
+;; The kernel appends frames at the head of a ring and we consume
+;; them from the tail. Only we write the tail, and only the kernel
+;; writes the head, so no synchronization is needed beyond reading
+;; a frame before moving the tail past it.
 (define (make-pmp name start len)
-  (define reader-offset 0)
-  ;; Compute a position from the current position
-  ;; Interrupts queue of things that need to be handled
-  ;; Offset is an array of integers that must be
-  ;; added back to the start pointer
-  (define (at . offset)
-    (+ start (modulo (apply + offset) len)))
-  (define (erase-and-move! total-len)
-    ;; See the following comment for why we erase backwards, and why this is important.
-    (for-each
-     (lambda (i) (store-u8 #f (at total-len -1 (- i) reader-offset) #x00))
-     (iota total-len))
-    (set! reader-offset (modulo (+ reader-offset total-len) len)))
+  (define mask (- len 1))
+  (define data (+ start RING-DATA))
+  (define (byte i)
+    (fetch-u8 #f (+ data (fxand i mask))))
+  (define (frame-params pos arr-len)
+    (let loop ((i (- arr-len 1)) (params '()))
+      (if (fx< i 0)
+          params
+          (loop (fx- i 1) (cons (byte (fx+ pos 2 i)) params)))))
+  ;; Dispatch every frame written so far, returns #f if there were none
   (lambda ()
-    (let ((int-no (fetch-u8 #f (at reader-offset))))
-      (if (fx= 0 int-no)
-          #f;; stop
-          (let* ((arr-len (fetch-u8 #f (at 1 reader-offset)))
-                 (params (map (lambda (n) (fetch-u8 #f (at 2 n reader-offset))) (iota arr-len)))
-                 (total-len (+ 2 arr-len)))
-            (dispatch-int int-no params)
-            (erase-and-move! total-len)
-            #t
-            )))
-    ))
+    (let ((head (peek-u32 (+ start RING-HEAD)))
+          (tail (peek-u32 (+ start RING-TAIL))))
+      (let loop ((pos tail))
+        (if (fx= pos head)
+            (and (not (fx= pos tail))
+                 (begin
+                   ;; Release the whole batch at once
+                   (poke-u32 pos (+ start RING-TAIL))
+                   #t))
+            (let* ((int-no (byte pos))
+                   (arr-len (byte (fx+ pos 1)))
+                   (params (frame-params pos arr-len)))
+              (dispatch-int int-no params)
+              (loop (fxand (fx+ pos 2 arr-len) mask))))))))
 
 (define upmp (make-pmp "upmp" FLOW-UNCONTROLLED-FIFO-START FLOW-UNCONTROLLED-FIFO-LEN))
 (define cpmp (make-pmp "cpmp" FLOW-CONTROLLED-FIFO-START FLOW-CONTROLLED-FIFO-LEN))
 
+;; Frames the kernel had to discard because a ring was full
+(define (interrupt-frames-dropped)
+  (+ (peek-u32 (+ FLOW-CONTROLLED-FIFO-START RING-DROPPED))
+     (peek-u32 (+ FLOW-UNCONTROLLED-FIFO-START RING-DROPPED))))
+
 (define (mimosa-interrupt-pump)
-  ;; We have no way to speak to the upper level to synchronize read operations
-  ;; We however need to synchronize read and write operations to the interrupt queue
-  ;; , since we want interrupts written in the queue to be read correctly.
-  ;; To achieve this, we make sure the first byte of the interrupt frame is never zero.
-  ;; We can ensure this by using our own interrupt codes. The C++ layer can therefore
-  ;; write on all memory cells that are not 0, as the first non-zero byte marks
-  ;; a non-empty section that follows.
-  ;; This is however not sufficient to ensure that accesses are done correctly.
-  ;; To achieve this, we need the guarantee that only one process at a time ever
-  ;; access the queue. Since the system is limited to a single thread/core (if not, it is now),
-  ;; this is not a problem.
-  ;; All the pump thread as to do now is ensure that bytes will never be written
-  ;; as zero until they have been placed into the Scheme heap. This is why we read
-  ;; all bytes as one go, and then erase them.
-  ;; To avoid the system potentially erasing interrupts that are being written
-  ;; while the system is switching, we also erase them starting from the end of
-  ;; the frame. Here is an example to see how this might happen if we do not.
-  ;;
-  ;;                      0               1   2   3   4
-  ;; Current frame:       | int_code  > 0 | 3 | 0 | 0 | 1 |
-  ;; Incoming interrupt : | int_code' > 0 | 2 | 2 | 1 |
-  ;; Incomplete frame:    |        0      | 0 | 0 | 0 | 1 |
-  ;; Partial frame :      | int_code' > 0 | 2 | 2 | 1 |
-  ;;
-  ;; If we erase from the front, we can imagine a case where cell 0 is erase up until cell
-  ;; 2. We can then suppose a context switch happens. We get the incomplete frame.
-  ;; The incoming interrupt is being written, since entries are 0, and we get the
-  ;; partial frame illustrated above.
-  ;; We context switch back to the erase routine, which completes erasing cells
-  ;; 2,3,4, erasing the parameters of the interrupt.
-  ;; This is unlikely, but it would be very, very hard to debug.
+  ;; Each call to a pump drains all the frames of its ring, so keep
+  ;; going until the kernel has nothing more for us. Frames that come
+  ;; in after the last check raise interrupt 5 again.
   (let pmp ()
     (let ((a (cpmp))
           (b (upmp)))
@@ -9,6 +9,8 @@
           outb
           inw
           outw
+          peek-u32
+          poke-u32
           enable-interrupts
           disable-interrupts)
   (begin
@@ -96,6 +98,29 @@
           (x86-shl   cgc (x86-eax) (x86-imm-int 2))
           (x86-ret   cgc))))
 
+    ;; Aligned 32 bit memory accesses, done in a single instruction so
+    ;; that the C side never sees half of a store. Values must fit in
+    ;; a fixnum.
+    (define peek-u32 ;; parameter: address
+      (asm
+        (lambda (cgc)
+          (x86-mov   cgc (x86-edx) (x86-mem 4 (x86-esp))) ; load the address
+          (x86-sar   cgc (x86-edx) (x86-imm-int 2))
+          (x86-mov   cgc (x86-eax) (x86-mem 0 (x86-edx)))
+          (x86-shl   cgc (x86-eax) (x86-imm-int 2))
+          (x86-ret   cgc))))
+
+    (define poke-u32 ;; parameters: value and address
+      (asm
+        (lambda (cgc)
+          (x86-mov   cgc (x86-edx) (x86-mem 8 (x86-esp))) ; load the address
+          (x86-sar   cgc (x86-edx) (x86-imm-int 2))
+          (x86-mov   cgc (x86-eax) (x86-mem 4 (x86-esp))) ; load the value
+          (x86-sar   cgc (x86-eax) (x86-imm-int 2)) ; unpack
+          (x86-mov   cgc (x86-mem 0 (x86-edx)) (x86-eax))
+          (x86-shl   cgc (x86-eax) (x86-imm-int 2))
+          (x86-ret   cgc))))
+
     (define enable-interrupts
       (asm (lambda (cgc) (x86-sti cgc) (x86-ret cgc))))
 
@@ -0,0 +1,119 @@
+; Mimosa
+; Université de Montréal
+; Marc Feeley, Samuel Yvon
+(define-library (pci)
+(import
+  (gambit)
+  (utils))
+(export
+  PCI-PATH
+  pci-devices
+  pci-find-device
+  pci-find-class
+  pci-device-bus
+  pci-device-slot
+  pci-device-function
+  pci-device-vendor-id
+  pci-device-device-id
+  pci-device-class
+  pci-device-subclass
+  pci-device-prog-if
+  pci-device-revision
+  pci-device-irq
+  pci-device-msi?
+  pci-device-bars
+  pci-bar-index
+  pci-bar-type
+  pci-bar-base
+  pci-bar-size)
+(begin
+  ; The kernel enumerates the PCI bus at boot and describes the
+  ; functions it found in this file, a line per function:
+  ;
+  ;   00:1f.2 8086:2922 01.06.01 rev 02 irq 11 msi bar5=mem:febf1000+1000
+  (define PCI-PATH "/sys/pci")
+
+  (define-type pci-device
+    bus
+    slot
+    function
+    vendor-id
+    device-id
+    class
+    subclass
+    prog-if
+    revision
+    irq
+    msi?
+    bars)
+
+  ; type is one of io, mem, mem64, memp and mem64p
+  (define-type pci-bar
+    index
+    type
+    base
+    size)
+
+  (define (hex s) (string->number s 16))
+
+  ; "a:b.c" -> ("a" "b" "c")
+  (define (split-address s)
+    (let ((colon (split-string #\: s)))
+      (cons (car colon) (split-string #\. (cadr colon)))))
+
+  (define (parse-bar token)
+    ; "bar5=mem:febf1000+1000"
+    (let* ((eq (split-string #\= token))
+           (type-rest (split-string #\: (cadr eq)))
+           (base-size (split-string #\+ (cadr type-rest))))
+      (make-pci-bar
+        (string->number (substring (car eq) 3 (string-length (car eq))))
+        (string->symbol (car type-rest))
+        (hex (car base-size))
+        (hex (cadr base-size)))))
+
+  (define (parse-line line)
+    (let* ((tokens (filter (split-string #\space line)
+                           (lambda (t) (not (string=? t "")))))
+           (address (split-address (list-ref tokens 0)))
+           (ids (split-string #\: (list-ref tokens 1)))
+           (class (split-string #\. (list-ref tokens 2)))
+           (rest (list-tail tokens 7))
+           (msi? (and (pair? rest) (string=? (car rest) "msi"))))
+      (make-pci-device
+        (hex (car address))
+        (hex (cadr address))
+        (hex (caddr address))
+        (hex (car ids))
+        (hex (cadr ids))
+        (hex (car class))
+        (hex (cadr class))
+        (hex (caddr class))
+        (hex (list-ref tokens 4))
+        (string->number (list-ref tokens 6))
+        msi?
+        (map parse-bar (if msi? (cdr rest) rest)))))
+
+  ; The list of the PCI functions, as found at boot
+  (define (pci-devices)
+    (call-with-input-file
+      PCI-PATH
+      (lambda (port)
+        (let loop ((acc '()))
+          (let ((line (read-line port)))
+            (if (or (eof-object? line) (string=? line ""))
+                (reverse acc)
+                (loop (cons (parse-line line) acc))))))))
+
+  (define (pci-find-device vendor-id device-id)
+    (filter (pci-devices)
+            (lambda (d)
+              (and (= (pci-device-vendor-id d) vendor-id)
+                   (= (pci-device-device-id d) device-id)))))
+
+  (define (pci-find-class class subclass)
+    (filter (pci-devices)
+            (lambda (d)
+              (and (= (pci-device-class d) class)
+                   (= (pci-device-subclass d) subclass)))))
+  ))
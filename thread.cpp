@@ -18,11 +18,19 @@
 #include "term.h"
 #include "thread.h"
 
-wait_queue *readyq;
-sleep_queue *sleepq;
+ready_queue *readyq;
 thread *sched_primordial_thread;
 thread *sched_current_thread;
 
+// Idle residency: time spent halted and number of halts
+time sched_idle_time;
+uint32 sched_idle_halts;
+
+// When the idle thread halted, 0 when it is not halted
+static time sched_idle_start;
+
+//-----------------------------------------------------------------------------
+
 mutex *new_mutex(mutex *m) {
   wait_queue_init(&m->super);
   m->_locked = false;
@@ -89,8 +97,7 @@ void rwmutex_readunlock(rwmutex *self) {
 
   self->_readers--;
   while ((t = wait_queue_head(&mself->super)) != NULL) {
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
+    timer_cancel(&t->super._sleep_timer);
     _sched_reschedule_thread(t);
   }
   _sched_yield_if_necessary();
@@ -105,8 +112,7 @@ void rwmutex_writeunlock(rwmutex *self) {
 
   self->super._locked = FALSE;
   while ((t = wait_queue_head(&mself->super)) != NULL) {
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
+    timer_cancel(&t->super._sleep_timer);
     _sched_reschedule_thread(t);
   }
   _sched_yield_if_necessary();
@@ -122,8 +128,7 @@ void mutex_unlock(mutex *self) {
   if (t == NULL) {
     self->_locked = FALSE;
   } else {
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
+    timer_cancel(&t->super._sleep_timer);
     _sched_reschedule_thread(t);
     _sched_yield_if_necessary();
   }
@@ -182,8 +187,7 @@ void condvar_wait(condvar *self, mutex *m) {
   if (t == NULL) {
     m->_locked = FALSE;
   } else {
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
+    timer_cancel(&t->super._sleep_timer);
     _sched_reschedule_thread(t);
   }
 
@@ -206,8 +210,7 @@ bool condvar_wait_or_timeout(condvar *self, mutex *m, time timeout) {
   if (t == NULL) {
     m->_locked = FALSE;
   } else {
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
+    timer_cancel(&t->super._sleep_timer);
     _sched_reschedule_thread(t);
   }
 
@@ -242,8 +245,7 @@ void condvar_signal(condvar *self) {
   thread *t = wait_queue_head(&self->super);
 
   if (t != NULL) {
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
+    timer_cancel(&t->super._sleep_timer);
     _sched_reschedule_thread(t);
     _sched_yield_if_necessary();
   }
@@ -257,8 +259,7 @@ void condvar_broadcast(condvar *self) {
   thread *t;
 
   while ((t = wait_queue_head(&self->super)) != NULL) {
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
+    timer_cancel(&t->super._sleep_timer);
     _sched_reschedule_thread(t);
   }
 
@@ -288,8 +289,7 @@ void condvar_mutexless_signal(condvar *self) {
   thread *t = wait_queue_head(&self->super);
 
   if (t != NULL) {
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
+    timer_cancel(&t->super._sleep_timer);
     _sched_reschedule_thread(t);
     _sched_yield_if_necessary();
   }
@@ -339,7 +339,7 @@ thread *new_thread(thread *self, void_fn run, native_string name) {
 
   mutex_queue_init(&self->super.super);
   wait_queue_detach(self);
-  sleep_queue_detach(self);
+  timer_init(&self->super._sleep_timer);
 
   uint32 *s = CAST(uint32 *, kmalloc(stack_size));
 
@@ -501,9 +501,14 @@ native_string thread_name(thread *self) { return self->_name; }
 
 // "scheduler" class implementation.
 
-mutex *mtab[100];
+// Tables of the mutexes and condition variables, for debugging. The ones
+// created once they are full aren't registered.
+
+#define SCHED_REG_MAX 100
+
+mutex *mtab[SCHED_REG_MAX];
 int mn = 0;
-condvar *ctab[100];
+condvar *ctab[SCHED_REG_MAX];
 int cn = 0;
 
 void sys_irq(void *esp) ///////////////// AMD... why do we need this hack???
@@ -515,13 +520,13 @@ void sys_irq(void *esp) ///////////////// AMD... why do we need this hack???
 void _sched_resume_next_thread() {
   ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
 
-  thread *current = wait_queue_head(readyq);
+  thread *current = ready_queue_head(readyq);
 
   if (current != NULL) {
     sched_current_thread = current;
     time now = current_time_no_interlock();
     current->_end_of_quantum = add_time(now, current->_quantum);
-    _sched_set_timer(current->_end_of_quantum, now);
+    _sched_set_next_timer(current->_end_of_quantum, now);
     restore_context(current->_sp); // never returns
   }
 
@@ -563,12 +568,10 @@ void APIC_timer_irq() {
 void sched_setup(void_fn continuation) {
   ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
 
-  readyq = CAST(wait_queue *, kmalloc(sizeof(wait_queue)));
-  readyq->safety = 0xAA;
-  wait_queue_init(readyq);
+  readyq = CAST(ready_queue *, kmalloc(sizeof(ready_queue)));
+  ready_queue_init(readyq);
 
-  sleepq = CAST(sleep_queue *, kmalloc(sizeof(sleep_queue)));
-  sleep_queue_init(sleepq);
+  setup_timers();
 
   thread *primordial = CAST(thread *, kmalloc(sizeof(thread)));
 
@@ -577,7 +580,7 @@ void sched_setup(void_fn continuation) {
 
   sched_current_thread = sched_primordial_thread;
 
-  wait_queue_insert(sched_current_thread, readyq);
+  ready_queue_insert(sched_current_thread, readyq);
 
   _sched_setup_timer();
   __asm__ __volatile__("int $0xD0" ::: "memory");
@@ -597,9 +600,10 @@ void sched_stats() {
 
   term_writeline(cout);
   term_write(cout, "Threads in wait queue:");
-  {
-    wait_mutex_node *t = readyq->super._next_in_wait_queue;
-    while (t != &readyq->super) {
+  for (int i = SCHED_PRIO_LEVELS - 1; i >= 0; --i) {
+    wait_mutex_node *level = CAST(wait_mutex_node *, &readyq->levels[i]);
+    wait_mutex_node *t = level->_next_in_wait_queue;
+    while (t != level) {
       term_write(cout, thread_name(CAST(thread *, t)));
       term_write(cout, " ");
       // n++;
@@ -608,28 +612,16 @@ void sched_stats() {
   }
 
   term_writeline(cout);
-  term_write(cout, "Threads in sleep queue:");
-  {
-    wait_mutex_sleep_node *t = sleepq->super._next_in_sleep_queue;
-    while (t != &sleepq->super) {
-      term_write(cout, thread_name(CAST(thread *, t)));
-      term_write(cout, " ");
-      // m++;
-      t = t->_next_in_sleep_queue;
-    }
-  }
+  term_write(cout, "Pending timers: ");
+  term_write(cout, timers.pending);
 
   term_writeline(cout);
-  term_write(cout, "Threads in circular buffer condvar:");
-  {
-    wait_mutex_sleep_node *t = sleepq->super._next_in_sleep_queue;
-    while (t != &sleepq->super) {
-      term_write(cout, thread_name(CAST(thread *, t)));
-      term_write(cout, " ");
-      // m++;
-      t = t->_next_in_sleep_queue;
-    }
-  }
+  term_write(cout, "Idle: ");
+  term_write(cout, sched_idle_halts);
+  term_write(cout, " halts, ");
+  term_write(cout,
+             CAST(uint32, sched_idle_time.n * 1000 / seconds_to_time(1).n));
+  term_write(cout, " ms halted");
 
   // term_writeline(cout);
   // term_write(cout, "RW mutex (->):");
@@ -682,20 +674,26 @@ void sched_stats() {
   enable_interrupts();
 }
 
-void sched_reg_mutex(mutex *m) { mtab[mn++] = m; }
+void sched_reg_mutex(mutex *m) {
+  if (mn < SCHED_REG_MAX)
+    mtab[mn++] = m;
+}
 
-void sched_reg_condvar(condvar *c) { ctab[cn++] = c; }
+void sched_reg_condvar(condvar *c) {
+  if (cn < SCHED_REG_MAX)
+    ctab[cn++] = c;
+}
 
 void _sched_reschedule_thread(thread *t) {
   ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
   wait_queue_remove(t);
-  wait_queue_insert(t, readyq);
+  ready_queue_insert(t, readyq);
 }
 
 void _sched_yield_if_necessary() {
   ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
 
-  thread *t = wait_queue_head(readyq);
+  thread *t = ready_queue_head(readyq);
 
   if (t != sched_current_thread) {
     save_context(_sched_switch_to_next_thread, NULL);
@@ -726,6 +724,8 @@ void _sched_switch_to_next_thread(uint32 cs, uint32 eflags, uint32 *sp,
 
   thread *current = sched_current_thread;
 
+  _sched_idle_end();
+
   current->_sp = sp;
   _sched_reschedule_thread(current);
   _sched_resume_next_thread();
@@ -754,6 +754,13 @@ void _sched_suspend_on_wait_queue(uint32 cs, uint32 eflags, uint32 *sp,
   panic(L"_sched_suspend_on_wait_queue is never supposed to return");
 }
 
+void _sched_sleep_timeout(timer *t, void *data) {
+  thread *sleeper = CAST(thread *, data);
+
+  sleeper->_did_not_timeout = FALSE;
+  _sched_reschedule_thread(sleeper);
+}
+
 void _sched_suspend_on_sleep_queue(uint32 cs, uint32 eflags, uint32 *sp,
                                    void *dummy) {
   ASSERT_INTERRUPTS_DISABLED(); // Interrupts should be disabled at this point
@@ -761,7 +768,8 @@ void _sched_suspend_on_sleep_queue(uint32 cs, uint32 eflags, uint32 *sp,
   thread *current = sched_current_thread;
 
   current->_sp = sp;
-  sleep_queue_insert(current, sleepq);
+  timer_add(&current->super._sleep_timer, current->_timeout,
+            _sched_sleep_timeout, current);
   _sched_resume_next_thread();
 
   // ** NEVER REACHED ** (this function never returns)
@@ -780,6 +788,22 @@ void _sched_setup_timer() {
   // context switch ("yield" with no timer reprogramming) takes about
   // 700 nanoseconds.
 
+#ifdef USE_APIC_FOR_TIMER
+
+  if (timer_source != TIMER_SOURCE_PIT) {
+    uint32 x;
+
+    x = APIC_LVTT;
+    x &= ~APIC_LVT_MASKED; // Unmask timer interrupt
+    if (timer_source == TIMER_SOURCE_TSC_DEADLINE)
+      x |= APIC_LVTT_TSC_DEADLINE;
+    APIC_LVTT = x;
+
+    return;
+  }
+
+#endif
+
 #ifdef USE_PIT_FOR_TIMER
 
 #ifdef USE_PIT_1_BYTE_COUNT
@@ -793,15 +817,9 @@ void _sched_setup_timer() {
 
   ENABLE_IRQ(0);
 
-#endif
-
-#ifdef USE_APIC_FOR_TIMER
-
-  uint32 x;
+#else
 
-  x = APIC_LVTT;
-  x &= ~APIC_LVT_MASKED; // Unmask timer interrupt
-  APIC_LVTT = x;
+  panic(L"No local APIC timer");
 
 #endif
 }
@@ -810,11 +828,46 @@ void _sched_set_timer(time t, time now) {
   // t must be >= now
   ASSERT_INTERRUPTS_DISABLED();
 
+  time delta = subtract_time(t, now);
   int64 count;
 
+  // A far away deadline (such as pos_infinity when idle) would overflow
+  // the conversions below.  The interrupt then comes early, which is
+  // harmless.
+
+  if (less_time(seconds_to_time(1), delta))
+    delta = seconds_to_time(1);
+
+#ifdef USE_APIC_FOR_TIMER
+
+  if (timer_source == TIMER_SOURCE_TSC_DEADLINE) {
+
+    // Unlike the other timers, the deadline does not need to be
+    // converted to bus cycles and no I/O is needed to arm it.
+
+    wrmsr(MSR_TSC_DEADLINE, rdtsc() + time_to_tsc_counts(delta) + 100);
+
+    return;
+  }
+
+  if (timer_source == TIMER_SOURCE_APIC) {
+    count = time_to_apic_timer_counts(delta) +
+            100; // 100 is added to avoid timer undershoot cascades when
+    // APIC timer is running fast compared to RTC or TSC
+
+    if (count > 0xffffffff)
+      count = 0xffffffff;
+
+    APIC_INITIAL_TIMER_COUNT = count;
+
+    return;
+  }
+
+#endif
+
 #ifdef USE_PIT_FOR_TIMER
 
-  count = time_to_pit_counts(subtract_time(t, now)) +
+  count = time_to_pit_counts(delta) +
           2; // 2 is added to avoid timer undershoot cascades when
   // PIT is running fast compared to RTC or TSC
 
@@ -839,19 +892,19 @@ void _sched_set_timer(time t, time now) {
 #endif
 
 #endif
+}
 
-#ifdef USE_APIC_FOR_TIMER
-
-  count = time_to_apic_timer_counts(subtract_time(t, now)) +
-          100; // 100 is added to avoid timer undershoot cascades when
-  // APIC timer is running fast compared to RTC or TSC
-
-  if (count > 0xffffffff)
-    count = 0xffffffff;
+// Program the timer interrupt for the end of the quantum or the next
+// kernel timer, whichever comes first
+void _sched_set_next_timer(time end_of_quantum, time now) {
+  time t = end_of_quantum;
+  time next;
 
-  APIC_INITIAL_TIMER_COUNT = count;
+  if (timer_next_expiry(now, &next) && less_time(next, t)) {
+    t = next;
+  }
 
-#endif
+  _sched_set_timer(t, now);
 }
 
 extern void send_signal(int sig); // from libc/src/signal.c
@@ -862,42 +915,15 @@ void _sched_timer_elapsed() {
 
   time now = current_time_no_interlock();
 
-#if 1
-  for (;;) {
-    thread *t = sleep_queue_head(sleepq);
-
-    if (t == NULL || less_time(now, t->_timeout)) {
-      break;
-    }
-
-    t->_did_not_timeout = FALSE;
-    sleep_queue_remove(t);
-    sleep_queue_detach(t);
-    _sched_reschedule_thread(t);
-  }
-#else
-  {
-    wait_mutex_sleep_node *temp = sleepq;
-    while (temp->_next_in_sleep_queue != sleepq) {
-      thread *t = CAST(thread *, temp);
-
-      temp = temp->_next_in_sleep_queue;
-
-      if (!less_time(now, t->_timeout)) {
-        t->_did_not_timeout = FALSE;
-        sleep_queue_remove(t);
-        sleep_queue_detach(t);
-        reschedule_thread(t);
-      }
-    }
-  }
-#endif
+  timer_run_expired(now);
 
   thread *current = sched_current_thread;
 
   if (less_time(now, current->_end_of_quantum)) {
     //      cout << "timer is fast\n";/////////////
-    _sched_set_timer(current->_end_of_quantum, now);
+    _sched_set_next_timer(current->_end_of_quantum, now);
+    // A timer may have readied a thread of higher priority
+    _sched_yield_if_necessary();
   } else {
 #if 0
         debug_write("Thread ");
@@ -905,10 +931,203 @@ void _sched_timer_elapsed() {
         debug_write("ran out of time");
 #endif
     send_signal(26); // send SIGVTALRM
-    save_context(_sched_switch_to_next_thread, NULL);
+
+    if (ready_queue_alone(current, readyq)) {
+      // Switching would resume the same thread, start a new quantum
+      current->_end_of_quantum = add_time(now, current->_quantum);
+      _sched_set_next_timer(current->_end_of_quantum, now);
+    } else {
+      save_context(_sched_switch_to_next_thread, NULL);
+    }
+  }
+}
+
+void _sched_idle_end() {
+  ASSERT_INTERRUPTS_DISABLED();
+
+  if (sched_idle_start.n != 0) {
+    time now = current_time_no_interlock();
+    sched_idle_time =
+        add_time(sched_idle_time, subtract_time(now, sched_idle_start));
+    sched_idle_start.n = 0;
+  }
+}
+
+void sched_idle() {
+  disable_interrupts();
+
+  if (ready_queue_head(readyq) != sched_current_thread) {
+    // A thread became ready without preempting this one
+    _sched_yield_if_necessary();
+    enable_interrupts();
+    return;
+  }
+
+  // Only the next kernel timer needs the timer interrupt, there is no
+  // quantum to enforce while halted
+  time now = current_time_no_interlock();
+  time next;
+
+  if (!timer_next_expiry(now, &next))
+    next = pos_infinity;
+
+  _sched_set_timer(next, now);
+
+  sched_idle_start = now;
+  sched_idle_halts++;
+
+  // "sti" only takes effect after "hlt" so no wakeup can be missed
+  __asm__ __volatile__("sti \n\t"
+                       "hlt"
+                       :
+                       :
+                       : "memory");
+
+  disable_interrupts();
+  _sched_idle_end();
+  enable_interrupts();
+}
+
+//-----------------------------------------------------------------------------
+
+#ifdef SCHED_BENCHMARK
+
+// Scheduler microbenchmark.  A set of threads calling "thread_yield"
+// measures voluntary context switches, then a pair of threads handing
+// a token back and forth through a condition variable measures
+// wakeups, and finally many threads doing short sleeps measure how
+// late the timer wakes them up.  Each phase runs for one second.
+
+#define SCHED_BENCHMARK_YIELDERS 8
+#define SCHED_BENCHMARK_SLEEPERS 32
+#define SCHED_BENCHMARK_SLEEP_NSECS 5000000
+
+static time bench_end;
+static volatile uint32 bench_count;
+static volatile uint32 bench_turn;
+static volatile uint32 bench_running;
+static volatile uint32 bench_max_late; // in microseconds
+static condvar bench_cv;
+static condvar bench_done_cv;
+
+static void bench_thread_done(uint32 count) {
+  disable_interrupts();
+  bench_count += count;
+  bench_running--;
+  condvar_mutexless_signal(&bench_done_cv);
+  enable_interrupts();
+}
+
+static void bench_yield_run() {
+  uint32 count = 0;
+
+  while (less_time(current_time(), bench_end)) {
+    thread_yield();
+    count++;
+  }
+
+  bench_thread_done(count);
+}
+
+static void bench_pingpong_run(uint32 me) {
+  uint32 count = 0;
+
+  disable_interrupts();
+
+  while (less_time(current_time_no_interlock(), bench_end)) {
+    if (bench_turn == me) {
+      bench_turn = 1 - me;
+      count++;
+      condvar_mutexless_signal(&bench_cv);
+    } else {
+      condvar_mutexless_wait(&bench_cv);
+    }
+  }
+
+  // The other thread may be waiting for its turn
+  condvar_mutexless_signal(&bench_cv);
+
+  enable_interrupts();
+
+  bench_thread_done(count);
+}
+
+static void bench_sleep_run() {
+  uint32 count = 0;
+
+  while (less_time(current_time(), bench_end)) {
+    time expected = add_time(
+        current_time(), nanoseconds_to_time(SCHED_BENCHMARK_SLEEP_NSECS));
+
+    thread_sleep(SCHED_BENCHMARK_SLEEP_NSECS);
+
+    time late = subtract_time(current_time(), expected);
+    uint32 usecs = late.n * 1000000 / seconds_to_time(1).n;
+
+    disable_interrupts();
+    if (usecs > bench_max_late)
+      bench_max_late = usecs;
+    enable_interrupts();
+
+    count++;
+  }
+
+  bench_thread_done(count);
+}
+
+static void bench_ping_run() { bench_pingpong_run(0); }
+
+static void bench_pong_run() { bench_pingpong_run(1); }
+
+static void bench_phase(native_string label, void_fn *runs, int n) {
+  bench_count = 0;
+  bench_turn = 0;
+  bench_running = n;
+  bench_end = add_time(current_time(), seconds_to_time(1));
+
+  for (int i = 0; i < n; ++i) {
+    thread *t = CAST(thread *, kmalloc(sizeof(thread)));
+    thread_start(new_thread(t, runs[i], "Scheduler benchmark"));
+  }
+
+  disable_interrupts();
+  while (bench_running > 0) {
+    condvar_mutexless_wait(&bench_done_cv);
   }
+  enable_interrupts();
+
+  term_write(cout, label);
+  term_write(cout, bench_count);
+  term_write(cout, " per second\n");
 }
 
+void sched_benchmark() {
+  void_fn runs[SCHED_BENCHMARK_SLEEPERS];
+
+  new_condvar(&bench_cv);
+  new_condvar(&bench_done_cv);
+
+  for (int i = 0; i < SCHED_BENCHMARK_YIELDERS; ++i) {
+    runs[i] = bench_yield_run;
+  }
+  bench_phase("Context switches (yield): ", runs, SCHED_BENCHMARK_YIELDERS);
+
+  runs[0] = bench_ping_run;
+  runs[1] = bench_pong_run;
+  bench_phase("Wakeups (condvar ping-pong): ", runs, 2);
+
+  bench_max_late = 0;
+  for (int i = 0; i < SCHED_BENCHMARK_SLEEPERS; ++i) {
+    runs[i] = bench_sleep_run;
+  }
+  bench_phase("Sleeper wakeups: ", runs, SCHED_BENCHMARK_SLEEPERS);
+  term_write(cout, "Maximum sleep lateness (us): ");
+  term_write(cout, bench_max_late);
+  term_writeline(cout);
+}
+
+#endif
+
 //-----------------------------------------------------------------------------
 
 // mode: C++ //
@@ -0,0 +1,217 @@
+#include "chrono.h"
+#include "general.h"
+#include "rtlib.h"
+#include "term.h"
+#include "thread.h"
+#include "timer.h"
+
+timer_wheel timers;
+
+#define time_to_ticks(t) CAST(uint32, (t).n >> timers.shift)
+
+#define LEVEL_SHIFT(level) ((level)*TIMER_WHEEL_SLOTS_LOG2)
+
+#define SLOT_INDEX(tick, level)                                                \
+  (((tick) >> LEVEL_SHIFT(level)) & (TIMER_WHEEL_SLOTS - 1))
+
+// A slot is a circular list whose head is a timer that is never armed
+
+static void slot_init(timer *slot) {
+  slot->next = slot;
+  slot->prev = slot;
+}
+
+static void slot_append(timer *slot, timer *t) {
+  t->next = slot;
+  t->prev = slot->prev;
+  slot->prev->next = t;
+  slot->prev = t;
+}
+
+static void timer_unlink(timer *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = NULL;
+  t->prev = NULL;
+}
+
+static inline uint32 bit_scan_forward(uint32 word) {
+  uint32 bit;
+  __asm__("bsfl %1,%0" : "=r"(bit) : "rm"(word));
+  return bit;
+}
+
+static void wheel_insert(timer *t) {
+  uint32 delta = t->expires - timers.tick;
+  timer *slot;
+
+  if (CAST(int32, delta) < 0) {
+    // Already expired, it runs with the next tick
+    slot = &timers.slots[0][SLOT_INDEX(timers.tick, 0)];
+  } else {
+    uint32 expires = t->expires;
+    uint32 level = 0;
+
+    if (delta >= TIMER_WHEEL_RANGE) {
+      delta = TIMER_WHEEL_RANGE - 1;
+      expires = timers.tick + delta;
+    }
+
+    while (delta >= (CAST(uint32, 1) << LEVEL_SHIFT(level + 1))) {
+      level++;
+    }
+
+    slot = &timers.slots[level][SLOT_INDEX(expires, level)];
+  }
+
+  if (slot < &timers.slots[1][0]) {
+    uint32 index = slot - &timers.slots[0][0];
+    timers.first_level_map[index >> 5] |= 1 << (index & 31);
+  }
+
+  slot_append(slot, t);
+}
+
+// Move the timers of a slot to the lower levels, returns the index of
+// the slot
+static uint32 cascade(uint32 level, uint32 index) {
+  timer *slot = &timers.slots[level][index];
+  timer *t = slot->next;
+
+  slot_init(slot);
+
+  while (t != slot) {
+    timer *next = t->next;
+    wheel_insert(t);
+    t = next;
+  }
+
+  return index;
+}
+
+void setup_timers() {
+  uint64 per_tick = seconds_to_time(1).n / TIMER_TICK_FREQ;
+
+  timers.shift = 0;
+  while ((per_tick >> (timers.shift + 1)) != 0) {
+    timers.shift++;
+  }
+
+  timers.tick = time_to_ticks(current_time_no_interlock());
+  timers.pending = 0;
+  timers.first_level_map[0] = 0;
+  timers.first_level_map[1] = 0;
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+      slot_init(&timers.slots[level][i]);
+    }
+  }
+}
+
+void timer_init(timer *t) {
+  t->next = NULL;
+  t->prev = NULL;
+  t->fn = NULL;
+  t->data = NULL;
+}
+
+void timer_add(timer *t, time expires, timer_fn fn, void *data) {
+  ASSERT_INTERRUPTS_DISABLED();
+
+  timer_cancel(t);
+
+  // Round up so that the timer never runs before expires
+  expires.n += (CAST(uint64, 1) << timers.shift) - 1;
+  t->expires = time_to_ticks(expires);
+  t->fn = fn;
+  t->data = data;
+
+  wheel_insert(t);
+  timers.pending++;
+}
+
+bool timer_cancel(timer *t) {
+  ASSERT_INTERRUPTS_DISABLED();
+
+  if (!timer_pending(t))
+    return FALSE;
+
+  timer_unlink(t);
+  timers.pending--;
+
+  return TRUE;
+}
+
+void timer_run_expired(time now) {
+  ASSERT_INTERRUPTS_DISABLED();
+
+  uint32 target = time_to_ticks(now);
+
+  while (CAST(int32, target - timers.tick) >= 0) {
+    if (timers.pending == 0) {
+      // Nothing can expire, skip the idle ticks
+      timers.tick = target + 1;
+      break;
+    }
+
+    uint32 index = SLOT_INDEX(timers.tick, 0);
+
+    // Each time a level wraps around, the next slot of the level above
+    // is spread over it
+    for (uint32 level = 1, i = index; i == 0 && level < TIMER_WHEEL_LEVELS;
+         ++level) {
+      i = cascade(level, SLOT_INDEX(timers.tick, level));
+    }
+
+    timers.tick++;
+
+    timer *slot = &timers.slots[0][index];
+
+    timers.first_level_map[index >> 5] &= ~(1 << (index & 31));
+
+    while (slot->next != slot) {
+      timer *t = slot->next;
+      timer_unlink(t);
+      timers.pending--;
+      t->fn(t, t->data);
+    }
+  }
+}
+
+bool timer_next_expiry(time now, time *t) {
+  if (timers.pending == 0)
+    return FALSE;
+
+  uint32 index = SLOT_INDEX(timers.tick, 0);
+  uint64 map = (CAST(uint64, timers.first_level_map[1]) << 32) |
+               timers.first_level_map[0];
+
+  // Rotate the map so that bit 0 is the next tick to process
+  map = (map >> index) | (map << ((TIMER_WHEEL_SLOTS - index) & 63));
+
+  // Timers of the other levels can only become due once the first
+  // level wraps around
+  uint32 distance = (TIMER_WHEEL_SLOTS - index) & (TIMER_WHEEL_SLOTS - 1);
+
+  if (CAST(uint32, map) != 0) {
+    uint32 d = bit_scan_forward(CAST(uint32, map));
+    if (d < distance)
+      distance = d;
+  } else if (CAST(uint32, map >> 32) != 0) {
+    uint32 d = 32 + bit_scan_forward(CAST(uint32, map >> 32));
+    if (d < distance)
+      distance = d;
+  }
+
+  // Ticks are only the low bits of the time, so go from now
+  int32 ahead = timers.tick + distance - time_to_ticks(now);
+
+  if (ahead <= 0) {
+    *t = now;
+  } else {
+    t->n = ((now.n >> timers.shift) + ahead) << timers.shift;
+  }
+
+  return TRUE;
+}
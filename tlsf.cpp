@@ -0,0 +1,452 @@
+#include "general.h"
+#include "rtlib.h"
+#include "tlsf.h"
+
+#define BLOCK_FREE_BIT 1
+#define BLOCK_PREV_FREE_BIT 2
+
+// The size field is the only overhead of a used block
+#define BLOCK_OVERHEAD sizeof(size_t)
+// Distance between a block and its data section
+#define BLOCK_START_OFFSET (sizeof(tlsf_block *) + sizeof(size_t))
+// A free block must be able to hold the free list pointers
+#define BLOCK_SIZE_MIN (sizeof(tlsf_block) - sizeof(tlsf_block *))
+#define BLOCK_SIZE_MAX (CAST(size_t, 1) << TLSF_FL_INDEX_MAX)
+
+#define block_size(b) ((b)->size & ~(BLOCK_FREE_BIT | BLOCK_PREV_FREE_BIT))
+#define block_is_free(b) (0 != ((b)->size & BLOCK_FREE_BIT))
+#define block_is_prev_free(b) (0 != ((b)->size & BLOCK_PREV_FREE_BIT))
+
+// The applications heap, when USE_TLSF_FOR_APPHEAP is selected
+tlsf apptlsf;
+
+// Index of the least significant bit set, word must not be 0
+static inline uint32 tlsf_ffs(uint32 word) {
+  uint32 bit;
+  __asm__("bsfl %1,%0" : "=r"(bit) : "rm"(word));
+  return bit;
+}
+
+// Index of the most significant bit set, word must not be 0
+static inline uint32 tlsf_fls(uint32 word) {
+  uint32 bit;
+  __asm__("bsrl %1,%0" : "=r"(bit) : "rm"(word));
+  return bit;
+}
+
+static inline void *block_to_ptr(tlsf_block *b) {
+  return CAST(void *, CAST(uint8 *, b) + BLOCK_START_OFFSET);
+}
+
+static inline tlsf_block *ptr_to_block(void *ptr) {
+  return CAST(tlsf_block *, CAST(uint8 *, ptr) - BLOCK_START_OFFSET);
+}
+
+static inline tlsf_block *block_next(tlsf_block *b) {
+  return CAST(tlsf_block *, CAST(uint8 *, block_to_ptr(b)) + block_size(b) -
+                                BLOCK_OVERHEAD);
+}
+
+static inline tlsf_block *block_link_next(tlsf_block *b) {
+  tlsf_block *next = block_next(b);
+  next->prev_phys = b;
+  return next;
+}
+
+static inline void block_set_size(tlsf_block *b, size_t size) {
+  b->size = size | (b->size & (BLOCK_FREE_BIT | BLOCK_PREV_FREE_BIT));
+}
+
+static inline void block_mark_as_free(tlsf_block *b) {
+  tlsf_block *next = block_link_next(b);
+  next->size |= BLOCK_PREV_FREE_BIT;
+  b->size |= BLOCK_FREE_BIT;
+}
+
+static inline void block_mark_as_used(tlsf_block *b) {
+  tlsf_block *next = block_next(b);
+  next->size &= ~BLOCK_PREV_FREE_BIT;
+  b->size &= ~BLOCK_FREE_BIT;
+}
+
+//-----------------------------------------------------------------------------
+
+// Size to list mapping
+
+static void mapping_insert(size_t size, uint32 *fl, uint32 *sl) {
+  if (size < TLSF_SMALL_BLOCK_SIZE) {
+    *fl = 0;
+    *sl = size / (TLSF_SMALL_BLOCK_SIZE / TLSF_SL_INDEX_COUNT);
+  } else {
+    uint32 f = tlsf_fls(size);
+    *sl = (size >> (f - TLSF_SL_INDEX_COUNT_LOG2)) ^ TLSF_SL_INDEX_COUNT;
+    *fl = f - (TLSF_FL_INDEX_SHIFT - 1);
+  }
+}
+
+// Round the size up to the next list so any block found there fits
+static void mapping_search(size_t size, uint32 *fl, uint32 *sl) {
+  if (size >= TLSF_SMALL_BLOCK_SIZE) {
+    size += (1 << (tlsf_fls(size) - TLSF_SL_INDEX_COUNT_LOG2)) - 1;
+  }
+  mapping_insert(size, fl, sl);
+}
+
+static tlsf_block *search_suitable_block(tlsf *t, uint32 *fl, uint32 *sl) {
+  uint32 sl_map = t->sl_bitmap[*fl] & (~CAST(uint32, 0) << *sl);
+
+  if (0 == sl_map) {
+    // Nothing left in this first level, take the next bigger one
+    uint32 fl_map = t->fl_bitmap & (~CAST(uint32, 0) << (*fl + 1));
+
+    if (0 == fl_map) {
+      return NULL;
+    }
+
+    *fl = tlsf_ffs(fl_map);
+    sl_map = t->sl_bitmap[*fl];
+  }
+
+  *sl = tlsf_ffs(sl_map);
+
+  return t->blocks[*fl][*sl];
+}
+
+//-----------------------------------------------------------------------------
+
+// Free lists
+
+static void remove_free_block(tlsf *t, tlsf_block *b, uint32 fl, uint32 sl) {
+  tlsf_block *prev = b->prev_free;
+  tlsf_block *next = b->next_free;
+
+  next->prev_free = prev;
+  prev->next_free = next;
+
+  if (t->blocks[fl][sl] == b) {
+    t->blocks[fl][sl] = next;
+
+    if (next == &t->null_block) {
+      t->sl_bitmap[fl] &= ~(1 << sl);
+
+      if (0 == t->sl_bitmap[fl]) {
+        t->fl_bitmap &= ~(1 << fl);
+      }
+    }
+  }
+}
+
+static void insert_free_block(tlsf *t, tlsf_block *b, uint32 fl, uint32 sl) {
+  tlsf_block *current = t->blocks[fl][sl];
+
+  b->next_free = current;
+  b->prev_free = &t->null_block;
+  current->prev_free = b;
+
+  t->blocks[fl][sl] = b;
+  t->fl_bitmap |= (1 << fl);
+  t->sl_bitmap[fl] |= (1 << sl);
+}
+
+static void block_remove(tlsf *t, tlsf_block *b) {
+  uint32 fl, sl;
+  mapping_insert(block_size(b), &fl, &sl);
+  remove_free_block(t, b, fl, sl);
+}
+
+static void block_insert(tlsf *t, tlsf_block *b) {
+  uint32 fl, sl;
+  mapping_insert(block_size(b), &fl, &sl);
+  insert_free_block(t, b, fl, sl);
+}
+
+//-----------------------------------------------------------------------------
+
+// Splitting and coalescing
+
+static inline bool block_can_split(tlsf_block *b, size_t size) {
+  return block_size(b) >= sizeof(tlsf_block) + size;
+}
+
+// Cut b to size bytes and return the (free) remainder
+static tlsf_block *block_split(tlsf_block *b, size_t size) {
+  tlsf_block *remaining = CAST(
+      tlsf_block *, CAST(uint8 *, block_to_ptr(b)) + size - BLOCK_OVERHEAD);
+
+  remaining->size = block_size(b) - (size + BLOCK_OVERHEAD);
+  block_set_size(b, size);
+  block_mark_as_free(remaining);
+
+  return remaining;
+}
+
+static tlsf_block *block_absorb(tlsf_block *prev, tlsf_block *b) {
+  prev->size += block_size(b) + BLOCK_OVERHEAD;
+  block_link_next(prev);
+  return prev;
+}
+
+static tlsf_block *block_merge_prev(tlsf *t, tlsf_block *b) {
+  if (block_is_prev_free(b)) {
+    tlsf_block *prev = b->prev_phys;
+    block_remove(t, prev);
+    b = block_absorb(prev, b);
+  }
+  return b;
+}
+
+static tlsf_block *block_merge_next(tlsf *t, tlsf_block *b) {
+  tlsf_block *next = block_next(b);
+  if (block_is_free(next)) {
+    block_remove(t, next);
+    b = block_absorb(b, next);
+  }
+  return b;
+}
+
+static void block_trim_free(tlsf *t, tlsf_block *b, size_t size) {
+  if (block_can_split(b, size)) {
+    tlsf_block *remaining = block_split(b, size);
+    block_link_next(b);
+    remaining->size |= BLOCK_PREV_FREE_BIT;
+    block_insert(t, remaining);
+  }
+}
+
+// Give back the end of a used block
+static void block_trim_used(tlsf *t, tlsf_block *b, size_t size) {
+  if (block_can_split(b, size)) {
+    tlsf_block *remaining = block_split(b, size);
+    remaining->size &= ~BLOCK_PREV_FREE_BIT;
+    remaining = block_merge_next(t, remaining);
+    block_insert(t, remaining);
+  }
+}
+
+// Give back the start of a free block, return the block that follows
+static tlsf_block *block_trim_free_leading(tlsf *t, tlsf_block *b,
+                                           size_t size) {
+  tlsf_block *remaining = b;
+
+  if (block_can_split(b, size)) {
+    remaining = block_split(b, size - BLOCK_OVERHEAD);
+    remaining->size |= BLOCK_PREV_FREE_BIT;
+    block_link_next(b);
+    block_insert(t, b);
+  }
+
+  return remaining;
+}
+
+static size_t adjust_request_size(size_t size) {
+  size_t aligned = (size + TLSF_ALIGN_SIZE - 1) & ~(TLSF_ALIGN_SIZE - 1);
+
+  if (aligned < BLOCK_SIZE_MIN) {
+    aligned = BLOCK_SIZE_MIN;
+  }
+
+  return aligned;
+}
+
+//-----------------------------------------------------------------------------
+
+void tlsf_init(tlsf *t, void *start, size_t size) {
+  t->start = start;
+  t->size = size;
+  t->alloc = 0;
+
+  t->null_block.next_free = &t->null_block;
+  t->null_block.prev_free = &t->null_block;
+
+  t->fl_bitmap = 0;
+  for (uint32 i = 0; i < TLSF_FL_INDEX_COUNT; ++i) {
+    t->sl_bitmap[i] = 0;
+    for (uint32 j = 0; j < TLSF_SL_INDEX_COUNT; ++j) {
+      t->blocks[i][j] = &t->null_block;
+    }
+  }
+
+  // The whole pool is a single free block followed by an empty used
+  // sentinel block which stops the coalescing at the end of the pool.
+  // The prev_phys field of the first block lies before the pool but it
+  // is never read since there is no previous free block.
+  size_t pool_bytes =
+      (size - 2 * BLOCK_OVERHEAD) & ~CAST(size_t, TLSF_ALIGN_SIZE - 1);
+
+  if (pool_bytes > BLOCK_SIZE_MAX - TLSF_ALIGN_SIZE) {
+    pool_bytes = BLOCK_SIZE_MAX - TLSF_ALIGN_SIZE;
+  }
+
+  tlsf_block *b =
+      CAST(tlsf_block *, CAST(uint8 *, start) - sizeof(tlsf_block *));
+  b->size = pool_bytes | BLOCK_FREE_BIT;
+  block_insert(t, b);
+
+  tlsf_block *sentinel = block_link_next(b);
+  sentinel->size = 0 | BLOCK_PREV_FREE_BIT;
+}
+
+// Take a free block of at least size bytes off its free list
+static tlsf_block *locate_free_block(tlsf *t, size_t size) {
+  uint32 fl, sl;
+  mapping_search(size, &fl, &sl);
+
+  if (fl >= TLSF_FL_INDEX_COUNT) {
+    return NULL;
+  }
+
+  tlsf_block *b = search_suitable_block(t, &fl, &sl);
+
+  if (NULL == b || b == &t->null_block) {
+    return NULL;
+  }
+
+  remove_free_block(t, b, fl, sl);
+
+  return b;
+}
+
+static void *block_prepare_used(tlsf *t, tlsf_block *b, size_t size) {
+  block_trim_free(t, b, size);
+  block_mark_as_used(b);
+
+  t->alloc += block_size(b) + BLOCK_OVERHEAD;
+
+  return block_to_ptr(b);
+}
+
+void *tlsf_malloc(tlsf *t, size_t size) {
+  if (size > BLOCK_SIZE_MAX - TLSF_ALIGN_SIZE) {
+    return NULL;
+  }
+
+  size = adjust_request_size(size);
+
+  tlsf_block *b = locate_free_block(t, size);
+
+  if (NULL == b) {
+    return NULL;
+  }
+
+  return block_prepare_used(t, b, size);
+}
+
+void tlsf_free(tlsf *t, void *ptr) {
+  if (NULL == ptr) {
+    return;
+  }
+
+  tlsf_block *b = ptr_to_block(ptr);
+
+#ifdef CHECK_ASSERTIONS
+  if (block_is_free(b)) {
+    panic(L"tlsf_free: double free");
+  }
+#endif
+
+  t->alloc -= block_size(b) + BLOCK_OVERHEAD;
+
+  block_mark_as_free(b);
+  b = block_merge_prev(t, b);
+  b = block_merge_next(t, b);
+  block_insert(t, b);
+}
+
+void *tlsf_realloc(tlsf *t, void *ptr, size_t size) {
+  if (NULL == ptr) {
+    return tlsf_malloc(t, size);
+  }
+
+  if (0 == size) {
+    tlsf_free(t, ptr);
+    return NULL;
+  }
+
+  if (size > BLOCK_SIZE_MAX - TLSF_ALIGN_SIZE) {
+    return NULL;
+  }
+
+  tlsf_block *b = ptr_to_block(ptr);
+  tlsf_block *next = block_next(b);
+
+  size_t cur_size = block_size(b);
+  size_t combined = cur_size + block_size(next) + BLOCK_OVERHEAD;
+  size_t adjusted = adjust_request_size(size);
+
+  if (adjusted > cur_size && (!block_is_free(next) || adjusted > combined)) {
+    // The block can't grow in place
+    void *nptr = tlsf_malloc(t, size);
+
+    if (NULL != nptr) {
+      memcpy(nptr, ptr, cur_size);
+      tlsf_free(t, ptr);
+    }
+
+    return nptr;
+  }
+
+  if (adjusted > cur_size) {
+    block_merge_next(t, b);
+    block_mark_as_used(b);
+  }
+
+  block_trim_used(t, b, adjusted);
+
+  t->alloc += block_size(b);
+  t->alloc -= cur_size;
+
+  return ptr;
+}
+
+void *tlsf_memalign(tlsf *t, size_t alignment, size_t size) {
+  if (alignment <= TLSF_ALIGN_SIZE) {
+    return tlsf_malloc(t, size);
+  }
+
+  if (size > BLOCK_SIZE_MAX - TLSF_ALIGN_SIZE - alignment) {
+    return NULL;
+  }
+
+  size_t adjusted = adjust_request_size(size);
+
+  // The gap in front of the aligned data must be able to hold a free
+  // block, so ask for enough to move the data one alignment further
+  size_t gap_min = sizeof(tlsf_block);
+  tlsf_block *b =
+      locate_free_block(t, adjust_request_size(adjusted + alignment + gap_min));
+
+  if (NULL == b) {
+    return NULL;
+  }
+
+  uint32 ptr = CAST(uint32, block_to_ptr(b));
+  uint32 aligned = (ptr + alignment - 1) & ~(alignment - 1);
+  size_t gap = aligned - ptr;
+
+  if (0 != gap && gap < gap_min) {
+    size_t offset = gap_min - gap;
+
+    if (offset < alignment) {
+      offset = alignment;
+    }
+
+    aligned = (aligned + offset + alignment - 1) & ~(alignment - 1);
+    gap = aligned - ptr;
+  }
+
+  if (0 != gap) {
+    b = block_trim_free_leading(t, b, gap);
+  }
+
+  return block_prepare_used(t, b, adjusted);
+}
+
+#undef BLOCK_FREE_BIT
+#undef BLOCK_PREV_FREE_BIT
+#undef BLOCK_OVERHEAD
+#undef BLOCK_START_OFFSET
+#undef BLOCK_SIZE_MIN
+#undef BLOCK_SIZE_MAX
+#undef block_size
+#undef block_is_free
+#undef block_is_prev_free
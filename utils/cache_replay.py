@@ -0,0 +1,140 @@
+#!/bin/python3
+
+# Replay a trace of block accesses on the disk cache policies of disk.cpp
+# (LRU and 2Q) and print their hit rates.
+#
+# A trace has a "disk sector" line per access, as in /sys/disktrace when
+# the kernel is built with DISK_CACHE_TRACE. Lines with a single number
+# are sectors of disk 0. Without a trace file a synthetic one is used: a
+# hot set of blocks interleaved with scans that each touch blocks once.
+#
+#   python3 utils/cache_replay.py [--blocks N] [trace]
+
+import argparse
+import random
+import sys
+from collections import OrderedDict
+
+SEGMENTS = 16  # DISK_CACHE_SEGMENTS
+IN_SHARE = 4   # DISK_CACHE_IN_SHARE
+OUT_SHARE = 2  # DISK_CACHE_OUT_SHARE
+
+
+class Segment:
+  """
+  A segment of the cache. The queues are ordered from the least recently
+  used to the most recently used block, like the back to the front of
+  the queues of disk.cpp.
+  """
+
+  def __init__(self, nb_blocks, two_q):
+    self.nb_blocks = nb_blocks
+    self.two_q = two_q
+    self.main = OrderedDict()  # Am, or the single LRU queue
+    for i in range(nb_blocks):
+      self.main[(None, i)] = True  # the blocks start free, in Am
+    self.a1in = OrderedDict()
+    self.nb_ghosts = nb_blocks // OUT_SHARE + 1
+    self.ghosts = [None] * self.nb_ghosts  # A1out, a ring
+    self.ghost_set = set()
+    self.next_ghost = 0
+
+  def remember(self, key):
+    old = self.ghosts[self.next_ghost]
+    if old is not None:
+      self.ghost_set.discard(old)
+    self.ghosts[self.next_ghost] = key
+    self.ghost_set.add(key)
+    self.next_ghost = (self.next_ghost + 1) % self.nb_ghosts
+
+  def forget(self, key):
+    if key not in self.ghost_set:
+      return False
+    self.ghost_set.discard(key)
+    self.ghosts[self.ghosts.index(key)] = None
+    return True
+
+  def evict(self):
+    queue = self.main
+    if len(self.a1in) > self.nb_blocks // IN_SHARE:
+      queue = self.a1in
+    if not queue:
+      queue = self.a1in if queue is self.main else self.main
+    key, _ = queue.popitem(last=False)
+    if queue is self.a1in:
+      self.remember(key)
+
+  def access(self, key):
+    """Access a block, telling if it was a hit."""
+    if key in self.main:
+      self.main.move_to_end(key)
+      return True
+    if key in self.a1in:
+      return True  # a block in A1in stays where it is
+
+    self.evict()
+
+    if self.two_q and not self.forget(key):
+      self.a1in[key] = True
+    else:
+      self.main[key] = True
+    return False
+
+
+def replay(trace, nb_blocks, two_q):
+  per_seg = (nb_blocks + SEGMENTS - 1) // SEGMENTS
+  segs = [Segment(per_seg, two_q) for _ in range(SEGMENTS)]
+  hits = 0
+  for disk, sector in trace:
+    if segs[sector % SEGMENTS].access((disk, sector)):
+      hits += 1
+  return hits
+
+
+def read_trace(path):
+  trace = []
+  with open(path) as f:
+    for line in f:
+      fields = line.split()
+      if len(fields) == 1:
+        trace.append((0, int(fields[0])))
+      elif len(fields) == 2:
+        trace.append((int(fields[0]), int(fields[1])))
+  return trace
+
+
+def synthetic_trace(nb_blocks, length=200000, seed=1):
+  # A block is a sector (DISK_LOG2_BLOCK_SIZE is 9)
+  rng = random.Random(seed)
+  hot = list(range(nb_blocks // 2))
+  scan = 4 * nb_blocks
+  trace = []
+  while len(trace) < length:
+    for _ in range(4 * len(hot)):
+      trace.append((0, rng.choice(hot)))
+    for _ in range(2 * nb_blocks):
+      trace.append((0, scan))
+      scan += 1
+  return trace[:length]
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser()
+  parser.add_argument("--blocks", type=int, default=1024,
+                      help="blocks in the cache (DISK_CACHE_BLOCKS)")
+  parser.add_argument("trace", nargs="?", help="trace file, synthetic if none")
+  args = parser.parse_args()
+
+  if args.trace:
+    trace = read_trace(args.trace)
+  else:
+    trace = synthetic_trace(args.blocks)
+
+  if not trace:
+    sys.exit("empty trace")
+
+  print("%d accesses, %d blocks" % (len(trace), args.blocks))
+  for name, two_q in (("LRU", False), ("2Q", True)):
+    hits = replay(trace, args.blocks, two_q)
+    print("%-4s hits %8d  misses %8d  hit rate %5.1f%%" %
+          (name, hits, len(trace) - hits, 100.0 * hits / len(trace)))
@@ -0,0 +1,416 @@
+// file: "blk_test.cpp"
+
+// Host test of the block request layer (blk.cpp). A device model takes
+// requests from a queue like a driver does and checks the commands it
+// gets. The commands and flushes it takes to write a file with the
+// write-back batches of disk.cpp are compared with a write and a flush
+// per sector, which is what the IDE driver used to do.
+
+#include "blk.h"
+#include "hosttest.h"
+#include "thread.h"
+
+//-----------------------------------------------------------------------------
+
+#define SECTOR_SIZE 512
+#define FILE_SECTORS 2048 // 1 MB
+
+#define IDE_MAX_COUNT 256 // IDE_LBA28_MAX_COUNT, the PIO limit of a command
+#define FLUSH_BATCH 64    // DISK_FLUSH_BATCH, blocks per write-back round
+#define MAX_DEPTH 32
+
+// The data of sector n is at data + n * SECTOR_SIZE
+static uint8 data[FILE_SECTORS * SECTOR_SIZE];
+
+// A device with up to depth commands in flight. They are done in the
+// order they were started when the test runs the device.
+
+typedef struct fake_dev_struct {
+  blk_queue queue;
+  uint32 depth;
+  blk_request *active[MAX_DEPTH]; // oldest first
+  uint32 nb_active;
+  bool flushing;
+  uint32 writes; // commands
+  uint32 reads;
+  uint32 flushes;
+  uint32 sectors;
+  uint32 max_active; // largest number of commands in flight
+} fake_dev;
+
+static void dev_check_command(fake_dev *dev, blk_request *req) {
+  uint8 *p = data + req->lba * SECTOR_SIZE;
+
+  CHECK(!dev->flushing); // nothing runs beside a flush
+
+  if (req->op == BLK_FLUSH) {
+    CHECK(dev->nb_active == 0); // the earlier requests are done
+    dev->flushing = TRUE;
+    dev->flushes++;
+    return;
+  }
+
+  CHECK(req->count <= dev->queue.max_count);
+  CHECK(req->nb_segments <= BLK_MAX_SEGMENTS);
+
+  // The segments of a merged request follow the sectors
+
+  for (uint32 i = 0; i < req->nb_segments; i++) {
+    CHECK(req->segments[i].buf == p);
+    p += req->segments[i].count * SECTOR_SIZE;
+  }
+
+  if (req->op == BLK_WRITE)
+    dev->writes++;
+  else
+    dev->reads++;
+
+  dev->sectors += req->count;
+}
+
+static void dev_start(blk_queue *q) {
+  fake_dev *dev = CAST(fake_dev *, q->driver_data);
+  blk_request *req;
+
+  ASSERT_INTERRUPTS_DISABLED();
+
+  while (dev->nb_active < dev->depth && (req = blk_queue_next(q)) != NULL) {
+    dev_check_command(dev, req);
+    dev->active[dev->nb_active++] = req;
+
+    if (dev->nb_active > dev->max_active)
+      dev->max_active = dev->nb_active;
+  }
+}
+
+static void dev_init(fake_dev *dev, uint32 depth, uint32 max_count) {
+  blk_queue_init(&dev->queue, dev_start, dev, max_count);
+  dev->depth = depth;
+  dev->nb_active = 0;
+  dev->flushing = FALSE;
+  dev->writes = 0;
+  dev->reads = 0;
+  dev->flushes = 0;
+  dev->sectors = 0;
+  dev->max_active = 0;
+}
+
+// Complete the oldest command, as the interrupt handler of a driver
+// would. Returns FALSE when the device is idle.
+static bool dev_run(fake_dev *dev) {
+  blk_request *req;
+
+  if (dev->nb_active == 0)
+    return FALSE;
+
+  req = dev->active[0];
+
+  for (uint32 i = 1; i < dev->nb_active; i++)
+    dev->active[i - 1] = dev->active[i];
+
+  dev->nb_active--;
+
+  if (req->op == BLK_FLUSH)
+    dev->flushing = FALSE;
+
+  disable_interrupts();
+  blk_complete(req, NO_ERROR);
+  dev_start(&dev->queue);
+  enable_interrupts();
+
+  return TRUE;
+}
+
+static void dev_drain(fake_dev *dev) {
+  while (dev_run(dev))
+    ;
+}
+
+static fake_dev *idle_dev;
+
+static void run_idle_dev() { dev_run(idle_dev); }
+
+//-----------------------------------------------------------------------------
+
+static uint32 done_count;
+
+static void count_done(blk_request *req) {
+  CHECK(req->err == NO_ERROR);
+  done_count++;
+}
+
+static void submit_wait(fake_dev *dev, blk_request *req) {
+  idle_dev = dev;
+  host_idle = run_idle_dev;
+  CHECK(blk_submit_wait(&dev->queue, req) == NO_ERROR);
+  host_idle = NULL;
+}
+
+static void init_sectors(blk_request *req, uint8 op, uint32 lba,
+                         uint32 count) {
+  blk_request_init(req, op, lba, count_done, NULL);
+  CHECK(blk_request_add(req, data + lba * SECTOR_SIZE, count));
+}
+
+// What the IDE driver used to do: every sector is written on its own
+// and followed by a flush of the drive's cache
+static void write_flush_per_sector(fake_dev *dev) {
+  blk_request req;
+
+  for (uint32 i = 0; i < FILE_SECTORS; i++) {
+    init_sectors(&req, BLK_WRITE, i, 1);
+    submit_wait(dev, &req);
+
+    blk_request_init(&req, BLK_FLUSH, 0, NULL, NULL);
+    submit_wait(dev, &req);
+  }
+}
+
+// What disk_write_back does with a file of one sector blocks, followed
+// by the flush of disk_flush. Each round takes FLUSH_BATCH dirty
+// blocks, gathers consecutive ones in requests of up to
+// BLK_MAX_SEGMENTS blocks and submits them with the queue plugged.
+static void write_back(fake_dev *dev) {
+  blk_request reqs[FLUSH_BATCH];
+  blk_request flush;
+
+  for (uint32 first = 0; first < FILE_SECTORS; first += FLUSH_BATCH) {
+    uint32 nb_reqs = 0;
+    blk_request *req = NULL;
+
+    for (uint32 i = first; i < first + FLUSH_BATCH; i++) {
+      if (req == NULL || !blk_request_add(req, data + i * SECTOR_SIZE, 1)) {
+        req = &reqs[nb_reqs++];
+        init_sectors(req, BLK_WRITE, i, 1);
+      }
+    }
+
+    done_count = 0;
+
+    blk_plug(&dev->queue);
+    for (uint32 i = 0; i < nb_reqs; i++)
+      blk_submit(&dev->queue, &reqs[i]);
+    blk_unplug(&dev->queue);
+
+    dev_drain(dev);
+    CHECK(done_count == nb_reqs);
+  }
+
+  blk_request_init(&flush, BLK_FLUSH, 0, NULL, NULL);
+  submit_wait(dev, &flush);
+}
+
+static void test_write_commands() {
+  fake_dev per_sector;
+  fake_dev batched;
+
+  dev_init(&per_sector, 1, IDE_MAX_COUNT);
+  write_flush_per_sector(&per_sector);
+
+  dev_init(&batched, 1, IDE_MAX_COUNT);
+  write_back(&batched);
+
+  printf("Writing %d sectors (1 MB) to an IDE disk:\n", FILE_SECTORS);
+  printf("  write and flush per sector: %4d writes, %4d flushes\n",
+         per_sector.writes, per_sector.flushes);
+  printf("  write-back and a flush:     %4d writes, %4d flushes\n",
+         batched.writes, batched.flushes);
+
+  CHECK(per_sector.writes == FILE_SECTORS);
+  CHECK(per_sector.flushes == FILE_SECTORS);
+  CHECK(batched.sectors == FILE_SECTORS);
+  CHECK(batched.writes == FILE_SECTORS / BLK_MAX_SEGMENTS);
+  CHECK(batched.flushes == 1);
+}
+
+// Requests submitted with the queue plugged are merged into one command
+// when they fit
+static void test_merge() {
+  fake_dev dev;
+  blk_request reqs[8];
+
+  dev_init(&dev, 1, IDE_MAX_COUNT);
+  done_count = 0;
+
+  blk_plug(&dev.queue);
+
+  // Out of order, each one continuing or preceding a pending one
+
+  init_sectors(&reqs[0], BLK_WRITE, 16, 4);
+  init_sectors(&reqs[1], BLK_WRITE, 20, 4);
+  init_sectors(&reqs[2], BLK_WRITE, 12, 4);
+  init_sectors(&reqs[3], BLK_WRITE, 28, 4);
+  init_sectors(&reqs[4], BLK_WRITE, 24, 4); // fills the gap to reqs[3]
+
+  for (uint32 i = 0; i < 5; i++)
+    blk_submit(&dev.queue, &reqs[i]);
+
+  blk_unplug(&dev.queue);
+  dev_drain(&dev);
+
+  CHECK(dev.writes == 1);
+  CHECK(dev.sectors == 20);
+  CHECK(done_count == 5);
+
+  // A merged request is limited by the device's largest command
+
+  dev_init(&dev, 1, 8);
+  done_count = 0;
+
+  blk_plug(&dev.queue);
+  for (uint32 i = 0; i < 4; i++) {
+    init_sectors(&reqs[i], BLK_WRITE, i * 4, 4);
+    blk_submit(&dev.queue, &reqs[i]);
+  }
+  blk_unplug(&dev.queue);
+  dev_drain(&dev);
+
+  CHECK(dev.writes == 2);
+  CHECK(done_count == 4);
+}
+
+// A flush waits for the requests submitted before it, and the ones
+// submitted after it wait for the flush, also on a device with several
+// commands in flight
+static void test_flush_barrier() {
+  fake_dev dev;
+  blk_request before[4];
+  blk_request after[4];
+  blk_request flush;
+
+  dev_init(&dev, 4, IDE_MAX_COUNT);
+  done_count = 0;
+
+  blk_plug(&dev.queue);
+
+  for (uint32 i = 0; i < 4; i++) {
+    init_sectors(&before[i], BLK_WRITE, i * 64, 8);
+    blk_submit(&dev.queue, &before[i]);
+  }
+
+  blk_request_init(&flush, BLK_FLUSH, 0, count_done, NULL);
+  blk_submit(&dev.queue, &flush);
+
+  // Continuing a request before the flush, it must not join it
+
+  init_sectors(&after[0], BLK_WRITE, 8, 8);
+  blk_submit(&dev.queue, &after[0]);
+
+  for (uint32 i = 1; i < 4; i++) {
+    init_sectors(&after[i], BLK_WRITE, 512 + i * 64, 8);
+    blk_submit(&dev.queue, &after[i]);
+  }
+
+  blk_unplug(&dev.queue);
+
+  CHECK(dev.nb_active == 4);
+  CHECK(dev.writes == 4);
+
+  for (uint32 i = 0; i < 4; i++)
+    dev_run(&dev);
+
+  CHECK(dev.flushing); // started alone once the writes were done
+  CHECK(dev.nb_active == 1);
+  CHECK(dev.writes == 4);
+
+  dev_run(&dev);
+
+  CHECK(dev.nb_active == 4); // the writes after the flush
+  CHECK(dev.writes == 8);
+
+  dev_drain(&dev);
+
+  CHECK(done_count == 9);
+  CHECK(dev.flushes == 1);
+}
+
+// Requests a driver gives back after a reset are started again before
+// the pending ones, and a flush given back is still a barrier
+static void test_requeue() {
+  fake_dev dev;
+  blk_request reqs[4];
+  blk_request flush;
+
+  dev_init(&dev, 4, IDE_MAX_COUNT);
+  done_count = 0;
+
+  blk_plug(&dev.queue);
+
+  for (uint32 i = 0; i < 3; i++) {
+    init_sectors(&reqs[i], BLK_READ, i * 64, 8);
+    blk_submit(&dev.queue, &reqs[i]);
+  }
+
+  blk_request_init(&flush, BLK_FLUSH, 0, count_done, NULL);
+  blk_submit(&dev.queue, &flush);
+
+  init_sectors(&reqs[3], BLK_WRITE, 256, 8);
+  blk_submit(&dev.queue, &reqs[3]);
+
+  blk_unplug(&dev.queue);
+
+  CHECK(dev.nb_active == 3);
+
+  // The device fails, the driver completes the first request and gives
+  // back the others
+
+  disable_interrupts();
+  dev.depth = 0; // nothing is started until the device is back
+  blk_complete(dev.active[0], NO_ERROR);
+  blk_requeue(dev.active[2]);
+  blk_requeue(dev.active[1]);
+  dev.nb_active = 0;
+  CHECK(dev.queue.active == 0);
+  dev.depth = 4;
+  dev_start(&dev.queue);
+  enable_interrupts();
+
+  CHECK(dev.nb_active == 2);
+  CHECK(dev.active[0] == &reqs[1] && dev.active[1] == &reqs[2]);
+
+  dev_run(&dev);
+  dev_run(&dev);
+
+  CHECK(dev.flushing);
+  dev_run(&dev);
+  CHECK(dev.active[0] == &reqs[3]);
+
+  // A flush given back while it runs
+
+  disable_interrupts();
+  dev_run(&dev);
+  enable_interrupts();
+
+  blk_request_init(&flush, BLK_FLUSH, 0, count_done, NULL);
+  blk_submit(&dev.queue, &flush);
+  CHECK(dev.flushing && dev.nb_active == 1);
+
+  disable_interrupts();
+  blk_requeue(dev.active[0]);
+  dev.nb_active = 0;
+  dev.flushing = FALSE;
+  CHECK(!dev.queue.barrier);
+  dev_start(&dev.queue);
+  enable_interrupts();
+
+  CHECK(dev.flushing && dev.flushes == 3); // started a second time
+  dev_drain(&dev);
+  CHECK(done_count == 6);
+}
+
+//-----------------------------------------------------------------------------
+
+int main() {
+  test_merge();
+  test_flush_barrier();
+  test_requeue();
+  test_write_commands();
+
+  printf("blk_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,491 @@
+// file: "disk_test.cpp"
+
+// Host test of the disk cache (disk.cpp) over a RAM disk that does its
+// requests in a random order, like a device with a queue of commands,
+// and sometimes fails a read. Random reads, writes, direct reads and
+// flushes of a partition are checked against a model of its sectors,
+// while the cache reads ahead and writes back on its own. Then the
+// workload of disk_cache_benchmark is replayed with its threads taking
+// turns, which gives the hit rate but not the lock waits, since there
+// is no other thread to wait for.
+
+#include "disk.h"
+#include "hosttest.h"
+#include "thread.h"
+
+//-----------------------------------------------------------------------------
+
+#define SECTOR_SIZE (1 << DISK_LOG2_BLOCK_SIZE)
+#define DISK_SECTORS 16384 // 8 MB
+#define PART_START 64
+#define PART_SECTORS (DISK_SECTORS - PART_START)
+
+#define MEMORY (32 * (1 << 20)) // for a cache of 1024 blocks
+#define DEV_DEPTH 8
+#define DEV_MAX_COUNT 32 // less than MAX_DIRECT, to split direct reads
+#define READ_ERROR_RATE 256 // one read in
+
+#define OPS 200000
+#define WORKING_SET 4096 // sectors of most random operations
+#define MAX_HELD 4
+#define MAX_RUN 64
+#define MAX_DIRECT 64
+
+// As in disk_cache_benchmark
+#define BENCH_THREADS 8
+#define BENCH_HOT_SECTORS 1024
+#define BENCH_HOT_SHARE 4
+#define BENCH_ROUNDS 50000
+
+static uint8 media[DISK_SECTORS * SECTOR_SIZE];
+
+//-----------------------------------------------------------------------------
+
+// Kernel services
+
+volatile uint64 _irq8_counter;
+
+uint64 total_usable_memory = MEMORY;
+
+#define POOL_SIZE (4 * (1 << 20))
+
+static uint8 pool[POOL_SIZE];
+static uint32 pool_used;
+static uint32 pool_last; // where the last allocation starts
+
+// Only the last allocation is given back, which is how disk_write_back
+// uses its requests
+void *kmalloc(size_t size) {
+  size = (size + 15) & ~15;
+  CHECK(pool_used + size <= POOL_SIZE);
+  pool_last = pool_used;
+  pool_used += size;
+
+  return pool + pool_last;
+}
+
+void kfree(void *ptr) {
+  if (ptr == pool + pool_last)
+    pool_used = pool_last;
+}
+
+//-----------------------------------------------------------------------------
+
+// The device, with up to DEV_DEPTH commands in flight
+
+typedef struct ram_dev_struct {
+  virtio_blk_device vdev; // only its queue is used
+  blk_request *active[DEV_DEPTH];
+  uint32 nb_active;
+  bool flushing;
+  uint32 state;
+  uint32 reads;
+  uint32 writes;
+  uint32 flushes;
+  uint32 errors;
+} ram_dev;
+
+static ram_dev dev;
+
+static void dev_start(blk_queue *q) {
+  blk_request *req;
+
+  ASSERT_INTERRUPTS_DISABLED();
+
+  while (dev.nb_active < DEV_DEPTH && (req = blk_queue_next(q)) != NULL) {
+    CHECK(!dev.flushing); // nothing runs beside a flush
+
+    if (req->op == BLK_FLUSH) {
+      CHECK(dev.nb_active == 0); // the earlier requests are done
+      dev.flushing = TRUE;
+    } else {
+      // The partition's LBA were made relative to the device
+      CHECK(req->lba >= PART_START);
+      CHECK(req->count <= DEV_MAX_COUNT);
+      CHECK(req->lba + req->count <= DISK_SECTORS);
+    }
+
+    dev.active[dev.nb_active++] = req;
+  }
+}
+
+// Complete one of the commands, as the interrupt handler of a driver
+// would. A failed read leaves garbage in the buffers. Returns FALSE
+// when the device is idle.
+static bool dev_run() {
+  blk_request *req;
+  error_code err = NO_ERROR;
+  uint8 *p;
+
+  if (dev.nb_active == 0)
+    return FALSE;
+
+  uint32 i = host_random(&dev.state) % dev.nb_active;
+
+  req = dev.active[i];
+  dev.active[i] = dev.active[--dev.nb_active];
+  p = media + req->lba * SECTOR_SIZE;
+
+  if (req->op == BLK_FLUSH) {
+    dev.flushing = FALSE;
+    dev.flushes++;
+  } else if (req->op == BLK_READ &&
+             host_random(&dev.state) % READ_ERROR_RATE == 0) {
+    for (uint32 j = 0; j < req->nb_segments; j++)
+      memset(req->segments[j].buf, 0xee, req->segments[j].count * SECTOR_SIZE);
+    err = UNKNOWN_ERROR;
+    dev.errors++;
+  } else {
+    for (uint32 j = 0; j < req->nb_segments; j++) {
+      uint32 n = req->segments[j].count * SECTOR_SIZE;
+      if (req->op == BLK_WRITE)
+        memcpy(p, req->segments[j].buf, n);
+      else
+        memcpy(req->segments[j].buf, p, n);
+      p += n;
+    }
+
+    if (req->op == BLK_WRITE)
+      dev.writes++;
+    else
+      dev.reads++;
+  }
+
+  disable_interrupts();
+  blk_complete(req, err);
+  dev_start(&dev.vdev.queue);
+  enable_interrupts();
+
+  return TRUE;
+}
+
+static disk *test_disk;
+static bool flusher_running;
+static uint32 flusher_runs;
+static uint32 op_flusher_runs; // since the start of the operation
+
+// A wait is for the device, or for a segment whose blocks are all dirty
+// or in use when it is idle. The flusher thread would then write the
+// dirty blocks back.
+static void dev_idle() {
+  if (dev_run())
+    return;
+
+  CHECK(!flusher_running); // a request was lost
+  CHECK(op_flusher_runs < 4); // the blocks are all in use
+
+  flusher_running = TRUE;
+  flusher_runs++;
+  op_flusher_runs++;
+  CHECK(disk_flush(test_disk) == NO_ERROR);
+  flusher_running = FALSE;
+}
+
+static disk *setup() {
+  disk *d;
+
+  pool_used = 0;
+  setup_disk();
+
+  blk_queue_init(&dev.vdev.queue, dev_start, &dev, DEV_MAX_COUNT);
+  dev.nb_active = 0;
+  dev.flushing = FALSE;
+  dev.state = 2024;
+  dev.reads = 0;
+  dev.writes = 0;
+  dev.flushes = 0;
+  dev.errors = 0;
+
+  d = disk_alloc();
+  CHECK(d != NULL);
+  d->kind = DISK_VIRTIO;
+  d->log2_sector_size = DISK_LOG2_BLOCK_SIZE;
+  d->partition_type = 0x83;
+  d->partition_path = 1;
+  d->partition_start = PART_START;
+  d->partition_length = PART_SECTORS;
+  d->_.virtio.dev = &dev.vdev;
+
+  test_disk = d;
+  host_idle = dev_idle;
+  flusher_runs = 0;
+
+  return d;
+}
+
+//-----------------------------------------------------------------------------
+
+// The model: the content of a sector depends on its LBA and on the
+// number of times it was written
+
+static uint32 version[PART_SECTORS];
+
+static uint8 sector_byte(uint32 lba, uint32 v, uint32 i) {
+  uint32 x = (lba + 1) * 2654435761U + v * 97;
+  return CAST(uint8, (x >> ((i & 3) * 8)) + (i >> 2));
+}
+
+static void sector_fill(uint8 *buf, uint32 lba) {
+  for (uint32 i = 0; i < SECTOR_SIZE; i++)
+    buf[i] = sector_byte(lba, version[lba], i);
+}
+
+static bool sector_intact(uint8 *buf, uint32 lba) {
+  for (uint32 i = 0; i < SECTOR_SIZE; i++)
+    if (buf[i] != sector_byte(lba, version[lba], i))
+      return FALSE;
+  return TRUE;
+}
+
+static void media_init() {
+  memset(media, 0xaa, PART_START * SECTOR_SIZE);
+
+  for (uint32 lba = 0; lba < PART_SECTORS; lba++) {
+    version[lba] = 0;
+    sector_fill(media + (PART_START + lba) * SECTOR_SIZE, lba);
+  }
+}
+
+// After a flush, the media has everything that was written, and nothing
+// outside of the partition
+static void check_media() {
+  disk_cache_stats stats;
+
+  disk_cache_get_stats(&stats);
+  CHECK(stats.nb_dirty == 0);
+
+  for (uint32 i = 0; i < PART_START * SECTOR_SIZE; i++)
+    CHECK(media[i] == 0xaa);
+
+  for (uint32 lba = 0; lba < PART_SECTORS; lba++)
+    CHECK(sector_intact(media + (PART_START + lba) * SECTOR_SIZE, lba));
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct held_block_struct {
+  cache_block *cb; // NULL when the slot is free
+  uint32 lba;
+} held_block;
+
+static held_block held[MAX_HELD];
+static uint32 acquire_errors;
+static uint32 direct_errors;
+
+// Acquire a block, which the device may fail to read
+static cache_block *acquire(disk *d, uint32 lba) {
+  cache_block *cb;
+
+  if (ERROR(disk_cache_block_acquire(d, lba, &cb))) {
+    acquire_errors++;
+    return NULL;
+  }
+
+  CHECK(cb->d == d && cb->sector_pos == lba);
+  CHECK(cb->refcount > 0);
+
+  return cb;
+}
+
+static void check_block(cache_block *cb, uint32 lba) {
+  rwmutex_readlock(cb->mut);
+  CHECK(sector_intact(cb->buf, lba));
+  rwmutex_readunlock(cb->mut);
+}
+
+static void read_sector(disk *d, uint32 lba) {
+  cache_block *cb = acquire(d, lba);
+
+  if (cb != NULL) {
+    check_block(cb, lba);
+    CHECK(disk_cache_block_release(cb) == NO_ERROR);
+  }
+}
+
+static void write_sector(disk *d, uint32 lba) {
+  cache_block *cb = acquire(d, lba);
+
+  if (cb != NULL) {
+    rwmutex_writelock(cb->mut);
+    version[lba]++;
+    sector_fill(cb->buf, lba);
+    disk_cache_block_dirty(cb);
+    rwmutex_writeunlock(cb->mut);
+    CHECK(disk_cache_block_release(cb) == NO_ERROR);
+  }
+}
+
+static void read_direct(disk *d, uint32 lba, uint32 count) {
+  static uint16 buf[MAX_DIRECT * SECTOR_SIZE / 2];
+  uint8 *p = CAST(uint8 *, buf);
+
+  if (ERROR(disk_read_direct(d, lba, p, count))) {
+    direct_errors++;
+    return;
+  }
+
+  // The blocks still dirty in the cache are the ones read
+  for (uint32 i = 0; i < count; i++)
+    CHECK(sector_intact(p + i * SECTOR_SIZE, lba + i));
+}
+
+// A block that stays acquired while the others come and go keeps its
+// sector and content
+static void hold_or_release(disk *d, uint32 slot, uint32 lba) {
+  held_block *h = &held[slot];
+
+  if (h->cb == NULL) {
+    h->cb = acquire(d, lba);
+    h->lba = lba;
+  } else {
+    CHECK(h->cb->d == d && h->cb->sector_pos == h->lba);
+    check_block(h->cb, h->lba);
+    CHECK(disk_cache_block_release(h->cb) == NO_ERROR);
+    h->cb = NULL;
+  }
+}
+
+static void test_random() {
+  uint32 state = 1234;
+  uint32 flushes = 0;
+  disk_cache_stats stats;
+  disk *d = setup();
+
+  media_init();
+
+  for (uint32 op = 0; op < OPS; op++) {
+    uint32 r = host_random(&state);
+    uint32 kind = r % 16;
+    uint32 lba = (host_random(&state) >> 4) % WORKING_SET;
+
+    op_flusher_runs = 0;
+    _irq8_counter += 1 + r % 4; // for the age of the dirty blocks
+
+    if (kind < 6) {
+      read_sector(d, lba);
+    } else if (kind < 9) {
+      write_sector(d, lba);
+    } else if (kind < 11) {
+      // A sequential read anywhere on the partition, which the cache
+      // reads ahead of
+      uint32 n = 1 + (r >> 8) % MAX_RUN;
+      lba = (r >> 4) % (PART_SECTORS - n);
+      for (uint32 i = 0; i < n; i++) {
+        read_sector(d, lba + i);
+        dev_run();
+      }
+    } else if (kind == 11) {
+      uint32 n = 1 + (r >> 8) % MAX_DIRECT;
+      read_direct(d, lba, n);
+    } else if (kind == 12) {
+      hold_or_release(d, (r >> 8) % MAX_HELD, lba);
+    } else if (kind == 13 && (r >> 8) % 64 == 0) {
+      for (uint32 i = 0; i < MAX_HELD; i++)
+        if (held[i].cb != NULL)
+          hold_or_release(d, i, 0);
+      CHECK(disk_flush(d) == NO_ERROR);
+      check_media();
+      flushes++;
+    } else {
+      read_sector(d, lba);
+    }
+
+    // Some of the commands in flight are done between the operations
+    for (uint32 i = (r >> 24) % 3; i > 0; i--)
+      dev_run();
+  }
+
+  for (uint32 i = 0; i < MAX_HELD; i++)
+    if (held[i].cb != NULL)
+      hold_or_release(d, i, 0);
+
+  CHECK(disk_flush(d) == NO_ERROR);
+  check_media();
+
+  disk_cache_get_stats(&stats);
+
+  printf("%u operations on %u blocks (%s), %u flushes checked\n", OPS,
+         stats.nb_blocks, stats.policy, flushes + 1);
+  printf("  %u blocks read ahead, %u used, %u evicted unused\n",
+         stats.ra_blocks, stats.ra_hits, stats.ra_wasted);
+  printf("  %u blocks written back by %u writes, %u times with a segment "
+         "full of dirty blocks\n",
+         stats.wb_blocks, stats.wb_writes, flusher_runs);
+  printf("  %u reads failed, %u acquires and %u direct reads gave the "
+         "error\n",
+         dev.errors, acquire_errors, direct_errors);
+}
+
+//-----------------------------------------------------------------------------
+
+// The threads of disk_cache_benchmark take turns for a read each
+static void bench() {
+  uint32 part = PART_SECTORS / BENCH_THREADS;
+  uint32 seed[BENCH_THREADS];
+  uint32 scan[BENCH_THREADS];
+  uint32 reads = 0;
+  disk_cache_stats stats;
+  disk *d = setup();
+
+  media_init();
+  acquire_errors = 0;
+
+  for (uint32 id = 0; id < BENCH_THREADS; id++) {
+    seed[id] = id * 2654435761U + 1;
+    scan[id] = part * id;
+  }
+
+  uint64 start = host_nsecs();
+
+  for (uint32 round = 0; round < BENCH_ROUNDS; round++) {
+    for (uint32 id = 0; id < BENCH_THREADS; id++) {
+      cache_block *cb;
+      uint32 lba;
+
+      seed[id] = seed[id] * 1103515245 + 12345;
+
+      if ((seed[id] >> 16) % 5 < BENCH_HOT_SHARE) {
+        lba = (seed[id] >> 8) % BENCH_HOT_SECTORS;
+      } else {
+        lba = scan[id]++;
+        if (scan[id] == part * (id + 1))
+          scan[id] = part * id;
+      }
+
+      if ((cb = acquire(d, lba)) != NULL) {
+        rwmutex_readlock(cb->mut);
+        rwmutex_readunlock(cb->mut);
+        disk_cache_block_release(cb);
+        reads++;
+      }
+
+      dev_run();
+    }
+  }
+
+  uint64 nsecs = host_nsecs() - start;
+
+  disk_cache_get_stats(&stats);
+
+  printf("Disk cache benchmark (%s) with %u threads taking turns: %u reads, "
+         "%u ns each\n",
+         stats.policy, BENCH_THREADS, reads, CAST(uint32, nsecs / reads));
+  printf("  hit rate (%%): %u, of the hits in the LRU list (%%): %u\n",
+         stats.hits * 100 / (stats.hits + stats.misses),
+         stats.main_hits * 100 / stats.hits);
+  printf("  %u blocks read ahead, %u used, %u evicted unused\n",
+         stats.ra_blocks, stats.ra_hits, stats.ra_wasted);
+}
+
+int main() {
+  test_random();
+  bench();
+
+  printf("disk_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,489 @@
+// file: "fat_test.cpp"
+
+// Host test of the FAT driver (drivers/filesystem/fat.cpp) on a FAT32
+// image it generates on a RAM disk, through the file system calls of
+// vfs.cpp and the disk cache. Files written a few clusters at a time
+// interleave their chains, and the extent map of one of them must give
+// the runs of its chain in the FAT. Seeks all over it must then cost no
+// more than the sector read after them, and a read of the whole file a
+// direct read per run. The size of a file written in small pieces only
+// reaches its directory entry when it is synced or closed.
+
+#include "disk.h"
+#include "fat.h"
+#include "hosttest.h"
+#include "thread.h"
+#include "tlsf.h"
+#include "vfs.h"
+
+//-----------------------------------------------------------------------------
+
+#define SECTOR_SIZE (1 << DISK_LOG2_BLOCK_SIZE)
+#define DISK_SECTORS 32768 // 16 MB
+
+// The FAT32 volume, with a cluster per sector so that files have many
+// clusters
+#define RESERVED_SECTORS 32
+#define FSINFO_SECTOR 1
+#define NB_FATS 2
+#define FAT_SECTORS 256
+#define FIRST_DATA_SECTOR (RESERVED_SECTORS + NB_FATS * FAT_SECTORS)
+#define ROOT_CLUSTER 2
+
+#define MEMORY (32 * (1 << 20)) // for a cache of 1024 blocks
+#define DEV_MAX_COUNT 128
+#define POOL_SIZE (8 * (1 << 20))
+
+#define NB_FILES 3
+#define FILE_CLUSTERS 2048 // 1 MB
+#define MAX_STRIDE 8       // clusters written to a file at a time
+#define SEEKS 10000
+
+static uint8 media[DISK_SECTORS * SECTOR_SIZE];
+
+//-----------------------------------------------------------------------------
+
+// Kernel services
+
+volatile uint64 _irq8_counter;
+
+uint64 total_usable_memory = MEMORY;
+
+static uint32 pool[POOL_SIZE / sizeof(uint32)];
+static tlsf pool_tlsf;
+
+void *kmalloc(size_t size) { return tlsf_malloc(&pool_tlsf, size); }
+
+void kfree(void *ptr) { tlsf_free(&pool_tlsf, ptr); }
+
+void get_current_time(uint8 *hour, uint8 *min, uint8 *sec) {
+  *hour = 12;
+  *min = 0;
+  *sec = 0;
+}
+
+void get_current_date(int16 *year, uint8 *month, uint8 *day) {
+  *year = 2024;
+  *month = 1;
+  *day = 1;
+}
+
+uint32 days_from_civil(int16 y, uint16 m, uint16 d) { return 0; }
+
+error_code mount_streams(vfnode *parent) { return NO_ERROR; }
+
+error_code mount_sysfiles(vfnode *parent) { return NO_ERROR; }
+
+//-----------------------------------------------------------------------------
+
+// The device does its commands in order, when the kernel waits
+
+typedef struct ram_dev_struct {
+  virtio_blk_device vdev; // only its queue is used
+  blk_request *active;
+  uint32 writes;
+} ram_dev;
+
+static ram_dev dev;
+
+static void dev_start(blk_queue *q) {
+  ASSERT_INTERRUPTS_DISABLED();
+
+  if (dev.active == NULL)
+    dev.active = blk_queue_next(q);
+}
+
+static bool dev_run() {
+  blk_request *req = dev.active;
+  uint8 *p;
+
+  if (req == NULL)
+    return FALSE;
+
+  dev.active = NULL;
+  p = media + req->lba * SECTOR_SIZE;
+
+  if (req->op != BLK_FLUSH) {
+    CHECK(req->lba + req->count <= DISK_SECTORS);
+
+    for (uint32 j = 0; j < req->nb_segments; j++) {
+      uint32 n = req->segments[j].count * SECTOR_SIZE;
+      if (req->op == BLK_WRITE)
+        memcpy(p, req->segments[j].buf, n);
+      else
+        memcpy(req->segments[j].buf, p, n);
+      p += n;
+    }
+
+    if (req->op == BLK_WRITE)
+      dev.writes++;
+  }
+
+  disable_interrupts();
+  blk_complete(req, NO_ERROR);
+  dev_start(&dev.vdev.queue);
+  enable_interrupts();
+
+  return TRUE;
+}
+
+static disk *test_disk;
+static bool flusher_running;
+
+// A wait finding the device idle is for a segment of the cache whose
+// blocks are all dirty, which the flusher thread would write back
+static void dev_idle() {
+  if (dev_run())
+    return;
+
+  CHECK(!flusher_running); // a request was lost
+
+  flusher_running = TRUE;
+  CHECK(disk_flush(test_disk) == NO_ERROR);
+  flusher_running = FALSE;
+}
+
+//-----------------------------------------------------------------------------
+
+// The image
+
+static void put_u16(uint8 *p, uint16 x) {
+  p[0] = x;
+  p[1] = x >> 8;
+}
+
+static void put_u32(uint8 *p, uint32 x) {
+  put_u16(p, x);
+  put_u16(p + 2, x >> 16);
+}
+
+static uint32 get_u32(uint8 *p) {
+  return p[0] + (p[1] << 8) + (p[2] << 16) + (CAST(uint32, p[3]) << 24);
+}
+
+static uint32 fat_entry(uint32 cluster) {
+  return get_u32(media + RESERVED_SECTORS * SECTOR_SIZE + cluster * 4) &
+         0x0fffffff;
+}
+
+static void format() {
+  BIOS_Parameter_Block *p = CAST(BIOS_Parameter_Block *, media);
+  FAT_FSInfo *info = CAST(FAT_FSInfo *, media + FSINFO_SECTOR * SECTOR_SIZE);
+
+  memset(media, 0, FIRST_DATA_SECTOR * SECTOR_SIZE + SECTOR_SIZE);
+
+  put_u16(p->BPB_BytsPerSec, SECTOR_SIZE);
+  p->BPB_SecPerClus = 1;
+  put_u16(p->BPB_RsvdSecCnt, RESERVED_SECTORS);
+  p->BPB_NumFATs = NB_FATS;
+  p->BPB_Media = 0xf8;
+  put_u32(p->BPB_TotSec32, DISK_SECTORS);
+  put_u32(p->_.FAT32.BPB_FATSz32, FAT_SECTORS);
+  put_u32(p->_.FAT32.BPB_RootClus, ROOT_CLUSTER);
+  put_u16(p->_.FAT32.BPB_FSInfo, FSINFO_SECTOR);
+  media[510] = 0x55;
+  media[511] = 0xaa;
+
+  put_u32(info->FSI_LeadSig, FAT_FSINFO_LEAD_SIG);
+  put_u32(info->FSI_StrucSig, FAT_FSINFO_STRUC_SIG);
+  put_u32(info->FSI_Free_Count, FAT_FSINFO_UNKNOWN);
+  put_u32(info->FSI_Nxt_Free, FAT_FSINFO_UNKNOWN);
+
+  for (uint32 i = 0; i < NB_FATS; i++) {
+    uint8 *fat = media + (RESERVED_SECTORS + i * FAT_SECTORS) * SECTOR_SIZE;
+    put_u32(fat, 0x0ffffff8);
+    put_u32(fat + 4, 0x0fffffff);
+    put_u32(fat + ROOT_CLUSTER * 4, 0x0fffffff); // the root directory
+  }
+}
+
+static void mount() {
+  disk *d;
+
+  tlsf_init(&pool_tlsf, pool, POOL_SIZE);
+  setup_disk();
+
+  blk_queue_init(&dev.vdev.queue, dev_start, &dev, DEV_MAX_COUNT);
+  dev.active = NULL;
+  host_idle = dev_idle;
+
+  // The volume takes the whole disk, without a partition table
+  d = disk_alloc();
+  CHECK(d != NULL);
+  d->kind = DISK_VIRTIO;
+  d->log2_sector_size = DISK_LOG2_BLOCK_SIZE;
+  d->partition_type = 0x0c;
+  d->partition_path = 1;
+  d->partition_start = 0;
+  d->partition_length = DISK_SECTORS;
+  d->_.virtio.dev = &dev.vdev;
+  test_disk = d;
+
+  CHECK(init_vfs() == NO_ERROR);
+}
+
+//-----------------------------------------------------------------------------
+
+static native_string paths[NB_FILES] = {"/dsk1/frag0.bin", "/dsk1/frag1.bin",
+                                        "/dsk1/frag2.bin"};
+
+static uint8 file_byte(uint32 f, uint32 pos) {
+  return CAST(uint8, pos * 7 + (pos >> 9) * 13 + f * 101);
+}
+
+static uint8 buf[FILE_CLUSTERS * SECTOR_SIZE];
+
+// The files are written in turns, each a few clusters at a time
+static void write_files() {
+  uint32 state = 77;
+  uint32 written[NB_FILES];
+  file *f[NB_FILES];
+
+  for (uint32 i = 0; i < NB_FILES; i++) {
+    CHECK(HAS_NO_ERROR(file_open(paths[i], "w+", &f[i])));
+    written[i] = 0;
+  }
+
+  for (bool more = TRUE; more;) {
+    more = FALSE;
+
+    for (uint32 i = 0; i < NB_FILES; i++) {
+      uint32 n = 1 + host_random(&state) % MAX_STRIDE;
+
+      if (n > FILE_CLUSTERS - written[i])
+        n = FILE_CLUSTERS - written[i];
+
+      uint32 pos = written[i] * SECTOR_SIZE;
+      uint32 len = n * SECTOR_SIZE;
+
+      for (uint32 j = 0; j < len; j++)
+        buf[j] = file_byte(i, pos + j);
+
+      CHECK(file_write(f[i], buf, len) == CAST(error_code, len));
+      written[i] += n;
+      more = more || written[i] < FILE_CLUSTERS;
+    }
+  }
+
+  for (uint32 i = 0; i < NB_FILES; i++)
+    CHECK(HAS_NO_ERROR(file_close(f[i])));
+
+  CHECK(disk_flush(test_disk) == NO_ERROR);
+}
+
+// The runs of the chain of a file in the FAT on the media
+static uint32 count_runs(uint32 cluster) {
+  uint32 runs = 1;
+  uint32 n = 1;
+
+  for (uint32 next; (next = fat_entry(cluster)) < 0x0ffffff8; cluster = next) {
+    if (next != cluster + 1)
+      runs++;
+    n++;
+  }
+
+  CHECK(n == FILE_CLUSTERS);
+
+  return runs;
+}
+
+// The extents are the runs of the chain, in order
+static void check_extents(fat_file *ff) {
+  uint32 cluster = ff->first_cluster;
+  uint32 index = 0;
+
+  CHECK(ff->extents.first_cluster == ff->first_cluster);
+
+  for (uint32 r = 0; r < ff->extents.nb_runs; r++) {
+    fat_extent *run = &ff->extents.runs[r];
+
+    CHECK(run->index == index);
+    CHECK(run->cluster == cluster);
+
+    for (uint32 i = 1; i < run->count; i++)
+      CHECK(fat_entry(run->cluster + i - 1) == run->cluster + i);
+
+    cluster = fat_entry(run->cluster + run->count - 1);
+    index += run->count;
+  }
+
+  CHECK(index == FILE_CLUSTERS);
+  CHECK(cluster >= 0x0ffffff8);
+}
+
+static uint32 cache_acquisitions() {
+  disk_cache_stats stats;
+
+  disk_cache_get_stats(&stats);
+
+  return stats.hits + stats.misses;
+}
+
+static void test_extents() {
+  uint32 len = FILE_CLUSTERS * SECTOR_SIZE;
+  uint32 state = 4242;
+  uint64 hops = 0;
+  file *f;
+
+  CHECK(HAS_NO_ERROR(file_open(paths[1], "r", &f)));
+
+  fat_file *ff = CAST(fat_file *, f);
+  uint32 runs = count_runs(ff->first_cluster);
+  disk_cache_stats before;
+  disk_cache_stats after;
+
+  // A whole read maps the file and goes past the cache a run at a time
+
+  disk_cache_get_stats(&before);
+  CHECK(file_read(f, buf, len) == CAST(error_code, len));
+  disk_cache_get_stats(&after);
+
+  for (uint32 i = 0; i < len; i++)
+    CHECK(buf[i] == file_byte(1, i));
+
+  CHECK(ff->extents.nb_runs == runs);
+  check_extents(ff);
+  CHECK(after.direct_reads - before.direct_reads <= runs);
+
+  printf("%u clusters in %u runs, read with %u direct reads\n", FILE_CLUSTERS,
+         runs, after.direct_reads - before.direct_reads);
+
+  // Seeks anywhere, backwards as well as forwards, only read the sector
+  // of the byte
+
+  uint32 start = cache_acquisitions();
+  uint64 t = host_nsecs();
+
+  for (uint32 i = 0; i < SEEKS; i++) {
+    uint32 pos = host_random(&state) % len;
+    uint8 b;
+
+    CHECK(HAS_NO_ERROR(file_set_to_absolute_position(f, pos)));
+    CHECK(file_read(f, &b, 1) == 1);
+    CHECK(b == file_byte(1, pos));
+
+    hops += pos / SECTOR_SIZE;
+  }
+
+  t = host_nsecs() - t;
+
+  uint32 acquisitions = cache_acquisitions() - start;
+
+  CHECK(acquisitions == SEEKS);
+
+  printf("%u seeks: %u cache acquisition each, %u ns each, where a walk of "
+         "the chain takes %u FAT hops on average\n",
+         SEEKS, acquisitions / SEEKS, CAST(uint32, t / SEEKS),
+         CAST(uint32, hops / SEEKS));
+
+  CHECK(HAS_NO_ERROR(file_close(f)));
+}
+
+#define SIZE_PATH "/dsk1/size.bin"
+#define SIZE_LEN 3000
+#define SMALL_WRITE 3
+
+// The size in the directory entry of an open file, as it is on the media
+static uint32 media_size(fat_file *ff) {
+  uint32 cluster = ff->parent.first_cluster;
+  uint32 pos = ff->entry.position;
+
+  for (; pos >= SECTOR_SIZE; pos -= SECTOR_SIZE)
+    cluster = fat_entry(cluster);
+
+  uint8 *sector = media + (FIRST_DATA_SECTOR + cluster - 2) * SECTOR_SIZE;
+  FAT_directory_entry *de = CAST(FAT_directory_entry *, sector + pos);
+
+  return get_u32(de->DIR_FileSize);
+}
+
+static uint32 stat_size(native_string path) {
+  stat_buff sb;
+
+  CHECK(HAS_NO_ERROR(file_stat(path, &sb)));
+
+  return sb.bytes;
+}
+
+static void size_write(file *f, uint32 pos, uint32 count, uint8 pass) {
+  for (uint32 i = 0; i < count; i++)
+    buf[i] = file_byte(pass, pos + i);
+
+  CHECK(HAS_NO_ERROR(file_set_to_absolute_position(f, pos)));
+  CHECK(file_write(f, buf, count) == CAST(error_code, count));
+}
+
+// Small writes leave the directory entry alone until the file is closed
+// or synced, and overwrites don't grow the file
+static void test_size() {
+  fat_file *ff;
+  file *f;
+
+  CHECK(HAS_NO_ERROR(file_open(SIZE_PATH, "w+", &f)));
+  ff = CAST(fat_file *, f);
+
+  uint32 writes = dev.writes;
+  uint64 t = host_nsecs();
+
+  for (uint32 pos = 0; pos < SIZE_LEN; pos += SMALL_WRITE)
+    size_write(f, pos, SMALL_WRITE, 0);
+
+  t = host_nsecs() - t;
+
+  // The cache writeback doesn't know of the open file
+  CHECK(disk_flush(test_disk) == NO_ERROR);
+  CHECK(media_size(ff) == 0);
+
+  printf("%u writes of %u bytes: %u ns each, %u sectors written back\n",
+         SIZE_LEN / SMALL_WRITE, SMALL_WRITE,
+         CAST(uint32, t / (SIZE_LEN / SMALL_WRITE)), dev.writes - writes);
+
+  CHECK(HAS_NO_ERROR(file_sync(f)));
+  CHECK(disk_flush(test_disk) == NO_ERROR);
+  CHECK(media_size(ff) == SIZE_LEN);
+
+  // An overwrite in the middle keeps the size
+  size_write(f, 100, 200, 1);
+  CHECK(ff->length == SIZE_LEN);
+  CHECK(HAS_NO_ERROR(file_close(f)));
+  CHECK(stat_size(SIZE_PATH) == SIZE_LEN);
+
+  // Writing past the end extends the file
+  CHECK(HAS_NO_ERROR(file_open(SIZE_PATH, "r+", &f)));
+  ff = CAST(fat_file *, f);
+  size_write(f, SIZE_LEN - 50, 100, 2);
+  CHECK(ff->length == SIZE_LEN + 50);
+  CHECK(media_size(ff) == SIZE_LEN);
+
+  CHECK(HAS_NO_ERROR(file_close(f)));
+  CHECK(stat_size(SIZE_PATH) == SIZE_LEN + 50);
+
+  CHECK(HAS_NO_ERROR(file_open(SIZE_PATH, "r", &f)));
+  ff = CAST(fat_file *, f);
+  CHECK(disk_flush(test_disk) == NO_ERROR);
+  CHECK(media_size(ff) == SIZE_LEN + 50);
+  CHECK(file_read(f, buf, SIZE_LEN + 100) == SIZE_LEN + 50);
+
+  for (uint32 i = 0; i < SIZE_LEN + 50; i++) {
+    uint8 pass = (i >= SIZE_LEN - 50) ? 2 : (i >= 100 && i < 300) ? 1 : 0;
+    CHECK(buf[i] == file_byte(pass, i));
+  }
+
+  CHECK(HAS_NO_ERROR(file_close(f)));
+}
+
+int main() {
+  format();
+  mount();
+  write_files();
+  test_extents();
+  test_size();
+
+  printf("fat_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,26 @@
+// file: "general.h"
+
+// Stand-in for general.h when heap.cpp is compiled as the first-fit
+// block allocator alone, which the slab caches are compared against.
+// Its entry points are renamed so it links beside the real heap.cpp.
+
+#ifndef FIRSTFIT_GENERAL_H
+#define FIRSTFIT_GENERAL_H
+
+#include "../../../include/general.h"
+
+#undef USE_SLAB_ALLOCATOR
+
+#define heap_init firstfit_heap_init
+#define heap_malloc firstfit_heap_malloc
+#define heap_free firstfit_heap_free
+#define heap_realloc firstfit_heap_realloc
+#define heap_memalign firstfit_heap_memalign
+#define kheap firstfit_kheap
+#define appheap firstfit_appheap
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
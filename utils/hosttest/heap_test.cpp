@@ -0,0 +1,231 @@
+// file: "heap_test.cpp"
+
+// Host test of the kernel heap (heap.cpp). A random mix of malloc,
+// realloc, memalign and free over the slab objects and the blocks
+// checks that no allocation overlaps another and that everything is
+// given back. The cost of small allocations in a fragmented heap is
+// then compared with the first-fit block allocator alone.
+
+#include "heap.h"
+#include "hosttest.h"
+
+//-----------------------------------------------------------------------------
+
+// heap.cpp without USE_SLAB_ALLOCATOR (see firstfit/general.h)
+void firstfit_heap_init(heap *h, void *start, size_t size);
+void *firstfit_heap_malloc(heap *h, size_t size);
+void firstfit_heap_free(heap *h, void *ptr);
+
+#define HEAP_SIZE (32 * (1 << 20)) // like kheap
+
+#define SLOTS 2048
+#define STRESS_OPS 400000
+
+#define BENCH_LIVE 4000
+#define BENCH_OPS 50000
+#define BENCH_MAX_SIZE 512
+
+static uint32 heap_space[HEAP_SIZE / sizeof(uint32)];
+static void *heap_start = heap_space;
+static heap test_heap;
+
+typedef struct slot_struct {
+  uint8 *ptr;
+  uint32 size;
+  uint8 seed;
+} slot;
+
+static slot slots[SLOTS];
+
+static void slot_fill(slot *s) {
+  for (uint32 i = 0; i < s->size; i++)
+    s->ptr[i] = CAST(uint8, s->seed + i);
+}
+
+// The first n bytes still hold what slot_fill wrote
+static bool slot_intact(slot *s, uint32 n) {
+  for (uint32 i = 0; i < n; i++)
+    if (s->ptr[i] != CAST(uint8, s->seed + i))
+      return FALSE;
+  return TRUE;
+}
+
+// Mostly slab objects, and blocks of up to 5 slabs' worth of objects
+static uint32 random_size(uint32 *state) {
+  uint32 r = host_random(state);
+
+  if (r % 4 != 0)
+    return 1 + (r >> 8) % SLAB_MAX_SIZE;
+
+  return SLAB_MAX_SIZE + 1 + (r >> 8) % (5 * SLAB_MAX_SIZE);
+}
+
+// Once everything is freed, the heap is made of coalesced free blocks
+// and of the empty slab every cache keeps
+static void check_heap_empty(heap *h) {
+  uint32 empty_slabs = 0;
+  uint32 used = 0;
+
+  for (uint32 i = 0; i < SLAB_CLASS_COUNT; i++) {
+    CHECK(h->caches[i].partial == NULL);
+    if (h->caches[i].empty != NULL)
+      empty_slabs++;
+  }
+
+  for (block *b = h->f; b != NULL; b = b->next) {
+    if (b->head.parts.used) {
+      used++;
+    } else {
+      CHECK(b->next == NULL || b->next->head.parts.used);
+    }
+  }
+
+  CHECK(used == empty_slabs);
+}
+
+static void test_stress() {
+  uint32 state = 12345;
+  uint32 live = 0;
+  uint32 max_live = 0;
+  uint32 reallocs = 0;
+  uint32 aligned = 0;
+
+  heap_init(&test_heap, heap_start, HEAP_SIZE);
+
+  for (uint32 op = 0; op < STRESS_OPS; op++) {
+    uint32 r = host_random(&state);
+    slot *s = &slots[r % SLOTS];
+
+    if (s->ptr == NULL) {
+      s->size = random_size(&state);
+      s->seed = CAST(uint8, r >> 24);
+
+      if ((r >> 12) % 8 == 0) {
+        size_t alignment = 8 << ((r >> 16) % 10); // up to 4 KB
+        s->ptr = CAST(uint8 *, heap_memalign(&test_heap, alignment, s->size));
+        CHECK(s->ptr != NULL);
+        CHECK((CAST(uint32, s->ptr) & (alignment - 1)) == 0);
+        aligned++;
+      } else {
+        s->ptr = CAST(uint8 *, heap_malloc(&test_heap, s->size));
+        CHECK(s->ptr != NULL);
+      }
+
+      CHECK((CAST(uint32, s->ptr) & (sizeof(void *) - 1)) == 0);
+      slot_fill(s);
+
+      if (++live > max_live)
+        max_live = live;
+    } else if ((r >> 12) % 3 == 0) {
+      uint32 size = random_size(&state);
+      uint32 kept = size < s->size ? size : s->size;
+
+      CHECK(slot_intact(s, s->size));
+      s->ptr = CAST(uint8 *, heap_realloc(&test_heap, s->ptr, size));
+      CHECK(s->ptr != NULL);
+      CHECK(slot_intact(s, kept));
+      s->size = size;
+      s->seed = CAST(uint8, r >> 24);
+      slot_fill(s);
+      reallocs++;
+    } else {
+      CHECK(slot_intact(s, s->size));
+      heap_free(&test_heap, s->ptr);
+      s->ptr = NULL;
+      live--;
+    }
+  }
+
+  for (uint32 i = 0; i < SLOTS; i++) {
+    if (slots[i].ptr != NULL) {
+      CHECK(slot_intact(&slots[i], slots[i].size));
+      heap_free(&test_heap, slots[i].ptr);
+      slots[i].ptr = NULL;
+    }
+  }
+
+  check_heap_empty(&test_heap);
+
+  printf("stress: %u operations, %u live at most, %u reallocs, %u memaligns\n",
+         STRESS_OPS, max_live, reallocs, aligned);
+}
+
+// A small object only grows in place up to the size of its class
+static void test_slab_realloc() {
+  heap_init(&test_heap, heap_start, HEAP_SIZE);
+
+  void *p = heap_malloc(&test_heap, 20);
+  CHECK(heap_realloc(&test_heap, p, 32) == p);  // class of 32 bytes
+  CHECK(heap_realloc(&test_heap, p, 1) == p);   // never shrinks
+  void *q = heap_realloc(&test_heap, p, 33);
+  CHECK(q != NULL && q != p);
+  q = heap_realloc(&test_heap, q, 2 * SLAB_MAX_SIZE); // to a block
+  CHECK(q != NULL);
+  heap_free(&test_heap, q);
+  heap_free(&test_heap, NULL);
+
+  check_heap_empty(&test_heap);
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct allocator_struct {
+  native_string name;
+  void (*init)(heap *h, void *start, size_t size);
+  void *(*malloc)(heap *h, size_t size);
+  void (*free)(heap *h, void *ptr);
+} allocator;
+
+static allocator allocators[] = {
+    {"slab", heap_init, heap_malloc, heap_free},
+    {"first-fit", firstfit_heap_init, firstfit_heap_malloc, firstfit_heap_free},
+};
+
+// Replace random objects of a live set that has as many holes as
+// objects, which is where the first-fit lists get long
+static void bench(allocator *a) {
+  uint32 state = 777;
+  void *live[2 * BENCH_LIVE];
+
+  a->init(&test_heap, heap_start, HEAP_SIZE);
+
+  for (uint32 i = 0; i < 2 * BENCH_LIVE; i++) {
+    live[i] = a->malloc(&test_heap, 1 + host_random(&state) % BENCH_MAX_SIZE);
+    CHECK(live[i] != NULL);
+  }
+
+  for (uint32 i = 0; i < 2 * BENCH_LIVE; i += 2) {
+    a->free(&test_heap, live[i]);
+    live[i] = live[2 * BENCH_LIVE - 1 - i];
+  }
+
+  uint64 start = host_nsecs();
+
+  for (uint32 op = 0; op < BENCH_OPS; op++) {
+    uint32 i = host_random(&state) % BENCH_LIVE;
+    a->free(&test_heap, live[i]);
+    live[i] = a->malloc(&test_heap, 1 + host_random(&state) % BENCH_MAX_SIZE);
+    CHECK(live[i] != NULL);
+  }
+
+  uint32 nsecs = host_nsecs() - start;
+
+  printf("%-9s %u live objects of 1 to %u bytes: %5u ns per free and malloc\n",
+         a->name, BENCH_LIVE, BENCH_MAX_SIZE, nsecs / BENCH_OPS);
+}
+
+int main() {
+  test_slab_realloc();
+  test_stress();
+
+  for (uint32 i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+    bench(&allocators[i]);
+
+  printf("heap_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //
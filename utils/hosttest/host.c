@@ -0,0 +1,254 @@
+/* file: "host.c" */
+
+/* Run time of the host tests. The tests are i386 programs, like the
+   kernel, and the host may have no 32 bit C library: this file starts
+   them and provides the few services they use with Linux system calls. */
+
+#include <stdarg.h>
+
+#define SYS_WRITE 4
+#define SYS_EXIT_GROUP 252
+#define SYS_CLOCK_GETTIME 265
+
+#define CLOCK_MONOTONIC 1
+
+int main(void);
+
+static int host_syscall(int nr, int a, int b, int c) {
+  int result;
+
+  __asm__ __volatile__("int $0x80"
+                       : "=a"(result)
+                       : "0"(nr), "b"(a), "c"(b), "d"(c)
+                       : "memory");
+
+  return result;
+}
+
+void exit(int status) {
+  for (;;)
+    host_syscall(SYS_EXIT_GROUP, status, 0, 0);
+}
+
+void host_start(void) { exit(main()); }
+
+__asm__(".text\n"
+        ".globl _start\n"
+        "_start:\n"
+        "  xorl %ebp, %ebp\n"
+        "  andl $-16, %esp\n"
+        "  call host_start\n");
+
+unsigned long long host_nsecs(void) {
+  struct {
+    long tv_sec;
+    long tv_nsec;
+  } ts;
+
+  host_syscall(SYS_CLOCK_GETTIME, CLOCK_MONOTONIC, (int)&ts, 0);
+
+  return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The kernel sources and the compiler may call these. They are weak so
+   a test can link the kernel's own. */
+
+__attribute__((weak)) void *memcpy(void *dest, const void *src,
+                                   unsigned int n) {
+  char *d = dest;
+  const char *s = src;
+
+  while (n-- > 0)
+    *d++ = *s++;
+
+  return dest;
+}
+
+__attribute__((weak)) void *memset(void *dest, int c, unsigned int n) {
+  char *d = dest;
+
+  while (n-- > 0)
+    *d++ = c;
+
+  return dest;
+}
+
+/* The 64 bit divisions gcc calls for i386 */
+
+__attribute__((weak)) unsigned long long __udivdi3(unsigned long long n,
+                                                   unsigned long long d) {
+  unsigned long long q = 0;
+  int shift = 0;
+
+  while ((long long)d > 0 && d < n) {
+    d <<= 1;
+    shift++;
+  }
+
+  for (; shift >= 0; shift--) {
+    q <<= 1;
+    if (n >= d) {
+      n -= d;
+      q |= 1;
+    }
+    d >>= 1;
+  }
+
+  return q;
+}
+
+__attribute__((weak)) unsigned long long __umoddi3(unsigned long long n,
+                                                   unsigned long long d) {
+  return n - __udivdi3(n, d) * d;
+}
+
+/* printf with the flags '-' and '0', a width, and the conversions d, u,
+   x, p, c, s and ls */
+
+static char out[1024];
+static int out_len;
+
+static void out_flush(void) {
+  int done = 0;
+
+  while (done < out_len) {
+    int n = host_syscall(SYS_WRITE, 1, (int)(out + done), out_len - done);
+
+    if (n <= 0)
+      break;
+
+    done += n;
+  }
+
+  out_len = 0;
+}
+
+static void out_char(char c) {
+  if (out_len == sizeof(out))
+    out_flush();
+
+  out[out_len++] = c;
+}
+
+static void out_field(const char *s, int len, int width, int left,
+                      char pad) {
+  int i;
+
+  if (!left)
+    for (i = len; i < width; i++)
+      out_char(pad);
+
+  for (i = 0; i < len; i++)
+    out_char(s[i]);
+
+  if (left)
+    for (i = len; i < width; i++)
+      out_char(' ');
+}
+
+static int format_number(char *buf, unsigned int n, unsigned int base) {
+  char digits[16];
+  int len = 0;
+  int i = 0;
+
+  do {
+    digits[len++] = "0123456789abcdef"[n % base];
+    n /= base;
+  } while (n != 0);
+
+  while (len > 0)
+    buf[i++] = digits[--len];
+
+  return i;
+}
+
+int printf(const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+
+  for (; *format != '\0'; format++) {
+    char buf[16];
+    int left = 0;
+    int width = 0;
+    char pad = ' ';
+    int len;
+
+    if (*format != '%') {
+      out_char(*format);
+      continue;
+    }
+
+    format++;
+
+    if (*format == '-') {
+      left = 1;
+      format++;
+    }
+
+    if (*format == '0') {
+      pad = '0';
+      format++;
+    }
+
+    while (*format >= '0' && *format <= '9')
+      width = width * 10 + *format++ - '0';
+
+    switch (*format) {
+    case 'd': {
+      int n = va_arg(ap, int);
+      if (n < 0) {
+        buf[0] = '-';
+        len = 1 + format_number(buf + 1, -(unsigned int)n, 10);
+      } else {
+        len = format_number(buf, n, 10);
+      }
+      out_field(buf, len, width, left, pad);
+      break;
+    }
+    case 'u':
+      len = format_number(buf, va_arg(ap, unsigned int), 10);
+      out_field(buf, len, width, left, pad);
+      break;
+    case 'x':
+      len = format_number(buf, va_arg(ap, unsigned int), 16);
+      out_field(buf, len, width, left, pad);
+      break;
+    case 'p':
+      buf[0] = '0';
+      buf[1] = 'x';
+      len = 2 + format_number(buf + 2, (unsigned int)va_arg(ap, void *), 16);
+      out_field(buf, len, width, left, pad);
+      break;
+    case 'c':
+      buf[0] = va_arg(ap, int);
+      out_field(buf, 1, width, left, pad);
+      break;
+    case 's': {
+      const char *s = va_arg(ap, const char *);
+      for (len = 0; s[len] != '\0'; len++)
+        ;
+      out_field(s, len, width, left, pad);
+      break;
+    }
+    case 'l':
+      if (format[1] == 's') {
+        const int *s = va_arg(ap, const int *); /* wchar_t is 32 bits */
+        format++;
+        while (*s != 0)
+          out_char(*s++);
+        break;
+      }
+      /* fall through */
+    default:
+      out_char(*format);
+      break;
+    }
+  }
+
+  va_end(ap);
+
+  out_flush();
+
+  return 0;
+}
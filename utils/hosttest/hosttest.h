@@ -0,0 +1,45 @@
+// file: "hosttest.h"
+
+// Support of the host tests. They are i386 programs compiled against
+// the kernel headers, and host.c gives them the few functions of a C
+// library they use.
+
+#ifndef __HOSTTEST_H
+#define __HOSTTEST_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+extern "C" {
+int printf(const char *format, ...); // see host.c for the conversions
+void exit(int status);
+uint64 host_nsecs(); // monotonic clock
+}
+
+#define CHECK(x)                                                               \
+  do {                                                                         \
+    if (!(x))                                                                  \
+      host_fail(__FILE__, __LINE__, "FAILED CHECK " #x);                       \
+  } while (0)
+
+void host_fail(native_string file, int line, native_string msg);
+
+// A xorshift generator, so the runs are the same on every host
+static inline uint32 host_random(uint32 *state) {
+  uint32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
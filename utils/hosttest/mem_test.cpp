@@ -0,0 +1,358 @@
+// file: "mem_test.cpp"
+
+// Host test of the memory and string routines of the kernel (mem.cpp),
+// with both of the bulk routines "identify_cpu" chooses from, and of
+// the generic ones of libc/src/string.c. Every size up to a few words
+// is checked at every alignment of the source and the destination,
+// including overlapping moves in both directions, then the copies and
+// scans are timed.
+
+#include "hosttest.h"
+#include "rtlib.h"
+
+//-----------------------------------------------------------------------------
+
+// libc/src/string.c compiled without USE_MIMOSA, under this prefix
+extern "C" {
+void *generic_memcpy(void *dest, const void *src, size_t n);
+void *generic_memmove(void *dest, const void *src, size_t n);
+void *generic_memset(void *dest, int c, size_t n);
+int generic_memcmp(const void *a, const void *b, size_t n);
+size_t generic_strlen(const char *s);
+int generic_strcmp(const char *a, const char *b);
+}
+
+#define MAX_SIZE 280
+#define MAX_ALIGN 8
+#define GUARD 16
+#define BUF_SIZE (GUARD + MAX_ALIGN + MAX_SIZE + GUARD)
+#define MAX_OVERLAP 9
+
+#define MAX_STRING 72
+
+#define BENCH_BYTES (64 * (1 << 20))
+
+typedef struct routines_struct {
+  native_string name;
+  void *(*memcpy)(void *dest, const void *src, size_t n);
+  void *(*memmove)(void *dest, const void *src, size_t n);
+  void *(*memset)(void *dest, int c, size_t n);
+  int (*memcmp)(const void *a, const void *b, size_t n);
+  size_t (*strlen)(const char *s);
+  int (*strcmp)(const char *a, const char *b);
+} routines;
+
+// What libc/src/string.c calls with USE_MIMOSA
+static size_t kernel_strlen(const char *s) {
+  return kstrlen(CAST(native_string, s)) - 1; // kstrlen counts the '\0'
+}
+
+static int kernel_strcmp(const char *a, const char *b) {
+  return kstrcmp(CAST(native_string, a), CAST(native_string, b));
+}
+
+static routines kernel = {"kernel", memcpy,        memmove,      memset,
+                          memcmp,   kernel_strlen, kernel_strcmp};
+
+static routines generic = {"string.c",     generic_memcpy, generic_memmove,
+                           generic_memset, generic_memcmp, generic_strlen,
+                           generic_strcmp};
+
+static uint8 src_buf[BUF_SIZE] __attribute__((aligned(16)));
+static uint8 dst_buf[BUF_SIZE] __attribute__((aligned(16)));
+static uint8 ref_buf[BUF_SIZE] __attribute__((aligned(16)));
+
+static void fill(uint8 *buf, uint32 n, uint8 seed) {
+  for (uint32 i = 0; i < n; i++)
+    buf[i] = CAST(uint8, seed + i * 7);
+}
+
+static bool same(uint8 *a, uint8 *b, uint32 n) {
+  for (uint32 i = 0; i < n; i++)
+    if (a[i] != b[i])
+      return FALSE;
+  return TRUE;
+}
+
+static int sign(int x) { return (x > 0) - (x < 0); }
+
+//-----------------------------------------------------------------------------
+
+// The destination is copied to ref_buf first, where the expected result
+// is then made a byte at a time, guards included
+
+static void check_memcpy(routines *r) {
+  for (uint32 n = 0; n < MAX_SIZE; n++) {
+    for (uint32 so = 0; so < MAX_ALIGN; so++) {
+      for (uint32 d = 0; d < MAX_ALIGN; d++) {
+        uint8 *src = src_buf + GUARD + so;
+        uint8 *dst = dst_buf + GUARD + d;
+
+        fill(src_buf, BUF_SIZE, n);
+        fill(dst_buf, BUF_SIZE, 0x80 + n);
+        fill(ref_buf, BUF_SIZE, 0x80 + n);
+        for (uint32 i = 0; i < n; i++)
+          ref_buf[GUARD + d + i] = src[i];
+
+        CHECK(r->memcpy(dst, src, n) == dst);
+        CHECK(same(dst_buf, ref_buf, BUF_SIZE));
+      }
+    }
+  }
+}
+
+static void check_memset(routines *r) {
+  for (uint32 n = 0; n < MAX_SIZE; n++) {
+    for (uint32 d = 0; d < MAX_ALIGN; d++) {
+      uint8 *dst = dst_buf + GUARD + d;
+      int c = (n & 1) ? 0x1a5 : 0xff; // only the low byte counts
+
+      fill(dst_buf, BUF_SIZE, n);
+      fill(ref_buf, BUF_SIZE, n);
+      for (uint32 i = 0; i < n; i++)
+        ref_buf[GUARD + d + i] = CAST(uint8, c);
+
+      CHECK(r->memset(dst, c, n) == dst);
+      CHECK(same(dst_buf, ref_buf, BUF_SIZE));
+    }
+  }
+}
+
+// Moves within a buffer, the destination up to MAX_OVERLAP bytes
+// before or after the source
+static void check_memmove(routines *r) {
+  for (uint32 n = 0; n < MAX_SIZE - 2 * MAX_OVERLAP; n++) {
+    for (uint32 so = 0; so < MAX_ALIGN; so++) {
+      for (int32 delta = -MAX_OVERLAP; delta <= MAX_OVERLAP; delta++) {
+        uint8 *src = dst_buf + GUARD + MAX_OVERLAP + so;
+        uint8 *dst = src + delta;
+
+        fill(dst_buf, BUF_SIZE, n + so);
+        fill(ref_buf, BUF_SIZE, n + so);
+        for (uint32 i = 0; i < n; i++)
+          ref_buf[GUARD + MAX_OVERLAP + so + delta + i] =
+              dst_buf[GUARD + MAX_OVERLAP + so + i];
+
+        CHECK(r->memmove(dst, src, n) == dst);
+        CHECK(same(dst_buf, ref_buf, BUF_SIZE));
+      }
+    }
+  }
+}
+
+// Bytes over 0x7f compare above the others
+static void check_memcmp(routines *r) {
+  for (uint32 n = 0; n < MAX_SIZE; n++) {
+    for (uint32 so = 0; so < MAX_ALIGN; so++) {
+      for (uint32 d = 0; d < MAX_ALIGN; d++) {
+        uint8 *a = src_buf + GUARD + so;
+        uint8 *b = dst_buf + GUARD + d;
+
+        fill(a, n, n);
+        fill(b, n, n);
+        CHECK(r->memcmp(a, b, n) == 0);
+
+        if (n == 0)
+          continue;
+
+        // A difference at the start, middle and end, and only the first
+        // one counts
+        uint32 at[3] = {0, n / 2, n - 1};
+
+        for (uint32 k = 0; k < 3; k++) {
+          a[at[k]] = 0x80;
+          b[at[k]] = 0x7f;
+          if (at[k] + 1 < n)
+            b[n - 1] = 0xff;
+          CHECK(r->memcmp(a, b, n) > 0);
+          CHECK(r->memcmp(b, a, n) < 0);
+          fill(a, n, n);
+          fill(b, n, n);
+        }
+      }
+    }
+  }
+}
+
+static void make_string(native_char *s, uint32 len, uint8 seed) {
+  // Bytes with the high bit set, and ones around 0x01, fool a careless
+  // test for a zero byte in a word
+  for (uint32 i = 0; i < len; i++) {
+    uint8 c = CAST(uint8, seed + i * 37);
+    s[i] = (c == 0) ? 0x80 : c;
+  }
+  s[len] = '\0';
+  s[len + 1] = 0x01;
+  s[len + 2] = 0x80;
+  s[len + 3] = 0xff;
+}
+
+static void check_strlen(routines *r) {
+  native_string s = CAST(native_string, src_buf + GUARD);
+
+  for (uint32 len = 0; len < MAX_STRING; len++) {
+    for (uint32 so = 0; so < MAX_ALIGN; so++) {
+      make_string(s + so, len, len + so);
+      CHECK(r->strlen(s + so) == len);
+    }
+  }
+}
+
+static int reference_strcmp(native_string a, native_string b) {
+  uint8 *p1 = CAST(uint8 *, a);
+  uint8 *p2 = CAST(uint8 *, b);
+
+  while (*p1 != '\0' && *p1 == *p2) {
+    p1++;
+    p2++;
+  }
+
+  return *p1 - *p2;
+}
+
+static void check_strcmp(routines *r) {
+  native_string a = CAST(native_string, src_buf + GUARD);
+  native_string b = CAST(native_string, dst_buf + GUARD);
+
+  for (uint32 len = 0; len < MAX_STRING; len++) {
+    for (uint32 ao = 0; ao < MAX_ALIGN; ao++) {
+      for (uint32 bo = 0; bo < MAX_ALIGN; bo++) {
+        make_string(a + ao, len, len);
+        make_string(b + bo, len, len);
+        CHECK(r->strcmp(a + ao, b + bo) == 0);
+
+        // b differs from a at i, or a is a prefix of b
+        for (uint32 i = 0; i <= len; i++) {
+          b[bo + i] = (i < len) ? b[bo + i] ^ 0x80 : 'x';
+          if (i < len && b[bo + i] == 0)
+            b[bo + i] = 1;
+          if (i == len)
+            b[bo + i + 1] = '\0';
+
+          int expected = sign(reference_strcmp(a + ao, b + bo));
+          CHECK(sign(r->strcmp(a + ao, b + bo)) == expected);
+          CHECK(sign(r->strcmp(b + bo, a + ao)) == -expected);
+
+          make_string(b + bo, len, len);
+        }
+
+        if (len > 0) {
+          b[bo + len - 1] = '\0';
+          CHECK(r->strcmp(a + ao, b + bo) > 0);
+          CHECK(r->strcmp(b + bo, a + ao) < 0);
+        }
+      }
+    }
+  }
+}
+
+static void check(routines *r, native_string variant) {
+  check_memcpy(r);
+  check_memset(r);
+  check_memmove(r);
+  check_memcmp(r);
+  check_strlen(r);
+  check_strcmp(r);
+
+  printf("%s%s: sizes 0 to %u at all alignments OK\n", r->name, variant,
+         MAX_SIZE - 1);
+}
+
+//-----------------------------------------------------------------------------
+
+static uint8 big_src[(64 << 10) + 64] __attribute__((aligned(64)));
+static uint8 big_dst[(64 << 10) + 64] __attribute__((aligned(64)));
+
+// MB/s of copies of size bytes, repeated for BENCH_BYTES
+static uint32 copy_rate(void *(*copy)(void *dest, const void *src, size_t n),
+                        uint32 size, uint32 so, uint32 d) {
+  uint32 times = BENCH_BYTES / size;
+  uint64 start = host_nsecs();
+
+  for (uint32 i = 0; i < times; i++)
+    copy(big_dst + d, big_src + so, size);
+
+  uint64 nsecs = host_nsecs() - start;
+
+  return CAST(uint32, CAST(uint64, times) * size * 1000 / nsecs);
+}
+
+// MB/s of overlapping moves that have to go backward
+static uint32 move_rate(void *(*move)(void *dest, const void *src, size_t n),
+                        uint32 size) {
+  uint32 times = BENCH_BYTES / size;
+  uint64 start = host_nsecs();
+
+  for (uint32 i = 0; i < times; i++)
+    move(big_dst + 4, big_dst, size);
+
+  uint64 nsecs = host_nsecs() - start;
+
+  return CAST(uint32, CAST(uint64, times) * size * 1000 / nsecs);
+}
+
+static uint32 set_rate(void *(*set)(void *dest, int c, size_t n),
+                       uint32 size) {
+  uint32 times = BENCH_BYTES / size;
+  uint64 start = host_nsecs();
+
+  for (uint32 i = 0; i < times; i++)
+    set(big_dst + 1, i, size);
+
+  uint64 nsecs = host_nsecs() - start;
+
+  return CAST(uint32, CAST(uint64, times) * size * 1000 / nsecs);
+}
+
+static uint32 strlen_rate(size_t (*len)(const char *s)) {
+  uint32 size = sizeof(big_src) - 1;
+  uint32 times = BENCH_BYTES / size;
+  uint32 total = 0;
+
+  for (uint32 i = 0; i < size; i++)
+    big_src[i] = 'a' + i % 26;
+  big_src[size] = '\0';
+
+  uint64 start = host_nsecs();
+
+  for (uint32 i = 0; i < times; i++)
+    total += len(CAST(char *, big_src));
+
+  uint64 nsecs = host_nsecs() - start;
+
+  CHECK(total == times * size);
+
+  return CAST(uint32, CAST(uint64, times) * size * 1000 / nsecs);
+}
+
+static void bench(routines *r, native_string variant) {
+  printf("%s%s, MB/s:\n", r->name, variant);
+  printf("  memcpy  64 KB aligned %6u, misaligned %6u, 256 B %6u, 40 B %6u\n",
+         copy_rate(r->memcpy, 64 << 10, 0, 0),
+         copy_rate(r->memcpy, 64 << 10, 1, 3), copy_rate(r->memcpy, 256, 0, 0),
+         copy_rate(r->memcpy, 40, 0, 0));
+  printf("  memmove 64 KB backward %6u\n",
+         move_rate(r->memmove, 64 << 10));
+  printf("  memset  64 KB %6u, strlen 64 KB %6u\n", set_rate(r->memset, 64 << 10),
+         strlen_rate(r->strlen));
+}
+
+int main() {
+  check(&generic, "");
+  check(&kernel, " rep movsd");
+  bench(&generic, "");
+  bench(&kernel, " rep movsd");
+
+  mem_use_erms(); // rep movsb works on every CPU, only slower without ERMS
+
+  check(&kernel, " rep movsb");
+  bench(&kernel, " rep movsb");
+
+  printf("mem_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //
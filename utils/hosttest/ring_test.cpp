@@ -0,0 +1,235 @@
+// file: "ring_test.cpp"
+
+// Host test of the interrupt rings shared with Gambit (gambit_ring.h).
+// The kernel's writer, gambit_ring_put, floods both rings while a copy
+// of the reader of scheme/interpreted/gambini.scm drains them. The
+// reader only knows the layout through the constants of gambini.scm,
+// which the makefile extracts to gambini.h, so a change to either side
+// that the other doesn't follow makes the frames come out wrong.
+
+#include "gambini.h"
+#include "gambit_ring.h"
+#include "hosttest.h"
+
+//-----------------------------------------------------------------------------
+
+#define ROUNDS 2000
+
+#define OFFSET_OF(type, field) __builtin_offsetof(type, field)
+
+static uint32 area[SCM_SHARED_MEMORY_AREA_LEN / sizeof(uint32)];
+
+// The shared memory at the addresses Gambit sees it
+static uint8 *at(uint32 addr) {
+  CHECK(addr >= SCM_FLOW_CONTROLLED_FIFO_START);
+  CHECK(addr < SCM_FLOW_CONTROLLED_FIFO_START + SCM_SHARED_MEMORY_AREA_LEN);
+  return CAST(uint8 *, area) + (addr - SCM_FLOW_CONTROLLED_FIFO_START);
+}
+
+static uint32 peek_u32(uint32 addr) {
+  return *CAST(volatile uint32 *, at(addr));
+}
+
+static void poke_u32(uint32 value, uint32 addr) {
+  *CAST(volatile uint32 *, at(addr)) = value;
+}
+
+static gambit_ring *kernel_ring(uint32 start) {
+  return CAST(gambit_ring *, at(start));
+}
+
+//-----------------------------------------------------------------------------
+
+// Frame n carries the number n & 0xff and params n + 1, n + 2, ...
+typedef struct ring_check_struct {
+  uint32 start;
+  uint32 len;
+  uint32 max_params;
+  uint32 state;
+  uint32 written; // frames accepted by the kernel
+  uint32 read;    // frames dispatched by Gambit
+  uint32 rejected;
+  uint8 lens[1 << 16]; // param count of each frame, by number
+} ring_check;
+
+static ring_check controlled;
+static ring_check uncontrolled;
+
+static void dispatch_int(ring_check *c, uint8 int_no, uint8 *params,
+                         uint32 nb_params) {
+  uint32 n = c->read++;
+
+  CHECK(n < c->written);
+  CHECK(int_no == CAST(uint8, n));
+  CHECK(nb_params == c->lens[n & 0xffff]);
+
+  for (uint32 i = 0; i < nb_params; i++)
+    CHECK(params[i] == CAST(uint8, n + 1 + i));
+}
+
+// make-pmp of gambini.scm: dispatch every frame written so far, FALSE
+// if there were none
+static bool pump(ring_check *c) {
+  uint32 mask = c->len - 1;
+  uint32 data = c->start + SCM_RING_DATA;
+  uint32 head = peek_u32(c->start + SCM_RING_HEAD);
+  uint32 tail = peek_u32(c->start + SCM_RING_TAIL);
+  uint32 pos = tail;
+
+  while (pos != head) {
+    uint8 int_no = *at(data + (pos & mask));
+    uint8 arr_len = *at(data + ((pos + 1) & mask));
+    uint8 params[256];
+
+    for (uint32 i = 0; i < arr_len; i++)
+      params[i] = *at(data + ((pos + 2 + i) & mask));
+
+    dispatch_int(c, int_no, params, arr_len);
+    pos = (pos + 2 + arr_len) & mask;
+  }
+
+  if (pos == tail)
+    return FALSE;
+
+  poke_u32(pos, c->start + SCM_RING_TAIL);
+
+  return TRUE;
+}
+
+static bool put(ring_check *c, uint32 nb_params) {
+  uint32 n = c->written;
+  uint8 params[256];
+
+  for (uint32 i = 0; i < nb_params; i++)
+    params[i] = CAST(uint8, n + 1 + i);
+
+  if (!gambit_ring_put(kernel_ring(c->start), c->len, CAST(uint8, n), params,
+                       nb_params)) {
+    c->rejected++;
+    return FALSE;
+  }
+
+  c->lens[n & 0xffff] = nb_params;
+  c->written++;
+
+  return TRUE;
+}
+
+static void ring_check_init(ring_check *c, uint32 start, uint32 len,
+                            uint32 max_params) {
+  c->start = start;
+  c->len = len;
+  c->max_params = max_params;
+  c->state = len;
+  c->written = 0;
+  c->read = 0;
+  c->rejected = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// The kernel and Gambit agree on where everything is
+static void test_layout() {
+  CHECK(OFFSET_OF(gambit_ring, head) == SCM_RING_HEAD);
+  CHECK(OFFSET_OF(gambit_ring, dropped) == SCM_RING_DROPPED);
+  CHECK(OFFSET_OF(gambit_ring, tail) == SCM_RING_TAIL);
+  CHECK(OFFSET_OF(gambit_ring, data) == SCM_RING_DATA);
+  CHECK(GAMBIT_RING_HEADER_LEN == SCM_RING_DATA);
+  CHECK(sizeof(gambit_ring) == GAMBIT_RING_HEADER_LEN);
+
+  CHECK(GAMBIT_SHARED_MEM_LEN == SCM_SHARED_MEMORY_AREA_LEN);
+  CHECK(GAMBIT_SHARED_MEM_CMD == SCM_FLOW_CONTROLLED_FIFO_START);
+  CHECK(GAMBIT_FLOW_CONTROLLED_START == SCM_FLOW_CONTROLLED_FIFO_START);
+  CHECK(GAMBIT_FLOW_CONTROLLED_LEN == SCM_FLOW_CONTROLLED_FIFO_LEN);
+  CHECK(GAMBIT_FLOW_UNCONTROLLED_START == SCM_FLOW_UNCONTROLLED_FIFO_START);
+  CHECK(GAMBIT_FLOW_UNCONTROLLED_LEN == SCM_FLOW_UNCONTROLLED_FIFO_LEN);
+
+  // Both rings fit in the shared memory
+  CHECK(GAMBIT_FLOW_UNCONTROLLED_START + GAMBIT_RING_HEADER_LEN +
+            GAMBIT_FLOW_UNCONTROLLED_LEN <=
+        GAMBIT_SHARED_MEM_CMD + GAMBIT_SHARED_MEM_LEN);
+}
+
+// Fill the ring until the kernel has to drop frames, then drain it. The
+// frames dropped are counted, and all the others come out intact and in
+// order, whichever way they wrap around the end of the data.
+static void flood(ring_check *c) {
+  gambit_ring *ring = kernel_ring(c->start);
+
+  for (uint32 round = 0; round < ROUNDS; round++) {
+    uint32 misses = 0;
+
+    while (misses < 4) {
+      if (!put(c, host_random(&c->state) % (c->max_params + 1)))
+        misses++;
+    }
+
+    // The ring is full to within a frame
+    uint32 used = (ring->head - ring->tail) & (c->len - 1);
+    CHECK(used + 2 + c->max_params >= c->len - 1);
+
+    CHECK(ring->dropped == c->rejected);
+
+    if (round % 2 == 0) {
+      CHECK(pump(c));
+    } else {
+      // Let Gambit drain part of it while the kernel writes more
+      for (uint32 i = 0; i < 4; i++) {
+        pump(c);
+        put(c, host_random(&c->state) % (c->max_params + 1));
+      }
+      pump(c);
+    }
+
+    CHECK(c->read == c->written);
+    CHECK(!pump(c));
+  }
+}
+
+// Nothing is dropped as long as Gambit drains the ring before the
+// kernel can have filled it
+static void keep_up(ring_check *c) {
+  gambit_ring *ring = kernel_ring(c->start);
+  uint32 dropped = ring->dropped;
+  uint32 batch = (c->len - 1) / (2 + c->max_params);
+
+  for (uint32 round = 0; round < ROUNDS; round++) {
+    uint32 n = 1 + host_random(&c->state) % batch;
+
+    for (uint32 i = 0; i < n; i++)
+      CHECK(put(c, host_random(&c->state) % (c->max_params + 1)));
+
+    CHECK(pump(c));
+  }
+
+  CHECK(ring->dropped == dropped);
+  CHECK(c->read == c->written);
+}
+
+static void test_ring(native_string name, ring_check *c) {
+  flood(c);
+  keep_up(c);
+
+  printf("%-12s %6u frames read, %6u dropped, none lost\n", name, c->read,
+         c->rejected);
+}
+
+int main() {
+  test_layout();
+
+  ring_check_init(&controlled, SCM_FLOW_CONTROLLED_FIFO_START,
+                  SCM_FLOW_CONTROLLED_FIFO_LEN, 8);
+  ring_check_init(&uncontrolled, SCM_FLOW_UNCONTROLLED_FIFO_START,
+                  SCM_FLOW_UNCONTROLLED_FIFO_LEN, 255);
+
+  test_ring("controlled", &controlled);
+  test_ring("uncontrolled", &uncontrolled);
+
+  printf("ring_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //
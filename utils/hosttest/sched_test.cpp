@@ -0,0 +1,210 @@
+// file: "sched_test.cpp"
+
+// Host test of the scheduler's run queue (ready_queue in thread.h). The
+// ready threads are also kept in a simple model, one array per priority
+// level, and after each random insertion, removal or round-robin step
+// the run queue must give the thread the model expects to run. Unlike
+// the other tests, this one is compiled against the kernel's own
+// thread.h, whose inline functions don't need the hardware.
+
+#include "hosttest.h"
+#include "thread.h"
+
+//-----------------------------------------------------------------------------
+
+#define NB_THREADS 256
+#define OPS 200000
+
+#define BENCH_OPS 1000000
+
+static thread threads[NB_THREADS];
+static bool ready[NB_THREADS];
+static ready_queue rq;
+
+// The ready threads of each level, oldest first
+static thread *model[SCHED_PRIO_LEVELS][NB_THREADS];
+static uint32 model_len[SCHED_PRIO_LEVELS];
+
+static void model_append(thread *t) {
+  uint32 level = ready_queue_level(t->_prio);
+  model[level][model_len[level]++] = t;
+}
+
+static void model_remove(thread *t) {
+  uint32 level = ready_queue_level(t->_prio);
+  uint32 i = 0;
+
+  while (model[level][i] != t)
+    i++;
+
+  for (model_len[level]--; i < model_len[level]; i++)
+    model[level][i] = model[level][i + 1];
+}
+
+static thread *model_head() {
+  for (int level = SCHED_PRIO_LEVELS - 1; level >= 0; level--)
+    if (model_len[level] > 0)
+      return model[level][0];
+  return NULL;
+}
+
+// The run queue holds the threads of the model in the same order, and
+// the bitmap has the bits of all the non-empty levels
+static void check_levels() {
+  for (uint32 level = 0; level < SCHED_PRIO_LEVELS; level++) {
+    wait_mutex_node *head = CAST(wait_mutex_node *, &rq.levels[level]);
+    wait_mutex_node *node = head->_next_in_wait_queue;
+    uint32 n = 0;
+
+    for (; node != head; node = node->_next_in_wait_queue) {
+      CHECK(n < model_len[level]);
+      CHECK(CAST(thread *, node) == model[level][n]);
+      CHECK(node->_next_in_wait_queue->_prev_in_wait_queue == node);
+      n++;
+    }
+
+    CHECK(n == model_len[level]);
+    CHECK(n == 0 || (rq.bitmap >> level) & 1);
+  }
+}
+
+static void check_head() {
+  thread *head = model_head();
+
+  CHECK(ready_queue_head(&rq) == head);
+
+  if (head != NULL)
+    CHECK(ready_queue_alone(head, &rq) ==
+          (model_len[ready_queue_level(head->_prio)] == 1));
+}
+
+// Priorities below 0 and above the last level share the end levels
+static int random_prio(uint32 *state) {
+  uint32 r = host_random(state);
+
+  if (r % 16 == 0)
+    return -CAST(int, (r >> 8) % 100);
+
+  if (r % 16 == 1)
+    return SCHED_PRIO_LEVELS * SCHED_PRIO_LEVEL_WIDTH + (r >> 8) % 100;
+
+  // Mostly a few common priorities, as the kernel uses
+  return CAST(int, ((r >> 8) % 8) * 40 + (r >> 16) % 2);
+}
+
+static void test_levels() {
+  CHECK(ready_queue_level(-5) == 0);
+  CHECK(ready_queue_level(0) == 0);
+  CHECK(ready_queue_level(SCHED_PRIO_LEVEL_WIDTH - 1) == 0);
+  CHECK(ready_queue_level(SCHED_PRIO_LEVEL_WIDTH) == 1);
+  CHECK(ready_queue_level(SCHED_PRIO_LEVELS * SCHED_PRIO_LEVEL_WIDTH) ==
+        SCHED_PRIO_LEVELS - 1);
+}
+
+static void test_random() {
+  uint32 state = 31337;
+  uint32 inserts = 0;
+  uint32 removes = 0;
+  uint32 rounds = 0;
+
+  ready_queue_init(&rq);
+  CHECK(ready_queue_head(&rq) == NULL);
+
+  for (uint32 op = 0; op < OPS; op++) {
+    uint32 r = host_random(&state);
+    uint32 i = (r >> 8) % NB_THREADS;
+    thread *t = &threads[i];
+
+    if (!ready[i]) {
+      // A thread becomes ready, possibly with a new priority
+      if (r % 4 == 0)
+        t->_prio = random_prio(&state);
+      ready_queue_insert(t, &rq);
+      model_append(t);
+      ready[i] = TRUE;
+      inserts++;
+    } else if (r % 2 == 0) {
+      // A ready thread blocks or sleeps
+      wait_queue_remove(t);
+      model_remove(t);
+      ready[i] = FALSE;
+      removes++;
+    } else {
+      // The running thread's quantum ends: it goes after its equals,
+      // like _sched_reschedule_thread does
+      thread *head = ready_queue_head(&rq);
+      if (head != NULL) {
+        wait_queue_remove(head);
+        ready_queue_insert(head, &rq);
+        model_remove(head);
+        model_append(head);
+        rounds++;
+      }
+    }
+
+    check_head();
+
+    if (op % 64 == 0)
+      check_levels();
+  }
+
+  // Empty it, which clears the bitmap as the levels are found empty
+
+  for (uint32 i = 0; i < NB_THREADS; i++) {
+    if (ready[i]) {
+      wait_queue_remove(&threads[i]);
+      model_remove(&threads[i]);
+      ready[i] = FALSE;
+      check_head();
+    }
+  }
+
+  check_levels();
+  CHECK(ready_queue_head(&rq) == NULL);
+  CHECK(rq.bitmap == 0);
+
+  printf("%u insertions, %u removals, %u round-robin steps checked\n",
+         inserts, removes, rounds);
+}
+
+// A round-robin step of the highest priority thread, with n threads
+// ready at various priorities
+static void bench(uint32 n) {
+  uint32 state = 4711;
+
+  ready_queue_init(&rq);
+
+  for (uint32 i = 0; i < n; i++) {
+    threads[i]._prio = random_prio(&state);
+    ready_queue_insert(&threads[i], &rq);
+  }
+
+  uint64 start = host_nsecs();
+
+  for (uint32 op = 0; op < BENCH_OPS; op++) {
+    thread *head = ready_queue_head(&rq);
+    wait_queue_remove(head);
+    ready_queue_insert(head, &rq);
+  }
+
+  uint64 nsecs = host_nsecs() - start;
+
+  printf("%3u ready threads: %3u ns per round-robin step\n", n,
+         CAST(uint32, nsecs / BENCH_OPS));
+}
+
+int main() {
+  test_levels();
+  test_random();
+
+  for (uint32 n = 4; n <= NB_THREADS; n *= 4)
+    bench(n);
+
+  printf("sched_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //
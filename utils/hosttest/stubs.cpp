@@ -0,0 +1,188 @@
+// file: "stubs.cpp"
+
+// Host versions of the kernel services the tested modules use
+
+#include "hosttest.h"
+#include "rtlib.h"
+#include "term.h"
+#include "thread.h"
+
+//-----------------------------------------------------------------------------
+
+bool host_interrupts_enabled = TRUE;
+
+void (*host_idle)() = NULL;
+
+void host_fail(native_string file, int line, native_string msg) {
+  printf("%s:%d: %s\n", file, line, msg);
+  exit(1);
+}
+
+void panic(unicode_string msg) {
+  printf("panic: %ls\n", msg);
+  exit(1);
+}
+
+uint8 log2(uint32 n) {
+  uint8 i = 0;
+
+  while ((n >>= 1) != 0)
+    i++;
+
+  return i;
+}
+
+native_string copy_without_trailing_spaces(uint8 *src, native_string dst,
+                                           uint32 n) {
+  uint32 i;
+  uint32 end = 0;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = src[i];
+    if (src[i] != ' ')
+      end = i + 1;
+  }
+
+  return dst + end;
+}
+
+void debug_write(void *ptr) { printf("%p\n", ptr); }
+
+void debug_write(uint32 x) { printf("%u\n", x); }
+
+void debug_write(native_string x) { printf("%s\n", x); }
+
+struct term {
+  uint32 unused;
+};
+
+term term_log;
+
+term *term_writeline(term *self) {
+  printf("\n");
+  return self;
+}
+
+term *term_write(term *self, uint8 x) {
+  printf("%u", x);
+  return self;
+}
+
+term *term_write(term *self, uint16 x) {
+  printf("%u", x);
+  return self;
+}
+
+term *term_write(term *self, uint32 x) {
+  printf("%u", x);
+  return self;
+}
+
+term *term_write(term *self, native_string x) {
+  printf("%s", x);
+  return self;
+}
+
+mutex *new_mutex(mutex *m) {
+  m->_locked = FALSE;
+  return m;
+}
+
+rwmutex *new_rwmutex(rwmutex *rwm) {
+  new_mutex(&rwm->super);
+  rwm->_readers = 0;
+  return rwm;
+}
+
+void mutex_lock(mutex *self) {
+  if (self->_locked)
+    host_fail(__FILE__, __LINE__, "a mutex would never be released");
+
+  self->_locked = TRUE;
+}
+
+bool mutex_lock_or_timeout(mutex *self, time timeout) {
+  if (self->_locked)
+    return FALSE;
+
+  self->_locked = TRUE;
+  return TRUE;
+}
+
+void mutex_unlock(mutex *self) {
+  if (!self->_locked)
+    host_fail(__FILE__, __LINE__, "unlock of a free mutex");
+
+  self->_locked = FALSE;
+}
+
+void rwmutex_readlock(rwmutex *self) {
+  if (self->super._locked)
+    host_fail(__FILE__, __LINE__, "a writer would never leave");
+
+  self->_readers++;
+}
+
+void rwmutex_writelock(rwmutex *self) {
+  if (self->_readers > 0)
+    host_fail(__FILE__, __LINE__, "a reader would never leave");
+
+  mutex_lock(&self->super);
+}
+
+void rwmutex_readunlock(rwmutex *self) {
+  if (self->_readers == 0)
+    host_fail(__FILE__, __LINE__, "read unlock without readers");
+
+  self->_readers--;
+}
+
+void rwmutex_writeunlock(rwmutex *self) { mutex_unlock(&self->super); }
+
+void wait_queue_init(wait_queue *self) { self->waits = 0; }
+
+condvar *new_condvar(condvar *t) {
+  wait_queue_init(&t->super);
+  return t;
+}
+
+static void host_wait(wait_queue *q) {
+  if (host_idle == NULL)
+    host_fail(__FILE__, __LINE__, "a wait would never end");
+
+  q->waits++;
+  host_idle();
+}
+
+void condvar_wait(condvar *self, mutex *m) {
+  mutex_unlock(m);
+  host_wait(&self->super);
+  mutex_lock(m);
+}
+
+bool condvar_wait_or_timeout(condvar *self, mutex *m, time timeout) {
+  condvar_wait(self, m);
+  return TRUE;
+}
+
+void condvar_signal(condvar *self) {}
+
+void condvar_mutexless_wait(condvar *self) {
+  ASSERT_INTERRUPTS_DISABLED();
+
+  enable_interrupts();
+  host_wait(&self->super);
+  disable_interrupts();
+}
+
+void condvar_mutexless_signal(condvar *self) { ASSERT_INTERRUPTS_DISABLED(); }
+
+void thread_sleep(uint64 timeout_nsecs) {}
+
+void thread_sleep_seconds(uint64 seconds) {}
+
+//-----------------------------------------------------------------------------
+
+// Local Variables: //
+// mode: C++ //
+// End: //
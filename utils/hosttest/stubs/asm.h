@@ -0,0 +1,28 @@
+// file: "asm.h"
+
+// Host stand-in for the kernel's asm.h. The port I/O goes to the device
+// model of the test that defines these functions.
+
+#ifndef __ASM_H
+#define __ASM_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+uint8 inb(uint16 port);
+uint16 inw(uint16 port);
+uint32 inl(uint16 port);
+void outb(uint8 val, uint16 port);
+void outw(uint16 val, uint16 port);
+void outl(uint32 val, uint16 port);
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,25 @@
+// file: "intr.h"
+
+// Host stand-in for the kernel's intr.h. The test that defines
+// intr_add_handler calls the handler when its device model interrupts.
+
+#ifndef INTR_H
+#define INTR_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+typedef void (*intr_handler)(void *data);
+
+bool intr_add_handler(uint8 irq, intr_handler fn, void *data);
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,44 @@
+// file: "rtlib.h"
+
+// Host stand-in for the kernel's rtlib.h
+
+#ifndef __RTLIB_H
+#define __RTLIB_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+void panic(unicode_string msg);
+
+uint8 log2(uint32 n);
+
+// Defined by the tests that need them
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+extern uint64 total_usable_memory; // defined by the tests that need it
+
+// host.c has memcpy and memset, a test can link mem.cpp instead
+extern "C" void *memcpy(void *dest, const void *src, size_t n);
+extern "C" void *memmove(void *dest, const void *src, size_t n);
+extern "C" void *memset(void *dest, int c, size_t n);
+extern "C" int memcmp(const void *a, const void *b, size_t n);
+
+void mem_use_erms();
+
+native_string copy_without_trailing_spaces(uint8 *src, native_string dst,
+                                           uint32 n);
+
+int16 kstrcmp(native_string a, native_string b);
+uint32 kstrlen(native_string a);
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,37 @@
+// file: "term.h"
+
+// Host stand-in for the kernel's term.h
+
+#ifndef TERM_H
+#define TERM_H
+
+//-----------------------------------------------------------------------------
+
+#include "general.h"
+
+//-----------------------------------------------------------------------------
+
+void debug_write(void *ptr);
+void debug_write(uint32 x);
+void debug_write(native_string x);
+
+// The console is the standard output
+typedef struct term term;
+
+extern term term_log;
+
+#define cout &term_log
+
+term *term_writeline(term *self);
+term *term_write(term *self, uint8 x);
+term *term_write(term *self, uint16 x);
+term *term_write(term *self, uint32 x);
+term *term_write(term *self, native_string x);
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
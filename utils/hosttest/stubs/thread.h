@@ -0,0 +1,94 @@
+// file: "thread.h"
+
+// Host stand-in for the kernel's thread.h. The host tests run on a
+// single thread: the interrupt flag is a variable and a wait calls the
+// test's idle function once. Like in the kernel, the callers of a wait
+// check their condition again when it returns. Taking a lock that is
+// held is a failure, since nothing else could ever release it.
+
+#ifndef THREAD_H
+#define THREAD_H
+
+//-----------------------------------------------------------------------------
+
+#include "asm.h"
+#include "general.h"
+#include "timer.h"
+
+//-----------------------------------------------------------------------------
+
+extern bool host_interrupts_enabled;
+
+// Called by the waits, typically to run a device model
+extern void (*host_idle)();
+
+void host_fail(native_string file, int line, native_string msg);
+
+#define disable_interrupts() (host_interrupts_enabled = FALSE)
+#define enable_interrupts() (host_interrupts_enabled = TRUE)
+#define CLI() disable_interrupts()
+#define STI() enable_interrupts()
+#define ARE_INTERRUPTS_ENABLED() host_interrupts_enabled
+
+#define ASSERT_INTERRUPTS_DISABLED()                                           \
+  do {                                                                         \
+    if (host_interrupts_enabled)                                               \
+      host_fail(__FILE__, __LINE__, "FAILED ASSERT_INTERRUPTS_DISABLED");      \
+  } while (0)
+
+#define ASSERT_INTERRUPTS_ENABLED()                                            \
+  do {                                                                         \
+    if (!host_interrupts_enabled)                                              \
+      host_fail(__FILE__, __LINE__, "FAILED ASSERT_INTERRUPTS_ENABLED");       \
+  } while (0)
+
+typedef struct wait_queue {
+  uint32 waits; // calls to the idle function
+} wait_queue;
+
+typedef struct condvar {
+  wait_queue super;
+} condvar;
+
+typedef struct mutex {
+  bool _locked;
+} mutex;
+
+typedef struct rwmutex {
+  mutex super; // held by the writer
+  uint16 _readers;
+} rwmutex;
+
+mutex *new_mutex(mutex *m);
+rwmutex *new_rwmutex(rwmutex *rwm);
+
+void mutex_lock(mutex *self);
+bool mutex_lock_or_timeout(mutex *self, time timeout); // FALSE when held
+void mutex_unlock(mutex *self);
+
+void rwmutex_readlock(rwmutex *self);
+void rwmutex_writelock(rwmutex *self);
+void rwmutex_readunlock(rwmutex *self);
+void rwmutex_writeunlock(rwmutex *self);
+
+void wait_queue_init(wait_queue *self);
+
+condvar *new_condvar(condvar *t);
+
+void condvar_wait(condvar *self, mutex *m);
+bool condvar_wait_or_timeout(condvar *self, mutex *m, time timeout);
+void condvar_signal(condvar *self);
+
+void condvar_mutexless_wait(condvar *self);
+void condvar_mutexless_signal(condvar *self);
+
+void thread_sleep(uint64 timeout_nsecs); // returns at once
+void thread_sleep_seconds(uint64 seconds);
+
+//-----------------------------------------------------------------------------
+
+#endif
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,318 @@
+// file: "tlsf_test.cpp"
+
+// Host test of the two-level segregated fit allocator (tlsf.cpp) that
+// backs the applications heap, and its comparison with the allocator it
+// replaced, heap_malloc on appheap. The same random trace of variable
+// size allocations runs on both, which are timed per call and compared
+// on how much of the pool they spread over and how big an allocation
+// they can still serve.
+
+#include "heap.h"
+#include "hosttest.h"
+#include "tlsf.h"
+
+//-----------------------------------------------------------------------------
+
+#define POOL_SIZE (32 * (1 << 20))
+
+#define SLOTS 8000
+#define OPS 200000
+#define MAX_SIZE (20 * (1 << 10))
+
+#define LARGEST_STEP (64 * (1 << 10))
+
+// Latencies are counted in buckets of LATENCY_STEP cycles
+#define LATENCY_STEP 16
+#define LATENCY_BUCKETS 4096
+
+static uint32 pool[POOL_SIZE / sizeof(uint32)];
+static uint8 *pool_start = CAST(uint8 *, pool);
+
+static tlsf test_tlsf;
+static heap test_heap;
+
+// Small objects mostly, some buffers and a few large ones
+static uint32 random_size(uint32 *state) {
+  uint32 r = host_random(state);
+  uint32 kind = r % 20;
+
+  r >>= 8;
+
+  if (kind < 14)
+    return 1 + r % 256;
+
+  if (kind < 19)
+    return 257 + r % 4096;
+
+  return 4353 + r % (MAX_SIZE - 4352);
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct slot_struct {
+  uint8 *ptr;
+  uint32 size;
+  uint8 seed;
+} slot;
+
+static slot slots[SLOTS];
+
+static void slot_fill(slot *s) {
+  for (uint32 i = 0; i < s->size; i++)
+    s->ptr[i] = CAST(uint8, s->seed + i);
+}
+
+static bool slot_intact(slot *s, uint32 n) {
+  for (uint32 i = 0; i < n; i++)
+    if (s->ptr[i] != CAST(uint8, s->seed + i))
+      return FALSE;
+  return TRUE;
+}
+
+// Every free block is on the list of its size, and the neighbours of a
+// free block are used. Returns the number of free blocks.
+static uint32 check_pool(tlsf *t) {
+  uint32 nb_free = 0;
+
+  for (uint32 fl = 0; fl < TLSF_FL_INDEX_COUNT; fl++) {
+    CHECK((t->sl_bitmap[fl] != 0) == ((t->fl_bitmap >> fl) & 1));
+
+    for (uint32 sl = 0; sl < TLSF_SL_INDEX_COUNT; sl++) {
+      tlsf_block *b = t->blocks[fl][sl];
+
+      CHECK((b != &t->null_block) == ((t->sl_bitmap[fl] >> sl) & 1));
+
+      for (; b != &t->null_block; b = b->next_free) {
+        CHECK(b->size & 1);    // free
+        CHECK(!(b->size & 2)); // its previous block is used
+        CHECK(b->next_free->prev_free == b || b->next_free == &t->null_block);
+        nb_free++;
+      }
+    }
+  }
+
+  return nb_free;
+}
+
+static void test_stress() {
+  uint32 state = 4242;
+  uint32 ops = 0;
+
+  tlsf_init(&test_tlsf, pool_start, POOL_SIZE);
+
+  for (uint32 op = 0; op < OPS; op++) {
+    uint32 r = host_random(&state);
+    slot *s = &slots[r % SLOTS];
+
+    if (s->ptr == NULL) {
+      s->size = random_size(&state);
+      s->seed = CAST(uint8, r >> 24);
+
+      if ((r >> 12) % 8 == 0) {
+        size_t alignment = 8 << ((r >> 16) % 10); // up to 4 KB
+        s->ptr = CAST(uint8 *, tlsf_memalign(&test_tlsf, alignment, s->size));
+        CHECK(s->ptr != NULL);
+        CHECK((CAST(uint32, s->ptr) & (alignment - 1)) == 0);
+      } else {
+        s->ptr = CAST(uint8 *, tlsf_malloc(&test_tlsf, s->size));
+        CHECK(s->ptr != NULL);
+      }
+
+      CHECK((CAST(uint32, s->ptr) & (TLSF_ALIGN_SIZE - 1)) == 0);
+      slot_fill(s);
+    } else if ((r >> 12) % 3 == 0) {
+      uint32 size = random_size(&state);
+      uint32 kept = size < s->size ? size : s->size;
+
+      CHECK(slot_intact(s, s->size));
+      s->ptr = CAST(uint8 *, tlsf_realloc(&test_tlsf, s->ptr, size));
+      CHECK(s->ptr != NULL);
+      CHECK(slot_intact(s, kept));
+      s->size = size;
+      s->seed = CAST(uint8, r >> 24);
+      slot_fill(s);
+    } else {
+      CHECK(slot_intact(s, s->size));
+      tlsf_free(&test_tlsf, s->ptr);
+      s->ptr = NULL;
+    }
+
+    if (++ops % 10000 == 0)
+      check_pool(&test_tlsf);
+  }
+
+  for (uint32 i = 0; i < SLOTS; i++) {
+    if (slots[i].ptr != NULL) {
+      CHECK(slot_intact(&slots[i], slots[i].size));
+      tlsf_free(&test_tlsf, slots[i].ptr);
+      slots[i].ptr = NULL;
+    }
+  }
+
+  // The pool is a single free block again
+  CHECK(check_pool(&test_tlsf) == 1);
+  CHECK(test_tlsf.alloc == 0);
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct allocator_struct {
+  native_string name;
+  void (*init)(void *start, size_t size);
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+} allocator;
+
+static void tlsf_pool_init(void *start, size_t size) {
+  tlsf_init(&test_tlsf, start, size);
+}
+
+static void *tlsf_pool_malloc(size_t size) {
+  return tlsf_malloc(&test_tlsf, size);
+}
+
+static void tlsf_pool_free(void *ptr) { tlsf_free(&test_tlsf, ptr); }
+
+static void heap_pool_init(void *start, size_t size) {
+  heap_init(&test_heap, start, size);
+}
+
+static void *heap_pool_malloc(size_t size) {
+  return heap_malloc(&test_heap, size);
+}
+
+static void heap_pool_free(void *ptr) { heap_free(&test_heap, ptr); }
+
+static allocator allocators[] = {
+    {"tlsf", tlsf_pool_init, tlsf_pool_malloc, tlsf_pool_free},
+    {"heap", heap_pool_init, heap_pool_malloc, heap_pool_free},
+};
+
+static uint32 latencies[LATENCY_BUCKETS];
+
+// The number of cycles under which are the given thousandths of calls
+static uint32 latency_under(uint32 calls, uint32 thousandths) {
+  uint32 n = 0;
+
+  for (uint32 i = 0; i < LATENCY_BUCKETS; i++) {
+    n += latencies[i];
+    if (n * 1000ULL >= CAST(uint64, calls) * thousandths)
+      return (i + 1) * LATENCY_STEP;
+  }
+
+  return LATENCY_BUCKETS * LATENCY_STEP;
+}
+
+static inline uint32 cycles() {
+  uint32 lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return lo;
+}
+
+// The largest allocation that succeeds, in KB to the LARGEST_STEP. The
+// sizes are tried from the biggest, so only failed calls come before
+// the answer and they leave the pool as it was.
+static uint32 largest_allocation(allocator *a) {
+  for (uint32 size = POOL_SIZE; size > 0; size -= LARGEST_STEP) {
+    void *p = a->malloc(size);
+
+    if (p != NULL) {
+      a->free(p);
+      return size >> 10;
+    }
+  }
+
+  return 0;
+}
+
+// Runs the trace of allocations and frees, timing every call. The
+// footprint is the end of the highest allocation in the pool.
+static void bench(allocator *a) {
+  uint32 state = 99;
+  uint32 calls = 0;
+  uint64 total = 0;
+  uint32 worst = 0;
+  uint32 live = 0;
+  uint32 max_live = 0;
+  uint32 footprint = 0;
+
+  a->init(pool_start, POOL_SIZE);
+
+  for (uint32 i = 0; i < LATENCY_BUCKETS; i++)
+    latencies[i] = 0;
+
+  for (uint32 op = 0; op < OPS; op++) {
+    uint32 r = host_random(&state);
+    slot *s = &slots[r % SLOTS];
+    uint32 start;
+    uint32 t;
+
+    if (s->ptr == NULL) {
+      s->size = random_size(&state);
+      start = cycles();
+      s->ptr = CAST(uint8 *, a->malloc(s->size));
+      t = cycles() - start;
+      CHECK(s->ptr != NULL);
+
+      uint32 end = s->ptr + s->size - pool_start;
+      if (end > footprint)
+        footprint = end;
+
+      live += s->size;
+      if (live > max_live)
+        max_live = live;
+    } else {
+      start = cycles();
+      a->free(s->ptr);
+      t = cycles() - start;
+      s->ptr = NULL;
+      live -= s->size;
+    }
+
+    total += t;
+    if (t > worst)
+      worst = t;
+    latencies[t / LATENCY_STEP < LATENCY_BUCKETS ? t / LATENCY_STEP
+                                                 : LATENCY_BUCKETS - 1]++;
+    calls++;
+  }
+
+  uint32 largest = largest_allocation(a);
+
+  for (uint32 i = 0; i < SLOTS; i++) {
+    if (slots[i].ptr != NULL) {
+      a->free(slots[i].ptr);
+      slots[i].ptr = NULL;
+    }
+  }
+
+  printf("%-4s cycles per call: %4u mean, %5u at 99%%, %5u at 99.9%%, %6u "
+         "at worst\n",
+         a->name, CAST(uint32, total / calls), latency_under(calls, 990),
+         latency_under(calls, 999), worst);
+  printf("     footprint %u KB for %u KB live at most, %u KB allocatable "
+         "at the end\n",
+         footprint >> 10, max_live >> 10, largest);
+}
+
+int main() {
+  // Fault the pages of the pool in before any timing
+  for (uint32 i = 0; i < POOL_SIZE / sizeof(uint32); i += 1024)
+    pool[i] = 0;
+
+  test_stress();
+
+  printf("%u calls of 1 byte to %u KB over %u slots:\n", OPS, MAX_SIZE >> 10,
+         SLOTS);
+
+  for (uint32 i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+    bench(&allocators[i]);
+
+  printf("tlsf_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //
@@ -0,0 +1,622 @@
+// file: "virtio_test.cpp"
+
+// Host test of the virtio block driver (drivers/virtio.cpp). A model of
+// a legacy virtio-blk PCI device over a RAM disk takes the chains of
+// descriptors the driver places in the available ring, checks them,
+// and returns them in the used ring in a random order, sometimes with
+// an error. Random reads, writes and flushes from many requests at
+// once must give back the data written, and run long enough for the
+// 16 bit ring indices to wrap around.
+
+#include "disk.h"
+#include "hosttest.h"
+#include "intr.h"
+#include "pci.h"
+#include "thread.h"
+#include "virtio.h"
+
+//-----------------------------------------------------------------------------
+
+#define SECTOR_SIZE (1 << VIRTIO_BLK_LOG2_SECTOR_SIZE)
+#define DISK_SECTORS 8192 // 4 MB
+
+// Each request has a region of the disk of its own, so the expected
+// content doesn't depend on the order in which the device does them
+#define NB_REQS 32
+#define REGION_SECTORS (DISK_SECTORS / NB_REQS)
+#define REQ_MAX_SECTORS 64
+#define REQ_MAX_SEGMENTS 4
+
+#define IO_BASE 0xc000
+#define IRQ 11
+
+static uint8 disk_data[DISK_SECTORS * SECTOR_SIZE];
+static uint8 expected[DISK_SECTORS * SECTOR_SIZE];
+
+//-----------------------------------------------------------------------------
+
+// Kernel services
+
+#define POOL_SIZE (1 << 20)
+
+static uint8 pool[POOL_SIZE];
+static uint32 pool_used;
+
+void *kmalloc(size_t size) {
+  void *p = pool + pool_used;
+
+  size = (size + 15) & ~15;
+  CHECK(pool_used + size <= POOL_SIZE);
+  pool_used += size;
+
+  return p;
+}
+
+void kfree(void *ptr) {}
+
+static disk disks[2];
+static uint32 nb_disks;
+
+disk *disk_alloc() {
+  CHECK(nb_disks < sizeof(disks) / sizeof(disks[0]));
+  return &disks[nb_disks++];
+}
+
+static intr_handler irq_handler;
+static void *irq_data;
+
+bool intr_add_handler(uint8 irq, intr_handler fn, void *data) {
+  CHECK(irq == IRQ);
+  irq_handler = fn;
+  irq_data = data;
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+
+// The device
+
+typedef struct chain_struct {
+  uint16 head;
+  uint8 type;
+  uint32 sector;
+  uint32 nb_segments;
+  volatile vring_desc *segments[BLK_MAX_SEGMENTS];
+  volatile uint8 *status;
+} chain;
+
+typedef struct fake_virtio_struct {
+  bool present;
+  bool flush; // offers VIRTIO_BLK_F_FLUSH
+  uint16 queue_size;
+  bool bus_master;
+
+  uint8 status;
+  uint32 guest_features;
+  uint32 pfn;
+  uint8 isr;
+  bool notified;
+
+  volatile vring_desc *desc;
+  volatile vring_avail *avail;
+  volatile vring_used *used;
+  uint16 last_avail;
+
+  bool busy[VIRTIO_BLK_MAX_QUEUE_SIZE]; // descriptors of the chains taken
+  chain active[VIRTIO_BLK_MAX_QUEUE_SIZE];
+  uint32 nb_active;
+  uint32 max_active;
+
+  uint32 state;
+  uint32 chains;
+  uint32 reads;
+  uint32 writes;
+  uint32 flushes;
+  uint32 errors;
+  uint32 segments;
+} fake_virtio;
+
+static fake_virtio dev;
+
+bool pci_find_device(uint16 vendor_id, uint16 device_id, uint32 index,
+                     pci_function *fn) {
+  if (!dev.present || vendor_id != VIRTIO_PCI_VENDOR_ID ||
+      device_id != VIRTIO_PCI_DEVICE_BLK_TRANSITIONAL || index != 0)
+    return FALSE;
+
+  fn->bus = 0;
+  fn->device = 4;
+  fn->function = 0;
+
+  return TRUE;
+}
+
+uint32 pci_read_config_dword(pci_function *fn, uint8 reg) {
+  return (reg == PCI_BASE_ADDRESS_0) ? (IO_BASE | PCI_BASE_ADDRESS_SPACE_IO)
+                                     : 0;
+}
+
+uint8 pci_read_config_byte(pci_function *fn, uint8 reg) {
+  return (reg == PCI_INTERRUPT_LINE) ? IRQ : 0;
+}
+
+uint8 pci_find_capability(pci_function *fn, uint8 cap_id, uint8 after) {
+  return 0; // legacy only
+}
+
+volatile uint8 *pci_bar_address(pci_function *fn, uint8 bar) { return NULL; }
+
+void pci_enable_bus_master(pci_function *fn) { dev.bus_master = TRUE; }
+
+// The rings where the legacy transport puts them, from the PFN alone
+static void dev_map_queue() {
+  uint8 *mem = CAST(uint8 *, dev.pfn << VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+  uint32 avail_end = dev.queue_size * 16 + 6 + 2 * dev.queue_size;
+
+  dev.desc = CAST(volatile vring_desc *, mem);
+  dev.avail = CAST(volatile vring_avail *, mem + dev.queue_size * 16);
+  dev.used = CAST(volatile vring_used *,
+                  mem + ((avail_end + VIRTIO_PCI_VRING_ALIGN - 1) &
+                         ~(VIRTIO_PCI_VRING_ALIGN - 1)));
+}
+
+uint8 inb(uint16 port) {
+  switch (port - IO_BASE) {
+  case VIRTIO_PCI_STATUS:
+    return dev.status;
+  case VIRTIO_PCI_ISR: {
+    uint8 isr = dev.isr;
+    dev.isr = 0;
+    return isr;
+  }
+  }
+
+  host_fail(__FILE__, __LINE__, "inb from an unknown port");
+  return 0;
+}
+
+uint16 inw(uint16 port) {
+  CHECK(port == IO_BASE + VIRTIO_PCI_QUEUE_SIZE);
+  return dev.queue_size;
+}
+
+uint32 inl(uint16 port) {
+  switch (port - IO_BASE) {
+  case VIRTIO_PCI_HOST_FEATURES:
+    return (dev.flush ? 1 << VIRTIO_BLK_F_FLUSH : 0) | (1 << 28); // + other
+  case VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY:
+    return DISK_SECTORS;
+  case VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4:
+    return 0;
+  }
+
+  host_fail(__FILE__, __LINE__, "inl from an unknown port");
+  return 0;
+}
+
+void outb(uint8 val, uint16 port) {
+  CHECK(port == IO_BASE + VIRTIO_PCI_STATUS);
+
+  if (val == 0) {
+    dev.status = 0;
+    dev.pfn = 0;
+    return;
+  }
+
+  // Bits are only added, in the order of the specification
+
+  CHECK((val & dev.status) == dev.status);
+  CHECK(val & VIRTIO_STATUS_ACKNOWLEDGE);
+  if (val & VIRTIO_STATUS_DRIVER_OK)
+    CHECK(dev.pfn != 0 && dev.bus_master);
+
+  dev.status = val;
+}
+
+void outw(uint16 val, uint16 port) {
+  switch (port - IO_BASE) {
+  case VIRTIO_PCI_QUEUE_SEL:
+    CHECK(val == 0); // the request queue
+    return;
+  case VIRTIO_PCI_QUEUE_NOTIFY:
+    CHECK(val == 0);
+    CHECK(dev.status & VIRTIO_STATUS_DRIVER_OK);
+    dev.notified = TRUE;
+    return;
+  }
+
+  host_fail(__FILE__, __LINE__, "outw to an unknown port");
+}
+
+void outl(uint32 val, uint16 port) {
+  switch (port - IO_BASE) {
+  case VIRTIO_PCI_GUEST_FEATURES:
+    CHECK(dev.status & VIRTIO_STATUS_DRIVER);
+    CHECK((val & ~(1 << VIRTIO_BLK_F_FLUSH)) == 0); // only what it knows
+    CHECK(dev.flush || val == 0);
+    dev.guest_features = val;
+    return;
+  case VIRTIO_PCI_QUEUE_PFN:
+    CHECK(val != 0);
+    dev.pfn = val;
+    dev_map_queue();
+    return;
+  }
+
+  host_fail(__FILE__, __LINE__, "outl to an unknown port");
+}
+
+static void dev_reset(bool flush, uint16 queue_size) {
+  dev.present = TRUE;
+  dev.flush = flush;
+  dev.queue_size = queue_size;
+  dev.bus_master = FALSE;
+  dev.status = 0;
+  dev.guest_features = 0;
+  dev.pfn = 0;
+  dev.isr = 0;
+  dev.notified = FALSE;
+  dev.last_avail = 0;
+  dev.nb_active = 0;
+  dev.max_active = 0;
+  dev.state = 2024;
+  dev.chains = 0;
+  dev.reads = 0;
+  dev.writes = 0;
+  dev.flushes = 0;
+  dev.errors = 0;
+  dev.segments = 0;
+
+  for (uint32 i = 0; i < VIRTIO_BLK_MAX_QUEUE_SIZE; i++)
+    dev.busy[i] = FALSE;
+}
+
+static volatile vring_desc *dev_take_desc(uint16 i) {
+  CHECK(i < dev.queue_size);
+  CHECK(!dev.busy[i]); // in two chains at once
+  dev.busy[i] = TRUE;
+  return &dev.desc[i];
+}
+
+// Take the chain whose first descriptor is head and check its shape:
+// a header, the buffers, and the status byte
+static void dev_take_chain(chain *c, uint16 head) {
+  volatile vring_desc *d = dev_take_desc(head);
+  virtio_blk_header *h = CAST(virtio_blk_header *, CAST(uint32, d->addr));
+  uint32 sectors = 0;
+
+  CHECK(d->len == sizeof(virtio_blk_header));
+  CHECK(d->flags == VRING_DESC_F_NEXT);
+
+  c->head = head;
+  c->type = h->type;
+  c->sector = h->sector;
+  c->nb_segments = 0;
+
+  for (;;) {
+    d = dev_take_desc(d->next);
+
+    if (!(d->flags & VRING_DESC_F_NEXT))
+      break;
+
+    CHECK(d->flags == (VRING_DESC_F_NEXT | (c->type == VIRTIO_BLK_T_IN
+                                                ? VRING_DESC_F_WRITE
+                                                : 0)));
+    CHECK(d->len > 0 && d->len % SECTOR_SIZE == 0);
+    CHECK(c->nb_segments < BLK_MAX_SEGMENTS);
+    c->segments[c->nb_segments++] = d;
+    sectors += d->len / SECTOR_SIZE;
+  }
+
+  CHECK(d->flags == VRING_DESC_F_WRITE);
+  CHECK(d->len == 1);
+  c->status = CAST(volatile uint8 *, CAST(uint32, d->addr));
+
+  switch (c->type) {
+  case VIRTIO_BLK_T_IN:
+  case VIRTIO_BLK_T_OUT:
+    CHECK(c->nb_segments > 0);
+    CHECK(c->sector + sectors <= DISK_SECTORS);
+    break;
+  case VIRTIO_BLK_T_FLUSH:
+    CHECK(dev.guest_features & (1 << VIRTIO_BLK_F_FLUSH));
+    CHECK(c->nb_segments == 0);
+    CHECK(dev.nb_active == 0); // the writes before it are done
+    break;
+  default:
+    host_fail(__FILE__, __LINE__, "unknown request type");
+  }
+
+  dev.chains++;
+  dev.segments += c->nb_segments;
+}
+
+static void dev_free_chain(uint16 head) {
+  uint16 i = head;
+
+  for (;;) {
+    CHECK(dev.busy[i]);
+    dev.busy[i] = FALSE;
+    if (!(dev.desc[i].flags & VRING_DESC_F_NEXT))
+      break;
+    i = dev.desc[i].next;
+  }
+}
+
+// Do the chain, or fail it without touching the disk
+static void dev_do_chain(chain *c) {
+  uint8 *p = disk_data + c->sector * SECTOR_SIZE;
+  uint32 len = 0;
+
+  if (host_random(&dev.state) % 64 == 0) {
+    *c->status = VIRTIO_BLK_S_IOERR;
+    dev.errors++;
+  } else {
+    for (uint32 i = 0; i < c->nb_segments; i++) {
+      uint8 *buf = CAST(uint8 *, CAST(uint32, c->segments[i]->addr));
+      uint32 n = c->segments[i]->len;
+
+      if (c->type == VIRTIO_BLK_T_IN) {
+        memcpy(buf, p, n);
+        len += n;
+      } else {
+        memcpy(p, buf, n);
+      }
+
+      p += n;
+    }
+
+    switch (c->type) {
+    case VIRTIO_BLK_T_IN:
+      dev.reads++;
+      break;
+    case VIRTIO_BLK_T_OUT:
+      dev.writes++;
+      break;
+    default:
+      dev.flushes++;
+      break;
+    }
+
+    *c->status = VIRTIO_BLK_S_OK;
+  }
+
+  // The device unmaps the chain before the driver can see it used
+
+  dev_free_chain(c->head);
+
+  uint16 idx = dev.used->idx;
+  volatile vring_used_elem *e = &dev.used->ring[idx & (dev.queue_size - 1)];
+
+  e->id = c->head;
+  e->len = len + 1; // with the status byte
+  dev.used->idx = idx + 1;
+}
+
+// Take the chains made available since the last run, then return a
+// random part of those in flight, in a random order, and interrupt
+static void dev_run() {
+  CHECK(dev.notified || dev.last_avail == dev.avail->idx);
+  dev.notified = FALSE;
+
+  while (dev.last_avail != dev.avail->idx) {
+    uint16 head = dev.avail->ring[dev.last_avail & (dev.queue_size - 1)];
+    dev_take_chain(&dev.active[dev.nb_active], head);
+    dev.nb_active++;
+    dev.last_avail++;
+  }
+
+  if (dev.nb_active > dev.max_active)
+    dev.max_active = dev.nb_active;
+
+  uint32 n = (dev.nb_active == 0) ? 0
+                                  : 1 + host_random(&dev.state) % dev.nb_active;
+
+  for (uint32 k = 0; k < n; k++) {
+    uint32 i = host_random(&dev.state) % dev.nb_active;
+
+    dev_do_chain(&dev.active[i]);
+    dev.active[i] = dev.active[--dev.nb_active];
+  }
+
+  // Sometimes the IRQ is shared and the interrupt isn't ours
+
+  if (n > 0)
+    dev.isr |= VIRTIO_ISR_QUEUE;
+  else if (host_random(&dev.state) % 4 != 0)
+    return;
+
+  disable_interrupts();
+  irq_handler(irq_data);
+  enable_interrupts();
+}
+
+//-----------------------------------------------------------------------------
+
+// The requests
+
+typedef struct test_req_struct {
+  blk_request req;
+  bool busy;
+  uint32 lba; // req->lba changes when requests merge into it
+  uint32 sectors;
+  uint32 buf[REQ_MAX_SECTORS * SECTOR_SIZE / 4];
+} test_req;
+
+static test_req reqs[NB_REQS];
+
+static uint32 done_reads;
+static uint32 done_writes;
+static uint32 done_flushes;
+static uint32 done_errors;
+
+static void req_done(blk_request *req) {
+  test_req *t = CAST(test_req *, req->data);
+  uint8 *p = expected + t->lba * SECTOR_SIZE;
+  uint32 n = t->sectors * SECTOR_SIZE;
+
+  ASSERT_INTERRUPTS_DISABLED();
+  CHECK(t->busy);
+  t->busy = FALSE;
+
+  if (req->err != NO_ERROR) {
+    CHECK(req->err == UNKNOWN_ERROR);
+    done_errors++;
+    return;
+  }
+
+  switch (req->op) {
+  case BLK_READ:
+    CHECK(memcmp(t->buf, p, n) == 0);
+    done_reads++;
+    break;
+  case BLK_WRITE:
+    memcpy(p, t->buf, n);
+    done_writes++;
+    break;
+  default:
+    done_flushes++;
+    break;
+  }
+}
+
+// A random request in the region of t, in up to REQ_MAX_SEGMENTS
+// segments
+static void req_submit(blk_queue *q, test_req *t, uint32 *state) {
+  blk_request *req = &t->req;
+  uint32 r = host_random(state);
+  uint32 region = (t - reqs) * REGION_SECTORS;
+
+  t->busy = TRUE;
+
+  if (r % 16 == 0) {
+    t->sectors = 0;
+    blk_request_init(req, BLK_FLUSH, 0, req_done, t);
+  } else {
+    uint8 op = (r >> 4) % 2 ? BLK_READ : BLK_WRITE;
+    uint32 count = 1 + (r >> 8) % REQ_MAX_SECTORS;
+    uint32 lba = region + (r >> 16) % (REGION_SECTORS - count + 1);
+    uint32 nb_segments = 1 + (r >> 24) % REQ_MAX_SEGMENTS;
+    uint8 *buf = CAST(uint8 *, t->buf);
+
+    t->lba = lba;
+    t->sectors = count;
+    blk_request_init(req, op, lba, req_done, t);
+
+    if (op == BLK_WRITE)
+      for (uint32 i = 0; i < count * SECTOR_SIZE / 4; i++)
+        CAST(uint32 *, buf)[i] = host_random(state);
+
+    for (uint32 i = 0; i < nb_segments && count > 0; i++) {
+      uint32 n = (i == nb_segments - 1) ? count : 1 + count / nb_segments;
+      if (n > count)
+        n = count;
+      CHECK(blk_request_add(req, buf, n));
+      buf += n * SECTOR_SIZE;
+      count -= n;
+    }
+  }
+
+  blk_submit(q, req);
+}
+
+//-----------------------------------------------------------------------------
+
+static void test_setup_fails() {
+  dev_reset(TRUE, 8); // too small for a request
+  nb_disks = 0;
+
+  setup_virtio_blk();
+
+  CHECK(nb_disks == 0);
+  CHECK(dev.status & VIRTIO_STATUS_FAILED);
+}
+
+static void test_device(bool flush, uint16 queue_size, uint32 chains) {
+  uint32 state = queue_size;
+
+  dev_reset(flush, queue_size);
+  nb_disks = 0;
+  done_reads = done_writes = done_flushes = done_errors = 0;
+
+  for (uint32 i = 0; i < DISK_SECTORS * SECTOR_SIZE; i++)
+    disk_data[i] = expected[i] = CAST(uint8, host_random(&state));
+
+  setup_virtio_blk();
+
+  CHECK(nb_disks == 1);
+  CHECK(dev.status == (VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                       VIRTIO_STATUS_DRIVER_OK));
+
+  disk *d = &disks[0];
+  blk_queue *q = &d->_.virtio.dev->queue;
+
+  CHECK(d->kind == DISK_VIRTIO);
+  CHECK(d->partition_path == 0);
+  CHECK(d->partition_length == DISK_SECTORS);
+  CHECK(d->log2_sector_size == VIRTIO_BLK_LOG2_SECTOR_SIZE);
+
+  while (dev.chains < chains) {
+    // Submit a burst of requests, sometimes plugged so they merge
+
+    bool plug = host_random(&state) % 4 == 0;
+
+    if (plug)
+      blk_plug(q);
+
+    for (uint32 i = 0; i < NB_REQS; i++) {
+      test_req *t = &reqs[i];
+
+      if (!t->busy && host_random(&state) % 3 == 0)
+        req_submit(q, t, &state);
+    }
+
+    if (plug)
+      blk_unplug(q);
+
+    dev_run();
+  }
+
+  // Let everything finish
+
+  for (uint32 i = 0; i < NB_REQS; i++)
+    while (reqs[i].busy)
+      dev_run();
+
+  CHECK(dev.nb_active == 0);
+  CHECK(memcmp(disk_data, expected, DISK_SECTORS * SECTOR_SIZE) == 0);
+  // A chain completes the requests merged into it too
+
+  CHECK(done_reads >= dev.reads && done_writes >= dev.writes);
+  CHECK(done_errors >= dev.errors);
+  CHECK(done_flushes >= dev.flushes);
+  CHECK(flush || dev.flushes == 0);
+
+  // All the descriptors are back on the free list
+
+  for (uint32 i = 0; i < queue_size; i++)
+    CHECK(!dev.busy[i]);
+
+  printf("queue of %3u%s: %6u chains of %6u segments, %2u in flight at "
+         "most, %5u flushes, %4u errors\n",
+         queue_size, flush ? ", flush" : "       ", dev.chains,
+         dev.segments, dev.max_active, dev.flushes, dev.errors);
+}
+
+int main() {
+  test_setup_fails();
+
+  // The used and available indices wrap around after 65536 chains
+
+  test_device(TRUE, 128, 70000);
+  test_device(FALSE, 32, 70000); // a single request in flight
+  test_device(TRUE, VIRTIO_BLK_MAX_QUEUE_SIZE, 20000);
+
+  printf("virtio_test: OK\n");
+
+  return 0;
+}
+
+// Local Variables: //
+// mode: C++ //
+// End: //